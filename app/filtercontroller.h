@@ -152,7 +152,7 @@ public:
             return true;
         }
         KFileItem fileItem = model()->itemForSourceIndex(index);
-        QDate date = TimeUtils::dateTimeForFileItem(fileItem).date();
+        QDate date = TimeUtils::dateTimeForFileItem(fileItem, TimeUtils::CacheOnly).date();
         switch (mMode) {
             case GreaterOrEqual:
                 return date >= mDate;
@@ -45,6 +45,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
 #include <lib/eventwatcher.h>
 #include <lib/redeyereduction/redeyereductiontool.h>
 #include <lib/gwenviewconfig.h>
+#include <lib/jpegtransformjob.h>
 #include <lib/resize/resizeimageoperation.h>
 #include <lib/resize/resizeimagedialog.h>
 #include <lib/transformimageoperation.h>
@@ -141,6 +142,51 @@ struct ImageOpsContextManagerItem::Private
         );
         return false;
     }
+
+    /**
+     * When several JPEG files are selected in browse mode, they are
+     * transformed on disk without being loaded. Returns their urls, or an
+     * empty list if this is not possible.
+     */
+    QList<QUrl> urlsToTransformOnDisk() const
+    {
+        if (mMainWindow->viewMainPage()->isVisible()) {
+            return QList<QUrl>();
+        }
+        const KFileItemList itemList = q->contextManager()->selectedFileItemList();
+        if (itemList.count() < 2) {
+            return QList<QUrl>();
+        }
+        // Do not overwrite changes which have not been saved
+        const QList<QUrl> modifiedUrls = DocumentFactory::instance()->modifiedDocumentList();
+        QList<QUrl> urls;
+        Q_FOREACH(const KFileItem& item, itemList) {
+            if (!JpegTransformJob::canTransform(item.url(), item.mimetype()) || modifiedUrls.contains(item.url())) {
+                return QList<QUrl>();
+            }
+            urls << item.url();
+        }
+        return urls;
+    }
+
+    void transformOnDisk(const QList<QUrl>& urls, Orientation orientation)
+    {
+        JpegTransformJob* job = new JpegTransformJob(urls, orientation);
+        QObject::connect(job, &JpegTransformJob::urlTransformed, [](const QUrl& url) {
+            // Cached documents are outdated
+            DocumentFactory::instance()->forget(url);
+        });
+        QObject::connect(job, &KJob::result, q, [this](KJob* job) {
+            if (job->error()) {
+                KMessageBox::detailedSorry(
+                    mMainWindow,
+                    i18nc("@info", "Some images could not be transformed."),
+                    job->errorString()
+                );
+            }
+        });
+        job->start();
+    }
 };
 
 ImageOpsContextManagerItem::ImageOpsContextManagerItem(ContextManager* manager, MainWindow* mainWindow)
@@ -194,8 +240,9 @@ void ImageOpsContextManagerItem::updateActions()
         }
     }
 
-    d->mRotateLeftAction->setEnabled(canModify);
-    d->mRotateRightAction->setEnabled(canModify);
+    const bool canTransformOnDisk = !canModify && !d->urlsToTransformOnDisk().isEmpty();
+    d->mRotateLeftAction->setEnabled(canModify || canTransformOnDisk);
+    d->mRotateRightAction->setEnabled(canModify || canTransformOnDisk);
     d->mMirrorAction->setEnabled(canModify);
     d->mFlipAction->setEnabled(canModify);
     d->mResizeAction->setEnabled(canModify);
@@ -207,12 +254,22 @@ void ImageOpsContextManagerItem::updateActions()
 
 void ImageOpsContextManagerItem::rotateLeft()
 {
+    const QList<QUrl> urls = d->urlsToTransformOnDisk();
+    if (!urls.isEmpty()) {
+        d->transformOnDisk(urls, ROT_270);
+        return;
+    }
     TransformImageOperation* op = new TransformImageOperation(ROT_270);
     applyImageOperation(op);
 }
 
 void ImageOpsContextManagerItem::rotateRight()
 {
+    const QList<QUrl> urls = d->urlsToTransformOnDisk();
+    if (!urls.isEmpty()) {
+        d->transformOnDisk(urls, ROT_90);
+        return;
+    }
     TransformImageOperation* op = new TransformImageOperation(ROT_90);
     applyImageOperation(op);
 }
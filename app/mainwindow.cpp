@@ -615,6 +615,30 @@ struct MainWindow::Private
         mThumbnailView->scrollTo(index);
     }
 
+    /**
+     * Appends to @p urls up to @p count local documents following @p index
+     * in the direction of @p offset
+     */
+    void appendPreloadUrls(QList<QUrl>* urls, const QModelIndex& index, int offset, int count) const
+    {
+        int row = index.row() + offset;
+        for (; count > 0; row += offset) {
+            QModelIndex sibling = mDirModel->sibling(row, index.column(), index);
+            if (!sibling.isValid()) {
+                return;
+            }
+            KFileItem item = mDirModel->itemForIndex(sibling);
+            if (ArchiveUtils::fileItemIsDirOrArchive(item)) {
+                continue;
+            }
+            // Remote documents are not preloaded
+            if (item.url().isLocalFile()) {
+                *urls << item.url();
+                --count;
+            }
+        }
+    }
+
     void goTo(int offset)
     {
         mPreloadDirectionIsForward = offset > 0;
@@ -1571,7 +1595,7 @@ void MainWindow::print()
 
 void MainWindow::preloadNextUrl()
 {
-    static bool disablePreload = qgetenv("GV_MAX_UNREFERENCED_IMAGES") == "0";
+    static bool disablePreload = qgetenv("GV_DOCUMENT_CACHE_SIZE") == "0";
     if (disablePreload) {
         qDebug() << "Preloading disabled";
         return;
@@ -1591,24 +1615,31 @@ void MainWindow::preloadNextUrl()
         return;
     }
 
+    QList<QUrl> urls;
     if (d->mCurrentMainPageId == ViewMainPageId) {
-        // If we are in view mode, preload the next url, otherwise preload the
-        // selected one
-        int offset = d->mPreloadDirectionIsForward ? 1 : -1;
-        index = d->mDirModel->sibling(index.row() + offset, index.column(), index);
-        if (!index.isValid()) {
-            return;
+        // If we are in view mode, preload the urls around the current one,
+        // looking further in the direction the user is going. Otherwise
+        // preload the selected one.
+        if (d->mSlideShow->isRunning()) {
+            Q_FOREACH(const QUrl& url, d->mSlideShow->upcomingUrls(GwenviewConfig::preloadAhead())) {
+                if (url.isLocalFile()) {
+                    urls << url;
+                }
+            }
+        } else {
+            int offset = d->mPreloadDirectionIsForward ? 1 : -1;
+            d->appendPreloadUrls(&urls, index, offset, GwenviewConfig::preloadAhead());
+            d->appendPreloadUrls(&urls, index, -offset, GwenviewConfig::preloadBehind());
         }
-    }
-
-    KFileItem item = d->mDirModel->itemForIndex(index);
-    if (!ArchiveUtils::fileItemIsDirOrArchive(item)) {
-        QUrl url = item.url();
-        if (url.isLocalFile()) {
-            QSize size = d->mViewStackedWidget->size();
-            d->mPreloader->preload(url, size);
+    } else {
+        KFileItem item = d->mDirModel->itemForIndex(index);
+        if (!ArchiveUtils::fileItemIsDirOrArchive(item) && item.url().isLocalFile()) {
+            urls << item.url();
         }
     }
+
+    QSize size = d->mViewStackedWidget->size();
+    d->mPreloader->preload(urls, size);
 }
 
 QSize MainWindow::sizeHint() const
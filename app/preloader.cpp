@@ -23,11 +23,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 
 // Qt
 #include <QDebug>
+#include <QHash>
+#include <QSize>
+#include <QUrl>
 
 // KDE
 
 // Local
 #include <lib/document/documentfactory.h>
+#include <lib/memoryutils.h>
+#include <lib/mimetypeutils.h>
 
 namespace Gwenview
 {
@@ -41,18 +46,167 @@ namespace Gwenview
 #define LOG(x) ;
 #endif
 
+struct PreloadEntry
+{
+    PreloadEntry()
+    : mDone(false)
+    {}
+
+    Document::Ptr mDocument;
+    /// Set once there is nothing left to do for this document
+    bool mDone;
+};
+
 struct PreloaderPrivate
 {
     Preloader* q;
+    /// Urls to preload, most important first
+    QList<QUrl> mUrls;
+    QHash<QUrl, PreloadEntry> mEntries;
+    /// The document we are waiting for, if any
     Document::Ptr mDocument;
     QSize mSize;
 
     void forgetDocument()
     {
-        // Forget about the document. Keeping a reference to it would prevent it
-        // from being garbage collected.
-        QObject::disconnect(mDocument.data(), nullptr, q, nullptr);
-        mDocument = nullptr;
+        // Only stop listening to the document, mEntries keeps a reference
+        // to it as long as it is in mUrls
+        if (mDocument) {
+            QObject::disconnect(mDocument.data(), nullptr, q, nullptr);
+            mDocument = nullptr;
+        }
+    }
+
+    void waitForDocument(const Document::Ptr& doc)
+    {
+        forgetDocument();
+        mDocument = doc;
+        QObject::connect(doc.data(), SIGNAL(metaInfoUpdated()),
+                         q, SLOT(doPreload()));
+        QObject::connect(doc.data(), SIGNAL(kindDetermined(QUrl)),
+                         q, SLOT(doPreload()));
+        QObject::connect(doc.data(), SIGNAL(downSampledImageReady()),
+                         q, SLOT(slotDocumentPreloaded()));
+        QObject::connect(doc.data(), SIGNAL(loaded(QUrl)),
+                         q, SLOT(slotDocumentPreloaded()));
+        QObject::connect(doc.data(), SIGNAL(loadingFailed(QUrl)),
+                         q, SLOT(slotDocumentPreloaded()));
+    }
+
+    /**
+     * Stops holding the document for url. If it was not done preloading, the
+     * factory is told it is not needed anymore: its decoding cannot be
+     * interrupted, but its result should not linger in the cache.
+     */
+    void removeEntry(const QUrl& url)
+    {
+        const PreloadEntry entry = mEntries.take(url);
+        if (!entry.mDocument) {
+            return;
+        }
+        if (entry.mDocument == mDocument) {
+            forgetDocument();
+        }
+        if (!entry.mDone) {
+            LOG("releasing" << url);
+            DocumentFactory::instance()->release(url);
+        }
+    }
+
+    qreal zoomForDocument(const Document::Ptr& doc) const
+    {
+        return qMin(
+                   mSize.width() / qreal(doc->width()),
+                   mSize.height() / qreal(doc->height())
+               );
+    }
+
+    /**
+     * Estimates how much memory doc uses once preloaded
+     */
+    qint64 costForDocument(const Document::Ptr& doc) const
+    {
+        qreal zoom = zoomForDocument(doc);
+        if (zoom >= Document::maxDownSampledZoom()) {
+            zoom = 1;
+        }
+        const qint64 imageCost = qint64(doc->width() * zoom) * qint64(doc->height() * zoom) * 4;
+        return qMax(imageCost, qint64(doc->memoryUsage()));
+    }
+
+    void preloadNext()
+    {
+        if (mDocument) {
+            // One document at a time
+            return;
+        }
+
+        // Documents we already hold are part of the budget
+        qint64 budget = qint64(MemoryUtils::getFreeMemory() / 2);
+        Q_FOREACH(const PreloadEntry& entry, mEntries) {
+            budget += entry.mDocument->memoryUsage();
+        }
+
+        qint64 cost = 0;
+        for (int idx = 0; idx < mUrls.count(); ++idx) {
+            const QUrl url = mUrls.at(idx);
+            PreloadEntry& entry = mEntries[url];
+            if (!entry.mDocument) {
+                LOG("loading" << url);
+                entry.mDocument = DocumentFactory::instance()->load(url);
+            }
+            Document::Ptr doc = entry.mDocument;
+
+            if (!entry.mDone) {
+                if (doc->loadingState() == Document::LoadingFailed) {
+                    LOG("loading failed" << url);
+                    entry.mDone = true;
+                } else if (doc->kind() != MimeTypeUtils::KIND_UNKNOWN
+                           && doc->kind() != MimeTypeUtils::KIND_RASTER_IMAGE) {
+                    LOG("not a raster image" << url);
+                    entry.mDone = true;
+                }
+            }
+            if (entry.mDone) {
+                cost += doc->memoryUsage();
+                continue;
+            }
+
+            if (!doc->size().isValid()) {
+                LOG("size not available yet" << url);
+                waitForDocument(doc);
+                return;
+            }
+
+            cost += costForDocument(doc);
+            if (cost > budget) {
+                LOG("memory budget reached, not preloading" << mUrls.mid(idx));
+                while (mUrls.count() > idx) {
+                    removeEntry(mUrls.takeLast());
+                }
+                return;
+            }
+
+            bool ready;
+            qreal zoom = zoomForDocument(doc);
+            if (zoom < Document::maxDownSampledZoom()) {
+                LOG("preloading down sampled" << url << "zoom=" << zoom);
+                ready = doc->prepareDownSampledImageForZoom(zoom);
+            } else {
+                LOG("preloading full image" << url);
+                ready = doc->loadingState() == Document::Loaded;
+                if (!ready) {
+                    doc->startLoadingFullImage();
+                }
+            }
+            if (ready) {
+                entry.mDone = true;
+                continue;
+            }
+            waitForDocument(doc);
+            return;
+        }
+        LOG("done");
     }
 };
 
@@ -70,52 +224,51 @@ Preloader::~Preloader()
 
 void Preloader::preload(const QUrl &url, const QSize& size)
 {
-    LOG("url=" << url);
-    if (d->mDocument) {
-        disconnect(d->mDocument.data(), nullptr, this, nullptr);
-    }
-
-    d->mDocument = DocumentFactory::instance()->load(url);
-    d->mSize = size;
-    connect(d->mDocument.data(), SIGNAL(metaInfoUpdated()),
-            SLOT(doPreload()));
-
-    if (d->mDocument->size().isValid()) {
-        LOG("size is already available");
-        doPreload();
-    }
+    preload(QList<QUrl>() << url, size);
 }
 
-void Preloader::doPreload()
+void Preloader::preload(const QList<QUrl>& urls, const QSize& size)
 {
-    if (!d->mDocument) {
-        return;
+    LOG("urls=" << urls);
+    // Release documents which left the window
+    Q_FOREACH(const QUrl& url, d->mEntries.keys()) {
+        if (!urls.contains(url)) {
+            d->removeEntry(url);
+        }
     }
 
-    if (d->mDocument->loadingState() == Document::LoadingFailed) {
-        LOG("loading failed");
+    if (size != d->mSize) {
+        // Requested zooms are no longer right
+        d->mSize = size;
+        QHash<QUrl, PreloadEntry>::Iterator it = d->mEntries.begin();
+        for (; it != d->mEntries.end(); ++it) {
+            it.value().mDone = false;
+        }
         d->forgetDocument();
-        return;
     }
 
-    if (!d->mDocument->size().isValid()) {
-        LOG("size not available yet");
-        return;
-    }
+    d->mUrls = urls;
+    d->preloadNext();
+}
+
+void Preloader::doPreload()
+{
+    // Something we were waiting for changed, reconsider
+    d->forgetDocument();
+    d->preloadNext();
+}
 
-    qreal zoom = qMin(
-                     d->mSize.width() / qreal(d->mDocument->width()),
-                     d->mSize.height() / qreal(d->mDocument->height())
-                 );
-
-    if (zoom < Document::maxDownSampledZoom()) {
-        LOG("preloading down sampled, zoom=" << zoom);
-        d->mDocument->prepareDownSampledImageForZoom(zoom);
-    } else {
-        LOG("preloading full image");
-        d->mDocument->startLoadingFullImage();
+void Preloader::slotDocumentPreloaded()
+{
+    if (d->mDocument) {
+        QUrl url = d->mDocument->url();
+        LOG("preloaded" << url);
+        if (d->mEntries.contains(url)) {
+            d->mEntries[url].mDone = true;
+        }
     }
     d->forgetDocument();
+    d->preloadNext();
 }
 
 } // namespace
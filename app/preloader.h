@@ -22,6 +22,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 #define PRELOADER_H
 
 // Qt
+#include <QList>
 #include <QObject>
 
 // KDE
@@ -38,7 +39,12 @@ namespace Gwenview
 struct PreloaderPrivate;
 
 /**
- * This class preloads a document to fit a specific size.
+ * This class preloads documents to fit a specific size.
+ *
+ * Documents are preloaded one at a time, in the order they have been given.
+ * Preloaded documents are kept referenced until they leave the list, so that
+ * DocumentFactory does not garbage collect them. Preloading stops when the
+ * documents would use more than half of the free memory.
  */
 class Preloader : public QObject
 {
@@ -49,8 +55,17 @@ public:
 
     void preload(const QUrl&, const QSize&);
 
+    /**
+     * Replaces the documents to preload with @p urls, most important first.
+     * Documents which are no longer in the list are released. Those which
+     * were not done preloading are dropped from the cache once they are
+     * unused, those which have not been started yet will not be.
+     */
+    void preload(const QList<QUrl>& urls, const QSize&);
+
 private Q_SLOTS:
     void doPreload();
+    void slotDocumentPreloaded();
 
 private:
     PreloaderPrivate* const d;
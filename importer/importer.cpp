@@ -22,16 +22,26 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 #include "importer.h"
 
 // Qt
+#include <QCryptographicHash>
 #include <QDateTime>
 #include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QMultiHash>
 #include <QUrl>
+#include <QtConcurrentMap>
 
 // KDE
 #include <KFileItem>
-#include <KIO/CopyJob>
 #include <KIO/DeleteJob>
 #include <KIO/Job>
 #include <KIO/JobUiDelegate>
+#include <KIO/SimpleJob>
+#include <KIO/StatJob>
+#include <KIO/TransferJob>
 #include <KJobWidgets>
 #include <KLocalizedString>
 
@@ -42,29 +52,165 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 #include <fileutils.h>
 #include <filenameformater.h>
 #include <lib/timeutils.h>
-#include <QDir>
 
 namespace Gwenview
 {
 
+/**
+ * How many documents are copied at the same time
+ */
+const int MAX_CONCURRENT_COPIES = 4;
+
+/**
+ * How far copies can get ahead of the first document which has not been
+ * imported yet
+ */
+const int MAX_PENDING_IMPORTS = 32;
+
+/**
+ * How much of the beginning of each document is kept in memory, to read its
+ * EXIF date without reading the copy again
+ */
+const int HEAD_SIZE = 128 * 1024;
+
+static QByteArray hashForFile(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Can't read" << path;
+        return QByteArray();
+    }
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(&file);
+    return hash.result();
+}
+
+struct ImportTask
+{
+    enum State {
+        Pending,
+        Copying,
+        Copied,
+        Failed
+    };
+
+    ImportTask(const QUrl& src)
+    : mSrc(src)
+    , mHash(QCryptographicHash::Sha1)
+    , mSize(0)
+    , mPercent(0)
+    , mState(Pending)
+    {}
+
+    QUrl mSrc;
+    QUrl mTempUrl;
+    QDateTime mModificationTime;
+    QFile mFile;
+    QCryptographicHash mHash;
+    QByteArray mHead;
+    qint64 mSize;
+    int mPercent;
+    State mState;
+};
+
+/**
+ * Knows the content of the destination folder, so that documents which are
+ * already there can be skipped whatever their name. Existing files are only
+ * hashed when a document of the same size comes in, in worker threads.
+ */
+struct DestinationIndex
+{
+    QMultiHash<qint64, QString> mUnhashedPathsForSize;
+    QMultiHash<qint64, QByteArray> mHashesForSize;
+    /// Number of hashings running for each size
+    QHash<qint64, int> mHashingCountForSize;
+    /// Incremented by reset(), so that hashings started before are ignored
+    int mGeneration;
+
+    DestinationIndex()
+    : mGeneration(0)
+    {}
+
+    void reset(const QString& dir)
+    {
+        mUnhashedPathsForSize.clear();
+        mHashesForSize.clear();
+        mHashingCountForSize.clear();
+        ++mGeneration;
+        Q_FOREACH(const QFileInfo& info, QDir(dir).entryInfoList(QDir::Files)) {
+            mUnhashedPathsForSize.insert(info.size(), info.filePath());
+        }
+    }
+
+    /**
+     * Returns the paths of the files of this size which have not been
+     * hashed yet, and expects their hashes through insertHashes()
+     */
+    QStringList takeUnhashedPaths(qint64 size)
+    {
+        const QStringList paths = mUnhashedPathsForSize.values(size);
+        if (!paths.isEmpty()) {
+            mUnhashedPathsForSize.remove(size);
+            ++mHashingCountForSize[size];
+        }
+        return paths;
+    }
+
+    void insertHashes(qint64 size, const QList<QByteArray>& hashes)
+    {
+        Q_FOREACH(const QByteArray& hash, hashes) {
+            mHashesForSize.insert(size, hash);
+        }
+        if (--mHashingCountForSize[size] == 0) {
+            mHashingCountForSize.remove(size);
+        }
+    }
+
+    /**
+     * Returns true if files of this size are being hashed: contains() cannot
+     * tell yet
+     */
+    bool isHashing(qint64 size) const
+    {
+        return mHashingCountForSize.contains(size);
+    }
+
+    bool contains(qint64 size, const QByteArray& hash) const
+    {
+        return mHashesForSize.contains(size, hash);
+    }
+
+    void insert(qint64 size, const QByteArray& hash)
+    {
+        mHashesForSize.insert(size, hash);
+    }
+};
+
 struct ImporterPrivate
 {
     Importer* q;
     QWidget* mAuthWindow;
     std::unique_ptr<FileNameFormater> mFileNameFormater;
     QUrl mTempImportDirUrl;
+    DestinationIndex mDestinationIndex;
 
     /* @defgroup reset Should be reset in start()
      * @{ */
-    QList<QUrl> mUrlList;
+    QList<ImportTask*> mTasks;
+    /// Index of the next task to start
+    int mNextTask;
+    /// Index of the first task which has not been imported yet
+    int mFirstPendingTask;
+    int mActiveCount;
+    QHash<KJob*, ImportTask*> mTaskForJob;
     QList<QUrl> mImportedUrlList;
     QList<QUrl> mSkippedUrlList;
     int mRenamedCount;
     int mProgress;
-    int mJobProgress;
     /* @} */
 
-    QUrl mCurrentUrl;
+    /// Set while tasks are being imported: renaming runs nested event loops
+    bool mImporting;
 
     void emitError(const QString& message)
     {
@@ -90,58 +236,175 @@ struct ImporterPrivate
         return true;
     }
 
-    void importNext()
+    void clearTasks()
     {
-        if (mUrlList.empty()) {
-            q->finalizeImport();
-            return;
+        QHash<KJob*, ImportTask*>::ConstIterator it = mTaskForJob.constBegin();
+        for (; it != mTaskForJob.constEnd(); ++it) {
+            it.key()->kill();
         }
-        mCurrentUrl = mUrlList.takeFirst();
-        QUrl dst = mTempImportDirUrl;
-        dst.setPath(dst.path() + mCurrentUrl.fileName());
-        KIO::Job* job = KIO::copy(mCurrentUrl, dst, KIO::HideProgressInfo);
+        mTaskForJob.clear();
+        qDeleteAll(mTasks);
+        mTasks.clear();
+    }
+
+    void startTasks()
+    {
+        while (mActiveCount < MAX_CONCURRENT_COPIES
+                && mNextTask < mTasks.count()
+                && mNextTask - mFirstPendingTask < MAX_PENDING_IMPORTS) {
+            startTask(mTasks.at(mNextTask), mNextTask);
+            ++mNextTask;
+        }
+    }
+
+    void startTask(ImportTask* task, int index)
+    {
+        // Prefix temporary names with the task index: documents with the same
+        // name may come from different folders
+        task->mTempUrl = mTempImportDirUrl;
+        task->mTempUrl.setPath(task->mTempUrl.path() + QString::number(index) + '-' + task->mSrc.fileName());
+        task->mState = ImportTask::Copying;
+        ++mActiveCount;
+
+        // Stat first to get the modification time, which KIO::get() does not
+        // provide
+        KIO::StatJob* job = KIO::stat(task->mSrc, KIO::HideProgressInfo);
         KJobWidgets::setWindow(job, mAuthWindow);
+        mTaskForJob.insert(job, task);
         QObject::connect(job, SIGNAL(result(KJob*)),
-                         q, SLOT(slotCopyDone(KJob*)));
-        QObject::connect(job, SIGNAL(percent(KJob*,ulong)),
-                         q, SLOT(slotPercent(KJob*,ulong)));
+                         q, SLOT(slotStatDone(KJob*)));
+    }
+
+    void finishTask(ImportTask* task, bool ok)
+    {
+        task->mFile.close();
+        if (ok) {
+            hashDestinationFiles(task->mSize);
+        } else {
+            qWarning() << "Could not copy" << task->mSrc;
+            QFile::remove(task->mTempUrl.toLocalFile());
+        }
+        task->mState = ok ? ImportTask::Copied : ImportTask::Failed;
+        --mActiveCount;
+        importReadyTasks();
+        startTasks();
     }
 
-    void renameImportedUrl(const QUrl& src)
+    /**
+     * Hashes the files of the destination folder which have the same size
+     * as a copied document, so that importTask() can tell whether it is
+     * already there
+     */
+    void hashDestinationFiles(qint64 size)
     {
+        const QStringList paths = mDestinationIndex.takeUnhashedPaths(size);
+        if (paths.isEmpty()) {
+            return;
+        }
+        const int generation = mDestinationIndex.mGeneration;
+        QFutureWatcher<QByteArray>* watcher = new QFutureWatcher<QByteArray>(q);
+        QObject::connect(watcher, &QFutureWatcher<QByteArray>::finished, q, [this, watcher, size, generation]() {
+            watcher->deleteLater();
+            if (generation != mDestinationIndex.mGeneration) {
+                return;
+            }
+            mDestinationIndex.insertHashes(size, watcher->future().results());
+            importReadyTasks();
+        });
+        watcher->setFuture(QtConcurrent::mapped(paths, hashForFile));
+    }
+
+    /**
+     * Imports copied documents, in order
+     */
+    void importReadyTasks()
+    {
+        if (mImporting) {
+            return;
+        }
+        mImporting = true;
+        while (mFirstPendingTask < mTasks.count()) {
+            ImportTask* task = mTasks.at(mFirstPendingTask);
+            if (task->mState == ImportTask::Failed) {
+                qWarning() << "FIXME: What do we do with failed urls?";
+            } else if (task->mState == ImportTask::Copied && !mDestinationIndex.isHashing(task->mSize)) {
+                importTask(task);
+            } else {
+                break;
+            }
+            mTasks[mFirstPendingTask] = nullptr;
+            delete task;
+            ++mFirstPendingTask;
+            q->advance();
+            startTasks();
+        }
+        mImporting = false;
+
+        if (mFirstPendingTask == mTasks.count()) {
+            q->finalizeImport();
+        }
+    }
+
+    void importTask(ImportTask* task)
+    {
+        const QByteArray hash = task->mHash.result();
+        if (mDestinationIndex.contains(task->mSize, hash)) {
+            // Already imported, skip it
+            QFile::remove(task->mTempUrl.toLocalFile());
+            mSkippedUrlList << task->mSrc;
+            return;
+        }
+
+        // Keep the modification time of the source, like KIO::copy() does
+        if (task->mModificationTime.isValid()) {
+            KIO::SimpleJob* job = KIO::setModificationTime(task->mTempUrl, task->mModificationTime);
+            KJobWidgets::setWindow(job, mAuthWindow);
+            job->exec();
+        }
+
+        if (renameImportedUrl(task)) {
+            mDestinationIndex.insert(task->mSize, hash);
+        }
+    }
+
+    bool renameImportedUrl(ImportTask* task)
+    {
+        const QUrl src = task->mTempUrl;
         QUrl dst = src.resolved(QUrl(".."));
         QString fileName;
         if (mFileNameFormater.get()) {
-            KFileItem item(src);
-            item.setDelayedMimeTypes(true);
-            // Get the document time, but do not cache the result because the
-            // 'src' url is temporary: if we import "foo/image.jpg" and
-            // "bar/image.jpg", both images will be temporarily saved in the
-            // 'src' url.
-            QDateTime dateTime = TimeUtils::dateTimeForFileItem(item, TimeUtils::SkipCache);
-            fileName = mFileNameFormater->format(src, dateTime);
+            // The EXIF header is usually in the head of the document, so
+            // there is no need to read the copy again
+            QDateTime dateTime;
+            if (!TimeUtils::dateTimeForData(task->mHead, &dateTime)) {
+                KFileItem item(src);
+                item.setDelayedMimeTypes(true);
+                // Get the document time, but do not cache the result because
+                // the 'src' url is temporary
+                dateTime = TimeUtils::dateTimeForFileItem(item, TimeUtils::SkipCache);
+            }
+            fileName = mFileNameFormater->format(task->mSrc, dateTime);
         } else {
-            fileName = src.fileName();
+            fileName = task->mSrc.fileName();
         }
         dst.setPath(dst.path() + fileName);
 
         FileUtils::RenameResult result = FileUtils::rename(src, dst, mAuthWindow);
         switch (result) {
         case FileUtils::RenamedOK:
-            mImportedUrlList << mCurrentUrl;
-            break;
+            mImportedUrlList << task->mSrc;
+            return true;
         case FileUtils::RenamedUnderNewName:
             mRenamedCount++;
-            mImportedUrlList << mCurrentUrl;
-            break;
+            mImportedUrlList << task->mSrc;
+            return true;
         case FileUtils::Skipped:
-            mSkippedUrlList << mCurrentUrl;
-            break;
+            mSkippedUrlList << task->mSrc;
+            return false;
         case FileUtils::RenameFailed:
-            qWarning() << "Rename failed for" << mCurrentUrl;
+            qWarning() << "Rename failed for" << task->mSrc;
         }
-        q->advance();
-        importNext();
+        return false;
     }
 };
 
@@ -151,10 +414,17 @@ Importer::Importer(QWidget* parent)
 {
     d->q = this;
     d->mAuthWindow = parent;
+    d->mNextTask = 0;
+    d->mFirstPendingTask = 0;
+    d->mActiveCount = 0;
+    d->mRenamedCount = 0;
+    d->mProgress = 0;
+    d->mImporting = false;
 }
 
 Importer::~Importer()
 {
+    d->clearTasks();
     delete d;
 }
 
@@ -169,35 +439,90 @@ void Importer::setAutoRenameFormat(const QString& format)
 
 void Importer::start(const QList<QUrl>& list, const QUrl& destination)
 {
-    d->mUrlList = list;
+    d->clearTasks();
+    Q_FOREACH(const QUrl& url, list) {
+        d->mTasks << new ImportTask(url);
+    }
+    d->mNextTask = 0;
+    d->mFirstPendingTask = 0;
+    d->mActiveCount = 0;
     d->mImportedUrlList.clear();
     d->mSkippedUrlList.clear();
     d->mRenamedCount = 0;
     d->mProgress = 0;
-    d->mJobProgress = 0;
 
     emitProgressChanged();
-    maximumChanged(d->mUrlList.count() * 100);
+    maximumChanged(d->mTasks.count() * 100);
 
     if (!d->createImportDir(destination)) {
         qWarning() << "Could not create import dir";
         return;
     }
-    d->importNext();
+    d->mDestinationIndex.reset(destination.toLocalFile());
+    if (d->mTasks.isEmpty()) {
+        finalizeImport();
+        return;
+    }
+    d->startTasks();
 }
 
-void Importer::slotCopyDone(KJob* _job)
+void Importer::slotStatDone(KJob* _job)
 {
-    KIO::CopyJob* job = static_cast<KIO::CopyJob*>(_job);
-    QUrl url = job->destUrl();
+    KIO::StatJob* job = static_cast<KIO::StatJob*>(_job);
+    ImportTask* task = d->mTaskForJob.take(job);
+    if (!task) {
+        return;
+    }
     if (job->error()) {
-        qWarning() << "FIXME: What do we do with failed urls?";
-        advance();
-        d->importNext();
+        d->finishTask(task, false);
         return;
     }
+    KFileItem item(job->statResult(), task->mSrc, true /* delayedMimeTypes */);
+    task->mModificationTime = item.time(KFileItem::ModificationTime);
 
-    d->renameImportedUrl(url);
+    task->mFile.setFileName(task->mTempUrl.toLocalFile());
+    if (!task->mFile.open(QIODevice::WriteOnly)) {
+        qWarning() << "Could not create" << task->mFile.fileName();
+        d->finishTask(task, false);
+        return;
+    }
+
+    KIO::TransferJob* transferJob = KIO::get(task->mSrc, KIO::NoReload, KIO::HideProgressInfo);
+    KJobWidgets::setWindow(transferJob, d->mAuthWindow);
+    d->mTaskForJob.insert(transferJob, task);
+    connect(transferJob, SIGNAL(data(KIO::Job*,QByteArray)),
+            SLOT(slotDataReceived(KIO::Job*,QByteArray)));
+    connect(transferJob, SIGNAL(result(KJob*)),
+            SLOT(slotCopyDone(KJob*)));
+    connect(transferJob, SIGNAL(percent(KJob*,ulong)),
+            SLOT(slotPercent(KJob*,ulong)));
+}
+
+void Importer::slotDataReceived(KIO::Job* job, const QByteArray& data)
+{
+    ImportTask* task = d->mTaskForJob.value(job);
+    if (!task || data.isEmpty()) {
+        return;
+    }
+    if (task->mFile.write(data) != data.size()) {
+        qWarning() << "Could not write to" << task->mFile.fileName();
+        job->kill(KJob::EmitResult);
+        return;
+    }
+    task->mHash.addData(data);
+    task->mSize += data.size();
+    if (task->mHead.size() < HEAD_SIZE) {
+        task->mHead.append(data.left(HEAD_SIZE - task->mHead.size()));
+    }
+}
+
+void Importer::slotCopyDone(KJob* job)
+{
+    ImportTask* task = d->mTaskForJob.take(job);
+    if (!task) {
+        return;
+    }
+    d->finishTask(task, !job->error());
 }
 
 void Importer::finalizeImport()
@@ -210,19 +535,28 @@ void Importer::finalizeImport()
 void Importer::advance()
 {
     ++d->mProgress;
-    d->mJobProgress = 0;
     emitProgressChanged();
 }
 
-void Importer::slotPercent(KJob*, unsigned long percent)
+void Importer::slotPercent(KJob* job, unsigned long percent)
 {
-    d->mJobProgress = percent;
+    ImportTask* task = d->mTaskForJob.value(job);
+    if (!task) {
+        return;
+    }
+    task->mPercent = percent;
     emitProgressChanged();
 }
 
 void Importer::emitProgressChanged()
 {
-    progressChanged(d->mProgress * 100 + d->mJobProgress);
+    // Documents which have been copied but not imported yet count as done
+    int jobProgress = 0;
+    for (int idx = d->mFirstPendingTask; idx < d->mNextTask; ++idx) {
+        const ImportTask* task = d->mTasks.at(idx);
+        jobProgress += task->mState == ImportTask::Copying ? task->mPercent : 100;
+    }
+    progressChanged(d->mProgress * 100 + jobProgress);
 }
 
 QList<QUrl> Importer::importedUrlList() const
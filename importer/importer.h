@@ -30,11 +30,23 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 // Local
 
 class KJob;
+namespace KIO
+{
+class Job;
+}
 
 namespace Gwenview
 {
 
 struct ImporterPrivate;
+/**
+ * Imports documents into a destination folder.
+ *
+ * Several documents are copied at the same time. Their content is hashed
+ * while it is copied to skip documents which are already in the destination
+ * folder, even under another name. Documents are then renamed and reported
+ * in the order they have been given.
+ */
 class Importer : public QObject
 {
     Q_OBJECT
@@ -76,6 +88,8 @@ Q_SIGNALS:
     void error(const QString& message);
 
 private Q_SLOTS:
+    void slotStatDone(KJob*);
+    void slotDataReceived(KIO::Job*, const QByteArray&);
     void slotCopyDone(KJob*);
     void slotPercent(KJob*, unsigned long);
     void emitProgressChanged();
@@ -25,20 +25,23 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 // Local
 #include <cms/cmsprofile_png.h>
 #include <gvdebug.h>
-#include <iodevicejpegsourcemanager.h>
-#include <jpegerrormanager.h>
-
-extern "C" {
-#include <cms/iccjpeg.h>
-}
 
 // KDE
 
 // Qt
-#include <QBuffer>
+#include <QCryptographicHash>
 #include <QDebug>
+#include <QHash>
+#include <QMutex>
+#include <QVector>
 #include <QtGlobal>
 
+// libc
+#include <string.h>
+
+// Exiv2
+#include <exiv2/version.hpp>
+
 // lcms
 #include <lcms2.h>
 
@@ -66,43 +69,107 @@ namespace Cms
 {
 
 //- JPEG -----------------------------------------------------------------------
-static cmsHPROFILE loadFromJpegData(const QByteArray& data)
+/**
+ * Extracts the ICC profile of a JPEG image by walking the markers of its
+ * header, without involving the decoder.
+ *
+ * Profiles are stored in one or more APP2 markers containing:
+ * - the "ICC_PROFILE\0" string (12 bytes)
+ * - the sequence number of the marker, starting at 1 (1 byte)
+ * - the number of markers (1 byte)
+ * - the profile data
+ */
+static QByteArray readIccDataFromJpegData(const QByteArray& data)
 {
-    cmsHPROFILE profile = nullptr;
-    struct jpeg_decompress_struct srcinfo;
-
-    JPEGErrorManager srcErrorManager;
-    srcinfo.err = &srcErrorManager;
-    jpeg_create_decompress(&srcinfo);
-    if (setjmp(srcErrorManager.jmp_buffer)) {
-        qCritical() << "libjpeg error in src\n";
-        return nullptr;
+    static const char ICC_ID[] = "ICC_PROFILE";
+    // ICC_ID with its trailing 0, sequence number and marker count
+    static const int ICC_OVERHEAD_LEN = 14;
+
+    const uchar* ptr = reinterpret_cast<const uchar*>(data.constData());
+    const int size = data.size();
+    if (size < 4 || ptr[0] != 0xFF || ptr[1] != 0xD8) {
+        return QByteArray();
     }
 
-    QBuffer buffer(const_cast<QByteArray*>(&data));
-    buffer.open(QIODevice::ReadOnly);
-    IODeviceJpegSourceManager::setup(&srcinfo, &buffer);
-
-    setup_read_icc_profile(&srcinfo);
-    jpeg_read_header(&srcinfo, true);
-    jpeg_start_decompress(&srcinfo);
+    QVector<QByteArray> chunks;
+    int pos = 2;
+    while (pos + 2 <= size) {
+        if (ptr[pos] != 0xFF) {
+            LOG("Invalid marker at" << pos);
+            return QByteArray();
+        }
+        const uchar marker = ptr[pos + 1];
+        if (marker == 0xFF) {
+            // Fill byte
+            ++pos;
+            continue;
+        }
+        pos += 2;
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+            // Markers without parameters
+            continue;
+        }
+        if (marker == 0xDA || marker == 0xD9) {
+            // Start of scan or end of image: there are no more header markers
+            break;
+        }
+        if (pos + 2 > size) {
+            break;
+        }
+        const int length = (ptr[pos] << 8) | ptr[pos + 1];
+        if (length < 2 || pos + length > size) {
+            LOG("Truncated marker at" << pos);
+            break;
+        }
+        const uchar* payload = ptr + pos + 2;
+        const int payloadLength = length - 2;
+        if (marker == 0xE2 && payloadLength > ICC_OVERHEAD_LEN
+            && memcmp(payload, ICC_ID, sizeof(ICC_ID)) == 0)
+        {
+            const int sequenceNumber = payload[12];
+            const int markerCount = payload[13];
+            if (chunks.isEmpty()) {
+                chunks.resize(markerCount);
+            }
+            if (markerCount != chunks.size() || sequenceNumber < 1 || sequenceNumber > markerCount) {
+                qWarning() << "Inconsistent ICC profile markers";
+                return QByteArray();
+            }
+            chunks[sequenceNumber - 1] = QByteArray::fromRawData(
+                reinterpret_cast<const char*>(payload + ICC_OVERHEAD_LEN),
+                payloadLength - ICC_OVERHEAD_LEN);
+        }
+        pos += length;
+    }
 
-    uchar* profile_data;
-    uint profile_len;
-    if (read_icc_profile(&srcinfo, &profile_data, &profile_len)) {
-        LOG("Found a profile, length:" << profile_len);
-        profile = cmsOpenProfileFromMem(profile_data, profile_len);
+    QByteArray iccData;
+    Q_FOREACH(const QByteArray& chunk, chunks) {
+        if (chunk.isEmpty()) {
+            qWarning() << "Missing ICC profile marker";
+            return QByteArray();
+        }
+        iccData.append(chunk);
     }
+    LOG("Found a profile, length:" << iccData.size());
+    return iccData;
+}
 
-    jpeg_destroy_decompress(&srcinfo);
+//- Profile cache --------------------------------------------------------------
+/**
+ * Images coming from the same device usually embed the same profile. Opened
+ * profiles are shared, indexed by the MD5 of their data.
+ */
+typedef QHash<QByteArray, Profile::Ptr> ProfileCache;
+Q_GLOBAL_STATIC(ProfileCache, sProfileCache)
+Q_GLOBAL_STATIC(QMutex, sProfileCacheMutex)
 
-    return profile;
-}
+static const int MAX_CACHED_PROFILE_COUNT = 32;
 
 //- Profile class --------------------------------------------------------------
 struct ProfilePrivate
 {
     cmsHPROFILE mProfile;
+    QByteArray mId;
 
     void reset()
     {
@@ -139,45 +206,74 @@ Profile::~Profile()
     delete d;
 }
 
+Profile::Ptr Profile::loadFromIccData(const QByteArray& iccData)
+{
+    if (iccData.isEmpty()) {
+        return Profile::Ptr();
+    }
+    const QByteArray hash = QCryptographicHash::hash(iccData, QCryptographicHash::Md5);
+    QMutexLocker locker(sProfileCacheMutex());
+    Profile::Ptr ptr = sProfileCache->value(hash);
+    if (ptr) {
+        LOG("Reusing profile" << hash.toHex());
+        return ptr;
+    }
+
+    cmsHPROFILE hProfile = cmsOpenProfileFromMem(iccData.constData(), iccData.size());
+    if (!hProfile) {
+        return ptr;
+    }
+    ptr = new Profile(hProfile);
+    // The MD5 of the data identifies the profile as well as its own id
+    ptr->d->mId = hash;
+    if (sProfileCache->size() >= MAX_CACHED_PROFILE_COUNT) {
+        sProfileCache->clear();
+    }
+    sProfileCache->insert(hash, ptr);
+    return ptr;
+}
+
 Profile::Ptr Profile::loadFromImageData(const QByteArray& data, const QByteArray& format)
 {
     Profile::Ptr ptr;
-    cmsHPROFILE hProfile = nullptr;
     if (format == "png") {
-        hProfile = loadFromPngData(data);
+        cmsHPROFILE hProfile = loadFromPngData(data);
+        if (hProfile) {
+            ptr = new Profile(hProfile);
+        }
     } else if (format == "jpeg") {
-        hProfile = loadFromJpegData(data);
-    }
-    if (hProfile) {
-        ptr = new Profile(hProfile);
+        ptr = loadFromIccData(readIccDataFromJpegData(data));
     }
     return ptr;
 }
 
 Profile::Ptr Profile::loadFromExiv2Image(const Exiv2::Image* image)
 {
-    Profile::Ptr ptr;
-    cmsHPROFILE hProfile = nullptr;
-
     const Exiv2::ExifData& exifData = image->exifData();
     Exiv2::ExifKey key("Exif.Image.InterColorProfile");
     Exiv2::ExifData::const_iterator it = exifData.findKey(key);
-    if (it == exifData.end()) {
-        LOG("No profile found");
-        return ptr;
+    if (it != exifData.end()) {
+        int size = it->size();
+        LOG("size:" << size);
+
+        QByteArray data;
+        data.resize(size);
+        it->copy(reinterpret_cast<Exiv2::byte*>(data.data()), Exiv2::invalidByteOrder);
+        return loadFromIccData(data);
     }
-    int size = it->size();
-    LOG("size:" << size);
-
-    QByteArray data;
-    data.resize(size);
-    it->copy(reinterpret_cast<Exiv2::byte*>(data.data()), Exiv2::invalidByteOrder);
-    hProfile = cmsOpenProfileFromMem(data, size);
 
-    if (hProfile) {
-        ptr = new Profile(hProfile);
+#if EXIV2_TEST_VERSION(0, 27, 0)
+    // Exiv2 collects the ICC markers of JPEG images while reading their
+    // metadata
+    Exiv2::Image* mutableImage = const_cast<Exiv2::Image*>(image);
+    if (mutableImage->iccProfileDefined()) {
+        const Exiv2::DataBuf* buf = mutableImage->iccProfile();
+        return loadFromIccData(QByteArray(reinterpret_cast<const char*>(buf->pData_), buf->size_));
     }
-    return ptr;
+#endif
+
+    LOG("No profile found");
+    return Profile::Ptr();
 }
 
 cmsHPROFILE Profile::handle() const
@@ -185,6 +281,21 @@ cmsHPROFILE Profile::handle() const
     return d->mProfile;
 }
 
+QByteArray Profile::id() const
+{
+    if (d->mId.isEmpty() && d->mProfile) {
+        cmsUInt8Number id[16];
+        cmsGetHeaderProfileID(d->mProfile, id);
+        if (QByteArray::fromRawData(reinterpret_cast<char*>(id), 16).count('\0') == 16) {
+            // Most profiles do not come with their id, compute it
+            cmsMD5computeID(d->mProfile);
+            cmsGetHeaderProfileID(d->mProfile, id);
+        }
+        d->mId = QByteArray(reinterpret_cast<char*>(id), 16);
+    }
+    return d->mId;
+}
+
 QString Profile::copyright() const
 {
     return d->readInfo(cmsInfoCopyright);
@@ -236,7 +347,10 @@ Profile::Ptr Profile::getMonitorProfile()
                                &bytes_after,
                                (unsigned char **) &str) == Success
                 ) {
-            hProfile = cmsOpenProfileFromMem((void*)str, nitems);
+            if (str) {
+                hProfile = cmsOpenProfileFromMem((void*)str, nitems);
+                XFree(str);
+            }
         }
     }
 #endif
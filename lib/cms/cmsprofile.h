@@ -62,6 +62,17 @@ public:
 
     cmsHPROFILE handle() const;
 
+    /**
+     * Returns the MD5 of the profile content. Two profiles with the same id
+     * produce the same transforms.
+     */
+    QByteArray id() const;
+
+    /**
+     * Returns a profile for this ICC data. Profiles are shared: loading the
+     * same data again returns the same profile.
+     */
+    static Profile::Ptr loadFromIccData(const QByteArray& iccData);
     static Profile::Ptr loadFromImageData(const QByteArray& data, const QByteArray& format);
     static Profile::Ptr loadFromExiv2Image(const Exiv2::Image* image);
     static Profile::Ptr getMonitorProfile();
@@ -48,9 +48,7 @@ public:
         if (!checkDocumentEditor()) {
             return;
         }
-        const QImage src = document()->image();
-        const QImage dst = src.copy(mRect);
-        document()->editor()->setImage(dst);
+        document()->editor()->applyCrop(mRect);
         setError(NoError);
     }
 
@@ -31,6 +31,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 #include <lib/orientation.h>
 
 class QImage;
+class QRect;
 
 namespace Gwenview
 {
@@ -64,6 +65,17 @@ public:
      * AbstractImageOperation and applied through Document::undoStack().
      */
     virtual void applyTransformation(Orientation) = 0;
+
+    /**
+     * Crop the document image to rect.
+     *
+     * Like transformations, crops can be done in a lossless way by some
+     * Document implementations.
+     *
+     * This method should only be called from a subclass of
+     * AbstractImageOperation and applied through Document::undoStack().
+     */
+    virtual void applyCrop(const QRect&) = 0;
 };
 
 } // namespace
@@ -88,6 +88,11 @@ public:
     virtual void stopAnimation()
     {}
 
+    virtual int currentFrameNumber() const
+    {
+        return 0;
+    }
+
     Document* document() const;
 
     virtual QSvgRenderer* svgRenderer() const
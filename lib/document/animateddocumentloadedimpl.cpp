@@ -24,21 +24,322 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 // Qt
 #include <QBuffer>
 #include <QImage>
-#include <QMovie>
+#include <QImageReader>
+#include <QMutex>
+#include <QQueue>
+#include <QScopedPointer>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
+#include <QWaitCondition>
 #include <QDebug>
 
 // KDE
 
 // Local
+#include <lib/memoryutils.h>
+
+// STL
+#include <string.h>
 
 namespace Gwenview
 {
 
+// How many frames the decoder thread prepares ahead of the one on screen
+static const int LOOK_AHEAD_FRAME_COUNT = 4;
+
+// Do not show frames shorter than this, like web browsers
+static const int MIN_FRAME_DELAY = 20;
+
+struct AnimatedFrame
+{
+    QImage image;
+    // Area which changed since the previous frame. Empty if the frame is
+    // identical to the previous one.
+    QRect dirtyRect;
+    int delay;
+    // Position of the frame in the animation
+    int number;
+};
+
+/**
+ * Returns the bounding rect of the pixels which differ between two frames
+ */
+static QRect changedRect(const QImage& previous, const QImage& current)
+{
+    if (previous.size() != current.size() || previous.format() != current.format() || current.depth() != 32) {
+        return current.rect();
+    }
+    const int width = current.width();
+    const int lineSize = width * 4;
+
+    int top = 0;
+    int bottom = current.height() - 1;
+    while (top <= bottom && memcmp(previous.constScanLine(top), current.constScanLine(top), lineSize) == 0) {
+        ++top;
+    }
+    if (top > bottom) {
+        return QRect();
+    }
+    while (memcmp(previous.constScanLine(bottom), current.constScanLine(bottom), lineSize) == 0) {
+        --bottom;
+    }
+
+    int left = width;
+    int right = -1;
+    for (int y = top; y <= bottom; ++y) {
+        const quint32* previousLine = reinterpret_cast<const quint32*>(previous.constScanLine(y));
+        const quint32* currentLine = reinterpret_cast<const quint32*>(current.constScanLine(y));
+        int x = 0;
+        while (x < left && previousLine[x] == currentLine[x]) {
+            ++x;
+        }
+        left = x;
+        x = width - 1;
+        while (x > right && previousLine[x] == currentLine[x]) {
+            --x;
+        }
+        right = x;
+    }
+    return QRect(QPoint(left, top), QPoint(right, bottom));
+}
+
+/**
+ * Produces the frames of an animation in playback order. Image readers
+ * already composite each frame over the previous ones, so frames can be shown
+ * as is.
+ *
+ * Frames of the first loop are kept as long as they fit in the cache budget:
+ * if all of them do, the following loops do not decode anything and reuse the
+ * same images.
+ */
+class AnimatedFrameSequence
+{
+public:
+    AnimatedFrameSequence(const QByteArray& data, const QImage& firstImage)
+    : mData(data)
+    , mPrevious(firstImage)
+    , mFrameNumber(0)
+    , mLoop(0)
+    , mLoopCount(0)
+    , mCaching(true)
+    , mCacheComplete(false)
+    , mCachedBytes(0)
+    {
+        // Use 1/64 of the installed memory, within sensible bounds
+        const qulonglong budget = MemoryUtils::getTotalMemory() / 64;
+        mCacheBudget = qBound(Q_UINT64_C(16 * 1024 * 1024), budget, Q_UINT64_C(256 * 1024 * 1024));
+
+        mBuffer.setBuffer(&mData);
+        mBuffer.open(QIODevice::ReadOnly);
+        mReader.reset(new QImageReader(&mBuffer));
+    }
+
+    ~AnimatedFrameSequence()
+    {
+        MemoryUtils::setCacheMemoryUsage(this, 0);
+    }
+
+    /**
+     * Sets frame to the next frame to show. Returns false when the animation
+     * is over or could not be decoded.
+     */
+    bool next(AnimatedFrame* frame)
+    {
+        if (mCacheComplete) {
+            if (mFrameNumber == mCachedFrames.size() && !startNewLoop()) {
+                return false;
+            }
+            *frame = mCachedFrames.at(mFrameNumber);
+            frame->number = mFrameNumber;
+            if (mFrameNumber == 0) {
+                frame->dirtyRect = mLoopDirtyRect;
+            }
+            ++mFrameNumber;
+            return true;
+        }
+
+        QImage image;
+        if (mReader->canRead()) {
+            image = mReader->read();
+        }
+        if (image.isNull()) {
+            if (mFrameNumber == 0) {
+                qWarning() << "Could not decode animation:" << mReader->errorString();
+                return false;
+            }
+            // End of the loop
+            mLoopCount = mReader->loopCount();
+            if (mCaching) {
+                mCacheComplete = true;
+                mLoopDirtyRect = changedRect(mPrevious, mCachedFrames.first().image);
+                mReader.reset();
+                mBuffer.close();
+            } else {
+                mBuffer.seek(0);
+                mReader.reset(new QImageReader(&mBuffer));
+            }
+            if (!startNewLoop()) {
+                return false;
+            }
+            return next(frame);
+        }
+
+        if (image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32) {
+            // Convert here rather than in the GUI thread
+            image = image.convertToFormat(image.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+        }
+        frame->image = image;
+        frame->dirtyRect = changedRect(mPrevious, image);
+        frame->delay = qMax(mReader->nextImageDelay(), MIN_FRAME_DELAY);
+        frame->number = mFrameNumber;
+        mPrevious = image;
+        ++mFrameNumber;
+
+        if (mCaching) {
+            mCachedBytes += image.byteCount();
+            if (mCachedBytes > mCacheBudget) {
+                // Too big, we will have to decode each loop
+                mCaching = false;
+                mCachedFrames.clear();
+                mCachedBytes = 0;
+            } else {
+                mCachedFrames << *frame;
+            }
+            MemoryUtils::setCacheMemoryUsage(this, mCachedBytes);
+        }
+        return true;
+    }
+
+private:
+    QByteArray mData;
+    QBuffer mBuffer;
+    QScopedPointer<QImageReader> mReader;
+    QImage mPrevious;
+    int mFrameNumber;
+    int mLoop;
+    int mLoopCount;
+
+    bool mCaching;
+    bool mCacheComplete;
+    qulonglong mCacheBudget;
+    qulonglong mCachedBytes;
+    QVector<AnimatedFrame> mCachedFrames;
+    // Dirty rect of the first frame when it follows the last one
+    QRect mLoopDirtyRect;
+
+    bool startNewLoop()
+    {
+        // Same rules as QMovie: -1 loops forever, 0 plays once
+        ++mLoop;
+        if (mLoopCount != -1 && mLoop > mLoopCount) {
+            return false;
+        }
+        mFrameNumber = 0;
+        return true;
+    }
+};
+
+/**
+ * Decodes frames ahead of playback. The receiver takes them with takeFrame(),
+ * if none was ready it is notified through its showNextFrame() slot, either
+ * when the frame is ready or when the animation is over.
+ */
+class AnimatedFrameDecoderThread : public QThread
+{
+public:
+    AnimatedFrameDecoderThread(QObject* receiver, const QByteArray& data, const QImage& firstImage)
+    : mReceiver(receiver)
+    , mData(data)
+    , mFirstImage(firstImage)
+    , mWaiting(false)
+    , mStopped(false)
+    , mFinished(false)
+    {}
+
+    bool takeFrame(AnimatedFrame* frame)
+    {
+        QMutexLocker locker(&mMutex);
+        if (mQueue.isEmpty()) {
+            mWaiting = true;
+            return false;
+        }
+        *frame = mQueue.dequeue();
+        mWaiting = false;
+        mCondition.wakeOne();
+        return true;
+    }
+
+    /**
+     * Returns true once all the frames have been taken
+     */
+    bool isOver()
+    {
+        QMutexLocker locker(&mMutex);
+        return mFinished && mQueue.isEmpty();
+    }
+
+    void stop()
+    {
+        {
+            QMutexLocker locker(&mMutex);
+            mStopped = true;
+            mCondition.wakeOne();
+        }
+        wait();
+    }
+
+protected:
+    void run() Q_DECL_OVERRIDE
+    {
+        AnimatedFrameSequence sequence(mData, mFirstImage);
+        QMutexLocker locker(&mMutex);
+        while (!mStopped) {
+            if (mQueue.size() >= LOOK_AHEAD_FRAME_COUNT) {
+                mCondition.wait(&mMutex);
+                continue;
+            }
+            locker.unlock();
+
+            AnimatedFrame frame;
+            const bool ok = sequence.next(&frame);
+
+            locker.relock();
+            if (!ok) {
+                mFinished = true;
+                if (mWaiting) {
+                    mWaiting = false;
+                    QMetaObject::invokeMethod(mReceiver, "showNextFrame", Qt::QueuedConnection);
+                }
+                break;
+            }
+            mQueue.enqueue(frame);
+            if (mWaiting) {
+                mWaiting = false;
+                QMetaObject::invokeMethod(mReceiver, "showNextFrame", Qt::QueuedConnection);
+            }
+        }
+    }
+
+private:
+    QObject* mReceiver;
+    QByteArray mData;
+    QImage mFirstImage;
+    QMutex mMutex;
+    QWaitCondition mCondition;
+    QQueue<AnimatedFrame> mQueue;
+    bool mWaiting;
+    bool mStopped;
+    bool mFinished;
+};
+
 struct AnimatedDocumentLoadedImplPrivate
 {
     QByteArray mRawData;
-    QBuffer mMovieBuffer;
-    QMovie mMovie;
+    AnimatedFrameDecoderThread* mThread;
+    QTimer mTimer;
+    bool mPlaying;
+    int mFrameNumber;
 };
 
 AnimatedDocumentLoadedImpl::AnimatedDocumentLoadedImpl(Document* document, const QByteArray& rawData)
@@ -46,16 +347,20 @@ AnimatedDocumentLoadedImpl::AnimatedDocumentLoadedImpl(Document* document, const
 , d(new AnimatedDocumentLoadedImplPrivate)
 {
     d->mRawData = rawData;
+    d->mThread = nullptr;
+    d->mPlaying = false;
+    d->mFrameNumber = 0;
 
-    connect(&d->mMovie, &QMovie::frameChanged, this, &AnimatedDocumentLoadedImpl::slotFrameChanged);
-
-    d->mMovieBuffer.setBuffer(&d->mRawData);
-    d->mMovieBuffer.open(QIODevice::ReadOnly);
-    d->mMovie.setDevice(&d->mMovieBuffer);
+    d->mTimer.setSingleShot(true);
+    connect(&d->mTimer, &QTimer::timeout, this, &AnimatedDocumentLoadedImpl::showNextFrame);
 }
 
 AnimatedDocumentLoadedImpl::~AnimatedDocumentLoadedImpl()
 {
+    if (d->mThread) {
+        d->mThread->stop();
+        delete d->mThread;
+    }
     delete d;
 }
 
@@ -81,11 +386,26 @@ QByteArray AnimatedDocumentLoadedImpl::rawData() const
     return d->mRawData;
 }
 
-void AnimatedDocumentLoadedImpl::slotFrameChanged(int /*frameNumber*/)
+void AnimatedDocumentLoadedImpl::showNextFrame()
 {
-    QImage image = d->mMovie.currentImage();
-    setDocumentImage(image);
-    emit imageRectUpdated(image.rect());
+    if (!d->mPlaying) {
+        return;
+    }
+    AnimatedFrame frame;
+    if (!d->mThread->takeFrame(&frame)) {
+        // The decoder is late and calls us back as soon as the frame is
+        // ready, unless the animation is over
+        if (d->mThread->isOver()) {
+            d->mPlaying = false;
+        }
+        return;
+    }
+    d->mFrameNumber = frame.number;
+    setDocumentImage(frame.image);
+    if (!frame.dirtyRect.isEmpty()) {
+        emit imageRectUpdated(frame.dirtyRect);
+    }
+    d->mTimer.start(frame.delay);
 }
 
 bool AnimatedDocumentLoadedImpl::isAnimated() const
@@ -95,18 +415,32 @@ bool AnimatedDocumentLoadedImpl::isAnimated() const
 
 void AnimatedDocumentLoadedImpl::startAnimation()
 {
-    d->mMovie.start();
-    if (d->mMovie.state() == QMovie::NotRunning) {
-        // This is true with qt-copy as of 2008.08.23
-        //qDebug() << "QMovie didn't start. This can happen in some cases when starting for the second time.";
-        //qDebug() << "Trying to start again, it usually fixes the bug.";
-        d->mMovie.start();
+    if (d->mPlaying) {
+        return;
+    }
+    d->mPlaying = true;
+    if (d->mThread && d->mThread->isFinished()) {
+        // The animation is over, play it again
+        delete d->mThread;
+        d->mThread = nullptr;
+    }
+    if (!d->mThread) {
+        // Dirty rects are computed from the image currently shown
+        d->mThread = new AnimatedFrameDecoderThread(this, d->mRawData, document()->image());
+        d->mThread->start();
     }
+    showNextFrame();
 }
 
 void AnimatedDocumentLoadedImpl::stopAnimation()
 {
-    d->mMovie.stop();
+    d->mPlaying = false;
+    d->mTimer.stop();
+}
+
+int AnimatedDocumentLoadedImpl::currentFrameNumber() const
+{
+    return d->mFrameNumber;
 }
 
 } // namespace
@@ -45,9 +45,10 @@ public:
     bool isAnimated() const Q_DECL_OVERRIDE;
     void startAnimation() Q_DECL_OVERRIDE;
     void stopAnimation() Q_DECL_OVERRIDE;
+    int currentFrameNumber() const Q_DECL_OVERRIDE;
 
 private Q_SLOTS:
-    void slotFrameChanged(int frameNumber);
+    void showNextFrame();
 
 private:
     AnimatedDocumentLoadedImplPrivate* const d;
@@ -22,7 +22,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 // Qt
 #include <QApplication>
+#include <QBuffer>
+#include <QFile>
 #include <QImage>
+#include <QImageReader>
 #include <QUndoStack>
 #include <QUrl>
 #include <QDebug>
@@ -35,10 +38,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "documentjob.h"
 #include "emptydocumentimpl.h"
 #include "gvdebug.h"
+#include "gwenviewconfig.h"
 #include "imagemetainfomodel.h"
+#include "imageutils.h"
+#include "jpegcontent.h"
+#include "jpegdocumentloadedimpl.h"
 #include "loadingdocumentimpl.h"
 #include "loadingjob.h"
 #include "savejob.h"
+#include "urlutils.h"
 
 namespace Gwenview
 {
@@ -88,6 +96,14 @@ static void logQueue(DocumentPrivate* d)
 //- DocumentPrivate ---------------------------------------
 void DocumentPrivate::scheduleImageLoading(int invertedZoom)
 {
+    if (mFullImageReleased) {
+        // Down sampled images are built from the full image
+        scheduleFullImageLoading();
+        if (invertedZoom != 1) {
+            scheduleImageDownSampling(invertedZoom);
+        }
+        return;
+    }
     LoadingDocumentImpl* impl = qobject_cast<LoadingDocumentImpl*>(mImpl);
     Q_ASSERT(impl);
     impl->loadImage(invertedZoom);
@@ -97,47 +113,182 @@ void DocumentPrivate::scheduleImageDownSampling(int invertedZoom)
 {
     LOG("invertedZoom=" << invertedZoom);
     DownSamplingJob* job = qobject_cast<DownSamplingJob*>(mCurrentJob.data());
-    if (job && job->mInvertedZoom == invertedZoom) {
-        LOG("Current job is already doing it");
-        return;
+    if (job) {
+        if (job->mInvertedZoom == invertedZoom) {
+            LOG("Current job is already doing it");
+            return;
+        }
+        LOG("Superseding current downsampling job");
+        job->supersede();
     }
 
     // Remove any previously scheduled downsampling job
-    DocumentJobQueue::Iterator it;
-    for (it = mJobQueue.begin(); it != mJobQueue.end(); ++it) {
+    DocumentJobQueue::Iterator it = mJobQueue.begin();
+    while (it != mJobQueue.end()) {
         DownSamplingJob* job = qobject_cast<DownSamplingJob*>(*it);
         if (!job) {
+            ++it;
             continue;
         }
         if (job->mInvertedZoom == invertedZoom) {
             // Already scheduled, nothing to do
             LOG("Already scheduled");
             return;
-        } else {
-            LOG("Removing downsampling job");
-            mJobQueue.erase(it);
-            delete job;
         }
+        LOG("Removing downsampling job");
+        it = mJobQueue.erase(it);
+        delete job;
     }
     q->enqueueJob(new DownSamplingJob(invertedZoom));
 }
 
-void DocumentPrivate::downSampleImage(int invertedZoom)
+void DocumentPrivate::scheduleFullImageLoading()
 {
-    mDownSampledImageMap[invertedZoom] = mImage.scaled(mImage.size() / invertedZoom, Qt::KeepAspectRatio, Qt::FastTransformation);
-    if (mDownSampledImageMap[invertedZoom].size().isEmpty()) {
-        mDownSampledImageMap[invertedZoom] = mImage;
+    if (qobject_cast<FullImageLoadingJob*>(mCurrentJob.data())) {
+        return;
     }
-    q->downSampledImageReady();
+    Q_FOREACH(DocumentJob* job, mJobQueue) {
+        if (qobject_cast<FullImageLoadingJob*>(job)) {
+            return;
+        }
+    }
+    q->enqueueJob(new FullImageLoadingJob);
 }
 
 //- DownSamplingJob ---------------------------------------
+DownSamplingJob::DownSamplingJob(int invertedZoom)
+: mInvertedZoom(invertedZoom)
+, mStartInvertedZoom(1)
+{
+}
+
+void DownSamplingJob::supersede()
+{
+    mSuperseded.store(1);
+}
+
 void DownSamplingJob::doStart()
 {
+    // Pick the input in the GUI thread: the document may change its images
+    // while we are working
     DocumentPrivate* d = document()->d;
-    d->downSampleImage(mInvertedZoom);
+    mFullImage = d->mImage;
+    mStartImage = d->mImage;
+    mStartInvertedZoom = 1;
+    QMap<int, QImage>::ConstIterator it = d->mDownSampledImageMap.constBegin();
+    for (; it != d->mDownSampledImageMap.constEnd(); ++it) {
+        if (it.key() > mStartInvertedZoom && it.key() <= mInvertedZoom) {
+            mStartInvertedZoom = it.key();
+            mStartImage = it.value();
+        }
+    }
+    ThreadedDocumentJob::doStart();
+}
+
+void DownSamplingJob::threadedStart()
+{
+    QImage image = mStartImage;
+    for (int invertedZoom = mStartInvertedZoom * 2; invertedZoom <= mInvertedZoom; invertedZoom *= 2) {
+        if (mSuperseded.load()) {
+            LOG("Superseded, stopping before invertedZoom=" << invertedZoom);
+            break;
+        }
+        QImage downSampled = image.scaled(image.size() / 2, Qt::KeepAspectRatio, Qt::FastTransformation);
+        if (downSampled.size().isEmpty()) {
+            downSampled = image;
+        }
+        mLevels[invertedZoom] = downSampled;
+        image = downSampled;
+    }
     setError(NoError);
+}
+
+void DownSamplingJob::applyResult()
+{
+    // Merge the levels before emitting the result: the next job starts as
+    // soon as this one is finished and must be able to use them
+    DocumentPrivate* d = document()->d;
+    if (d->mImage.cacheKey() != mFullImage.cacheKey()) {
+        LOG("Image changed while down sampling, dropping result");
+        mLevels.clear();
+    }
+    const bool ready = !mLevels.isEmpty();
+    QMap<int, QImage>::ConstIterator it = mLevels.constBegin();
+    for (; it != mLevels.constEnd(); ++it) {
+        d->mDownSampledImageMap[it.key()] = it.value();
+    }
+    mLevels.clear();
     emitResult();
+    if (ready) {
+        emit document()->downSampledImageReady();
+    }
+}
+
+//- FullImageLoadingJob -----------------------------------
+void FullImageLoadingJob::doStart()
+{
+    DocumentPrivate* d = document()->d;
+    mPath = d->mUrl.toLocalFile();
+    mData = d->mImpl->rawData();
+    mFormat = d->mFormat;
+    // Only JpegDocumentLoadedImpl applies the EXIF orientation. Its data
+    // can be the preview of a raw image, rather than the file.
+    mIsJpeg = qobject_cast<JpegDocumentLoadedImpl*>(d->mImpl) != nullptr;
+    ThreadedDocumentJob::doStart();
+}
+
+void FullImageLoadingJob::threadedStart()
+{
+    if (mData.isEmpty()) {
+        QFile file(mPath);
+        if (!file.open(QIODevice::ReadOnly)) {
+            LOG("Could not open" << mPath);
+            return;
+        }
+        mData = file.readAll();
+    }
+    QBuffer buffer(&mData);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer, mFormat);
+    if (!reader.read(&mImage)) {
+        LOG("QImageReader::read() failed:" << reader.errorString());
+        return;
+    }
+    if (mIsJpeg && GwenviewConfig::applyExifOrientation()) {
+        JpegContent content;
+        if (content.loadFromData(mData)) {
+            mImage = mImage.transformed(ImageUtils::transformMatrix(content.orientation()));
+        }
+    }
+    mData.clear();
+}
+
+void FullImageLoadingJob::applyResult()
+{
+    Document* doc = document().data();
+    DocumentPrivate* d = doc->d;
+    if (!d->mFullImageReleased) {
+        // The document has been reloaded in the meantime
+        setError(NoError);
+        emitResult();
+        return;
+    }
+    // The file may have changed since it was loaded
+    if (mImage.isNull() || mImage.size() != d->mSize) {
+        // Keep the loaded impl, reloading the document reports errors
+        LOG("Could not decode the full image again, reloading");
+        setError(NoError);
+        emitResult();
+        doc->reload();
+        return;
+    }
+    d->mFullImageReleased = false;
+    d->mImage = mImage;
+    mImage = QImage();
+    setError(NoError);
+    emitResult();
+    emit doc->imageRectUpdated(d->mImage.rect());
+    doc->emitLoaded();
 }
 
 //- Document ----------------------------------------------
@@ -180,6 +331,7 @@ void Document::reload()
     d->mUndoStack.clear();
     d->mErrorString.clear();
     d->mCmsProfile = nullptr;
+    d->mFullImageReleased = false;
 
     switchToImpl(new LoadingDocumentImpl(this));
 }
@@ -228,6 +380,9 @@ const QImage& Document::downSampledImageForZoom(qreal zoom) const
 
 Document::LoadingState Document::loadingState() const
 {
+    if (d->mFullImageReleased) {
+        return MetaInfoLoaded;
+    }
     return d->mImpl->loadingState();
 }
 
@@ -360,14 +515,41 @@ bool Document::hasAlphaChannel() const
     }
 }
 
-int Document::memoryUsage() const
+qint64 Document::memoryUsage() const
+{
+    return memoryUsageWithoutFullImage() + d->mImage.byteCount();
+}
+
+qint64 Document::memoryUsageWithoutFullImage() const
 {
     // FIXME: Take undo stack into account
-    int usage = d->mImage.byteCount();
-    usage += rawData().length();
+    qint64 usage = 0;
+    Q_FOREACH(const QImage& image, d->mDownSampledImageMap) {
+        usage += image.byteCount();
+    }
+    usage += d->mImpl->rawData().length();
     return usage;
 }
 
+bool Document::releaseFullImage()
+{
+    if (loadingState() != Loaded
+            || d->mKind != MimeTypeUtils::KIND_RASTER_IMAGE
+            || d->mDownSampledImageMap.isEmpty()
+            || isModified()
+            || isBusy()
+            || isAnimated()
+            || !UrlUtils::urlIsFastLocalFile(d->mUrl)) {
+        return false;
+    }
+    LOG(d->mUrl);
+    // Keep the loaded impl: it holds the meta information, the raw data and
+    // knows how to save the document
+    d->mImage = QImage();
+    d->mFullImageReleased = true;
+    return true;
+}
+
 void Document::setSize(const QSize& size)
 {
     if (size == d->mSize) {
@@ -385,6 +567,9 @@ bool Document::isModified() const
 
 AbstractDocumentEditor* Document::editor()
 {
+    if (d->mFullImageReleased) {
+        return nullptr;
+    }
     return d->mImpl->editor();
 }
 
@@ -419,6 +604,10 @@ ImageMetaInfoModel* Document::metaInfo() const
 
 void Document::startLoadingFullImage()
 {
+    if (d->mFullImageReleased) {
+        d->scheduleFullImageLoading();
+        return;
+    }
     LoadingState state = loadingState();
     if (state <= MetaInfoLoaded) {
         // Schedule full image loading
@@ -496,7 +685,7 @@ void Document::imageOperationCompleted()
 
 bool Document::isEditable() const
 {
-    return d->mImpl->isEditable();
+    return !d->mFullImageReleased && d->mImpl->isEditable();
 }
 
 bool Document::isAnimated() const
@@ -514,6 +703,11 @@ void Document::stopAnimation()
     return d->mImpl->stopAnimation();
 }
 
+int Document::currentFrameNumber() const
+{
+    return d->mImpl->currentFrameNumber();
+}
+
 void Document::enqueueJob(DocumentJob* job)
 {
     LOG("job=" << job);
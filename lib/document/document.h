@@ -156,9 +156,25 @@ public:
     bool keepRawData() const;
 
     /**
-     * Returns how much bytes the document is using
+     * Returns how much bytes the document is using, including its down sampled
+     * images
      */
-    int memoryUsage() const;
+    qint64 memoryUsage() const;
+
+    /**
+     * Returns how much bytes the document would use after a call to
+     * releaseFullImage()
+     */
+    qint64 memoryUsageWithoutFullImage() const;
+
+    /**
+     * Frees the full image of a loaded document, keeping its down sampled
+     * images and its meta information. The document is then in the
+     * MetaInfoLoaded state: its full image is decoded again by
+     * startLoadingFullImage(). Returns false if the document cannot do so: it is modified, busy, not
+     * a local raster image or has no down sampled image to keep.
+     */
+    bool releaseFullImage();
 
     /**
      * Returns the compressed version of the document, if it is still
@@ -195,6 +211,12 @@ public:
      */
     void stopAnimation();
 
+    /**
+     * Returns the number of the animation frame in image(), counted from the
+     * start of the animation. Always 0 if isAnimated() returns false.
+     */
+    int currentFrameNumber() const;
+
     void enqueueJob(DocumentJob*);
 
     void imageOperationCompleted();
@@ -230,6 +252,7 @@ private:
     friend class DocumentFactory;
     friend struct DocumentPrivate;
     friend class DownSamplingJob;
+    friend class FullImageLoadingJob;
 
     void setImageInternal(const QImage&);
     void setKind(MimeTypeUtils::Kind);
@@ -29,6 +29,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 #include <QUrl>
 
 // Qt
+#include <QAtomicInt>
 #include <QImage>
 #include <QQueue>
 #include <QUndoStack>
@@ -61,28 +62,77 @@ struct DocumentPrivate
     QUndoStack mUndoStack;
     QString mErrorString;
     Cms::Profile::Ptr mCmsProfile;
+    /// True if mImage has been dropped by releaseFullImage()
+    bool mFullImageReleased;
     /** @} */
 
     void scheduleImageLoading(int invertedZoom);
     void scheduleImageDownSampling(int invertedZoom);
-    void downSampleImage(int invertedZoom);
+    void scheduleFullImageLoading();
 };
 
 
-class DownSamplingJob : public DocumentJob
+/**
+ * Builds down sampled versions of the full image in a separate thread.
+ *
+ * Each level is built from the previous one (a mip chain), starting from the
+ * closest level which has already been built. The job can be superseded by a
+ * newer request: it then stops after the level it is working on, keeping the
+ * levels it already built.
+ */
+class DownSamplingJob : public ThreadedDocumentJob
 {
     Q_OBJECT
 public:
-    DownSamplingJob(int invertedZoom)
-    : mInvertedZoom(invertedZoom)
-    {}
+    DownSamplingJob(int invertedZoom);
 
-    void doStart() Q_DECL_OVERRIDE;
+    void threadedStart() Q_DECL_OVERRIDE;
+
+    void supersede();
 
     int mInvertedZoom;
+
+protected:
+    void doStart() Q_DECL_OVERRIDE;
+    void applyResult() Q_DECL_OVERRIDE;
+
+private:
+    // Full image at the time the job started, used to detect the image
+    // changed while we were working
+    QImage mFullImage;
+    QImage mStartImage;
+    int mStartInvertedZoom;
+    QMap<int, QImage> mLevels;
+    QAtomicInt mSuperseded;
 };
 
 
+/**
+ * Decodes the full image of a document again, after releaseFullImage(). The
+ * loaded impl and the meta information of the document are kept. If the image
+ * cannot be decoded again, the document is reloaded.
+ */
+class FullImageLoadingJob : public ThreadedDocumentJob
+{
+    Q_OBJECT
+public:
+    void threadedStart() Q_DECL_OVERRIDE;
+
+protected:
+    void doStart() Q_DECL_OVERRIDE;
+    void applyResult() Q_DECL_OVERRIDE;
+
+private:
+    QString mPath;
+    // Data kept by the loaded impl, read from mPath if empty
+    QByteArray mData;
+    // Format detected by the loader, which may differ from the one of the
+    // file: the data of a raw image is its preview
+    QByteArray mFormat;
+    bool mIsJpeg;
+    QImage mImage;
+};
+
 } // namespace
 
 #endif /* DOCUMENT_P_H */
@@ -23,6 +23,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <QByteArray>
 #include <QDateTime>
 #include <QMap>
+#include <QTimer>
 #include <QUndoGroup>
 #include <QUrl>
 #include <QDebug>
@@ -31,6 +32,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 // Local
 #include <gvdebug.h>
+#include <memoryutils.h>
 
 namespace Gwenview
 {
@@ -44,20 +46,40 @@ namespace Gwenview
 #define LOG(x) ;
 #endif
 
-inline int getMaxUnreferencedImages()
+/**
+ * Maximum amount of memory used by the documents which are not referenced
+ * anymore, in bytes. Can be overridden with the GV_DOCUMENT_CACHE_SIZE
+ * environment variable, in megabytes.
+ */
+inline qint64 getMaxCacheSize()
 {
-    int defaultValue = 3;
-    QByteArray ba = qgetenv("GV_MAX_UNREFERENCED_IMAGES");
+    qint64 defaultValue = qBound(qint64(128) << 20,
+                                 qint64(MemoryUtils::getTotalMemory() / 8),
+                                 qint64(2048) << 20);
+    QByteArray ba = qgetenv("GV_DOCUMENT_CACHE_SIZE");
     if (ba.isEmpty()) {
         return defaultValue;
     }
-    LOG("Custom value for max unreferenced images:" << ba);
+    LOG("Custom value for document cache size:" << ba);
     bool ok;
     int value = ba.toInt(&ok);
-    return ok ? value : defaultValue;
+    return ok ? qint64(value) << 20 : defaultValue;
 }
 
-static const int MAX_UNREFERENCED_IMAGES = getMaxUnreferencedImages();
+static const qint64 MAX_CACHE_SIZE = getMaxCacheSize();
+
+/**
+ * Returns true if doc may be decoding its image: deleting it would block
+ * until it is done
+ */
+static bool isDecoding(const Document::Ptr& doc)
+{
+    if (doc->isBusy()) {
+        return true;
+    }
+    const Document::LoadingState state = doc->loadingState();
+    return state != Document::Loaded && state != Document::LoadingFailed && doc->memoryUsage() == 0;
+}
 
 /**
  * This internal structure holds the document and the last time it has been
@@ -68,6 +90,10 @@ struct DocumentInfo
 {
     Document::Ptr mDocument;
     QDateTime mLastAccess;
+    /// Number of calls to load() for this document
+    int mLoadCount;
+    /// Set by release(), cleared by load()
+    bool mReleased;
 };
 
 /**
@@ -81,9 +107,30 @@ struct DocumentFactoryPrivate
 {
     DocumentMap mDocumentMap;
     QUndoGroup mUndoGroup;
+    QTimer mGarbageCollectTimer;
+    qint64 mCacheMemoryUsage;
+    int mHitCount;
+    int mMissCount;
+    int mEvictionCount;
+    int mReleaseCount;
 
     /**
-     * Removes items in a map if they are no longer referenced elsewhere
+     * The budget shrinks when the system runs out of memory: unreferenced
+     * documents never use more than half of what they use plus what is free.
+     */
+    qint64 cacheBudget(qint64 usage) const
+    {
+        const qint64 available = usage + qint64(MemoryUtils::getFreeMemory());
+        return qMin(MAX_CACHE_SIZE, available / 2);
+    }
+
+    /**
+     * Frees documents which are no longer referenced elsewhere, least
+     * recently used first, until they fit in the cache budget.
+     *
+     * Recently used documents are kept as they are as long as they fit. Older
+     * ones only keep their down sampled images, so that going back to them
+     * still shows something right away. The oldest ones are removed.
      */
     void garbageCollect(DocumentMap& map)
     {
@@ -92,30 +139,70 @@ struct DocumentFactoryPrivate
         // See https://bugs.kde.org/show_bug.cgi?id=296401
         typedef QMultiMap<QDateTime, QUrl> UnreferencedImages;
         UnreferencedImages unreferencedImages;
+        qint64 usage = 0;
+
+        QList<QUrl> releasedUrls;
 
         DocumentMap::Iterator it = map.begin(), end = map.end();
         for (; it != end; ++it) {
             DocumentInfo* info = it.value();
             if (info->mDocument->ref == 1 && !info->mDocument->isModified()) {
+                if (info->mReleased && !isDecoding(info->mDocument)) {
+                    releasedUrls << it.key();
+                    continue;
+                }
                 unreferencedImages.insert(info->mLastAccess, it.key());
+                usage += info->mDocument->memoryUsage();
             }
         }
 
-        // Remove oldest unreferenced images. Since the map is sorted by key,
-        // the oldest one is always unreferencedImages.begin().
-        for (
-            UnreferencedImages::Iterator unreferencedIt = unreferencedImages.begin();
-            unreferencedImages.count() > MAX_UNREFERENCED_IMAGES;
-            unreferencedIt = unreferencedImages.erase(unreferencedIt))
-        {
-            QUrl url = unreferencedIt.value();
-            LOG("Collecting" << url);
-            it = map.find(url);
-            Q_ASSERT(it != map.end());
-            delete it.value();
-            map.erase(it);
+        Q_FOREACH(const QUrl& url, releasedUrls) {
+            LOG("Collecting released" << url);
+            delete map.take(url);
+            ++mEvictionCount;
         }
 
+        const qint64 budget = cacheBudget(usage);
+        if (usage > budget) {
+            LOG("usage=" << usage << "budget=" << budget);
+            // Go from the most recently used image to the oldest one,
+            // deciding what each can keep
+            QList<QUrl> urlsToRemove;
+            qint64 keptUsage = 0;
+            UnreferencedImages::Iterator unreferencedIt = unreferencedImages.end();
+            while (unreferencedIt != unreferencedImages.begin()) {
+                --unreferencedIt;
+                const QUrl url = unreferencedIt.value();
+                Document::Ptr doc = map.value(url)->mDocument;
+                const qint64 fullUsage = doc->memoryUsage();
+                if (keptUsage + fullUsage <= budget) {
+                    keptUsage += fullUsage;
+                    continue;
+                }
+                const qint64 reducedUsage = doc->memoryUsageWithoutFullImage();
+                if (keptUsage + reducedUsage <= budget && doc->releaseFullImage()) {
+                    LOG("Releasing full image of" << url);
+                    ++mReleaseCount;
+                    keptUsage += doc->memoryUsage();
+                    continue;
+                }
+                urlsToRemove << url;
+            }
+
+            Q_FOREACH(const QUrl& url, urlsToRemove) {
+                LOG("Collecting" << url);
+                it = map.find(url);
+                Q_ASSERT(it != map.end());
+                delete it.value();
+                map.erase(it);
+                ++mEvictionCount;
+            }
+            usage = keptUsage;
+        }
+
+        mCacheMemoryUsage = usage;
+        MemoryUtils::setCacheMemoryUsage(this, quint64(usage));
+
 #ifdef ENABLE_LOG
         logDocumentMap(map);
 #endif
@@ -130,7 +217,8 @@ struct DocumentFactoryPrivate
         for (; it != end; ++it) {
             LOG("-" << it.key()
                 << "refCount=" << it.value()->mDocument.count()
-                << "lastAccess=" << it.value()->mLastAccess);
+                << "lastAccess=" << it.value()->mLastAccess
+                << "memoryUsage=" << it.value()->mDocument->memoryUsage());
         }
     }
 
@@ -140,10 +228,22 @@ struct DocumentFactoryPrivate
 DocumentFactory::DocumentFactory()
 : d(new DocumentFactoryPrivate)
 {
+    d->mCacheMemoryUsage = 0;
+    d->mHitCount = 0;
+    d->mMissCount = 0;
+    d->mEvictionCount = 0;
+    d->mReleaseCount = 0;
+
+    // Documents grow when they finish loading, check the budget once they
+    // are done rather than from their signal handlers
+    d->mGarbageCollectTimer.setSingleShot(true);
+    d->mGarbageCollectTimer.setInterval(0);
+    connect(&d->mGarbageCollectTimer, &QTimer::timeout, this, &DocumentFactory::collectGarbage);
 }
 
 DocumentFactory::~DocumentFactory()
 {
+    MemoryUtils::setCacheMemoryUsage(d, 0);
     qDeleteAll(d->mDocumentMap);
     delete d;
 }
@@ -171,6 +271,13 @@ Document::Ptr DocumentFactory::load(const QUrl &url)
         LOG(url.fileName() << "url in mDocumentMap");
         info = it.value();
         info->mLastAccess = QDateTime::currentDateTime();
+        if (info->mReleased) {
+            // Whoever released it wants it back
+            info->mReleased = false;
+        } else {
+            ++info->mLoadCount;
+        }
+        ++d->mHitCount;
         return info->mDocument;
     }
 
@@ -178,17 +285,21 @@ Document::Ptr DocumentFactory::load(const QUrl &url)
 
     // Start loading the document
     LOG(url.fileName() << "loading");
+    ++d->mMissCount;
     Document* doc = new Document(url);
     connect(doc, &Document::loaded, this, &DocumentFactory::slotLoaded);
     connect(doc, &Document::saved, this, &DocumentFactory::slotSaved);
     connect(doc, &Document::modified, this, &DocumentFactory::slotModified);
     connect(doc, &Document::busyChanged, this, &DocumentFactory::slotBusyChanged);
+    connect(doc, &Document::downSampledImageReady, &d->mGarbageCollectTimer, static_cast<void (QTimer::*)()>(&QTimer::start));
 
     // Create DocumentInfo instance
     info = new DocumentInfo;
     Document::Ptr docPtr(doc);
     info->mDocument = docPtr;
     info->mLastAccess = QDateTime::currentDateTime();
+    info->mLoadCount = 1;
+    info->mReleased = false;
 
     // Place DocumentInfo in the map
     d->mDocumentMap[url] = info;
@@ -213,10 +324,43 @@ void DocumentFactory::clearCache()
     qDeleteAll(d->mDocumentMap);
     d->mDocumentMap.clear();
     d->mModifiedDocumentList.clear();
+    d->mCacheMemoryUsage = 0;
+    MemoryUtils::setCacheMemoryUsage(d, 0);
+}
+
+qint64 DocumentFactory::cacheMemoryUsage() const
+{
+    return d->mCacheMemoryUsage;
+}
+
+int DocumentFactory::cacheHitCount() const
+{
+    return d->mHitCount;
+}
+
+int DocumentFactory::cacheMissCount() const
+{
+    return d->mMissCount;
+}
+
+int DocumentFactory::cacheEvictionCount() const
+{
+    return d->mEvictionCount;
+}
+
+int DocumentFactory::cacheReleaseCount() const
+{
+    return d->mReleaseCount;
+}
+
+void DocumentFactory::collectGarbage()
+{
+    d->garbageCollect(d->mDocumentMap);
 }
 
 void DocumentFactory::slotLoaded(const QUrl &url)
 {
+    d->mGarbageCollectTimer.start();
     if (d->mModifiedDocumentList.contains(url)) {
         d->mModifiedDocumentList.removeAll(url);
         emit modifiedDocumentListChanged();
@@ -257,6 +401,10 @@ void DocumentFactory::slotModified(const QUrl &url)
 
 void DocumentFactory::slotBusyChanged(const QUrl &url, bool busy)
 {
+    if (!busy) {
+        // Released documents can go once their jobs are done
+        d->mGarbageCollectTimer.start();
+    }
     emit documentBusyStateChanged(url, busy);
 }
 
@@ -279,4 +427,15 @@ void DocumentFactory::forget(const QUrl &url)
     }
 }
 
+void DocumentFactory::release(const QUrl &url)
+{
+    DocumentInfo* info = d->mDocumentMap.value(url);
+    if (!info || info->mLoadCount > 1) {
+        return;
+    }
+    LOG(url);
+    info->mReleased = true;
+    d->mGarbageCollectTimer.start();
+}
+
 } // namespace
@@ -40,6 +40,10 @@ struct DocumentFactoryPrivate;
  * It keeps a cache of recently accessed documents to avoid reloading them.
  * To do so it keeps a last-access timestamp, which is updated to the
  * current time every time DocumentFactory::load() is called.
+ *
+ * The cache is limited by the memory used by unreferenced documents rather
+ * than by their count: when it goes over budget, the least recently used
+ * documents first lose their full image, then are removed.
  */
 class GWENVIEWLIB_EXPORT DocumentFactory : public QObject
 {
@@ -67,6 +71,33 @@ public:
 
     void clearCache();
 
+    /**
+     * Returns how much memory unreferenced documents used, as of the last
+     * garbage collection
+     */
+    qint64 cacheMemoryUsage() const;
+
+    /**
+     * Number of calls to load() which found the document in the cache
+     */
+    int cacheHitCount() const;
+
+    /**
+     * Number of calls to load() which had to create a new document
+     */
+    int cacheMissCount() const;
+
+    /**
+     * Number of documents removed from the cache to stay within its budget
+     */
+    int cacheEvictionCount() const;
+
+    /**
+     * Number of documents whose full image has been released to stay within
+     * the cache budget, keeping their down sampled images
+     */
+    int cacheReleaseCount() const;
+
     QUndoGroup* undoGroup();
 
     /**
@@ -75,6 +106,14 @@ public:
      */
     void forget(const QUrl &url);
 
+    /**
+     * Tells that the document loaded for @p url is not needed anymore, for
+     * example because it was being preloaded. Unless someone else loaded
+     * it too, it is removed from the cache as soon as it is unreferenced
+     * and done loading, instead of when the cache is over budget.
+     */
+    void release(const QUrl &url);
+
 Q_SIGNALS:
     void modifiedDocumentListChanged();
     void documentChanged(const QUrl&);
@@ -85,6 +124,7 @@ private Q_SLOTS:
     void slotSaved(const QUrl&, const QUrl&);
     void slotModified(const QUrl&);
     void slotBusyChanged(const QUrl&, bool);
+    void collectGarbage();
 
 private:
     DocumentFactory();
@@ -86,8 +86,13 @@ void ThreadedDocumentJob::doStart()
 {
     QFuture<void> future = QtConcurrent::run(this, &ThreadedDocumentJob::threadedStart);
     QFutureWatcher<void>* watcher = new QFutureWatcher<void>(this);
-    connect(watcher, SIGNAL(finished()), SLOT(emitResult()));
+    connect(watcher, &QFutureWatcher<void>::finished, this, &ThreadedDocumentJob::applyResult);
     watcher->setFuture(future);
 }
 
+void ThreadedDocumentJob::applyResult()
+{
+    emitResult();
+}
+
 } // namespace
@@ -109,6 +109,13 @@ public:
 
 protected:
     void doStart() Q_DECL_OVERRIDE;
+
+    /**
+     * Called from the GUI thread once threadedStart() is done. The default
+     * implementation emits the result. Reimplement it to apply the work of
+     * threadedStart() to the document, then call emitResult().
+     */
+    virtual void applyResult();
 };
 
 } // namespace
@@ -115,6 +115,11 @@ void DocumentLoadedImpl::applyTransformation(Orientation orientation)
     imageRectUpdated(image.rect());
 }
 
+void DocumentLoadedImpl::applyCrop(const QRect& rect)
+{
+    setImage(document()->image().copy(rect));
+}
+
 QByteArray DocumentLoadedImpl::rawData() const
 {
     return d->mRawData;
@@ -63,6 +63,7 @@ protected:
     // AbstractDocumentEditor
     void setImage(const QImage&) Q_DECL_OVERRIDE;
     void applyTransformation(Orientation orientation) Q_DECL_OVERRIDE;
+    void applyCrop(const QRect& rect) Q_DECL_OVERRIDE;
     //
 
 private:
@@ -24,10 +24,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
 // Qt
 #include <QImage>
 #include <QIODevice>
+#include <QMatrix>
 
 // KDE
 
 // Local
+#include "imageutils.h"
 #include "jpegcontent.h"
 
 namespace Gwenview
@@ -36,6 +38,11 @@ namespace Gwenview
 struct JpegDocumentLoadedImplPrivate
 {
     JpegContent* mJpegContent;
+    // Operations applied since the image was loaded or saved, so that the
+    // EXIF thumbnail is only regenerated from the image when its pixels
+    // changed
+    bool mPixelsChanged;
+    QMatrix mThumbnailMatrix;
 };
 
 JpegDocumentLoadedImpl::JpegDocumentLoadedImpl(Document* doc, JpegContent* jpegContent)
@@ -44,6 +51,7 @@ JpegDocumentLoadedImpl::JpegDocumentLoadedImpl(Document* doc, JpegContent* jpegC
 {
     Q_ASSERT(jpegContent);
     d->mJpegContent = jpegContent;
+    d->mPixelsChanged = false;
 }
 
 JpegDocumentLoadedImpl::~JpegDocumentLoadedImpl()
@@ -56,13 +64,20 @@ bool JpegDocumentLoadedImpl::saveInternal(QIODevice* device, const QByteArray& f
 {
     if (format == "jpeg") {
         d->mJpegContent->resetOrientation();
-        if (!d->mJpegContent->thumbnail().isNull()) {
-            QImage thumbnail = document()->image().scaled(128, 128, Qt::KeepAspectRatio);
-            d->mJpegContent->setThumbnail(thumbnail);
+        const QImage thumbnail = d->mJpegContent->thumbnail();
+        if (!thumbnail.isNull()) {
+            if (d->mPixelsChanged) {
+                d->mJpegContent->setThumbnail(document()->image().scaled(128, 128, Qt::KeepAspectRatio));
+            } else if (!d->mThumbnailMatrix.isIdentity()) {
+                d->mJpegContent->setThumbnail(thumbnail.transformed(d->mThumbnailMatrix));
+            }
         }
 
         bool ok = d->mJpegContent->save(device);
-        if (!ok) {
+        if (ok) {
+            d->mPixelsChanged = false;
+            d->mThumbnailMatrix.reset();
+        } else {
             setDocumentErrorString(d->mJpegContent->errorString());
         }
         return ok;
@@ -74,6 +89,7 @@ bool JpegDocumentLoadedImpl::saveInternal(QIODevice* device, const QByteArray& f
 void JpegDocumentLoadedImpl::setImage(const QImage& image)
 {
     d->mJpegContent->setImage(image);
+    d->mPixelsChanged = true;
     DocumentLoadedImpl::setImage(image);
 }
 
@@ -81,6 +97,18 @@ void JpegDocumentLoadedImpl::applyTransformation(Orientation orientation)
 {
     DocumentLoadedImpl::applyTransformation(orientation);
     d->mJpegContent->transform(orientation);
+    d->mThumbnailMatrix = d->mThumbnailMatrix * ImageUtils::transformMatrix(orientation);
+}
+
+void JpegDocumentLoadedImpl::applyCrop(const QRect& rect)
+{
+    if (!d->mJpegContent->crop(rect)) {
+        // Not aligned on iMCUs: crop the pixels, they will be encoded again
+        DocumentLoadedImpl::applyCrop(rect);
+        return;
+    }
+    DocumentLoadedImpl::setImage(document()->image().copy(rect));
+    d->mPixelsChanged = true;
 }
 
 QByteArray JpegDocumentLoadedImpl::rawData() const
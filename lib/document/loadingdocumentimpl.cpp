@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
 */
 // Self
 #include "loadingdocumentimpl.h"
+#include "config-gwenview.h"
 
 // STL
 #include <memory>
@@ -27,7 +28,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
 // Qt
 #include <QBuffer>
 #include <QByteArray>
+#include <QDateTime>
 #include <QFile>
+#include <QFileInfo>
 #include <QFuture>
 #include <QFutureWatcher>
 #include <QImage>
@@ -55,9 +58,14 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
 #include "emptydocumentimpl.h"
 #include "exiv2imageloader.h"
 #include "gvdebug.h"
+#include "imageformats/jpeghandler.h"
+#ifdef HAVE_FITS
+#include "imageformats/fitsformat/fitsdata.h"
+#endif
 #include "imageutils.h"
 #include "jpegcontent.h"
 #include "jpegdocumentloadedimpl.h"
+#include "mappedfile.h"
 #include "orientation.h"
 #include "svgdocumentloadedimpl.h"
 #include "urlutils.h"
@@ -80,6 +88,9 @@ const int MIN_PREV_SIZE = 1000;
 
 const int HEADER_SIZE = 256;
 
+// Smaller files are read: mapping them is not worth it
+const qint64 MIN_MAPPED_FILE_SIZE = 1024 * 1024;
+
 struct LoadingDocumentImplPrivate
 {
     LoadingDocumentImpl* q;
@@ -98,7 +109,13 @@ struct LoadingDocumentImplPrivate
     bool mDownSampledImageLoaded;
     QByteArray mFormatHint;
     QByteArray mData;
+    // Set if the file is mapped. mData points to the mapping until it is
+    // replaced, by the preview of a raw image for example.
+    QScopedPointer<MappedFile> mMappedFile;
+    QString mMimeType;
     QByteArray mFormat;
+    // Modification time of the file, for local files
+    QDateTime mModificationTime;
     QSize mImageSize;
     Exiv2::Image::AutoPtr mExiv2Image;
     std::unique_ptr<JpegContent> mJpegContent;
@@ -121,6 +138,7 @@ struct LoadingDocumentImplPrivate
             mimeType = db.mimeTypeForData(mData).name();
         }
         MimeTypeUtils::Kind kind = MimeTypeUtils::mimeTypeKind(mimeType);
+        mMimeType = mimeType;
         LOG("mimeType:" << mimeType);
         LOG("kind:" << kind);
         q->setDocumentKind(kind);
@@ -144,6 +162,71 @@ struct LoadingDocumentImplPrivate
         }
     }
 
+    /**
+     * Returns true if the file should be mapped rather than read. Mapping
+     * avoids a private copy of the file, which only helps if the loaded impl
+     * does not keep the data: JpegContent and SvgDocumentLoadedImpl do.
+     */
+    bool shouldMapFile(qint64 size) const
+    {
+        return size >= MIN_MAPPED_FILE_SIZE
+            && q->document()->kind() == MimeTypeUtils::KIND_RASTER_IMAGE
+            && mMimeType != QLatin1String("image/jpeg");
+    }
+
+    /**
+     * Make mData point to a read-only mapping of @p path, so that decoders
+     * read straight from the page cache instead of a private copy.
+     *
+     * The mapping only lives as long as the loading: releaseMappedFile()
+     * copies the data the loaded impl keeps. Nothing else may keep pointing
+     * to it: Exiv2 reads the file itself.
+     * @return false if the file should be read instead.
+     */
+    bool mapFile(const QString& path)
+    {
+        QScopedPointer<MappedFile> file(new MappedFile(path));
+        if (!file->map()) {
+            return false;
+        }
+        mMappedFile.reset(file.take());
+        mData = mMappedFile->data();
+        return true;
+    }
+
+    /**
+     * Stop using the file mapping, if any. The data is copied if @p keepData
+     * is true, so that the loaded impl can keep it.
+     * @return false if the file was truncated while it was mapped: what has
+     * been decoded is not valid, so loading failed and we switched to an
+     * EmptyDocumentImpl.
+     */
+    bool releaseMappedFile(bool keepData)
+    {
+        if (!mMappedFile) {
+            return true;
+        }
+        const bool ok = !mMappedFile->isTruncated();
+        if (mData.constData() == mMappedFile->data().constData()) {
+            if (ok && keepData) {
+                mData = QByteArray(mData.constData(), mData.size());
+            } else {
+                mData.clear();
+            }
+        }
+        mMappedFile.reset();
+        if (!ok) {
+            LOG("File changed while it was mapped");
+            mJpegContent.reset();
+            q->setDocumentErrorString(
+                i18nc("@info", "The file %1 changed while it was being loaded.", q->document()->url().toLocalFile())
+            );
+            emit q->loadingFailed();
+            q->switchToImpl(new EmptyDocumentImpl(q->document()));
+        }
+        return ok;
+    }
+
     void startLoading()
     {
         Q_ASSERT(!mMetaInfoLoaded);
@@ -164,7 +247,9 @@ struct LoadingDocumentImplPrivate
             break;
 
         case MimeTypeUtils::KIND_SVG_IMAGE:
-            q->switchToImpl(new SvgDocumentLoadedImpl(q->document(), mData));
+            if (releaseMappedFile(true)) {
+                q->switchToImpl(new SvgDocumentLoadedImpl(q->document(), mData));
+            }
             break;
 
         case MimeTypeUtils::KIND_VIDEO:
@@ -257,8 +342,13 @@ struct LoadingDocumentImplPrivate
         LOG("mFormat" << mFormat);
         GV_RETURN_VALUE_IF_FAIL(!mFormat.isEmpty(), false);
 
+        // Exiv2 images read from the data they are created from as long as
+        // they live, which is longer than the mapping
         Exiv2ImageLoader loader;
-        if (loader.load(mData)) {
+        const bool exiv2Loaded = mMappedFile
+            ? loader.load(q->document()->url().toLocalFile())
+            : loader.load(mData);
+        if (exiv2Loaded) {
             mExiv2Image = loader.popImage();
         }
 
@@ -289,14 +379,54 @@ struct LoadingDocumentImplPrivate
         return true;
     }
 
+    bool loadDownSampledJpegData(QBuffer* buffer)
+    {
+        // Use our own handler: it can stop reading progressive JPEGs after
+        // their first scans when a heavily down sampled image is enough
+        JpegHandler handler;
+        handler.setDevice(buffer);
+        QSize size = handler.option(QImageIOHandler::Size).toSize() / mImageDataInvertedZoom;
+        if (!size.isEmpty()) {
+            LOG("Setting scaled size to" << size);
+            handler.setOption(QImageIOHandler::ScaledSize, size);
+        }
+        return handler.read(&mImage);
+    }
+
+    void applyExifOrientation()
+    {
+        if (mJpegContent.get() && GwenviewConfig::applyExifOrientation()) {
+            Gwenview::Orientation orientation = mJpegContent->orientation();
+            QMatrix matrix = ImageUtils::transformMatrix(orientation);
+            mImage = mImage.transformed(matrix);
+        }
+    }
+
     void loadImageData()
     {
         QBuffer buffer;
         buffer.setBuffer(&mData);
         buffer.open(QIODevice::ReadOnly);
-        QImageReader reader(&buffer, mFormat);
 
         LOG("mImageDataInvertedZoom=" << mImageDataInvertedZoom);
+        if (mFormat == "jpeg" && mImageSize.isValid() && mImageDataInvertedZoom != 1) {
+            if (!loadDownSampledJpegData(&buffer)) {
+                LOG("JpegHandler::read() failed");
+                mImage = QImage();
+                return;
+            }
+            applyExifOrientation();
+            return;
+        }
+
+#ifdef HAVE_FITS
+        if (mFormat == "fits" && mModificationTime.isValid()) {
+            // Lets the document and its thumbnail share the decoded image
+            FITSData::setModificationTime(buffer, mModificationTime);
+        }
+#endif
+        QImageReader reader(&buffer, mFormat);
+
         if (mImageSize.isValid()
                 && mImageDataInvertedZoom != 1
                 && reader.supportsOption(QImageIOHandler::ScaledSize)
@@ -318,11 +448,7 @@ struct LoadingDocumentImplPrivate
             return;
         }
 
-        if (mJpegContent.get() && GwenviewConfig::applyExifOrientation()) {
-            Gwenview::Orientation orientation = mJpegContent->orientation();
-            QMatrix matrix = ImageUtils::transformMatrix(orientation);
-            mImage = mImage.transformed(matrix);
-        }
+        applyExifOrientation();
 
         if (reader.supportsAnimation()
                 && reader.nextImageDelay() > 0 // Assume delay == 0 <=> only one frame
@@ -396,11 +522,14 @@ void LoadingDocumentImpl::init()
             switchToImpl(new EmptyDocumentImpl(document()));
             return;
         }
+        d->mModificationTime = QFileInfo(file).lastModified();
         d->mData = file.read(HEADER_SIZE);
         if (d->determineKind()) {
             return;
         }
-        d->mData += file.readAll();
+        if (!d->shouldMapFile(file.size()) || !d->mapFile(file.fileName())) {
+            d->mData += file.readAll();
+        }
         d->startLoading();
     } else {
         // Transfer file via KIO
@@ -521,6 +650,9 @@ void LoadingDocumentImpl::slotImageLoaded()
             setDocumentImage(d->mImage);
         }
 
+        if (!d->releaseMappedFile(true)) {
+            return;
+        }
         switchToImpl(new AnimatedDocumentLoadedImpl(
                          document(),
                          d->mData));
@@ -537,6 +669,9 @@ void LoadingDocumentImpl::slotImageLoaded()
     }
 
     LOG("Loaded a full image");
+    if (!d->releaseMappedFile(d->mJpegContent.get() || document()->keepRawData())) {
+        return;
+    }
     setDocumentImage(d->mImage);
     DocumentLoadedImpl* impl;
     if (d->mJpegContent.get()) {
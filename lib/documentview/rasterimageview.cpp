@@ -26,20 +26,207 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 #include <lib/imagescaler.h>
 #include <lib/cms/cmsprofile.h>
 #include <lib/gvdebug.h>
+#include <lib/paintutils.h>
 
 // KDE
 
 // Qt
 #include <QGraphicsSceneMouseEvent>
+#include <QGuiApplication>
+#include <QHash>
 #include <QPainter>
 #include <QTimer>
 #include <QPointer>
+#include <QSet>
 #include <QDebug>
-
+#include <QThread>
+#include <QtConcurrentMap>
 
 namespace Gwenview
 {
 
+/**
+ * Creating a display transform is expensive, and so is retrieving the monitor
+ * profile. Transforms are shared by all views and kept until the screen
+ * configuration changes.
+ */
+class DisplayTransformCache : public QObject
+{
+public:
+    DisplayTransformCache()
+    : mMonitorProfileLookedUp(false)
+    {
+        connect(qApp, &QGuiApplication::screenAdded, this, &DisplayTransformCache::invalidate);
+        connect(qApp, &QGuiApplication::screenRemoved, this, &DisplayTransformCache::invalidate);
+        connect(qApp, &QGuiApplication::primaryScreenChanged, this, &DisplayTransformCache::invalidate);
+        // The monitor profile is usually changed from the system settings,
+        // while we are not active: look it up again when we are back.
+        // Transforms are keyed by profile, they do not need to be cleared.
+        connect(qApp, &QGuiApplication::applicationStateChanged, this, [this](Qt::ApplicationState state) {
+            if (state == Qt::ApplicationActive) {
+                mMonitorProfileLookedUp = false;
+            }
+        });
+    }
+
+    ~DisplayTransformCache()
+    {
+        clearTransforms();
+    }
+
+    /**
+     * Returns a transform from profile to the monitor profile, or nullptr if
+     * none can be created. The transform belongs to the cache and must not
+     * be kept.
+     */
+    cmsHTRANSFORM transform(Cms::Profile::Ptr profile, cmsUInt32Number format, cmsUInt32Number renderingIntent)
+    {
+        if (!mMonitorProfileLookedUp) {
+            // Remember failures too: this is called for each tile
+            mMonitorProfileLookedUp = true;
+            mMonitorProfile = Cms::Profile::getMonitorProfile();
+            if (!mMonitorProfile) {
+                qWarning() << "Could not get monitor color profile";
+            }
+        }
+        if (!mMonitorProfile) {
+            return nullptr;
+        }
+        if (!profile) {
+            // The assumption that something unmarked is *probably* sRGB is better than failing to apply any transform when one
+            // has a wide-gamut screen.
+            if (!mSRgbProfile) {
+                mSRgbProfile = Cms::Profile::getSRgbProfile();
+            }
+            profile = mSRgbProfile;
+        }
+
+        Key key;
+        key.mProfileId = profile->id();
+        key.mMonitorProfileId = mMonitorProfile->id();
+        key.mFormat = format;
+        key.mRenderingIntent = renderingIntent;
+        TransformHash::ConstIterator it = mTransforms.constFind(key);
+        if (it != mTransforms.constEnd()) {
+            return it.value();
+        }
+
+        if (mTransforms.size() >= MAX_TRANSFORM_COUNT) {
+            clearTransforms();
+        }
+        cmsHTRANSFORM transform = cmsCreateTransform(profile->handle(), format,
+                                                     mMonitorProfile->handle(), format,
+                                                     renderingIntent, cmsFLAGS_BLACKPOINTCOMPENSATION);
+        mTransforms.insert(key, transform);
+        return transform;
+    }
+
+    void invalidate()
+    {
+        clearTransforms();
+        mMonitorProfile.reset();
+        mMonitorProfileLookedUp = false;
+    }
+
+private:
+    enum { MAX_TRANSFORM_COUNT = 16 };
+
+    struct Key
+    {
+        QByteArray mProfileId;
+        QByteArray mMonitorProfileId;
+        cmsUInt32Number mFormat;
+        cmsUInt32Number mRenderingIntent;
+
+        bool operator==(const Key& other) const
+        {
+            return mProfileId == other.mProfileId
+                && mMonitorProfileId == other.mMonitorProfileId
+                && mFormat == other.mFormat
+                && mRenderingIntent == other.mRenderingIntent;
+        }
+    };
+
+    friend uint qHash(const Key& key)
+    {
+        return qHash(key.mProfileId) ^ qHash(key.mMonitorProfileId)
+            ^ qHash(key.mFormat) ^ (qHash(key.mRenderingIntent) << 8);
+    }
+
+    typedef QHash<Key, cmsHTRANSFORM> TransformHash;
+    TransformHash mTransforms;
+    Cms::Profile::Ptr mMonitorProfile;
+    bool mMonitorProfileLookedUp;
+    Cms::Profile::Ptr mSRgbProfile;
+
+    void clearTransforms()
+    {
+        Q_FOREACH(cmsHTRANSFORM transform, mTransforms) {
+            if (transform) {
+                cmsDeleteTransform(transform);
+            }
+        }
+        mTransforms.clear();
+    }
+};
+
+Q_GLOBAL_STATIC(DisplayTransformCache, sDisplayTransformCache)
+
+struct TransformedRows
+{
+    cmsHTRANSFORM mTransform;
+    uchar* mBits;
+    int mBytesPerLine;
+    int mWidth;
+    int mTop;
+    int mBottom;
+};
+
+/**
+ * cmsDoTransform() can be called from several threads on the same transform:
+ * lcms works on a copy of the transform cache.
+ */
+static void transformRows(const TransformedRows& rows)
+{
+    for (int y = rows.mTop; y < rows.mBottom; ++y) {
+        uchar* line = rows.mBits + y * rows.mBytesPerLine;
+        cmsDoTransform(rows.mTransform, line, line, rows.mWidth);
+    }
+}
+
+static void applyDisplayTransform(cmsHTRANSFORM transform, QImage* image)
+{
+    // Below this amount of pixels, dispatching rows to threads costs more
+    // than it saves
+    static const int MIN_PARALLEL_PIXEL_COUNT = 128 * 128;
+
+    TransformedRows rows;
+    rows.mTransform = transform;
+    rows.mBits = image->bits();
+    rows.mBytesPerLine = image->bytesPerLine();
+    rows.mWidth = image->width();
+
+    const int height = image->height();
+    const int chunkCount = image->width() * height < MIN_PARALLEL_PIXEL_COUNT
+        ? 1
+        : qMin(QThread::idealThreadCount(), height);
+    if (chunkCount <= 1) {
+        rows.mTop = 0;
+        rows.mBottom = height;
+        transformRows(rows);
+        return;
+    }
+
+    QVector<TransformedRows> chunks;
+    chunks.reserve(chunkCount);
+    for (int idx = 0; idx < chunkCount; ++idx) {
+        rows.mTop = height * idx / chunkCount;
+        rows.mBottom = height * (idx + 1) / chunkCount;
+        chunks << rows;
+    }
+    QtConcurrent::blockingMap(chunks, transformRows);
+}
+
 struct RasterImageViewPrivate
 {
     RasterImageView* q;
@@ -65,29 +252,21 @@ struct RasterImageViewPrivate
     QPointer<AbstractRasterImageViewTool> mTool;
 
     bool mApplyDisplayTransform; // Defaults to true. Can be set to false if there is no need or no way to apply color profile
-    cmsHTRANSFORM mDisplayTransform;
-
-    void updateDisplayTransform(QImage::Format format)
+    // Image formats for which no transform could be created. They are not
+    // tried again until the document or the rendering intent changes.
+    QSet<int> mFailedDisplayTransformFormats;
+
+    /**
+     * Returns the transform to apply to images of this format, nullptr if
+     * there is none. The transform must not be kept: it belongs to
+     * sDisplayTransformCache.
+     */
+    cmsHTRANSFORM displayTransform(QImage::Format format)
     {
-        GV_RETURN_IF_FAIL(format != QImage::Format_Invalid);
-        mApplyDisplayTransform = false;
-        if (mDisplayTransform) {
-            cmsDeleteTransform(mDisplayTransform);
-        }
-        mDisplayTransform = nullptr;
-
-        Cms::Profile::Ptr profile = q->document()->cmsProfile();
-        if (!profile) {
-            // The assumption that something unmarked is *probably* sRGB is better than failing to apply any transform when one
-            // has a wide-gamut screen.
-            profile = Cms::Profile::getSRgbProfile();
-        }
-        Cms::Profile::Ptr monitorProfile = Cms::Profile::getMonitorProfile();
-        if (!monitorProfile) {
-            qWarning() << "Could not get monitor color profile";
-            return;
+        GV_RETURN_VALUE_IF_FAIL(format != QImage::Format_Invalid, nullptr);
+        if (mFailedDisplayTransformFormats.contains(format)) {
+            return nullptr;
         }
-
         cmsUInt32Number cmsFormat = 0;
         switch (format) {
         case QImage::Format_RGB32:
@@ -101,13 +280,15 @@ struct RasterImageViewPrivate
 #endif
         default:
             qWarning() << "Gwenview can only apply color profile on RGB32 or ARGB32 images";
-            return;
+            mFailedDisplayTransformFormats << format;
+            return nullptr;
         }
 
-        mDisplayTransform = cmsCreateTransform(profile->handle(), cmsFormat,
-                                               monitorProfile->handle(), cmsFormat,
-                                               mRenderingIntent, cmsFLAGS_BLACKPOINTCOMPENSATION);
-        mApplyDisplayTransform = true;
+        cmsHTRANSFORM transform = sDisplayTransformCache->transform(q->document()->cmsProfile(), cmsFormat, mRenderingIntent);
+        if (!transform) {
+            mFailedDisplayTransformFormats << format;
+        }
+        return transform;
     }
 
     void setupUpdateTimer()
@@ -139,6 +320,23 @@ struct RasterImageViewPrivate
         mScaler->setDestinationRegion(QRegion(rect.toRect()));
     }
 
+    /**
+     * Only rescales the visible part of imageRect, the rest of the buffer is
+     * still up to date
+     */
+    void setScalerRegionToVisiblePartOf(const QRect& imageRect)
+    {
+        const qreal zoom = q->zoom();
+        const QRect zoomedRect = PaintUtils::containingRect(QRectF(
+            imageRect.left() * zoom, imageRect.top() * zoom,
+            imageRect.width() * zoom, imageRect.height() * zoom));
+        const QRectF visibleRect = mapViewportToZoomedImage(q->boundingRect());
+        const QRect rect = zoomedRect & visibleRect.toRect();
+        if (!rect.isEmpty()) {
+            mScaler->setDestinationRegion(QRegion(rect));
+        }
+    }
+
     void resizeBuffer()
     {
         QSize size = q->visibleImageSize().toSize();
@@ -195,7 +393,6 @@ RasterImageView::RasterImageView(QGraphicsItem* parent)
     d->q = this;
     d->mEmittedCompleted = false;
     d->mApplyDisplayTransform = true;
-    d->mDisplayTransform = nullptr;
 
     d->mAlphaBackgroundMode = AlphaBackgroundNone;
     d->mAlphaBackgroundColor = Qt::black;
@@ -214,9 +411,6 @@ RasterImageView::~RasterImageView()
     if (d->mTool) {
         d->mTool.data()->toolDeactivated();
     }
-    if (d->mDisplayTransform) {
-        cmsDeleteTransform(d->mDisplayTransform);
-    }
     delete d;
 }
 
@@ -242,6 +436,7 @@ void RasterImageView::setRenderingIntent(const RenderingIntent::Enum& renderingI
 {
     if (d->mRenderingIntent != renderingIntent) {
         d->mRenderingIntent = renderingIntent;
+        d->mFailedDisplayTransformFormats.clear();
         updateBuffer();
     }
 }
@@ -253,6 +448,7 @@ void RasterImageView::loadFromDocument()
         return;
     }
 
+    d->mFailedDisplayTransformFormats.clear();
     connect(doc.data(), SIGNAL(metaInfoLoaded(QUrl)),
             SLOT(slotDocumentMetaInfoLoaded()));
     connect(doc.data(), SIGNAL(isAnimatedUpdated()),
@@ -309,6 +505,7 @@ void RasterImageView::updateImageRect(const QRect& imageRect)
         return;
     }
 
+    const qreal oldZoom = zoom();
     if (zoomToFit()) {
         setZoom(computeZoomToFit());
     } else if (zoomToFill()) {
@@ -317,7 +514,12 @@ void RasterImageView::updateImageRect(const QRect& imageRect)
         applyPendingScrollPos();
     }
 
-    d->setScalerRegionToVisibleRect();
+    if (zoom() == oldZoom && !d->mBufferIsEmpty && imageRect != document()->image().rect()) {
+        // Typically the next frame of an animation
+        d->setScalerRegionToVisiblePartOf(imageRect);
+    } else {
+        d->setScalerRegionToVisibleRect();
+    }
     update();
     emit imageRectUpdated();
 }
@@ -327,13 +529,15 @@ void RasterImageView::slotDocumentIsAnimatedUpdated()
     d->startAnimationIfNecessary();
 }
 
-void RasterImageView::updateFromScaler(int zoomedImageLeft, int zoomedImageTop, const QImage& image)
+void RasterImageView::updateFromScaler(int zoomedImageLeft, int zoomedImageTop, const QImage& scaledImage)
 {
+    // The scaler keeps its tiles in a cache: work on our own copy if we need
+    // to modify the pixels
+    QImage image = scaledImage;
     if (d->mApplyDisplayTransform) {
-        d->updateDisplayTransform(image.format());
-        if (d->mDisplayTransform) {
-            quint8 *bytes = const_cast<quint8*>(image.bits());
-            cmsDoTransform(d->mDisplayTransform, bytes, bytes, image.width() * image.height());
+        cmsHTRANSFORM transform = d->displayTransform(image.format());
+        if (transform) {
+            applyDisplayTransform(transform, &image);
         }
     }
 
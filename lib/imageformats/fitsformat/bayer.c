@@ -2431,6 +2431,59 @@ dc1394error_t dc1394_bayer_AHD_uint16(const uint16_t *bayer, uint16_t *dst, int
     return DC1394_SUCCESS;
 }
 
+/* Bilinear de-mosaicing of a single row, with planar output.
+   above and below are the rows around row. The caller mirrors them at the
+   top and bottom borders, so that rows can be processed in any order, in
+   place or from several threads. Columns are mirrored here. y is the index
+   of the row in the image, it tells which colors the row contains. */
+#define BAYER_BILINEAR_PLANAR_ROW(name, type)                                                           \
+    dc1394error_t name(const type *above, const type *row, const type *below, type *r, type *g,         \
+                       type *b, uint32_t width, uint32_t y, dc1394color_filter_t tile)                  \
+    {                                                                                                    \
+        int red_row, start_with_green;                                                                   \
+        type *row_color, *other_color;                                                                   \
+        uint32_t x;                                                                                      \
+                                                                                                         \
+        if ((tile > DC1394_COLOR_FILTER_MAX) || (tile < DC1394_COLOR_FILTER_MIN))                        \
+            return DC1394_INVALID_COLOR_FILTER;                                                          \
+        if (width < 2)                                                                                   \
+            return DC1394_FAILURE;                                                                       \
+                                                                                                         \
+        red_row          = tile == DC1394_COLOR_FILTER_RGGB || tile == DC1394_COLOR_FILTER_GRBG;         \
+        start_with_green = tile == DC1394_COLOR_FILTER_GBRG || tile == DC1394_COLOR_FILTER_GRBG;         \
+        if (y & 1)                                                                                       \
+        {                                                                                                \
+            red_row          = !red_row;                                                                 \
+            start_with_green = !start_with_green;                                                        \
+        }                                                                                                \
+        row_color   = red_row ? r : b;                                                                   \
+        other_color = red_row ? b : r;                                                                   \
+                                                                                                         \
+        for (x = 0; x < width; x++)                                                                      \
+        {                                                                                                \
+            const uint32_t left  = x > 0 ? x - 1 : x + 1;                                                \
+            const uint32_t right = x + 1 < width ? x + 1 : x - 1;                                        \
+                                                                                                         \
+            if ((int)(x & 1) != start_with_green)                                                        \
+            {                                                                                            \
+                /* Green sample */                                                                       \
+                g[x]           = row[x];                                                                 \
+                row_color[x]   = (type)((row[left] + row[right] + 1) >> 1);                              \
+                other_color[x] = (type)((above[x] + below[x] + 1) >> 1);                                 \
+            }                                                                                            \
+            else                                                                                         \
+            {                                                                                            \
+                row_color[x]   = row[x];                                                                 \
+                g[x]           = (type)((row[left] + row[right] + above[x] + below[x] + 2) >> 2);        \
+                other_color[x] = (type)((above[left] + above[right] + below[left] + below[right] + 2) >> 2); \
+            }                                                                                            \
+        }                                                                                                \
+        return DC1394_SUCCESS;                                                                           \
+    }
+
+BAYER_BILINEAR_PLANAR_ROW(dc1394_bayer_Bilinear_planar_row, uint8_t)
+BAYER_BILINEAR_PLANAR_ROW(dc1394_bayer_Bilinear_planar_row_uint16, uint16_t)
+
 dc1394error_t dc1394_bayer_decoding_8bit(const uint8_t *bayer, uint8_t *rgb, uint32_t sx, uint32_t sy,
                                          dc1394color_filter_t tile, dc1394bayer_method_t method)
 {
@@ -270,6 +270,21 @@ dc1394error_t dc1394_bayer_decoding_8bit(const uint8_t *bayer, uint8_t *rgb, uin
 dc1394error_t dc1394_bayer_decoding_16bit(const uint16_t *bayer, uint16_t *rgb, uint32_t width, uint32_t height,
                                           dc1394color_filter_t tile, dc1394bayer_method_t method, uint32_t bits);
 
+/**
+ * Perform bilinear de-mosaicing of a single row of an 8-bit image, writing planar R, G and B rows.
+ * above and below are the neighbour rows, mirrored at the image borders. y is the index of the row.
+ */
+dc1394error_t dc1394_bayer_Bilinear_planar_row(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                                               uint8_t *r, uint8_t *g, uint8_t *b, uint32_t width, uint32_t y,
+                                               dc1394color_filter_t tile);
+
+/**
+ * Perform bilinear de-mosaicing of a single row of a 16-bit image, writing planar R, G and B rows.
+ */
+dc1394error_t dc1394_bayer_Bilinear_planar_row_uint16(const uint16_t *above, const uint16_t *row,
+                                                      const uint16_t *below, uint16_t *r, uint16_t *g, uint16_t *b,
+                                                      uint32_t width, uint32_t y, dc1394color_filter_t tile);
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,14 +23,414 @@ Gwenview: an image viewer
 #include "fitsdata.h"
 
 #include <QApplication>
+#include <QCache>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
 #include <QImage>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThreadPool>
+#include <QVector>
+#include <QtConcurrent>
 
+#include <limits>
 #include <math.h>
+#include <string.h>
+
+namespace
+{
+/// FITS files are made of blocks of 2880 bytes, headers of cards of 80 bytes
+const int FITS_BLOCK_SIZE = 2880;
+const int FITS_CARD_SIZE  = 80;
+/// Give up looking for the END card after this many blocks
+const int MAX_HEADER_BLOCKS = 1000;
+
+/// Dynamic property holding the modification time of the file the data of a
+/// device comes from, see FITSData::setModificationTime()
+const char MODIFICATION_TIME_PROPERTY[] = "gwenview_fits_modification_time";
+
+/// Maximum size of the decoded images kept in memory, in KB
+const int IMAGE_CACHE_MAX_COST = 256 * 1024;
+
+/**
+ * Full decoded images, so that the document and its thumbnail do not each
+ * decode the same file
+ */
+struct ImageCache
+{
+    ImageCache()
+    : mCache(IMAGE_CACHE_MAX_COST)
+    {
+    }
+
+    QMutex mMutex;
+    QCache<QByteArray, QImage> mCache;
+};
+
+Q_GLOBAL_STATIC(ImageCache, sImageCache)
+
+/**
+ * Reads the blocks of the primary header, up to the END card. Returns an
+ * empty array if buffer does not contain a complete header.
+ */
+QByteArray readFITSHeader(QIODevice &buffer)
+{
+    QByteArray header;
+
+    if (!buffer.seek(0)) {
+        return header;
+    }
+
+    for (int block = 0; block < MAX_HEADER_BLOCKS; ++block) {
+        QByteArray data = buffer.read(FITS_BLOCK_SIZE);
+
+        if (data.size() != FITS_BLOCK_SIZE) {
+            break;
+        }
+        header.append(data);
+
+        for (int pos = 0; pos < FITS_BLOCK_SIZE; pos += FITS_CARD_SIZE) {
+            if (qstrncmp(data.constData() + pos, "END     ", 8) == 0) {
+                return header;
+            }
+        }
+    }
+    return QByteArray();
+}
+
+/**
+ * Identifies the content of buffer without reading its data: the header, the
+ * size, and the modification time of the file it comes from. Returns an empty
+ * key if this time is unknown, in which case the image is not cached.
+ */
+QByteArray imageCacheKey(QIODevice &buffer, const QByteArray &header)
+{
+    QDateTime modificationTime;
+    QFileDevice *file = qobject_cast<QFileDevice *>(&buffer);
+
+    if (file && !file->fileName().isEmpty()) {
+        modificationTime = QFileInfo(file->fileName()).lastModified();
+    } else {
+        modificationTime = buffer.property(MODIFICATION_TIME_PROPERTY).toDateTime();
+    }
+    if (!modificationTime.isValid()) {
+        return QByteArray();
+    }
+
+    QCryptographicHash hash(QCryptographicHash::Md5);
+
+    hash.addData(header);
+    hash.addData(QByteArray::number(buffer.size()));
+    hash.addData(QByteArray::number(modificationTime.toMSecsSinceEpoch()));
+    return hash.result();
+}
+
+/**
+ * Applies the ClipRect and ScaledSize options to a full image
+ */
+QImage clippedAndScaledImage(const QImage &image, const QRect &clipRect, const QSize &scaledSize)
+{
+    QImage result = image;
+
+    if (clipRect.isValid()) {
+        result = result.copy(clipRect & result.rect());
+    }
+    if (scaledSize.isValid() && !scaledSize.isEmpty() && result.size() != scaledSize) {
+        result = result.scaled(scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    }
+    return result;
+}
+
+/// Below this amount of samples, dispatching work to threads costs more than
+/// it saves
+const qint64 MIN_PARALLEL_SAMPLE_COUNT = 256 * 256;
+
+/// Kernels process this many samples side by side, so that the compiler can
+/// turn the loops into SIMD instructions
+const int KERNEL_LANES = 8;
+
+int parallelChunkCount(qint64 sampleCount, int rowCount)
+{
+    if (sampleCount < MIN_PARALLEL_SAMPLE_COUNT) {
+        return 1;
+    }
+    return qBound(1, QThreadPool::globalInstance()->maxThreadCount(), rowCount);
+}
+
+/**
+ * Statistics of a set of samples. mM2 is the sum of squared differences to
+ * the mean, so that sets can be merged without losing precision.
+ */
+struct ChannelStats
+{
+    double mMin { std::numeric_limits<double>::max() };
+    double mMax { std::numeric_limits<double>::lowest() };
+    double mMean { 0 };
+    double mM2 { 0 };
+    qint64 mCount { 0 };
+
+    void merge(const ChannelStats &other)
+    {
+        if (other.mCount == 0) {
+            return;
+        }
+        const qint64 count = mCount + other.mCount;
+        const double delta = other.mMean - mMean;
+
+        mMin   = qMin(mMin, other.mMin);
+        mMax   = qMax(mMax, other.mMax);
+        mMean += delta * other.mCount / count;
+        mM2   += other.mM2 + delta * delta * mCount * other.mCount / count;
+        mCount = count;
+    }
+};
+
+template <typename T>
+struct StatsChunk
+{
+    const T *mData;
+    qint64 mCount;
+    int mChannel;
+    ChannelStats mStats;
+};
+
+template <typename T>
+void computeChunkStats(StatsChunk<T> &chunk)
+{
+    const T *data      = chunk.mData;
+    const qint64 count = chunk.mCount;
+
+    if (count == 0) {
+        return;
+    }
+
+    // Sums are computed relative to the first sample, which keeps the sum of
+    // squares precise when the mean is large compared to the deviation
+    const double shift = data[0];
+    T minLanes[KERNEL_LANES], maxLanes[KERNEL_LANES];
+    double sumLanes[KERNEL_LANES], sumSqLanes[KERNEL_LANES];
+
+    for (int lane = 0; lane < KERNEL_LANES; ++lane) {
+        minLanes[lane]   = std::numeric_limits<T>::max();
+        maxLanes[lane]   = std::numeric_limits<T>::lowest();
+        sumLanes[lane]   = 0;
+        sumSqLanes[lane] = 0;
+    }
+
+    qint64 i = 0;
+    for (; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+        for (int lane = 0; lane < KERNEL_LANES; ++lane) {
+            const T value      = data[i + lane];
+            const double delta = double(value) - shift;
+
+            minLanes[lane]    = value < minLanes[lane] ? value : minLanes[lane];
+            maxLanes[lane]    = value > maxLanes[lane] ? value : maxLanes[lane];
+            sumLanes[lane]   += delta;
+            sumSqLanes[lane] += delta * delta;
+        }
+    }
+    for (; i < count; ++i) {
+        const T value      = data[i];
+        const double delta = double(value) - shift;
+
+        minLanes[0]    = value < minLanes[0] ? value : minLanes[0];
+        maxLanes[0]    = value > maxLanes[0] ? value : maxLanes[0];
+        sumLanes[0]   += delta;
+        sumSqLanes[0] += delta * delta;
+    }
+
+    T min = minLanes[0], max = maxLanes[0];
+    double sum = 0, sumSq = 0;
+    for (int lane = 0; lane < KERNEL_LANES; ++lane) {
+        min    = qMin(min, minLanes[lane]);
+        max    = qMax(max, maxLanes[lane]);
+        sum   += sumLanes[lane];
+        sumSq += sumSqLanes[lane];
+    }
+
+    chunk.mStats.mMin   = min;
+    chunk.mStats.mMax   = max;
+    chunk.mStats.mMean  = shift + sum / count;
+    chunk.mStats.mM2    = qMax(0., sumSq - sum * sum / count);
+    chunk.mStats.mCount = count;
+}
+
+/**
+ * Linear stretch parameters of a channel: samples are clamped to
+ * [mLow, mHigh], then mapped to sample * mScale + mZero
+ */
+struct StretchParams
+{
+    float mLow;
+    float mHigh;
+    float mScale;
+    float mZero;
+};
+
+template <typename T>
+struct StretchChunk
+{
+    const T *mBuffer;
+    qint64 mPlaneSize;
+    int mWidth;
+    int mTop;
+    int mBottom;
+    int mChannels;
+    StretchParams mParams[3];
+    QImage *mImage;
+};
+
+template <typename T>
+inline float stretchSample(T sample, const StretchParams &params)
+{
+    float value = float(sample);
+
+    value = value < params.mLow ? params.mLow : value;
+    value = value > params.mHigh ? params.mHigh : value;
+    value = value * params.mScale + params.mZero;
+    value = value < 0.f ? 0.f : value;
+    return value > 255.f ? 255.f : value;
+}
+
+template <typename T>
+void stretchRows(StretchChunk<T> &chunk)
+{
+    const int width = chunk.mWidth;
+
+    for (int y = chunk.mTop; y < chunk.mBottom; ++y) {
+        const T *row = chunk.mBuffer + qint64(y) * width;
+
+        if (chunk.mChannels == 1) {
+            const StretchParams params = chunk.mParams[0];
+            uchar *scanLine = chunk.mImage->scanLine(y);
+
+            for (int x = 0; x < width; ++x) {
+                scanLine[x] = uchar(stretchSample(row[x], params));
+            }
+        } else {
+            const T *rRow = row;
+            const T *gRow = row + chunk.mPlaneSize;
+            const T *bRow = row + chunk.mPlaneSize * 2;
+            const StretchParams rParams = chunk.mParams[0];
+            const StretchParams gParams = chunk.mParams[1];
+            const StretchParams bParams = chunk.mParams[2];
+            QRgb *scanLine = reinterpret_cast<QRgb *>(chunk.mImage->scanLine(y));
+
+            for (int x = 0; x < width; ++x) {
+                const uint r = uint(stretchSample(rRow[x], rParams));
+                const uint g = uint(stretchSample(gRow[x], gParams));
+                const uint b = uint(stretchSample(bRow[x], bParams));
+
+                scanLine[x] = 0xff000000 | (r << 16) | (g << 8) | b;
+            }
+        }
+    }
+}
+
+/**
+ * Returns the pattern of the image, given the pattern which starts at
+ * (offsetX, offsetY)
+ */
+dc1394color_filter_t shiftedFilter(dc1394color_filter_t filter, int offsetX, int offsetY)
+{
+    if (offsetX & 1) {
+        switch (filter)
+        {
+        case DC1394_COLOR_FILTER_RGGB:
+            filter = DC1394_COLOR_FILTER_GRBG;
+            break;
+        case DC1394_COLOR_FILTER_GRBG:
+            filter = DC1394_COLOR_FILTER_RGGB;
+            break;
+        case DC1394_COLOR_FILTER_GBRG:
+            filter = DC1394_COLOR_FILTER_BGGR;
+            break;
+        case DC1394_COLOR_FILTER_BGGR:
+            filter = DC1394_COLOR_FILTER_GBRG;
+            break;
+        }
+    }
+    if (offsetY & 1) {
+        switch (filter)
+        {
+        case DC1394_COLOR_FILTER_RGGB:
+            filter = DC1394_COLOR_FILTER_GBRG;
+            break;
+        case DC1394_COLOR_FILTER_GBRG:
+            filter = DC1394_COLOR_FILTER_RGGB;
+            break;
+        case DC1394_COLOR_FILTER_GRBG:
+            filter = DC1394_COLOR_FILTER_BGGR;
+            break;
+        case DC1394_COLOR_FILTER_BGGR:
+            filter = DC1394_COLOR_FILTER_GRBG;
+            break;
+        }
+    }
+    return filter;
+}
+
+inline dc1394error_t bilinearPlanarRow(const uint8_t *above, const uint8_t *row, const uint8_t *below,
+                                       uint8_t **planes, qint64 offset, int width, int y, dc1394color_filter_t filter)
+{
+    return dc1394_bayer_Bilinear_planar_row(above, row, below, planes[0] + offset, planes[1] + offset,
+                                            planes[2] + offset, width, y, filter);
+}
+
+inline dc1394error_t bilinearPlanarRow(const uint16_t *above, const uint16_t *row, const uint16_t *below,
+                                       uint16_t **planes, qint64 offset, int width, int y, dc1394color_filter_t filter)
+{
+    return dc1394_bayer_Bilinear_planar_row_uint16(above, row, below, planes[0] + offset, planes[1] + offset,
+                                                   planes[2] + offset, width, y, filter);
+}
+
+/**
+ * Rows [mTop, mBottom) of an image being debayered in place: the samples are
+ * in mPlanes[2], which receives the blue plane.
+ */
+template <typename T>
+struct DebayerTile
+{
+    T *mPlanes[3];
+    int mWidth;
+    int mTop;
+    int mBottom;
+    dc1394color_filter_t mFilter;
+    /// Copies of the sample rows just above and below the tile
+    QVector<T> mAbove;
+    QVector<T> mBelow;
+};
+
+template <typename T>
+void debayerTile(DebayerTile<T> &tile)
+{
+    const int width = tile.mWidth;
+    T *samples      = tile.mPlanes[2];
+    // Each row is copied before its blue row overwrites it, the previous
+    // copy is the row above the next one
+    QVector<T> previousRow(width);
+    QVector<T> currentRow(width);
+    const T *above = tile.mAbove.constData();
+
+    for (int y = tile.mTop; y < tile.mBottom; ++y) {
+        const qint64 offset = qint64(y) * width;
+        const T *below      = y + 1 < tile.mBottom ? samples + offset + width : tile.mBelow.constData();
+
+        memcpy(currentRow.data(), samples + offset, width * sizeof(T));
+        bilinearPlanarRow(above, currentRow.constData(), below, tile.mPlanes, offset, width, y, tile.mFilter);
+
+        previousRow.swap(currentRow);
+        above = previousRow.constData();
+    }
+}
+} // namespace
 
 FITSData::FITSData()
 {
     mode                  = FITS_NORMAL;
-    debayerParams.method  = DC1394_BAYER_METHOD_NEAREST;
+    debayerParams.method  = DC1394_BAYER_METHOD_BILINEAR;
     debayerParams.filter  = DC1394_COLOR_FILTER_RGGB;
     debayerParams.offsetX = debayerParams.offsetY = 0;
 }
@@ -46,45 +446,41 @@ FITSData::~FITSData()
     }
 }
 
-bool FITSData::loadFITS(QIODevice &buffer)
+bool FITSData::openFITS(QByteArray data)
 {
-    int status = 0, anynull = 0;
+    int status = 0;
     long naxes[3];
     char error_status[512];
-    QString errMessage;
-    qint64 oldPos = buffer.pos();
-    QByteArray imageData;
-    char* imageDataBuf = nullptr;
-    size_t imageDataSize = 0;
-
-    buffer.seek(0);
-    imageData = buffer.readAll();
-    imageDataBuf = imageData.data();
-    imageDataSize = (size_t)imageData.size();
 
     if (fptr) {
         fits_close_file(fptr, &status);
+        fptr = nullptr;
+        status = 0;
     }
 
-    if (fits_open_memfile(&fptr, "", READONLY, reinterpret_cast<void**>(&imageDataBuf), &imageDataSize, 3000, nullptr, &status)) {
+    // Swap rather than assign: sharing the data would make data() detach,
+    // copying the whole file
+    fitsBuffer.swap(data);
+    fitsBufferPtr  = fitsBuffer.data();
+    fitsBufferSize = (size_t)fitsBuffer.size();
+
+    if (fits_open_memfile(&fptr, "", READONLY, &fitsBufferPtr, &fitsBufferSize, 3000, nullptr, &status)) {
         fits_report_error(stderr, status);
         fits_get_errstatus(status, error_status);
-        errMessage = QString("Could not open file %1. Error %2").arg(filename, QString::fromUtf8(error_status));
-        buffer.seek(oldPos);
+        lastError = QString("Could not open file %1. Error %2").arg(filename, QString::fromUtf8(error_status));
+        fptr = nullptr;
         return false;
     }
 
     if (fits_get_img_param(fptr, 3, &(stats.bitpix), &(stats.ndim), naxes, &status)) {
         fits_report_error(stderr, status);
         fits_get_errstatus(status, error_status);
-        errMessage = QString("FITS file open error (fits_get_img_param): %1").arg(QString::fromUtf8(error_status));
-        buffer.seek(oldPos);
+        lastError = QString("FITS file open error (fits_get_img_param): %1").arg(QString::fromUtf8(error_status));
         return false;
     }
 
     if (stats.ndim < 2) {
-        errMessage = "1D FITS images are not supported.";
-        buffer.seek(oldPos);
+        lastError = "1D FITS images are not supported.";
         return false;
     }
 
@@ -125,7 +521,7 @@ bool FITSData::loadFITS(QIODevice &buffer)
         stats.bytesPerPixel = sizeof(double);
         break;
     default:
-        errMessage = QString("Bit depth %1 is not supported.").arg(stats.bitpix);
+        lastError = QString("Bit depth %1 is not supported.").arg(stats.bitpix);
         return false;
         break;
     }
@@ -135,8 +531,7 @@ bool FITSData::loadFITS(QIODevice &buffer)
     }
 
     if (naxes[0] == 0 || naxes[1] == 0) {
-        errMessage = QString("Image has invalid dimensions %1x%2").arg(naxes[0], naxes[1]);
-        buffer.seek(oldPos);
+        lastError = QString("Image has invalid dimensions %1x%2").arg(naxes[0]).arg(naxes[1]);
         return false;
     }
 
@@ -147,221 +542,375 @@ bool FITSData::loadFITS(QIODevice &buffer)
     clearImageBuffers();
 
     channels = naxes[2];
+    return true;
+}
+
+bool FITSData::loadFITS(QIODevice &buffer, const QRect &clipRect, const QSize &scaledSize)
+{
+    qint64 oldPos = buffer.pos();
+
+    buffer.seek(0);
+    if (!openFITS(buffer.readAll())) {
+        buffer.seek(oldPos);
+        return false;
+    }
 
-    imageBuffer = new uint8_t[stats.samples_per_channel * channels * stats.bytesPerPixel];
+    const QRect fullRect(0, 0, stats.width, stats.height);
+
+    regionRect = clipRect.isValid() ? clipRect & fullRect : fullRect;
+    regionStep = 1;
+    if (regionRect.isEmpty()) {
+        lastError = "The clip rectangle is outside of the image.";
+        buffer.seek(oldPos);
+        return false;
+    }
+    if (scaledSize.isValid() && !scaledSize.isEmpty()) {
+        regionStep = qMax(1, qMin(regionRect.width() / scaledSize.width(), regionRect.height() / scaledSize.height()));
+    }
+
+    bool ok;
+    if (regionRect == fullRect && regionStep == 1) {
+        ok = readImage();
+    } else {
+        ok = readImageRegion(regionRect, regionStep);
+    }
+    if (!ok) {
+        buffer.seek(oldPos);
+        return false;
+    }
+
+    // After debayering, so that each color channel gets its own statistics
+    calculateStats();
+    return true;
+}
+
+bool FITSData::readImage()
+{
+    int status = 0, anynull = 0;
+    const bool bayer   = checkDebayer();
+    const bool inPlace = bayer && canDebayerInPlace();
+    uint8_t *samples   = allocateImageBuffer(inPlace);
 
     long nelements = stats.samples_per_channel * channels;
 
-    if (fits_read_img(fptr, data_type, 1, nelements, 0, imageBuffer, &anynull, &status)) {
+    if (fits_read_img(fptr, data_type, 1, nelements, 0, samples, &anynull, &status)) {
         char errmsg[512];
         fits_get_errstatus(status, errmsg);
-        errMessage = QString("Error reading image: %1").arg(errmsg);
+        lastError = QString("Error reading image: %1").arg(errmsg);
         fits_report_error(stderr, status);
-        buffer.seek(oldPos);
         return false;
     }
+    loadedRect = QRect(0, 0, stats.width, stats.height);
 
-    calculateStats();
-
-    if (checkDebayer()) {
-        bayerBuffer = imageBuffer;
-        debayer();
+    if (bayer) {
+        debayerSamples(inPlace);
     }
     return true;
 }
 
-void FITSData::clearImageBuffers()
+bool FITSData::readImageRegion(const QRect &rect, int step)
 {
-    delete[] imageBuffer;
-    imageBuffer = nullptr;
-    bayerBuffer = nullptr;
+    if (channels != 1 || !checkDebayer()) {
+        return readSubset(rect, step, false);
+    }
+
+    if (step >= 2 && rect.width() >= 3 && rect.height() >= 3) {
+        // Cells of 2x2 samples, use an even step so that all cells share
+        // the same pattern
+        switch (data_type)
+        {
+        case TBYTE:
+            return readSuperPixels<uint8_t>(rect, step & ~1);
+
+        case TUSHORT:
+            return readSuperPixels<uint16_t>(rect, step & ~1);
+
+        default:
+            break;
+        }
+    }
+
+    if (step == 1) {
+        // Start on an even sample, so that the pattern offsets of the full
+        // image still apply
+        QRect alignedRect = rect;
+        alignedRect.setLeft(rect.left() & ~1);
+        alignedRect.setTop(rect.top() & ~1);
+
+        return readSubset(alignedRect, 1, true);
+    }
+
+    // Too small to be debayered, keep the raw samples
+    return readSubset(rect, step, false);
 }
 
-void FITSData::calculateStats(bool refresh)
+bool FITSData::readSubset(const QRect &rect, int step, bool bayer)
 {
-    // Calculate min max
-    calculateMinMax(refresh);
+    int status = 0, anynull = 0;
+    long fpixel[3] = { rect.left() + 1, rect.top() + 1, 1 };
+    long lpixel[3] = { rect.right() + 1, rect.bottom() + 1, channels };
+    long inc[3]    = { step, step, 1 };
 
-    // Get standard deviation and mean in one run
-    switch (data_type)
-    {
-    case TBYTE:
-        runningAverageStdDev<uint8_t>();
-        break;
+    clearImageBuffers();
 
-    case TSHORT:
-        runningAverageStdDev<int16_t>();
-        break;
+    stats.width               = (rect.width() - 1) / step + 1;
+    stats.height              = (rect.height() - 1) / step + 1;
+    stats.samples_per_channel = stats.width * stats.height;
 
-    case TUSHORT:
-        runningAverageStdDev<uint16_t>();
-        break;
+    const bool inPlace = bayer && canDebayerInPlace();
+    uint8_t *samples   = allocateImageBuffer(inPlace);
 
-    case TLONG:
-        runningAverageStdDev<int32_t>();
-        break;
+    if (fits_read_subset(fptr, data_type, fpixel, lpixel, inc, nullptr, samples, &anynull, &status)) {
+        char errmsg[512];
+        fits_get_errstatus(status, errmsg);
+        lastError = QString("Error reading image: %1").arg(errmsg);
+        fits_report_error(stderr, status);
+        return false;
+    }
+    loadedRect = rect;
 
-    case TULONG:
-        runningAverageStdDev<uint32_t>();
-        break;
+    if (bayer) {
+        debayerSamples(inPlace);
+    }
+    return true;
+}
 
-    case TFLOAT:
-        runningAverageStdDev<float>();
-        break;
+uint8_t *FITSData::allocateImageBuffer(bool inPlaceDebayer)
+{
+    const size_t planeSize = size_t(stats.samples_per_channel) * stats.bytesPerPixel;
 
-    case TLONGLONG:
-        runningAverageStdDev<int64_t>();
-        break;
+    clearImageBuffers();
 
-    case TDOUBLE:
-        runningAverageStdDev<double>();
-        break;
+    if (inPlaceDebayer) {
+        // Room for the three color planes, the samples go to the last one
+        imageBuffer = new uint8_t[planeSize * 3];
+        bayerBuffer = imageBuffer + planeSize * 2;
+        return bayerBuffer;
+    }
+    imageBuffer = new uint8_t[planeSize * channels];
+    return imageBuffer;
+}
 
+/**
+ * Debayers rect at a reduced resolution: each output pixel is made of the
+ * samples of a single 2x2 cell, and cells are step samples apart. Only two
+ * rows of raw samples are in memory at any time.
+ */
+template <typename T>
+bool FITSData::readSuperPixels(const QRect &rect, int step)
+{
+    int status = 0, anynull = 0;
+
+    // Cells start where the pattern does
+    const int left = rect.left() + ((rect.left() - debayerParams.offsetX) & 1);
+    const int top  = rect.top() + ((rect.top() - debayerParams.offsetY) & 1);
+    const int width  = (rect.right() - 1 - left) / step + 1;
+    const int height = (rect.bottom() - 1 - top) / step + 1;
+    const int spanWidth = (width - 1) * step + 2;
+
+    // Position of the colors in a cell: 0 is top-left, 1 top-right, 2
+    // bottom-left and 3 bottom-right
+    int red, green1, green2, blue;
+    switch (debayerParams.filter)
+    {
+    case DC1394_COLOR_FILTER_RGGB:
+        red = 0, green1 = 1, green2 = 2, blue = 3;
+        break;
+    case DC1394_COLOR_FILTER_BGGR:
+        blue = 0, green1 = 1, green2 = 2, red = 3;
+        break;
+    case DC1394_COLOR_FILTER_GRBG:
+        green1 = 0, red = 1, blue = 2, green2 = 3;
+        break;
+    case DC1394_COLOR_FILTER_GBRG:
+        green1 = 0, blue = 1, red = 2, green2 = 3;
+        break;
     default:
-        return;
+        return readSubset(rect, step, false);
     }
 
-    stats.SNR = stats.mean[0] / stats.stddev[0];
-}
+    clearImageBuffers();
 
-int FITSData::calculateMinMax(bool refresh)
-{
-    int status, nfound = 0;
+    channels                  = 3;
+    stats.width               = width;
+    stats.height              = height;
+    stats.samples_per_channel = width * height;
 
-    status = 0;
+    imageBuffer = new uint8_t[stats.samples_per_channel * channels * sizeof(T)];
 
-    if (fptr && refresh == false) {
-        if (fits_read_key_dbl(fptr, "DATAMIN", &(stats.min[0]), nullptr, &status) == 0) {
-            nfound++;
-        }
+    T *rPlane = reinterpret_cast<T *>(imageBuffer);
+    T *gPlane = rPlane + stats.samples_per_channel;
+    T *bPlane = gPlane + stats.samples_per_channel;
+    QVector<T> rows(spanWidth * 2);
 
-        if (fits_read_key_dbl(fptr, "DATAMAX", &(stats.max[0]), nullptr, &status) == 0) {
-            nfound++;
+    for (int y = 0; y < height; ++y) {
+        const int sourceY = top + y * step;
+        long fpixel[3] = { left + 1, sourceY + 1, 1 };
+        long lpixel[3] = { left + spanWidth, sourceY + 2, 1 };
+        long inc[3]    = { 1, 1, 1 };
+
+        if (fits_read_subset(fptr, data_type, fpixel, lpixel, inc, nullptr, rows.data(), &anynull, &status)) {
+            char errmsg[512];
+            fits_get_errstatus(status, errmsg);
+            lastError = QString("Error reading image: %1").arg(errmsg);
+            fits_report_error(stderr, status);
+            return false;
         }
 
-        // If we found both keywords, no need to calculate them, unless they are both zeros
-        if (nfound == 2 && !(stats.min[0] == 0 && stats.max[0] == 0)) {
-            return 0;
+        const T *row0 = rows.constData();
+        const T *row1 = row0 + spanWidth;
+        const int offset = y * width;
+
+        for (int x = 0; x < width; ++x) {
+            const int sourceX = x * step;
+            const uint cell[4] = { row0[sourceX], row0[sourceX + 1], row1[sourceX], row1[sourceX + 1] };
+
+            rPlane[offset + x] = cell[red];
+            gPlane[offset + x] = (cell[green1] + cell[green2]) / 2;
+            bPlane[offset + x] = cell[blue];
         }
     }
+    loadedRect = QRect(left, top, spanWidth, (height - 1) * step + 2);
+    return true;
+}
 
-    stats.min[0] = 1.0E30;
-    stats.max[0] = -1.0E30;
+bool FITSData::loadFITSHeader(QIODevice &buffer)
+{
+    qint64 oldPos = buffer.pos();
+    QByteArray header = readFITSHeader(buffer);
+    buffer.seek(oldPos);
 
-    stats.min[1] = 1.0E30;
-    stats.max[1] = -1.0E30;
+    if (header.isEmpty()) {
+        lastError = "Could not find the end of the FITS header.";
+        return false;
+    }
+    return openFITS(header);
+}
 
-    stats.min[2] = 1.0E30;
-    stats.max[2] = -1.0E30;
+void FITSData::clearImageBuffers()
+{
+    delete[] imageBuffer;
+    imageBuffer = nullptr;
+    bayerBuffer = nullptr;
+}
 
+void FITSData::calculateStats(bool refresh)
+{
     switch (data_type)
     {
     case TBYTE:
-        calculateMinMax<uint8_t>();
+        calculateChannelStats<uint8_t>();
         break;
 
     case TSHORT:
-        calculateMinMax<int16_t>();
+        calculateChannelStats<int16_t>();
         break;
 
     case TUSHORT:
-        calculateMinMax<uint16_t>();
+        calculateChannelStats<uint16_t>();
         break;
 
     case TLONG:
-        calculateMinMax<int32_t>();
+        calculateChannelStats<int32_t>();
         break;
 
     case TULONG:
-        calculateMinMax<uint32_t>();
+        calculateChannelStats<uint32_t>();
         break;
 
     case TFLOAT:
-        calculateMinMax<float>();
+        calculateChannelStats<float>();
         break;
 
     case TLONGLONG:
-        calculateMinMax<int64_t>();
+        calculateChannelStats<int64_t>();
         break;
 
     case TDOUBLE:
-        calculateMinMax<double>();
+        calculateChannelStats<double>();
         break;
 
     default:
-        break;
+        return;
     }
 
-    //qDebug() << "DATAMIN: " << stats.min << " - DATAMAX: " << stats.max;
-    return 0;
+    // Prefer the range stored in the header, if any
+    calculateMinMax(refresh);
+
+    stats.SNR = stats.mean[0] / stats.stddev[0];
 }
 
-template <typename T>
-void FITSData::calculateMinMax()
+int FITSData::calculateMinMax(bool refresh)
 {
-    T *buffer = reinterpret_cast<T *>(imageBuffer);
+    int status, nfound = 0;
+    double min = 0, max = 0;
 
-    if (channels == 1) {
-        for (unsigned int i = 0; i < stats.samples_per_channel; i++) {
-            if (buffer[i] < stats.min[0]) {
-                stats.min[0] = buffer[i];
-            } else
-            if (buffer[i] > stats.max[0]) {
-                stats.max[0] = buffer[i];
-            }
+    status = 0;
+
+    if (fptr && refresh == false) {
+        if (fits_read_key_dbl(fptr, "DATAMIN", &min, nullptr, &status) == 0) {
+            nfound++;
         }
-    }
-    else
-    {
-        int g_offset = stats.samples_per_channel;
-        int b_offset = stats.samples_per_channel * 2;
-
-        for (unsigned int i = 0; i < stats.samples_per_channel; i++) {
-            if (buffer[i] < stats.min[0]) {
-                stats.min[0] = buffer[i];
-            } else
-            if (buffer[i] > stats.max[0]) {
-                stats.max[0] = buffer[i];
-            }
 
-            if (buffer[i + g_offset] < stats.min[1]) {
-                stats.min[1] = buffer[i + g_offset];
-            } else
-            if (buffer[i + g_offset] > stats.max[1]) {
-                stats.max[1] = buffer[i + g_offset];
-            }
+        if (fits_read_key_dbl(fptr, "DATAMAX", &max, nullptr, &status) == 0) {
+            nfound++;
+        }
 
-            if (buffer[i + b_offset] < stats.min[2]) {
-                stats.min[2] = buffer[i + b_offset];
-            } else
-            if (buffer[i + b_offset] > stats.max[2]) {
-                stats.max[2] = buffer[i + b_offset];
-            }
+        // Only use the keywords if we found both of them, and they are not both zeros
+        if (nfound == 2 && !(min == 0 && max == 0)) {
+            stats.min[0] = min;
+            stats.max[0] = max;
         }
     }
+
+    //qDebug() << "DATAMIN: " << stats.min << " - DATAMAX: " << stats.max;
+    return 0;
 }
 
 template <typename T>
-void FITSData::runningAverageStdDev()
+void FITSData::calculateChannelStats()
 {
-    T *buffer     = reinterpret_cast<T *>(imageBuffer);
-    int m_n       = 2;
-    double m_oldM = 0, m_newM = 0, m_oldS = 0, m_newS = 0;
+    const T *buffer = reinterpret_cast<T *>(imageBuffer);
+    const int channelCount     = qMin(channels, 3);
+    const int chunksPerChannel = parallelChunkCount(stats.samples_per_channel, stats.height);
+
+    // Split each channel plane in chunks of whole rows
+    QVector<StatsChunk<T> > chunks;
+    chunks.reserve(channelCount * chunksPerChannel);
+    for (int channel = 0; channel < channelCount; ++channel) {
+        const T *plane = buffer + qint64(stats.samples_per_channel) * channel;
+
+        for (int idx = 0; idx < chunksPerChannel; ++idx) {
+            const qint64 top    = stats.height * idx / chunksPerChannel;
+            const qint64 bottom = stats.height * (idx + 1) / chunksPerChannel;
+            StatsChunk<T> chunk;
+
+            chunk.mData    = plane + top * stats.width;
+            chunk.mCount   = (bottom - top) * stats.width;
+            chunk.mChannel = channel;
+            chunks << chunk;
+        }
+    }
 
-    m_oldM = m_newM = buffer[0];
-    for (unsigned int i = 1; i < stats.samples_per_channel; i++) {
-        m_newM = m_oldM + (buffer[i] - m_oldM) / m_n;
-        m_newS = m_oldS + (buffer[i] - m_oldM) * (buffer[i] - m_newM);
+    if (chunks.size() == 1) {
+        computeChunkStats(chunks.first());
+    } else {
+        QtConcurrent::blockingMap(chunks, computeChunkStats<T>);
+    }
 
-        m_oldM = m_newM;
-        m_oldS = m_newS;
-        m_n++;
+    ChannelStats channelStats[3];
+    Q_FOREACH(const StatsChunk<T> &chunk, chunks) {
+        channelStats[chunk.mChannel].merge(chunk.mStats);
     }
 
-    double variance = (m_n == 2 ? 0 : m_newS / (m_n - 2));
+    for (int channel = 0; channel < channelCount; ++channel) {
+        const ChannelStats &result = channelStats[channel];
 
-    stats.mean[0]   = m_newM;
-    stats.stddev[0] = sqrt(variance);
+        stats.min[channel]    = result.mMin;
+        stats.max[channel]    = result.mMax;
+        stats.mean[channel]   = result.mMean;
+        stats.stddev[channel] = sqrt(result.mCount > 1 ? result.mM2 / (result.mCount - 1) : 0.);
+    }
 }
 
 int FITSData::getFITSRecord(QString &recordList, int &nkeys)
@@ -454,6 +1003,84 @@ bool FITSData::debayer()
     return false;
 }
 
+bool FITSData::canDebayerInPlace() const
+{
+    return debayerParams.method == DC1394_BAYER_METHOD_BILINEAR
+           && channels == 1
+           && stats.width >= 2 && stats.height >= 2
+           && (data_type == TBYTE || data_type == TUSHORT);
+}
+
+void FITSData::debayerSamples(bool inPlace)
+{
+    if (!inPlace) {
+        bayerBuffer = imageBuffer;
+        debayer();
+        return;
+    }
+
+    switch (data_type)
+    {
+    case TBYTE:
+        debayerInPlace<uint8_t>();
+        break;
+
+    case TUSHORT:
+        debayerInPlace<uint16_t>();
+        break;
+
+    default:
+        break;
+    }
+}
+
+template <typename T>
+bool FITSData::debayerInPlace()
+{
+    const int width        = stats.width;
+    const int height       = stats.height;
+    const qint64 planeSize = stats.samples_per_channel;
+    T *rPlane              = reinterpret_cast<T *>(imageBuffer);
+    T *bPlane              = rPlane + planeSize * 2;
+
+    Q_ASSERT(bayerBuffer == reinterpret_cast<uint8_t *>(bPlane));
+
+    DebayerTile<T> tile;
+    tile.mPlanes[0] = rPlane;
+    tile.mPlanes[1] = rPlane + planeSize;
+    tile.mPlanes[2] = bPlane;
+    tile.mWidth     = width;
+    tile.mFilter    = shiftedFilter(debayerParams.filter, debayerParams.offsetX, debayerParams.offsetY);
+
+    // The blue plane is written over the samples: save the rows around each
+    // tile before any tile overwrites them. Rows are mirrored at the borders.
+    const int tileCount = parallelChunkCount(planeSize, height);
+    QVector<DebayerTile<T> > tiles;
+    tiles.reserve(tileCount);
+    for (int idx = 0; idx < tileCount; ++idx) {
+        tile.mTop    = height * idx / tileCount;
+        tile.mBottom = height * (idx + 1) / tileCount;
+
+        const T *above = bPlane + qint64(tile.mTop > 0 ? tile.mTop - 1 : 1) * width;
+        const T *below = bPlane + qint64(tile.mBottom < height ? tile.mBottom : height - 2) * width;
+        tile.mAbove = QVector<T>(width);
+        tile.mBelow = QVector<T>(width);
+        memcpy(tile.mAbove.data(), above, width * sizeof(T));
+        memcpy(tile.mBelow.data(), below, width * sizeof(T));
+        tiles << tile;
+    }
+
+    if (tiles.size() == 1) {
+        debayerTile(tiles.first());
+    } else {
+        QtConcurrent::blockingMap(tiles, debayerTile<T>);
+    }
+
+    channels    = 3;
+    bayerBuffer = nullptr;
+    return true;
+}
+
 bool FITSData::debayer_8bit()
 {
     dc1394error_t error_code;
@@ -574,119 +1201,111 @@ QString FITSData::getLastError() const
 }
 
 template <typename T>
-void FITSData::convertToQImage(double dataMin, double dataMax, double scale, double zero, QImage &image)
+void FITSData::convertToQImage(QImage &image)
 {
-    T *buffer = (T*)getImageBuffer();
-    const T limit   = std::numeric_limits<T>::max();
-    T bMin    = dataMin < 0 ? 0 : dataMin;
-    T bMax    = dataMax > limit ? limit : dataMax;
-    uint16_t w    = getWidth();
-    uint16_t h    = getHeight();
-    uint32_t size = getSize();
-    double val;
-
-    if (getNumOfChannels() == 1) {
-        /* Fill in pixel values using indexed map, linear scale */
-        for (int j = 0; j < h; j++) {
-            unsigned char *scanLine = image.scanLine(j);
-
-            for (int i = 0; i < w; i++) {
-                val         = qBound(bMin, buffer[j * w + i], bMax);
-                val         = val * scale + zero;
-                scanLine[i] = qBound<unsigned char>(0, (unsigned char)val, 255);
-            }
+    StretchChunk<T> rows;
+
+    rows.mBuffer    = reinterpret_cast<T *>(getImageBuffer());
+    rows.mPlaneSize = getSize();
+    rows.mWidth     = getWidth();
+    rows.mChannels  = getNumOfChannels() == 1 ? 1 : 3;
+    rows.mImage     = &image;
+
+    // Stretch each channel from mean - stddev to mean + 3 * stddev
+    for (int channel = 0; channel < rows.mChannels; ++channel) {
+        const double dataMin = stats.mean[channel] - stats.stddev[channel];
+        const double dataMax = stats.mean[channel] + stats.stddev[channel] * 3;
+        const double limit   = std::numeric_limits<T>::max();
+        StretchParams &params = rows.mParams[channel];
+
+        params.mLow  = dataMin < 0 ? 0 : dataMin;
+        params.mHigh = dataMax > limit ? limit : dataMax;
+        if (dataMax > dataMin) {
+            params.mScale = 255. / (dataMax - dataMin);
+            params.mZero  = (-dataMin) * (255. / (dataMax - dataMin));
+        } else {
+            // Flat channel
+            params.mScale = 0;
+            params.mZero  = 255;
         }
     }
-    else
-    {
-        double rval = 0, gval = 0, bval = 0;
-        QRgb value;
-        /* Fill in pixel values using indexed map, linear scale */
-        for (int j = 0; j < h; j++) {
-            QRgb *scanLine = reinterpret_cast<QRgb *>((image.scanLine(j)));
 
-            for (int i = 0; i < w; i++) {
-                rval = qBound(bMin, buffer[j * w + i], bMax);
-                gval = qBound(bMin, buffer[j * w + i + size], bMax);
-                bval = qBound(bMin, buffer[j * w + i + size * 2], bMax);
+    const int height     = getHeight();
+    const int chunkCount = parallelChunkCount(getSize(), height);
 
-                value = qRgb(rval * scale + zero, gval * scale + zero, bval * scale + zero);
+    if (chunkCount == 1) {
+        rows.mTop    = 0;
+        rows.mBottom = height;
+        stretchRows(rows);
+        return;
+    }
 
-                scanLine[i] = value;
-            }
-        }
+    QVector<StretchChunk<T> > chunks;
+    chunks.reserve(chunkCount);
+    for (int idx = 0; idx < chunkCount; ++idx) {
+        rows.mTop    = height * idx / chunkCount;
+        rows.mBottom = height * (idx + 1) / chunkCount;
+        chunks << rows;
     }
+    QtConcurrent::blockingMap(chunks, stretchRows<T>);
 }
 
-QImage FITSData::FITSToImage(QIODevice &buffer)
+QImage FITSData::toImage()
 {
     QImage fitsImage;
     double min, max;
-    FITSData data;
 
-    bool rc = data.loadFITS(buffer);
-
-    if (rc == false) {
-        return fitsImage;
-    }
-
-    data.getMinMax(&min, &max);
+    getMinMax(&min, &max);
 
     if (min == max) {
         fitsImage.fill(Qt::white);
         return fitsImage;
     }
 
-    if (data.getNumOfChannels() == 1) {
-        fitsImage = QImage(data.getWidth(), data.getHeight(), QImage::Format_Indexed8);
+    if (getNumOfChannels() == 1) {
+        fitsImage = QImage(getWidth(), getHeight(), QImage::Format_Indexed8);
 
         fitsImage.setColorCount(256);
         for (int i = 0; i < 256; i++) {
             fitsImage.setColor(i, qRgb(i, i, i));
         }
     } else {
-        fitsImage = QImage(data.getWidth(), data.getHeight(), QImage::Format_RGB32);
+        fitsImage = QImage(getWidth(), getHeight(), QImage::Format_RGB32);
     }
 
-    double dataMin = data.stats.mean[0] - data.stats.stddev[0];
-    double dataMax = data.stats.mean[0] + data.stats.stddev[0] * 3;
-
-    double bscale = 255. / (dataMax - dataMin);
-    double bzero  = (-dataMin) * (255. / (dataMax - dataMin));
-
     // Long way to do this since we do not want to use templated functions here
-    switch (data.getDataType())
+    switch (getDataType())
     {
     case TBYTE:
-        data.convertToQImage<uint8_t>(dataMin, dataMax, bscale, bzero, fitsImage);
+        convertToQImage<uint8_t>(fitsImage);
         break;
 
     case TSHORT:
-        data.convertToQImage<int16_t>(dataMin, dataMax, bscale, bzero, fitsImage);
+        convertToQImage<int16_t>(fitsImage);
         break;
 
     case TUSHORT:
-        data.convertToQImage<uint16_t>(dataMin, dataMax, bscale, bzero, fitsImage);
+        convertToQImage<uint16_t>(fitsImage);
         break;
 
     case TLONG:
-        data.convertToQImage<int32_t>(dataMin, dataMax, bscale, bzero, fitsImage);
+        convertToQImage<int32_t>(fitsImage);
         break;
 
     case TULONG:
-        data.convertToQImage<uint32_t>(dataMin, dataMax, bscale, bzero, fitsImage);
+        convertToQImage<uint32_t>(fitsImage);
         break;
 
     case TFLOAT:
-        data.convertToQImage<float>(dataMin, dataMax, bscale, bzero, fitsImage);
+        convertToQImage<float>(fitsImage);
         break;
 
     case TLONGLONG:
-        data.convertToQImage<int64_t>(dataMin, dataMax, bscale, bzero, fitsImage);
+        convertToQImage<int64_t>(fitsImage);
         break;
 
     case TDOUBLE:
-        data.convertToQImage<double>(dataMin, dataMax, bscale, bzero, fitsImage);
+        convertToQImage<double>(fitsImage);
         break;
 
     default:
@@ -695,3 +1314,62 @@ QImage FITSData::FITSToImage(QIODevice &buffer)
 
     return fitsImage;
 }
+
+QImage FITSData::FITSToImage(QIODevice &buffer, const QRect &clipRect, const QSize &scaledSize)
+{
+    QImage fitsImage;
+    FITSData data;
+    qint64 oldPos = buffer.pos();
+    QByteArray key;
+
+    if (!buffer.isSequential()) {
+        QByteArray header = readFITSHeader(buffer);
+
+        if (!header.isEmpty()) {
+            key = imageCacheKey(buffer, header);
+        }
+        buffer.seek(oldPos);
+    }
+
+    if (!key.isEmpty()) {
+        QMutexLocker locker(&sImageCache->mMutex);
+        QImage *cachedImage = sImageCache->mCache.object(key);
+
+        if (cachedImage) {
+            return clippedAndScaledImage(*cachedImage, clipRect, scaledSize);
+        }
+    }
+
+    bool rc = data.loadFITS(buffer, clipRect, scaledSize);
+
+    if (rc == false) {
+        return fitsImage;
+    }
+
+    fitsImage = data.toImage();
+
+    // Bayer images may have been read from a larger rectangle
+    if (data.regionStep == 1 && data.loadedRect != data.regionRect && !fitsImage.isNull()) {
+        fitsImage = fitsImage.copy(data.regionRect.translated(-data.loadedRect.topLeft()));
+    }
+
+    // Reading one sample out of N gets close to scaledSize, finish the job
+    if (scaledSize.isValid() && !scaledSize.isEmpty() && !fitsImage.isNull() && fitsImage.size() != scaledSize) {
+        fitsImage = fitsImage.scaled(scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    }
+
+    // Only full images are cached: they can serve any other request
+    const bool isFullImage = !clipRect.isValid() && (!scaledSize.isValid() || scaledSize.isEmpty());
+
+    if (!key.isEmpty() && isFullImage && !fitsImage.isNull()) {
+        QMutexLocker locker(&sImageCache->mMutex);
+        sImageCache->mCache.insert(key, new QImage(fitsImage), qMax(1, fitsImage.byteCount() / 1024));
+    }
+
+    return fitsImage;
+}
+
+void FITSData::setModificationTime(QIODevice &buffer, const QDateTime &time)
+{
+    buffer.setProperty(MODIFICATION_TIME_PROPERTY, time);
+}
@@ -33,10 +33,13 @@ typedef enum { FITS_NORMAL, FITS_FOCUS, FITS_GUIDE, FITS_CALIBRATE, FITS_ALIGN }
 
 #include <fitsio.h>
 
+#include <QByteArray>
+#include <QDateTime>
 #include <QIODevice>
 #include <QObject>
 #include <QRect>
 #include <QRectF>
+#include <QSize>
 
 
 class FITSData
@@ -45,8 +48,15 @@ class FITSData
     FITSData();
     ~FITSData();
 
-    /* Loads FITS image, scales it, and displays it in the GUI */
-    bool loadFITS(QIODevice &buffer);
+    /* Loads FITS image, scales it, and displays it in the GUI. If clipRect is
+       valid, only this part of the image is read. If scaledSize is valid, one
+       sample out of N is read in each direction, N being chosen so that the
+       image is not smaller than scaledSize. Bayer images are then debayered
+       at the reduced resolution. */
+    bool loadFITS(QIODevice &buffer, const QRect &clipRect = QRect(), const QSize &scaledSize = QSize());
+    /* Only reads the FITS header: dimensions, data type and records are
+       available afterwards, but no image data */
+    bool loadFITSHeader(QIODevice &buffer);
     /* Calculate stats */
     void calculateStats(bool refresh = false);
 
@@ -69,7 +79,9 @@ class FITSData
         *max = stats.max[channel];
     }
 
-    // Debayer
+    // Debayer. The default method is bilinear, which is done in place with
+    // planar output; other methods go through an interleaved RGB buffer
+    void setDebayerMethod(dc1394bayer_method_t method) { debayerParams.method = method; }
     bool debayer();
     bool debayer_8bit();
     bool debayer_16bit();
@@ -77,30 +89,55 @@ class FITSData
     // FITS Record
     int getFITSRecord(QString &recordList, int &nkeys);
 
-    // Create autostretch image from FITS File
-    static QImage FITSToImage(QIODevice &buffer);
+    // Create autostretch image from the loaded data
+    QImage toImage();
+
+    // Create autostretch image from FITS File, with the semantic of the
+    // ClipRect and ScaledSize options of QImageIOHandler. Full images of
+    // files are cached, so that the same file is only decoded once; other
+    // requests are served from this cache when possible.
+    static QImage FITSToImage(QIODevice &buffer, const QRect &clipRect = QRect(), const QSize &scaledSize = QSize());
+
+    // Tells FITSToImage() the modification time of the file the data of
+    // buffer comes from, when buffer is not the file itself. Without it, the
+    // image decoded from buffer cannot be cached.
+    static void setModificationTime(QIODevice &buffer, const QDateTime &time);
 
     QString getLastError() const;
 
   private:
+    bool openFITS(QByteArray data);
+    bool readImage();
+    bool readImageRegion(const QRect &rect, int step);
+    bool readSubset(const QRect &rect, int step, bool bayer);
+    uint8_t *allocateImageBuffer(bool inPlaceDebayer);
+    template <typename T>
+    bool readSuperPixels(const QRect &rect, int step);
     int calculateMinMax(bool refresh = false);
     bool checkDebayer();
+    bool canDebayerInPlace() const;
+    void debayerSamples(bool inPlace);
 
     // Templated functions
     template <typename T>
     bool debayer();
-
     template <typename T>
-    void calculateMinMax();
-    /* Calculate running average & standard deviation using Welford’s method for computing variance */
+    bool debayerInPlace();
+
+    /* Calculate min, max, mean & standard deviation of each channel, in parallel */
     template <typename T>
-    void runningAverageStdDev();
+    void calculateChannelStats();
 
     template <typename T>
-    void convertToQImage(double dataMin, double dataMax, double scale, double zero, QImage &image);
+    void convertToQImage(QImage &image);
 
     /// Pointer to CFITSIO FITS file struct
     fitsfile *fptr { nullptr };
+    /// Memory fptr reads from, must outlive it
+    QByteArray fitsBuffer;
+    /// CFITSIO keeps pointers to these, they must outlive fptr too
+    void *fitsBufferPtr { nullptr };
+    size_t fitsBufferSize { 0 };
 
     /// FITS image data type (TBYTE, TUSHORT, TINT, TFLOAT, TLONG, TDOUBLE)
     int data_type { 0 };
@@ -109,6 +146,13 @@ class FITSData
     /// Generic data image buffer
     uint8_t *imageBuffer { nullptr };
 
+    /// Part of the image to read and the distance between read samples
+    QRect regionRect;
+    int regionStep { 1 };
+    /// Part of the image actually read, can be larger than regionRect to
+    /// start on a Bayer cell
+    QRect loadedRect;
+
     /// Our very own file name
     QString filename;
     /// FITS Mode (Normal, WCS, Guide, Focus..etc)
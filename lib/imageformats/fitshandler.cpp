@@ -25,12 +25,29 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 
 #include <QDebug>
 #include <QImage>
+#include <QRect>
 #include <QSize>
 #include <QVariant>
 
 namespace Gwenview
 {
 
+struct FitsHandlerPrivate
+{
+    QSize mScaledSize;
+    QRect mClipRect;
+};
+
+FitsHandler::FitsHandler()
+: d(new FitsHandlerPrivate)
+{
+}
+
+FitsHandler::~FitsHandler()
+{
+    delete d;
+}
+
 bool FitsHandler::canRead() const
 {
     if (!device()) {
@@ -42,9 +59,10 @@ bool FitsHandler::canRead() const
         return false;
     }
 
+    // Only the header is needed to know whether the image can be decoded
     FITSData fitsLoader;
 
-    if (fitsLoader.loadFITS(*device())) {
+    if (fitsLoader.loadFITSHeader(*device())) {
         setFormat("fits");
         return true;
     }
@@ -57,13 +75,13 @@ bool FitsHandler::read(QImage *image)
           return false;
     }
 
-    *image = FITSData::FITSToImage(*device());
-    return true;
+    *image = FITSData::FITSToImage(*device(), d->mClipRect, d->mScaledSize);
+    return !image->isNull();
 }
 
 bool FitsHandler::supportsOption(ImageOption option) const
 {
-    return option == Size;
+    return option == Size || option == ScaledSize || option == ClipRect;
 }
 
 QVariant FitsHandler::option(ImageOption option) const
@@ -71,12 +89,25 @@ QVariant FitsHandler::option(ImageOption option) const
     if (option == Size && device()) {
         FITSData fitsLoader;
 
-        if (fitsLoader.loadFITS(*device())) {
+        if (fitsLoader.loadFITSHeader(*device())) {
             return QSize((int)fitsLoader.getWidth(), (int)fitsLoader.getHeight());
         }
+    } else if (option == ScaledSize) {
+        return d->mScaledSize;
+    } else if (option == ClipRect) {
+        return d->mClipRect;
     }
     return QVariant();
 }
 
+void FitsHandler::setOption(ImageOption option, const QVariant &value)
+{
+    if (option == ScaledSize) {
+        d->mScaledSize = value.toSize();
+    } else if (option == ClipRect) {
+        d->mClipRect = value.toRect();
+    }
+}
+
 } // namespace
 
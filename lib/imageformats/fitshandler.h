@@ -25,17 +25,26 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 
 namespace Gwenview
 {
+struct FitsHandlerPrivate;
 /**
- * A FITS handler.
+ * A FITS handler. Supports reading a part of the image and reading it at a
+ * lower resolution, without decoding the full image.
  */
 class FitsHandler : public QImageIOHandler
 {
 public:
+    FitsHandler();
+    ~FitsHandler();
+
     bool canRead() const Q_DECL_OVERRIDE;
     bool read(QImage *image) Q_DECL_OVERRIDE;
 
     bool supportsOption(ImageOption option) const Q_DECL_OVERRIDE;
     QVariant option(ImageOption option) const Q_DECL_OVERRIDE;
+    void setOption(ImageOption option, const QVariant &value) Q_DECL_OVERRIDE;
+
+private:
+    FitsHandlerPrivate* const d;
 };
 
 } // namespace
@@ -28,6 +28,7 @@ Copyright (C) 1992-2008 Trolltech ASA. All rights reserved.
 
 // Qt
 #include <QImage>
+#include <QRect>
 #include <QSize>
 #include <QVariant>
 
@@ -41,6 +42,11 @@ extern "C" {
 #include <jpeglib.h>
 }
 
+// jpeg_crop_scanline() and jpeg_skip_scanlines() are libjpeg-turbo extensions
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+#define GV_JPEG_HAS_CROP
+#endif
+
 // Local
 #include "../iodevicejpegsourcemanager.h"
 
@@ -118,7 +124,48 @@ static QSize getJpegSize(QIODevice* ioDevice)
     return size;
 }
 
-static bool loadJpeg(QImage* image, QIODevice* ioDevice, QSize scaledSize)
+/**
+ * Progressive JPEGs store the DC coefficients of all blocks in their first
+ * scans. When decoding at 1/8 scale, libjpeg only uses the DC coefficient of
+ * each block, so we can stop reading as soon as all DC coefficients are fully
+ * known, skipping the AC scans which make up most of the file.
+ */
+static bool dcCoefficientsAreComplete(j_decompress_ptr cinfo)
+{
+    for (int ci = 0; ci < cinfo->num_components; ++ci) {
+        if (cinfo->coef_bits[ci][0] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void consumeDcScans(j_decompress_ptr cinfo)
+{
+    while (true) {
+        int ret = jpeg_consume_input(cinfo);
+        if (ret == JPEG_SUSPENDED || ret == JPEG_REACHED_EOI) {
+            return;
+        }
+        if (ret == JPEG_SCAN_COMPLETED && dcCoefficientsAreComplete(cinfo)) {
+            LOG("DC coefficients complete after scan" << cinfo->input_scan_number);
+            return;
+        }
+    }
+}
+
+/**
+ * Decodes the JPEG available from @p ioDevice.
+ *
+ * @p clipRect, @p scaledSize and @p scaledClipRect follow QImageIOHandler
+ * semantics: the image is clipped to @p clipRect, then scaled to
+ * @p scaledSize, then clipped to @p scaledClipRect. Any of them can be
+ * invalid.
+ *
+ * When libjpeg-turbo is available, columns and lines outside of the clip rect
+ * are not decoded at all.
+ */
+static bool loadJpeg(QImage* image, QIODevice* ioDevice, QSize scaledSize, QRect clipRect, QRect scaledClipRect)
 {
     struct jpeg_decompress_struct cinfo;
 
@@ -136,14 +183,25 @@ static bool loadJpeg(QImage* image, QIODevice* ioDevice, QSize scaledSize)
     Gwenview::IODeviceJpegSourceManager::setup(&cinfo, ioDevice);
     jpeg_read_header(&cinfo, true);
 
+    const QRect fullRect(0, 0, cinfo.image_width, cinfo.image_height);
+    if (clipRect.isValid()) {
+        clipRect &= fullRect;
+        if (clipRect.isEmpty()) {
+            jpeg_destroy_decompress(&cinfo);
+            return false;
+        }
+    } else {
+        clipRect = fullRect;
+    }
+
     // Compute scale value
     cinfo.scale_num = 1;
     if (!scaledSize.isEmpty()) {
         // Use !scaledSize.isEmpty(), not scaledSize.isValid() because
         // isValid() returns true if both the width and height is equal to or
         // greater than 0, so it is possible to get a division by 0.
-        cinfo.scale_denom = qMin(cinfo.image_width / scaledSize.width(),
-                                 cinfo.image_height / scaledSize.height());
+        cinfo.scale_denom = qMin(clipRect.width() / scaledSize.width(),
+                                 clipRect.height() / scaledSize.height());
         if (cinfo.scale_denom < 2) {
             cinfo.scale_denom = 1;
         } else if (cinfo.scale_denom < 4) {
@@ -158,16 +216,46 @@ static bool loadJpeg(QImage* image, QIODevice* ioDevice, QSize scaledSize)
     }
     LOG("cinfo.scale_denom=" << cinfo.scale_denom);
 
+    const bool dcOnly = cinfo.progressive_mode && cinfo.scale_denom == 8;
+    cinfo.buffered_image = dcOnly;
+
     // Init image
     jpeg_start_decompress(&cinfo);
+    if (dcOnly) {
+        consumeDcScans(&cinfo);
+        jpeg_start_output(&cinfo, cinfo.input_scan_number);
+    }
+
+    // Map the clip rect to the output, rounding outwards
+    const qint64 outputWidth = cinfo.output_width;
+    const qint64 outputHeight = cinfo.output_height;
+    const int outputLeft = clipRect.left() * outputWidth / cinfo.image_width;
+    const int outputTop = clipRect.top() * outputHeight / cinfo.image_height;
+    const int outputRight = qMin(outputWidth, ((clipRect.left() + clipRect.width()) * outputWidth + cinfo.image_width - 1) / cinfo.image_width);
+    const int outputBottom = qMin(outputHeight, ((clipRect.top() + clipRect.height()) * outputHeight + cinfo.image_height - 1) / cinfo.image_height);
+    const QRect outputClipRect = QRect(QPoint(outputLeft, outputTop), QPoint(outputRight - 1, outputBottom - 1));
+
+    JDIMENSION xOffset = 0;
+    JDIMENSION decodedWidth = cinfo.output_width;
+#ifdef GV_JPEG_HAS_CROP
+    const bool useCrop = !dcOnly && outputClipRect != QRect(0, 0, outputWidth, outputHeight);
+    if (useCrop) {
+        // libjpeg aligns the crop on iMCU boundaries, so it may decode a bit
+        // more than requested
+        xOffset = outputClipRect.left();
+        decodedWidth = outputClipRect.width();
+        jpeg_crop_scanline(&cinfo, &xOffset, &decodedWidth);
+    }
+#endif
+
     switch (cinfo.output_components) {
     case 3:
     case 4:
-        *image = QImage(cinfo.output_width, cinfo.output_height, QImage::Format_RGB32);
+        *image = QImage(decodedWidth, outputClipRect.height(), QImage::Format_RGB32);
         break;
     case 1: // B&W image
-        *image = QImage(cinfo.output_width, cinfo.output_height, QImage::Format_Indexed8);
-        image->setNumColors(256);
+        *image = QImage(decodedWidth, outputClipRect.height(), QImage::Format_Indexed8);
+        image->setColorCount(256);
         for (int i = 0; i < 256; ++i) {
             image->setColor(i, qRgba(i, i, i, 255));
         }
@@ -177,8 +265,19 @@ static bool loadJpeg(QImage* image, QIODevice* ioDevice, QSize scaledSize)
         return false;
     }
 
-    while (cinfo.output_scanline < cinfo.output_height) {
-        uchar *line = image->scanLine(cinfo.output_scanline);
+#ifdef GV_JPEG_HAS_CROP
+    if (useCrop) {
+        jpeg_skip_scanlines(&cinfo, outputClipRect.top());
+    }
+#endif
+    while (cinfo.output_scanline < JDIMENSION(outputClipRect.top())) {
+        // No way to skip lines: decode them in the first line of the image,
+        // which gets overwritten below
+        uchar *line = image->scanLine(0);
+        jpeg_read_scanlines(&cinfo, &line, 1);
+    }
+    while (cinfo.output_scanline <= JDIMENSION(outputClipRect.bottom())) {
+        uchar *line = image->scanLine(cinfo.output_scanline - outputClipRect.top());
         jpeg_read_scanlines(&cinfo, &line, 1);
     }
 
@@ -198,13 +297,25 @@ static bool loadJpeg(QImage* image, QIODevice* ioDevice, QSize scaledSize)
         expand24to32bpp(image);
     }
 
-    const QSize actualSize(cinfo.output_width, cinfo.output_height);
+    if (dcOnly) {
+        jpeg_finish_output(&cinfo);
+    }
+    // Do not call jpeg_finish_decompress(): we may not have read all the
+    // scans or all the lines
+    jpeg_destroy_decompress(&cinfo);
+
+    if (image->width() != outputClipRect.width() || xOffset != JDIMENSION(outputClipRect.left())) {
+        *image = image->copy(outputClipRect.left() - xOffset, 0, outputClipRect.width(), outputClipRect.height());
+    }
+
+    const QSize actualSize = image->size();
     if (scaledSize.isValid() && actualSize != scaledSize) {
         *image = image->scaled(scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
     }
 
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
+    if (scaledClipRect.isValid()) {
+        *image = image->copy(scaledClipRect);
+    }
 
     return true;
 }
@@ -331,7 +442,7 @@ static bool write_jpeg_image(const QImage &sourceImage, QIODevice *device, int s
         case 1:
         case 8:
             gray = true;
-            for (int i = image.numColors(); gray && i--;) {
+            for (int i = image.colorCount(); gray && i--;) {
                 gray = gray & (qRed(cmap[i]) == qGreen(cmap[i]) &&
                                qRed(cmap[i]) == qBlue(cmap[i]));
             }
@@ -455,6 +566,8 @@ END_COPY
 struct JpegHandlerPrivate
 {
     QSize mScaledSize;
+    QRect mClipRect;
+    QRect mScaledClipRect;
     int mQuality;
 };
 
@@ -494,7 +607,7 @@ bool JpegHandler::read(QImage* image)
     if (!canRead()) {
         return false;
     }
-    return loadJpeg(image, device(), d->mScaledSize);
+    return loadJpeg(image, device(), d->mScaledSize, d->mClipRect, d->mScaledClipRect);
 }
 
 bool JpegHandler::write(const QImage& image)
@@ -505,13 +618,18 @@ bool JpegHandler::write(const QImage& image)
 
 bool JpegHandler::supportsOption(ImageOption option) const
 {
-    return option == ScaledSize || option == Size || option == Quality;
+    return option == ScaledSize || option == Size || option == Quality
+        || option == ClipRect || option == ScaledClipRect;
 }
 
 QVariant JpegHandler::option(ImageOption option) const
 {
     if (option == ScaledSize) {
         return d->mScaledSize;
+    } else if (option == ClipRect) {
+        return d->mClipRect;
+    } else if (option == ScaledClipRect) {
+        return d->mScaledClipRect;
     } else if (option == Size) {
         if (canRead() && !device()->isSequential()) {
             qint64 pos = device()->pos();
@@ -529,6 +647,10 @@ void JpegHandler::setOption(ImageOption option, const QVariant &value)
 {
     if (option == ScaledSize) {
         d->mScaledSize = value.toSize();
+    } else if (option == ClipRect) {
+        d->mClipRect = value.toRect();
+    } else if (option == ScaledClipRect) {
+        d->mScaledClipRect = value.toRect();
     } else if (option == Quality) {
         d->mQuality = value.toInt();
     }
@@ -352,7 +352,7 @@ void ImageMetaInfoModel::setUrl(const QUrl &url)
             return;
         }
 
-        if (fitsLoader.loadFITS(file)) {
+        if (fitsLoader.loadFITSHeader(file)) {
             QString recordList;
             int nkeys = 0;
 
@@ -20,14 +20,22 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "imagescaler.h"
 
 // Qt
+#include <QAtomicInt>
+#include <QCache>
+#include <QFutureWatcher>
+#include <QHash>
 #include <QImage>
 #include <QRegion>
+#include <QSet>
+#include <QSharedPointer>
+#include <QtConcurrentRun>
 #include <QDebug>
 
 // KDE
 
 // Local
 #include <lib/document/document.h>
+#include <lib/memoryutils.h>
 #include <lib/paintutils.h>
 
 #undef ENABLE_LOG
@@ -45,12 +53,319 @@ namespace Gwenview
 // Amount of pixels to keep so that smooth scale is correct
 static const int SMOOTH_MARGIN = 3;
 
+// Size of a tile, in zoomed image coordinates
+static const int TILE_SIZE = 256;
+
+struct TileKey
+{
+    const Document* document;
+    // Identifies the image the tile comes from: its QImage::cacheKey(), or
+    // the frame number for animations
+    qint64 imageKey;
+    qreal zoom;
+    Qt::TransformationMode mode;
+    int x;
+    int y;
+
+    bool operator==(const TileKey& other) const
+    {
+        return document == other.document
+            && imageKey == other.imageKey
+            && zoom == other.zoom
+            && mode == other.mode
+            && x == other.x
+            && y == other.y;
+    }
+};
+
+inline uint qHash(const TileKey& key)
+{
+    return ::qHash(quintptr(key.document))
+        ^ ::qHash(key.imageKey)
+        ^ ::qHash(key.zoom)
+        ^ ::qHash(key.x)
+        ^ (::qHash(key.y) << 16)
+        ^ uint(key.mode);
+}
+
+struct ScaledTile
+{
+    TileKey key;
+    int generation;
+    QPoint pos;
+    QImage image;
+};
+
+/**
+ * Everything a worker thread needs to scale one tile. The source image is
+ * implicitly shared with the document, so this is cheap to copy.
+ */
+struct TileJob
+{
+    TileKey key;
+    QImage image;
+    qreal zoom;
+    QRect rect;
+    QSharedPointer<QAtomicInt> currentGeneration;
+    int generation;
+};
+
+/**
+ * Scales the part of @p image covering @p rect, a rect expressed in zoomed
+ * image coordinates. This is thread-safe: it only reads @p image.
+ */
+static ScaledTile scaleImageRect(const QImage& image, qreal zoom, const QRect& rect, Qt::TransformationMode mode)
+{
+    ScaledTile tile;
+    // If rect contains "half" pixels, make sure sourceRect includes them
+    QRectF sourceRectF(
+        rect.left() / zoom,
+        rect.top() / zoom,
+        rect.width() / zoom,
+        rect.height() / zoom);
+
+    sourceRectF = sourceRectF.intersected(image.rect());
+    QRect sourceRect = PaintUtils::containingRect(sourceRectF);
+    if (sourceRect.isEmpty()) {
+        return tile;
+    }
+
+    // Compute smooth margin
+    bool needsSmoothMargins = mode == Qt::SmoothTransformation;
+
+    int sourceLeftMargin, sourceRightMargin, sourceTopMargin, sourceBottomMargin;
+    int destLeftMargin, destRightMargin, destTopMargin, destBottomMargin;
+    if (needsSmoothMargins) {
+        sourceLeftMargin = qMin(sourceRect.left(), SMOOTH_MARGIN);
+        sourceTopMargin = qMin(sourceRect.top(), SMOOTH_MARGIN);
+        sourceRightMargin = qMin(image.rect().right() - sourceRect.right(), SMOOTH_MARGIN);
+        sourceBottomMargin = qMin(image.rect().bottom() - sourceRect.bottom(), SMOOTH_MARGIN);
+        sourceRect.adjust(
+            -sourceLeftMargin,
+            -sourceTopMargin,
+            sourceRightMargin,
+            sourceBottomMargin);
+        destLeftMargin = int(sourceLeftMargin * zoom);
+        destTopMargin = int(sourceTopMargin * zoom);
+        destRightMargin = int(sourceRightMargin * zoom);
+        destBottomMargin = int(sourceBottomMargin * zoom);
+    } else {
+        sourceLeftMargin = sourceRightMargin = sourceTopMargin = sourceBottomMargin = 0;
+        destLeftMargin = destRightMargin = destTopMargin = destBottomMargin = 0;
+    }
+
+    // destRect is almost like rect, but it contains only "full" pixels
+    QRectF destRectF = QRectF(
+                           sourceRect.left() * zoom,
+                           sourceRect.top() * zoom,
+                           sourceRect.width() * zoom,
+                           sourceRect.height() * zoom
+                       );
+    QRect destRect = PaintUtils::containingRect(destRectF);
+
+    QImage tmp;
+    tmp = image.copy(sourceRect);
+    tmp = tmp.scaled(
+              destRect.width(),
+              destRect.height(),
+              Qt::IgnoreAspectRatio, // Do not use KeepAspectRatio, it can lead to skipped rows or columns
+              mode);
+
+    if (needsSmoothMargins) {
+        tmp = tmp.copy(
+                  destLeftMargin, destTopMargin,
+                  destRect.width() - (destLeftMargin + destRightMargin),
+                  destRect.height() - (destTopMargin + destBottomMargin)
+              );
+    }
+
+    tile.pos = QPoint(destRect.left() + destLeftMargin, destRect.top() + destTopMargin);
+    tile.image = tmp;
+    return tile;
+}
+
+static ScaledTile runTileJob(const TileJob& job)
+{
+    ScaledTile tile;
+    if (job.currentGeneration->load() == job.generation) {
+        tile = scaleImageRect(job.image, job.zoom, job.rect, job.key.mode);
+    } else {
+        LOG("Skipping outdated tile" << job.key.x << job.key.y);
+    }
+    tile.key = job.key;
+    tile.generation = job.generation;
+    return tile;
+}
+
+/**
+ * Process-wide LRU cache of scaled tiles. The cost of each entry is its size
+ * in kilobytes. Only accessed from the GUI thread.
+ */
+class TileCache
+{
+public:
+    TileCache()
+    {
+        // Use 1/32 of the installed memory, within sensible bounds
+        const qulonglong budget = MemoryUtils::getTotalMemory() / 32 / 1024;
+        mCache.setMaxCost(int(qBound(Q_UINT64_C(32 * 1024), budget, Q_UINT64_C(512 * 1024))));
+    }
+
+    const ScaledTile* tile(const TileKey& key) const
+    {
+        return mCache.object(key);
+    }
+
+    void insert(const ScaledTile& tile)
+    {
+        watchDocument(tile.key.document);
+        mCache.insert(tile.key, new ScaledTile(tile), tile.image.byteCount() / 1024 + 1);
+    }
+
+    void removeDocument(const Document* document)
+    {
+        Q_FOREACH(const TileKey& key, mCache.keys()) {
+            if (key.document == document) {
+                mCache.remove(key);
+            }
+        }
+    }
+
+private:
+    QCache<TileKey, ScaledTile> mCache;
+    QSet<const Document*> mWatchedDocuments;
+    QObject mContext;
+
+    void watchDocument(const Document* document)
+    {
+        if (mWatchedDocuments.contains(document)) {
+            return;
+        }
+        mWatchedDocuments << document;
+        // Document pointers are used as keys: make sure no tile survives its
+        // document, otherwise a new document allocated at the same address
+        // would get them.
+        QObject::connect(document, &QObject::destroyed, &mContext, [this, document]() {
+            removeDocument(document);
+            mWatchedDocuments.remove(document);
+        });
+    }
+};
+
+Q_GLOBAL_STATIC(TileCache, sTileCache)
+
+/**
+ * Scaled tiles of the frames of an animation, for the current zoom. They are
+ * keyed by frame number, so that each loop reuses the tiles of the previous
+ * one, even if the frames had to be decoded again.
+ */
+class FrameTileCache
+{
+public:
+    FrameTileCache()
+    {
+        // Use 1/64 of the installed memory, within sensible bounds
+        const qulonglong budget = MemoryUtils::getTotalMemory() / 64 / 1024;
+        mCache.setMaxCost(int(qBound(Q_UINT64_C(16 * 1024), budget, Q_UINT64_C(256 * 1024))));
+    }
+
+    const ScaledTile* tile(const TileKey& key) const
+    {
+        return mCache.object(key);
+    }
+
+    void insert(const ScaledTile& tile)
+    {
+        mCache.insert(tile.key, new ScaledTile(tile), tile.image.byteCount() / 1024 + 1);
+    }
+
+    void clear()
+    {
+        mCache.clear();
+    }
+
+private:
+    QCache<TileKey, ScaledTile> mCache;
+};
+
+typedef QFutureWatcher<ScaledTile> TileWatcher;
+
 struct ImageScalerPrivate
 {
     Qt::TransformationMode mTransformationMode;
     Document::Ptr mDocument;
+    qint64 mImageKey;
     qreal mZoom;
     QRegion mRegion;
+    // All the regions requested since the zoom or the document changed. Tiles
+    // which are not in this region are cached but not emitted.
+    QRegion mWantedRegion;
+    // Area of the tiles which were still being scaled when the next frame of
+    // an animation arrived. It must be scaled again from the new frame.
+    QRegion mLateRegion;
+    QHash<TileKey, TileWatcher*> mPendingTiles;
+    FrameTileCache mFrameTiles;
+    // Incremented whenever queued tiles become useless. Tile jobs compare it
+    // with the value they were created with and skip their work if it changed.
+    QSharedPointer<QAtomicInt> mGeneration;
+
+    void cancelPendingTiles()
+    {
+        mGeneration->ref();
+        mPendingTiles.clear();
+        mLateRegion = QRegion();
+    }
+
+    /**
+     * Animations are scaled from the full frames: down sampling each frame
+     * would cost more than it saves
+     */
+    bool useDownSampledImage() const
+    {
+        return mZoom < Document::maxDownSampledZoom() && !mDocument->isAnimated();
+    }
+
+    /**
+     * Still images share the process-wide cache, animations use their own
+     * so that their frames do not push the other images out of it
+     */
+    const ScaledTile* cachedTile(const TileKey& key) const
+    {
+        if (mDocument->isAnimated()) {
+            return mFrameTiles.tile(key);
+        }
+        return sTileCache->tile(key);
+    }
+
+    void insertTile(const ScaledTile& tile)
+    {
+        if (mDocument->isAnimated()) {
+            mFrameTiles.insert(tile);
+        } else {
+            sTileCache->insert(tile);
+        }
+    }
+
+    TileKey tileKey(int x, int y) const
+    {
+        TileKey key;
+        key.document = mDocument.data();
+        key.imageKey = mImageKey;
+        key.zoom = mZoom;
+        key.mode = mTransformationMode;
+        key.x = x;
+        key.y = y;
+        return key;
+    }
+
+    bool isCurrentTile(const ScaledTile& tile) const
+    {
+        return tile.generation == mGeneration->load()
+            && tile.key.document == mDocument.data()
+            && tile.key.imageKey == mImageKey
+            && tile.key.zoom == mZoom
+            && tile.key.mode == mTransformationMode;
+    }
 };
 
 ImageScaler::ImageScaler(QObject* parent)
@@ -58,20 +373,39 @@ ImageScaler::ImageScaler(QObject* parent)
 , d(new ImageScalerPrivate)
 {
     d->mTransformationMode = Qt::FastTransformation;
+    d->mImageKey = 0;
     d->mZoom = 0;
+    d->mGeneration.reset(new QAtomicInt(0));
 }
 
 ImageScaler::~ImageScaler()
 {
+    // Running jobs keep a reference to the generation counter, this makes
+    // sure they do not start working on tiles nobody is waiting for anymore
+    d->cancelPendingTiles();
     delete d;
 }
 
+int ImageScaler::tileSize()
+{
+    return TILE_SIZE;
+}
+
 void ImageScaler::setDocument(Document::Ptr document)
 {
     if (d->mDocument) {
         disconnect(d->mDocument.data(), nullptr, this, nullptr);
     }
     d->mDocument = document;
+    d->mWantedRegion = QRegion();
+    d->mFrameTiles.clear();
+    d->cancelPendingTiles();
+    // Must be connected before doScale(), so that outdated tiles are dropped
+    // before we rescale
+    connect(d->mDocument.data(), SIGNAL(imageRectUpdated(QRect)),
+            SLOT(slotImageRectUpdated()));
+    connect(d->mDocument.data(), SIGNAL(loaded(QUrl)),
+            SLOT(invalidateDocumentTiles()));
     // Used when scaler asked for a down-sampled image
     connect(d->mDocument.data(), SIGNAL(downSampledImageReady()),
             SLOT(doScale()));
@@ -82,30 +416,65 @@ void ImageScaler::setDocument(Document::Ptr document)
 
 void ImageScaler::setZoom(qreal zoom)
 {
+    if (d->mZoom == zoom) {
+        return;
+    }
     d->mZoom = zoom;
+    d->mWantedRegion = QRegion();
+    d->mFrameTiles.clear();
+    d->cancelPendingTiles();
 }
 
 void ImageScaler::setTransformationMode(Qt::TransformationMode mode)
 {
+    if (d->mTransformationMode == mode) {
+        return;
+    }
     d->mTransformationMode = mode;
+    d->mFrameTiles.clear();
+    d->cancelPendingTiles();
 }
 
 void ImageScaler::setDestinationRegion(const QRegion& region)
 {
     LOG(region);
-    d->mRegion = region;
+    d->mRegion = region | d->mLateRegion;
+    d->mLateRegion = QRegion();
     if (d->mRegion.isEmpty()) {
         return;
     }
+    d->mWantedRegion |= region;
 
     if (d->mDocument && d->mZoom > 0) {
         doScale();
     }
 }
 
+void ImageScaler::invalidateDocumentTiles()
+{
+    LOG("");
+    sTileCache->removeDocument(d->mDocument.data());
+    d->mFrameTiles.clear();
+    d->cancelPendingTiles();
+}
+
+void ImageScaler::slotImageRectUpdated()
+{
+    if (d->mDocument->isAnimated()) {
+        // Tiles of the previous frames are still valid, keep them for the
+        // next loop. Pending tiles belong to the previous frame and will not
+        // be shown: their area must be scaled again from the new one.
+        Q_FOREACH(const TileKey& key, d->mPendingTiles.keys()) {
+            d->mLateRegion |= QRect(key.x * TILE_SIZE, key.y * TILE_SIZE, TILE_SIZE, TILE_SIZE);
+        }
+        return;
+    }
+    invalidateDocumentTiles();
+}
+
 void ImageScaler::doScale()
 {
-    if (d->mZoom < Document::maxDownSampledZoom()) {
+    if (d->useDownSampledImage()) {
         if (!d->mDocument->prepareDownSampledImageForZoom(d->mZoom)) {
             LOG("Asked for a down sampled image");
             return;
@@ -135,7 +504,7 @@ void ImageScaler::scaleRect(const QRect& rect)
 
     QImage image;
     qreal zoom;
-    if (d->mZoom < Document::maxDownSampledZoom()) {
+    if (d->useDownSampledImage()) {
         image = d->mDocument->downSampledImageForZoom(d->mZoom);
         Q_ASSERT(!image.isNull());
         qreal zoom1 = qreal(image.width()) / d->mDocument->width();
@@ -144,69 +513,65 @@ void ImageScaler::scaleRect(const QRect& rect)
         image = d->mDocument->image();
         zoom = d->mZoom;
     }
-    // If rect contains "half" pixels, make sure sourceRect includes them
-    QRectF sourceRectF(
-        rect.left() / zoom,
-        rect.top() / zoom,
-        rect.width() / zoom,
-        rect.height() / zoom);
+    d->mImageKey = d->mDocument->isAnimated() ? d->mDocument->currentFrameNumber() : image.cacheKey();
 
-    sourceRectF = sourceRectF.intersected(image.rect());
-    QRect sourceRect = PaintUtils::containingRect(sourceRectF);
-    if (sourceRect.isEmpty()) {
+    const QRect zoomedImageRect = PaintUtils::containingRect(
+        QRectF(0, 0, image.width() * zoom, image.height() * zoom));
+    const QRect clippedRect = rect & zoomedImageRect;
+    if (clippedRect.isEmpty()) {
         return;
     }
 
-    // Compute smooth margin
-    bool needsSmoothMargins = d->mTransformationMode == Qt::SmoothTransformation;
+    const int firstX = clippedRect.left() / TILE_SIZE;
+    const int lastX = clippedRect.right() / TILE_SIZE;
+    const int firstY = clippedRect.top() / TILE_SIZE;
+    const int lastY = clippedRect.bottom() / TILE_SIZE;
+    for (int y = firstY; y <= lastY; ++y) {
+        for (int x = firstX; x <= lastX; ++x) {
+            const TileKey key = d->tileKey(x, y);
+            const ScaledTile* tile = d->cachedTile(key);
+            if (tile) {
+                emit scaledRect(tile->pos.x(), tile->pos.y(), tile->image);
+                continue;
+            }
+            if (d->mPendingTiles.contains(key)) {
+                continue;
+            }
 
-    int sourceLeftMargin, sourceRightMargin, sourceTopMargin, sourceBottomMargin;
-    int destLeftMargin, destRightMargin, destTopMargin, destBottomMargin;
-    if (needsSmoothMargins) {
-        sourceLeftMargin = qMin(sourceRect.left(), SMOOTH_MARGIN);
-        sourceTopMargin = qMin(sourceRect.top(), SMOOTH_MARGIN);
-        sourceRightMargin = qMin(image.rect().right() - sourceRect.right(), SMOOTH_MARGIN);
-        sourceBottomMargin = qMin(image.rect().bottom() - sourceRect.bottom(), SMOOTH_MARGIN);
-        sourceRect.adjust(
-            -sourceLeftMargin,
-            -sourceTopMargin,
-            sourceRightMargin,
-            sourceBottomMargin);
-        destLeftMargin = int(sourceLeftMargin * zoom);
-        destTopMargin = int(sourceTopMargin * zoom);
-        destRightMargin = int(sourceRightMargin * zoom);
-        destBottomMargin = int(sourceBottomMargin * zoom);
-    } else {
-        sourceLeftMargin = sourceRightMargin = sourceTopMargin = sourceBottomMargin = 0;
-        destLeftMargin = destRightMargin = destTopMargin = destBottomMargin = 0;
-    }
+            TileJob job;
+            job.key = key;
+            job.image = image;
+            job.zoom = zoom;
+            job.rect = QRect(x * TILE_SIZE, y * TILE_SIZE, TILE_SIZE, TILE_SIZE) & zoomedImageRect;
+            job.currentGeneration = d->mGeneration;
+            job.generation = d->mGeneration->load();
 
-    // destRect is almost like rect, but it contains only "full" pixels
-    QRectF destRectF = QRectF(
-                           sourceRect.left() * zoom,
-                           sourceRect.top() * zoom,
-                           sourceRect.width() * zoom,
-                           sourceRect.height() * zoom
-                       );
-    QRect destRect = PaintUtils::containingRect(destRectF);
+            TileWatcher* watcher = new TileWatcher(this);
+            connect(watcher, SIGNAL(finished()), SLOT(slotTileScaled()));
+            watcher->setFuture(QtConcurrent::run(runTileJob, job));
+            d->mPendingTiles.insert(key, watcher);
+        }
+    }
+}
 
-    QImage tmp;
-    tmp = image.copy(sourceRect);
-    tmp = tmp.scaled(
-              destRect.width(),
-              destRect.height(),
-              Qt::IgnoreAspectRatio, // Do not use KeepAspectRatio, it can lead to skipped rows or columns
-              d->mTransformationMode);
+void ImageScaler::slotTileScaled()
+{
+    TileWatcher* watcher = static_cast<TileWatcher*>(sender());
+    const ScaledTile tile = watcher->result();
+    watcher->deleteLater();
+    if (d->mPendingTiles.value(tile.key) == watcher) {
+        d->mPendingTiles.remove(tile.key);
+    }
 
-    if (needsSmoothMargins) {
-        tmp = tmp.copy(
-                  destLeftMargin, destTopMargin,
-                  destRect.width() - (destLeftMargin + destRightMargin),
-                  destRect.height() - (destTopMargin + destBottomMargin)
-              );
+    if (tile.image.isNull() || tile.generation != d->mGeneration->load()) {
+        // Outdated or empty tile
+        return;
     }
+    d->insertTile(tile);
 
-    emit scaledRect(destRect.left() + destLeftMargin, destRect.top() + destTopMargin, tmp);
+    if (d->isCurrentTile(tile) && d->mWantedRegion.intersects(QRect(tile.pos, tile.image.size()))) {
+        emit scaledRect(tile.pos.x(), tile.pos.y(), tile.image);
+    }
 }
 
 } // namespace
@@ -39,6 +39,15 @@ namespace Gwenview
 class Document;
 
 struct ImageScalerPrivate;
+/**
+ * Scales the visible part of a Document for a given zoom.
+ *
+ * The zoomed image is split in fixed-size tiles which are scaled in the
+ * global thread pool and delivered through scaledRect() as soon as each of
+ * them is ready. Scaled tiles are kept in a process-wide LRU cache bounded in
+ * bytes, so that going back to an area which has already been displayed at
+ * the same zoom level does not require any scaling.
+ */
 class GWENVIEWLIB_EXPORT ImageScaler : public QObject
 {
     Q_OBJECT
@@ -51,6 +60,11 @@ public:
 
     void setTransformationMode(Qt::TransformationMode);
 
+    /**
+     * Size of the tiles, in zoomed image coordinates
+     */
+    static int tileSize();
+
 Q_SIGNALS:
     void scaledRect(int left, int top, const QImage&);
 
@@ -60,6 +74,9 @@ private:
 
 private Q_SLOTS:
     void doScale();
+    void slotTileScaled();
+    void slotImageRectUpdated();
+    void invalidateDocumentTiles();
 };
 
 } // namespace
@@ -36,6 +36,7 @@ extern "C" {
 #include <QImage>
 #include <QImageWriter>
 #include <QMatrix>
+#include <QRect>
 #include <QDebug>
 
 // KDE
@@ -153,6 +154,7 @@ struct JpegContent::Private
         jpeg_create_decompress(&srcinfo);
         if (setjmp(errorManager.jmp_buffer)) {
             qCritical() << "libjpeg fatal error\n";
+            jpeg_destroy_decompress(&srcinfo);
             return false;
         }
 
@@ -187,6 +189,131 @@ struct JpegContent::Private
         mImage = QImage();
         return true;
     }
+
+    /**
+     * Transforms mRawData without decoding it, cropping it to cropRect if it
+     * is not null. cropRect is expressed in the coordinates of the
+     * transformed image. Returns false, leaving mRawData untouched, if
+     * cropRect does not start on an iMCU boundary.
+     */
+    bool transformRawData(JXFORM_CODE transform, const QRect& cropRect)
+    {
+        // The following code is inspired by jpegtran.c from the libjpeg
+
+        // Init JPEG structs
+        struct jpeg_decompress_struct srcinfo;
+        struct jpeg_compress_struct dstinfo;
+        jvirt_barray_ptr * src_coef_arrays;
+        jvirt_barray_ptr * dst_coef_arrays;
+
+        // Initialize the JPEG decompression object
+        JPEGErrorManager srcErrorManager;
+        srcinfo.err = &srcErrorManager;
+        jpeg_create_decompress(&srcinfo);
+
+        // Initialize the JPEG compression object
+        JPEGErrorManager dstErrorManager;
+        dstinfo.err = &dstErrorManager;
+        jpeg_create_compress(&dstinfo);
+
+        // Both objects exist from now on, errors must release them
+        if (setjmp(srcErrorManager.jmp_buffer)) {
+            qCritical() << "libjpeg error in src\n";
+            jpeg_destroy_compress(&dstinfo);
+            jpeg_destroy_decompress(&srcinfo);
+            return false;
+        }
+        if (setjmp(dstErrorManager.jmp_buffer)) {
+            qCritical() << "libjpeg error in dst\n";
+            jpeg_destroy_compress(&dstinfo);
+            jpeg_destroy_decompress(&srcinfo);
+            return false;
+        }
+
+        // Specify data source for decompression
+        QBuffer buffer(&mRawData);
+        buffer.open(QIODevice::ReadOnly);
+        IODeviceJpegSourceManager::setup(&srcinfo, &buffer);
+
+        // Enable saving of extra markers that we want to copy
+        jcopy_markers_setup(&srcinfo, JCOPYOPT_ALL);
+
+        (void) jpeg_read_header(&srcinfo, true);
+
+        // Init transformation
+        jpeg_transform_info transformoption;
+        memset(&transformoption, 0, sizeof(jpeg_transform_info));
+        transformoption.transform = transform;
+#if JPEG_LIB_VERSION >= 80
+        if (!cropRect.isNull()) {
+            transformoption.crop = true;
+            transformoption.crop_xoffset = cropRect.x();
+            transformoption.crop_xoffset_set = JCROP_POS;
+            transformoption.crop_yoffset = cropRect.y();
+            transformoption.crop_yoffset_set = JCROP_POS;
+            transformoption.crop_width = cropRect.width();
+            transformoption.crop_width_set = JCROP_POS;
+            transformoption.crop_height = cropRect.height();
+            transformoption.crop_height_set = JCROP_POS;
+        }
+#endif
+        jtransform_request_workspace(&srcinfo, &transformoption);
+#if JPEG_LIB_VERSION >= 80
+        // libjpeg extends the crop area to the top-left iMCU boundary
+        if (transformoption.crop
+                && (int(transformoption.output_width) != cropRect.width()
+                    || int(transformoption.output_height) != cropRect.height())) {
+            jpeg_destroy_compress(&dstinfo);
+            jpeg_destroy_decompress(&srcinfo);
+            return false;
+        }
+#endif
+
+        /* Read source file as DCT coefficients */
+        src_coef_arrays = jpeg_read_coefficients(&srcinfo);
+
+        /* Initialize destination compression parameters from source values */
+        jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
+
+        /* Adjust destination parameters if required by transform options;
+        * also find out which set of coefficient arrays will hold the output.
+        */
+        dst_coef_arrays = jtransform_adjust_parameters(&srcinfo, &dstinfo,
+                          src_coef_arrays,
+                          &transformoption);
+
+        /* Specify data destination for compression */
+        QByteArray output;
+        output.resize(mRawData.size());
+        setupInmemDestination(&dstinfo, &output);
+
+        /* Start compressor (note no image data is actually written here) */
+        jpeg_write_coefficients(&dstinfo, dst_coef_arrays);
+
+        /* Copy to the output file any extra markers that we want to preserve */
+        jcopy_markers_execute(&srcinfo, &dstinfo, JCOPYOPT_ALL);
+
+        /* Execute image transformation, if any */
+        jtransform_execute_transformation(&srcinfo, &dstinfo,
+                                          src_coef_arrays,
+                                          &transformoption);
+
+        /* Finish compression and release memory */
+        jpeg_finish_compress(&dstinfo);
+        jpeg_destroy_compress(&dstinfo);
+        (void) jpeg_finish_decompress(&srcinfo);
+        jpeg_destroy_decompress(&srcinfo);
+
+        // Set rawData to our new JPEG
+        mRawData = output;
+        return true;
+    }
+
+    void updatePixelDimensions()
+    {
+        mExifData["Exif.Photo.PixelXDimension"] = mSize.width();
+        mExifData["Exif.Photo.PixelYDimension"] = mSize.height();
+    }
 };
 
 //------------
@@ -403,11 +530,19 @@ static const OrientationInfoList& orientationInfoList()
 void JpegContent::transform(Orientation orientation)
 {
     if (orientation != NOT_AVAILABLE && orientation != NORMAL) {
-        d->mPendingTransformation = true;
         OrientationInfoList::ConstIterator it(orientationInfoList().begin()), end(orientationInfoList().end());
         for (; it != end; ++it) {
             if ((*it).orientation == orientation) {
-                d->mTransformMatrix = (*it).matrix * d->mTransformMatrix;
+                if (!d->mImage.isNull()) {
+                    // The pixels are going to be encoded anyway, no need to
+                    // transform the JPEG data afterward
+                    d->mImage = d->mImage.transformed((*it).matrix);
+                    d->mSize = d->mImage.size();
+                    d->updatePixelDimensions();
+                } else {
+                    d->mPendingTransformation = true;
+                    d->mTransformMatrix = (*it).matrix * d->mTransformMatrix;
+                }
                 break;
             }
         }
@@ -454,86 +589,48 @@ void JpegContent::applyPendingTransformation()
         qCritical() << "No data loaded\n";
         return;
     }
+    d->transformRawData(findJxform(d->mTransformMatrix), QRect());
+}
 
-    // The following code is inspired by jpegtran.c from the libjpeg
-
-    // Init JPEG structs
-    struct jpeg_decompress_struct srcinfo;
-    struct jpeg_compress_struct dstinfo;
-    jvirt_barray_ptr * src_coef_arrays;
-    jvirt_barray_ptr * dst_coef_arrays;
-
-    // Initialize the JPEG decompression object
-    JPEGErrorManager srcErrorManager;
-    srcinfo.err = &srcErrorManager;
-    jpeg_create_decompress(&srcinfo);
-    if (setjmp(srcErrorManager.jmp_buffer)) {
-        qCritical() << "libjpeg error in src\n";
-        return;
+bool JpegContent::crop(const QRect& rect)
+{
+#if JPEG_LIB_VERSION >= 80
+    if (d->mRawData.size() == 0) {
+        // Pixels have been replaced, they will be encoded anyway
+        return false;
     }
-
-    // Initialize the JPEG compression object
-    JPEGErrorManager dstErrorManager;
-    dstinfo.err = &dstErrorManager;
-    jpeg_create_compress(&dstinfo);
-    if (setjmp(dstErrorManager.jmp_buffer)) {
-        qCritical() << "libjpeg error in dst\n";
-        return;
+    if (GwenviewConfig::applyExifOrientation()) {
+        const Orientation exifOrientation = orientation();
+        if (exifOrientation != NORMAL && exifOrientation != NOT_AVAILABLE) {
+            // rect does not match the stored pixels
+            return false;
+        }
     }
-
-    // Specify data source for decompression
-    QBuffer buffer(&d->mRawData);
-    buffer.open(QIODevice::ReadOnly);
-    IODeviceJpegSourceManager::setup(&srcinfo, &buffer);
-
-    // Enable saving of extra markers that we want to copy
-    jcopy_markers_setup(&srcinfo, JCOPYOPT_ALL);
-
-    (void) jpeg_read_header(&srcinfo, true);
-
-    // Init transformation
-    jpeg_transform_info transformoption;
-    memset(&transformoption, 0, sizeof(jpeg_transform_info));
-    transformoption.transform = findJxform(d->mTransformMatrix);
-    jtransform_request_workspace(&srcinfo, &transformoption);
-
-    /* Read source file as DCT coefficients */
-    src_coef_arrays = jpeg_read_coefficients(&srcinfo);
-
-    /* Initialize destination compression parameters from source values */
-    jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
-
-    /* Adjust destination parameters if required by transform options;
-    * also find out which set of coefficient arrays will hold the output.
-    */
-    dst_coef_arrays = jtransform_adjust_parameters(&srcinfo, &dstinfo,
-                      src_coef_arrays,
-                      &transformoption);
-
-    /* Specify data destination for compression */
-    QByteArray output;
-    output.resize(d->mRawData.size());
-    d->setupInmemDestination(&dstinfo, &output);
-
-    /* Start compressor (note no image data is actually written here) */
-    jpeg_write_coefficients(&dstinfo, dst_coef_arrays);
-
-    /* Copy to the output file any extra markers that we want to preserve */
-    jcopy_markers_execute(&srcinfo, &dstinfo, JCOPYOPT_ALL);
-
-    /* Execute image transformation, if any */
-    jtransform_execute_transformation(&srcinfo, &dstinfo,
-                                      src_coef_arrays,
-                                      &transformoption);
-
-    /* Finish compression and release memory */
-    jpeg_finish_compress(&dstinfo);
-    jpeg_destroy_compress(&dstinfo);
-    (void) jpeg_finish_decompress(&srcinfo);
-    jpeg_destroy_decompress(&srcinfo);
-
-    // Set rawData to our new JPEG
-    d->mRawData = output;
+    // rect is expressed in the coordinates of the transformed image: apply
+    // the pending transformation in the same pass, so that nothing changes
+    // if rect is not aligned on iMCUs
+    JXFORM_CODE transform = JXFORM_NONE;
+    QSize size = d->mSize;
+    if (d->mPendingTransformation) {
+        transform = findJxform(d->mTransformMatrix);
+        size = d->mTransformMatrix.mapRect(QRect(QPoint(0, 0), size)).size();
+    }
+    if (!QRect(QPoint(0, 0), size).contains(rect)) {
+        qWarning() << "Crop rect" << rect << "is outside image";
+        return false;
+    }
+    if (!d->transformRawData(transform, rect)) {
+        return false;
+    }
+    d->mPendingTransformation = false;
+    d->mTransformMatrix.reset();
+    d->mSize = rect.size();
+    d->updatePixelDimensions();
+    return true;
+#else
+    Q_UNUSED(rect);
+    return false;
+#endif
 }
 
 QImage JpegContent::thumbnail() const
@@ -633,8 +730,7 @@ void JpegContent::setImage(const QImage& image)
     d->mRawData.clear();
     d->mImage = image;
     d->mSize = image.size();
-    d->mExifData["Exif.Photo.PixelXDimension"] = image.width();
-    d->mExifData["Exif.Photo.PixelYDimension"] = image.height();
+    d->updatePixelDimensions();
     resetOrientation();
 
     d->mPendingTransformation = false;
@@ -26,6 +26,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <lib/gwenviewlib_export.h>
 #include <QByteArray>
 class QImage;
+class QRect;
 class QSize;
 class QString;
 class QIODevice;
@@ -57,6 +58,20 @@ public:
 
     void transform(Orientation);
 
+    /**
+     * Crops the image to @p rect, expressed in the coordinates of the image
+     * as Gwenview shows it, without decoding it.
+     *
+     * This is only possible if the top-left corner of @p rect falls on an
+     * iMCU boundary, the pixels have not been replaced with setImage() and
+     * no EXIF orientation is applied to the image. Returns false if the
+     * image could not be cropped this way, in which case it is left
+     * untouched.
+     *
+     * Note: thumbnail must be updated separately
+     */
+    bool crop(const QRect& rect);
+
     QImage thumbnail() const;
     void setThumbnail(const QImage&);
 
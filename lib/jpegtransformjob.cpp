@@ -0,0 +1,199 @@
+// vim: set tabstop=4 shiftwidth=4 expandtab:
+/*
+Gwenview: an image viewer
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA.
+
+*/
+// Self
+#include "jpegtransformjob.h"
+
+// Qt
+#include <QDebug>
+#include <QFutureWatcher>
+#include <QImage>
+#include <QMatrix>
+#include <QSaveFile>
+#include <QStringList>
+#include <QtConcurrentMap>
+
+// KDE
+#include <KLocalizedString>
+
+// Local
+#include "gwenviewconfig.h"
+#include "imageutils.h"
+#include "jpegcontent.h"
+#include "thumbnailprovider/thumbnailprovider.h"
+
+namespace Gwenview
+{
+
+#undef ENABLE_LOG
+#undef LOG
+//#define ENABLE_LOG
+#ifdef ENABLE_LOG
+#define LOG(x) qDebug() << x
+#else
+#define LOG(x) ;
+#endif
+
+/**
+ * Transforms one file, returns an error message or an empty string
+ */
+struct TransformFunctor {
+    typedef QString result_type;
+
+    Orientation mOrientation;
+
+    QString operator()(const QUrl& url) const
+    {
+        const QString path = url.toLocalFile();
+        JpegContent content;
+        if (!content.load(path)) {
+            return i18nc("@info", "Could not load %1.", path);
+        }
+
+        Orientation orientation = mOrientation;
+        // If the image is shown with its EXIF orientation applied, apply it
+        // to the pixels too: the result is what the user expects whether
+        // other viewers honor the orientation or not
+        const bool applyExifOrientation = GwenviewConfig::applyExifOrientation();
+        if (applyExifOrientation) {
+            const Orientation exifOrientation = content.orientation();
+            if (exifOrientation != NOT_AVAILABLE) {
+                orientation = JpegTransformJob::combinedOrientation(exifOrientation, orientation);
+            }
+        }
+
+        const QImage thumbnail = content.thumbnail();
+        content.transform(orientation);
+        if (applyExifOrientation) {
+            content.resetOrientation();
+        }
+        if (!thumbnail.isNull()) {
+            content.setThumbnail(thumbnail.transformed(ImageUtils::transformMatrix(orientation)));
+        }
+
+        QSaveFile file(path);
+        if (!file.open(QIODevice::WriteOnly)) {
+            return file.errorString();
+        }
+        if (!content.save(&file)) {
+            file.cancelWriting();
+            return content.errorString();
+        }
+        if (!file.commit()) {
+            return file.errorString();
+        }
+        LOG("Transformed" << path);
+        return QString();
+    }
+};
+
+struct JpegTransformJobPrivate
+{
+    QList<QUrl> mUrls;
+    Orientation mOrientation;
+    QFutureWatcher<QString> mWatcher;
+    QList<QUrl> mFailedUrls;
+    QStringList mErrors;
+    int mProcessedCount;
+};
+
+JpegTransformJob::JpegTransformJob(const QList<QUrl>& urls, Orientation orientation, QObject* parent)
+: KJob(parent)
+, d(new JpegTransformJobPrivate)
+{
+    d->mUrls = urls;
+    d->mOrientation = orientation;
+    d->mProcessedCount = 0;
+    connect(&d->mWatcher, SIGNAL(resultReadyAt(int)), SLOT(slotResultReadyAt(int)));
+    connect(&d->mWatcher, SIGNAL(finished()), SLOT(slotFinished()));
+}
+
+JpegTransformJob::~JpegTransformJob()
+{
+    delete d;
+}
+
+bool JpegTransformJob::canTransform(const QUrl& url, const QString& mimeType)
+{
+    return url.isLocalFile() && mimeType == QStringLiteral("image/jpeg");
+}
+
+Orientation JpegTransformJob::combinedOrientation(Orientation first, Orientation second)
+{
+    const QMatrix matrix = ImageUtils::transformMatrix(first) * ImageUtils::transformMatrix(second);
+    for (int value = NORMAL; value <= ROT_270; ++value) {
+        const QMatrix candidate = ImageUtils::transformMatrix(Orientation(value));
+        if (qAbs(candidate.m11() - matrix.m11()) < 0.001
+                && qAbs(candidate.m12() - matrix.m12()) < 0.001
+                && qAbs(candidate.m21() - matrix.m21()) < 0.001
+                && qAbs(candidate.m22() - matrix.m22()) < 0.001) {
+            return Orientation(value);
+        }
+    }
+    qWarning() << "No orientation matches" << first << "followed by" << second;
+    return NOT_AVAILABLE;
+}
+
+void JpegTransformJob::start()
+{
+    setTotalAmount(KJob::Files, d->mUrls.size());
+    TransformFunctor functor;
+    functor.mOrientation = d->mOrientation;
+    d->mWatcher.setFuture(QtConcurrent::mapped(d->mUrls, functor));
+}
+
+QList<QUrl> JpegTransformJob::failedUrls() const
+{
+    return d->mFailedUrls;
+}
+
+bool JpegTransformJob::doKill()
+{
+    // Files being transformed are not interrupted, QSaveFile makes sure
+    // they are left either untouched or fully transformed
+    d->mWatcher.disconnect(this);
+    d->mWatcher.cancel();
+    return true;
+}
+
+void JpegTransformJob::slotResultReadyAt(int index)
+{
+    const QUrl url = d->mUrls.at(index);
+    const QString error = d->mWatcher.resultAt(index);
+    if (error.isEmpty()) {
+        ThumbnailProvider::deleteImageThumbnail(url);
+        emit urlTransformed(url);
+    } else {
+        qWarning() << "Could not transform" << url << ":" << error;
+        d->mFailedUrls << url;
+        d->mErrors << error;
+    }
+    setProcessedAmount(KJob::Files, ++d->mProcessedCount);
+}
+
+void JpegTransformJob::slotFinished()
+{
+    if (!d->mFailedUrls.isEmpty()) {
+        setError(UserDefinedError);
+        setErrorText(d->mErrors.join('\n'));
+    }
+    emitResult();
+}
+
+} // namespace
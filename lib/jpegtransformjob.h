@@ -0,0 +1,89 @@
+// vim: set tabstop=4 shiftwidth=4 expandtab:
+/*
+Gwenview: an image viewer
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA.
+
+*/
+#ifndef JPEGTRANSFORMJOB_H
+#define JPEGTRANSFORMJOB_H
+
+#include <lib/gwenviewlib_export.h>
+
+// Qt
+#include <QList>
+#include <QUrl>
+
+// KDE
+#include <KJob>
+
+// Local
+#include <lib/orientation.h>
+
+namespace Gwenview
+{
+
+struct JpegTransformJobPrivate;
+
+/**
+ * Transforms local JPEG files on disk, without decoding them: the DCT
+ * coefficients are transformed by JpegContent. The EXIF orientation is
+ * applied at the same time if Gwenview applies it when showing images, and
+ * the EXIF thumbnail is transformed too.
+ *
+ * Files are transformed in parallel, in the global thread pool. Cached
+ * thumbnails of the files are deleted as they get transformed.
+ */
+class GWENVIEWLIB_EXPORT JpegTransformJob : public KJob
+{
+    Q_OBJECT
+public:
+    JpegTransformJob(const QList<QUrl>& urls, Orientation orientation, QObject* parent = nullptr);
+    ~JpegTransformJob() Q_DECL_OVERRIDE;
+
+    void start() Q_DECL_OVERRIDE;
+
+    /**
+     * Returns true if url can be transformed by this job
+     */
+    static bool canTransform(const QUrl& url, const QString& mimeType);
+
+    /**
+     * Returns the orientation equivalent to applying @p first then @p second
+     */
+    static Orientation combinedOrientation(Orientation first, Orientation second);
+
+    /**
+     * Urls which could not be transformed. Valid once the job is done.
+     */
+    QList<QUrl> failedUrls() const;
+
+Q_SIGNALS:
+    void urlTransformed(const QUrl&);
+
+protected:
+    bool doKill() Q_DECL_OVERRIDE;
+
+private Q_SLOTS:
+    void slotResultReadyAt(int);
+    void slotFinished();
+
+private:
+    JpegTransformJobPrivate* const d;
+};
+
+} // namespace
+
+#endif /* JPEGTRANSFORMJOB_H */
@@ -0,0 +1,235 @@
+// vim: set tabstop=4 shiftwidth=4 expandtab:
+/*
+Gwenview: an image viewer
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA.
+
+*/
+// Self
+#include "mappedfile.h"
+
+// STL
+#include <limits>
+
+// Qt
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QDebug>
+
+#ifdef Q_OS_UNIX
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// KDE
+
+// Local
+
+namespace Gwenview
+{
+
+#undef ENABLE_LOG
+#undef LOG
+//#define ENABLE_LOG
+#ifdef ENABLE_LOG
+#define LOG(x) qDebug() << x
+#else
+#define LOG(x) ;
+#endif
+
+#ifdef Q_OS_UNIX
+// How many files can be mapped at the same time
+static const int MAX_GUARDED_MAPPINGS = 64;
+
+/**
+ * A mapping whose SIGBUS are handled. The signal handler only reads
+ * mAddress and mSize, and sets mTruncated.
+ */
+struct GuardedMapping
+{
+    QAtomicPointer<char> mAddress;
+    qint64 mSize;
+    QAtomicInt mTruncated;
+};
+
+static GuardedMapping sGuardedMappings[MAX_GUARDED_MAPPINGS];
+// Protects the registration of mappings, never used by the signal handler
+static QBasicMutex sGuardedMappingsMutex;
+static struct sigaction sPreviousSigbusAction;
+static quintptr sPageSize = 0;
+
+static void sigbusHandler(int sig, siginfo_t* info, void* context)
+{
+    char* address = static_cast<char*>(info->si_addr);
+    for (int idx = 0; idx < MAX_GUARDED_MAPPINGS; ++idx) {
+        GuardedMapping& mapping = sGuardedMappings[idx];
+        char* start = mapping.mAddress.loadAcquire();
+        if (!start || address < start || address >= start + mapping.mSize) {
+            continue;
+        }
+        // The file has been truncated. Replace the pages which are not backed
+        // by the file anymore with zeros, the faulting read is then run again.
+        char* page = reinterpret_cast<char*>(quintptr(address) & ~(sPageSize - 1));
+        const size_t length = size_t(start + mapping.mSize - page);
+        if (mmap(page, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            mapping.mTruncated.storeRelease(1);
+            return;
+        }
+        break;
+    }
+
+    // Not one of our mappings
+    if (sPreviousSigbusAction.sa_flags & SA_SIGINFO) {
+        sPreviousSigbusAction.sa_sigaction(sig, info, context);
+    } else if (sPreviousSigbusAction.sa_handler != SIG_DFL && sPreviousSigbusAction.sa_handler != SIG_IGN) {
+        sPreviousSigbusAction.sa_handler(sig);
+    } else {
+        // Crash as usual when the faulting read is run again
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = SIG_DFL;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGBUS, &action, nullptr);
+    }
+}
+
+static bool installSigbusHandler()
+{
+    sPageSize = quintptr(sysconf(_SC_PAGESIZE));
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = sigbusHandler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGBUS, &action, &sPreviousSigbusAction) != 0) {
+        qWarning() << "Could not install SIGBUS handler:" << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Returns the index of the slot used for the mapping, -1 if there is none
+ */
+static int guardMapping(char* address, qint64 size)
+{
+    static const bool handlerInstalled = installSigbusHandler();
+    if (!handlerInstalled) {
+        return -1;
+    }
+    QMutexLocker locker(&sGuardedMappingsMutex);
+    for (int idx = 0; idx < MAX_GUARDED_MAPPINGS; ++idx) {
+        GuardedMapping& mapping = sGuardedMappings[idx];
+        if (!mapping.mAddress.loadAcquire()) {
+            mapping.mSize = size;
+            mapping.mTruncated.storeRelease(0);
+            mapping.mAddress.storeRelease(address);
+            return idx;
+        }
+    }
+    return -1;
+}
+
+static void unguardMapping(int idx)
+{
+    QMutexLocker locker(&sGuardedMappingsMutex);
+    sGuardedMappings[idx].mAddress.storeRelease(nullptr);
+}
+#endif
+
+struct MappedFilePrivate
+{
+    QFile mFile;
+    uchar* mAddress;
+    QByteArray mData;
+    // Index in sGuardedMappings, -1 if the mapping is not guarded
+    int mGuardIndex;
+};
+
+MappedFile::MappedFile(const QString& path)
+: d(new MappedFilePrivate)
+{
+    d->mFile.setFileName(path);
+    d->mAddress = nullptr;
+    d->mGuardIndex = -1;
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef Q_OS_UNIX
+    if (d->mGuardIndex != -1) {
+        unguardMapping(d->mGuardIndex);
+    }
+#endif
+    if (d->mAddress) {
+        // This also unmaps the pages replaced by the signal handler
+        d->mFile.unmap(d->mAddress);
+    }
+    delete d;
+}
+
+bool MappedFile::map()
+{
+    Q_ASSERT(!d->mAddress);
+    if (!d->mFile.open(QIODevice::ReadOnly)) {
+        LOG("Could not open file:" << d->mFile.errorString());
+        return false;
+    }
+    const qint64 size = d->mFile.size();
+    if (size == 0 || size > std::numeric_limits<int>::max()) {
+        return false;
+    }
+    d->mAddress = d->mFile.map(0, size);
+    if (!d->mAddress) {
+        LOG("Could not map file:" << d->mFile.errorString());
+        return false;
+    }
+#ifdef Q_OS_UNIX
+    d->mGuardIndex = guardMapping(reinterpret_cast<char*>(d->mAddress), size);
+    if (d->mGuardIndex == -1) {
+        // Reading would be safer
+        d->mFile.unmap(d->mAddress);
+        d->mAddress = nullptr;
+        return false;
+    }
+#endif
+    d->mData = QByteArray::fromRawData(reinterpret_cast<const char*>(d->mAddress), int(size));
+    return true;
+}
+
+const QByteArray& MappedFile::data() const
+{
+    return d->mData;
+}
+
+bool MappedFile::isTruncated() const
+{
+#ifdef Q_OS_UNIX
+    if (d->mGuardIndex != -1 && sGuardedMappings[d->mGuardIndex].mTruncated.loadAcquire()) {
+        return true;
+    }
+#endif
+    // QFile::size() asks the file descriptor, so it sees truncations done by
+    // other programs
+    return d->mFile.size() < d->mData.size();
+}
+
+} // namespace
@@ -0,0 +1,77 @@
+// vim: set tabstop=4 shiftwidth=4 expandtab:
+/*
+Gwenview: an image viewer
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA.
+
+*/
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <lib/gwenviewlib_export.h>
+
+// Qt
+#include <QByteArray>
+#include <QString>
+
+// KDE
+
+// Local
+
+namespace Gwenview
+{
+
+struct MappedFilePrivate;
+
+/**
+ * A read-only mapping of a whole file.
+ *
+ * Reading pages of a mapping which are past the end of its file raises
+ * SIGBUS, which happens if another program truncates the file while it is
+ * mapped. MappedFile catches this signal for its mappings: the missing pages
+ * read as zeros instead, and isTruncated() returns true. Data read from a
+ * truncated mapping must be considered invalid.
+ */
+class GWENVIEWLIB_EXPORT MappedFile
+{
+public:
+    explicit MappedFile(const QString& path);
+    ~MappedFile();
+
+    /**
+     * Maps the file. Returns false if it could not be mapped, in which case
+     * it should be read instead.
+     */
+    bool map();
+
+    /**
+     * The content of the file. It points to the mapping, so it must not be
+     * used after the MappedFile has been deleted.
+     */
+    const QByteArray& data() const;
+
+    /**
+     * Returns true if the file shrank since it was mapped
+     */
+    bool isTruncated() const;
+
+private:
+    MappedFilePrivate* const d;
+    Q_DISABLE_COPY(MappedFile)
+};
+
+} // namespace
+
+#endif /* MAPPEDFILE_H */
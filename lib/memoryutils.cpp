@@ -25,6 +25,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 
 // Qt
 #include <QFile>
+#include <QHash>
+#include <QMutex>
 #include <QTextStream>
 #include <QTime>
 
@@ -166,6 +168,36 @@ qulonglong getFreeMemory()
 #endif
 }
 
+typedef QHash<const void*, qulonglong> CacheUsageHash;
+Q_GLOBAL_STATIC(CacheUsageHash, sCacheUsageHash)
+Q_GLOBAL_STATIC(QMutex, sCacheUsageMutex)
+
+void setCacheMemoryUsage(const void* owner, qulonglong bytes)
+{
+    if (sCacheUsageHash.isDestroyed() || sCacheUsageMutex.isDestroyed()) {
+        return;
+    }
+    QMutexLocker locker(sCacheUsageMutex());
+    if (bytes == 0) {
+        sCacheUsageHash->remove(owner);
+    } else {
+        sCacheUsageHash->insert(owner, bytes);
+    }
+}
+
+qulonglong getCacheMemoryUsage()
+{
+    if (sCacheUsageHash.isDestroyed() || sCacheUsageMutex.isDestroyed()) {
+        return 0;
+    }
+    QMutexLocker locker(sCacheUsageMutex());
+    qulonglong total = 0;
+    Q_FOREACH(qulonglong bytes, *sCacheUsageHash) {
+        total += bytes;
+    }
+    return total;
+}
+
 } // MemoryUtils namespace
 
 } // Gwenview namespace
@@ -49,6 +49,18 @@ GWENVIEWLIB_EXPORT qulonglong getTotalMemory();
  */
 GWENVIEWLIB_EXPORT qulonglong getFreeMemory();
 
+/**
+ * Caches call this function to report how much memory they currently use.
+ * owner identifies the cache, reporting 0 bytes unregisters it.
+ */
+GWENVIEWLIB_EXPORT void setCacheMemoryUsage(const void* owner, qulonglong bytes);
+
+/**
+ * Returns the amount of memory used by all the caches which reported their
+ * usage with setCacheMemoryUsage()
+ */
+GWENVIEWLIB_EXPORT qulonglong getCacheMemoryUsage();
+
 } // namespace
 
 } // namespace
@@ -54,6 +54,14 @@ AbstractSemanticInfoBackEnd::AbstractSemanticInfoBackEnd(QObject* parent)
 : QObject(parent)
 {
     qRegisterMetaType<SemanticInfo>("SemanticInfo");
+    qRegisterMetaType<SemanticInfoHash>("SemanticInfoHash");
+}
+
+void AbstractSemanticInfoBackEnd::retrieveSemanticInfoBatch(const QList<QUrl>& urls)
+{
+    Q_FOREACH(const QUrl& url, urls) {
+        retrieveSemanticInfo(url);
+    }
 }
 
 } // namespace
@@ -24,15 +24,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 #include <lib/gwenviewlib_export.h>
 
 // Qt
+#include <QHash>
+#include <QList>
 #include <QObject>
 #include <QSet>
+#include <QUrl>
 
 // KDE
 
 // Local
 
-class QUrl;
-
 namespace Gwenview
 {
 
@@ -65,6 +66,8 @@ struct SemanticInfo
     TagSet mTags;
 };
 
+typedef QHash<QUrl, SemanticInfo> SemanticInfoHash;
+
 /**
  * An abstract class, used by SemanticInfoDirModel to store and retrieve metadata.
  */
@@ -82,6 +85,17 @@ public:
 
     virtual void retrieveSemanticInfo(const QUrl&) = 0;
 
+    /**
+     * Retrieves the semantic info of many urls. Results are emitted in
+     * chunks with semanticInfoBatchRetrieved(), without any order guarantee.
+     *
+     * Back ends which can read semantic info outside of the GUI thread should
+     * reimplement this method. The default implementation calls
+     * retrieveSemanticInfo() for each url, so results may come through
+     * semanticInfoRetrieved() instead.
+     */
+    virtual void retrieveSemanticInfoBatch(const QList<QUrl>&);
+
     virtual QString labelForTag(const SemanticInfoTag&) const = 0;
 
     /**
@@ -93,6 +107,8 @@ public:
 Q_SIGNALS:
     void semanticInfoRetrieved(const QUrl&, const SemanticInfo&);
 
+    void semanticInfoBatchRetrieved(const SemanticInfoHash&);
+
     /**
      * Emitted whenever a new tag is added to allTags()
      */
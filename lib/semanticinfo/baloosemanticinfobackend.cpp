@@ -27,6 +27,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 
 // Qt
 #include <QDebug>
+#include <QMutex>
+#include <QQueue>
+#include <QThread>
 #include <QUrl>
 
 // KDE
@@ -38,19 +41,123 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 namespace Gwenview
 {
 
+/**
+ * Number of urls the retriever thread reads before handing their semantic info
+ * to the GUI thread
+ */
+static const int BATCH_SIZE = 64;
+
+static SemanticInfo readSemanticInfo(const QUrl& url)
+{
+    KFileMetaData::UserMetaData md(url.toLocalFile());
+
+    SemanticInfo si;
+    si.mRating = md.rating();
+    si.mDescription = md.userComment();
+    si.mTags = md.tags().toSet();
+    return si;
+}
+
+/**
+ * Reads the semantic info of the queued urls. Results are collected in
+ * batches, the receiver is notified through its processRetrievedSemanticInfo()
+ * slot.
+ */
+class SemanticInfoRetrieverThread : public QThread
+{
+public:
+    SemanticInfoRetrieverThread(QObject* receiver)
+    : mReceiver(receiver)
+    , mRunning(false)
+    , mNotified(false)
+    , mStopped(false)
+    {}
+
+    void queue(const QList<QUrl>& urls)
+    {
+        QMutexLocker locker(&mMutex);
+        if (mStopped) {
+            return;
+        }
+        Q_FOREACH(const QUrl& url, urls) {
+            mUrls.enqueue(url);
+        }
+        if (mRunning) {
+            return;
+        }
+        mRunning = true;
+        locker.unlock();
+        // run() may not have returned yet after processing its last url
+        wait();
+        start(QThread::LowPriority);
+    }
+
+    SemanticInfoHash takeResults()
+    {
+        QMutexLocker locker(&mMutex);
+        SemanticInfoHash results;
+        results.swap(mResults);
+        mNotified = false;
+        return results;
+    }
+
+    void stop()
+    {
+        {
+            QMutexLocker locker(&mMutex);
+            mStopped = true;
+            mUrls.clear();
+        }
+        wait();
+    }
+
+protected:
+    void run() Q_DECL_OVERRIDE
+    {
+        QMutexLocker locker(&mMutex);
+        while (!mUrls.isEmpty()) {
+            const QUrl url = mUrls.dequeue();
+            locker.unlock();
+
+            const SemanticInfo semanticInfo = readSemanticInfo(url);
+
+            locker.relock();
+            mResults.insert(url, semanticInfo);
+            if (!mNotified && !mStopped && (mResults.size() >= BATCH_SIZE || mUrls.isEmpty())) {
+                mNotified = true;
+                QMetaObject::invokeMethod(mReceiver, "processRetrievedSemanticInfo", Qt::QueuedConnection);
+            }
+        }
+        mRunning = false;
+    }
+
+private:
+    QObject* mReceiver;
+    QMutex mMutex;
+    QQueue<QUrl> mUrls;
+    SemanticInfoHash mResults;
+    bool mRunning;
+    bool mNotified;
+    bool mStopped;
+};
+
 struct BalooSemanticInfoBackend::Private
 {
     TagSet mAllTags;
+    SemanticInfoRetrieverThread* mThread;
 };
 
 BalooSemanticInfoBackend::BalooSemanticInfoBackend(QObject* parent)
 : AbstractSemanticInfoBackEnd(parent)
 , d(new BalooSemanticInfoBackend::Private)
 {
+    d->mThread = new SemanticInfoRetrieverThread(this);
 }
 
 BalooSemanticInfoBackend::~BalooSemanticInfoBackend()
 {
+    d->mThread->stop();
+    delete d->mThread;
     delete d;
 }
 
@@ -83,14 +190,20 @@ void BalooSemanticInfoBackend::storeSemanticInfo(const QUrl &url, const Semantic
 
 void BalooSemanticInfoBackend::retrieveSemanticInfo(const QUrl &url)
 {
-    KFileMetaData::UserMetaData md(url.toLocalFile());
+    emit semanticInfoRetrieved(url, readSemanticInfo(url));
+}
 
-    SemanticInfo si;
-    si.mRating = md.rating();
-    si.mDescription = md.userComment();
-    si.mTags = md.tags().toSet();
+void BalooSemanticInfoBackend::retrieveSemanticInfoBatch(const QList<QUrl>& urls)
+{
+    d->mThread->queue(urls);
+}
 
-    emit semanticInfoRetrieved(url, si);
+void BalooSemanticInfoBackend::processRetrievedSemanticInfo()
+{
+    const SemanticInfoHash results = d->mThread->takeResults();
+    if (!results.isEmpty()) {
+        emit semanticInfoBatchRetrieved(results);
+    }
 }
 
 QString BalooSemanticInfoBackend::labelForTag(const SemanticInfoTag& uriString) const
@@ -53,10 +53,18 @@ public:
 
     void retrieveSemanticInfo(const QUrl&) Q_DECL_OVERRIDE;
 
+    /**
+     * Reads semantic info in a background thread
+     */
+    void retrieveSemanticInfoBatch(const QList<QUrl>&) Q_DECL_OVERRIDE;
+
     QString labelForTag(const SemanticInfoTag&) const Q_DECL_OVERRIDE;
 
     SemanticInfoTag tagForLabel(const QString&) Q_DECL_OVERRIDE;
 
+private Q_SLOTS:
+    void processRetrievedSemanticInfo();
+
 private:
     struct Private;
     Private* const d;
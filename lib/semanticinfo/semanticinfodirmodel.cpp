@@ -25,6 +25,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 // Qt
 #include <QHash>
 #include <QDebug>
+#include <QTimer>
 
 // KDE
 
@@ -63,6 +64,33 @@ struct SemanticInfoDirModelPrivate
 {
     SemanticInfoCache mSemanticInfoCache;
     AbstractSemanticInfoBackEnd* mBackEnd;
+    /// Urls to hand to the back end with the next batch
+    QList<QUrl> mPendingUrls;
+    QTimer mRetrieveTimer;
+
+    /**
+     * Updates the cache item of url, returns its index if it changed
+     */
+    QModelIndex updateCacheItem(const QUrl& url, const SemanticInfo& semanticInfo)
+    {
+        SemanticInfoCache::iterator it = mSemanticInfoCache.find(url);
+        if (it == mSemanticInfoCache.end()) {
+            // The cache has been cleared since the info was requested
+            return QModelIndex();
+        }
+        SemanticInfoCacheItem& cacheItem = it.value();
+        if (!cacheItem.mIndex.isValid()) {
+            qWarning() << "Index for" << url << "is invalid";
+            return QModelIndex();
+        }
+        if (cacheItem.mValid) {
+            // Do not overwrite changes made while the info was being read
+            return QModelIndex();
+        }
+        cacheItem.mInfo = semanticInfo;
+        cacheItem.mValid = true;
+        return cacheItem.mIndex;
+    }
 };
 
 SemanticInfoDirModel::SemanticInfoDirModel(QObject* parent)
@@ -76,6 +104,13 @@ SemanticInfoDirModel::SemanticInfoDirModel(QObject* parent)
 #endif
 
     connect(d->mBackEnd, &AbstractSemanticInfoBackEnd::semanticInfoRetrieved, this, &SemanticInfoDirModel::slotSemanticInfoRetrieved, Qt::QueuedConnection);
+    connect(d->mBackEnd, &AbstractSemanticInfoBackEnd::semanticInfoBatchRetrieved, this, &SemanticInfoDirModel::slotSemanticInfoBatchRetrieved);
+
+    // Rows ask for their semantic info one at a time while the view is
+    // filtered or sorted, gather them before calling the back end
+    d->mRetrieveTimer.setSingleShot(true);
+    d->mRetrieveTimer.setInterval(0);
+    connect(&d->mRetrieveTimer, &QTimer::timeout, this, &SemanticInfoDirModel::retrievePendingSemanticInfo);
 
     connect(this, &SemanticInfoDirModel::modelAboutToBeReset, this, &SemanticInfoDirModel::slotModelAboutToBeReset);
 
@@ -90,6 +125,7 @@ SemanticInfoDirModel::~SemanticInfoDirModel()
 void SemanticInfoDirModel::clearSemanticInfoCache()
 {
     d->mSemanticInfoCache.clear();
+    d->mPendingUrls.clear();
 }
 
 bool SemanticInfoDirModel::semanticInfoAvailableForIndex(const QModelIndex& index) const
@@ -135,10 +171,27 @@ void SemanticInfoDirModel::retrieveSemanticInfoForIndex(const QModelIndex& index
     if (ArchiveUtils::fileItemIsDirOrArchive(item)) {
         return;
     }
+    const QUrl url = item.targetUrl();
+    if (d->mSemanticInfoCache.contains(url)) {
+        // Already retrieved or being retrieved
+        return;
+    }
     SemanticInfoCacheItem cacheItem;
     cacheItem.mIndex = QPersistentModelIndex(index);
-    d->mSemanticInfoCache[item.targetUrl()] = cacheItem;
-    d->mBackEnd->retrieveSemanticInfo(item.targetUrl());
+    d->mSemanticInfoCache[url] = cacheItem;
+    d->mPendingUrls << url;
+    if (!d->mRetrieveTimer.isActive()) {
+        d->mRetrieveTimer.start();
+    }
+}
+
+void SemanticInfoDirModel::retrievePendingSemanticInfo()
+{
+    QList<QUrl> urls;
+    urls.swap(d->mPendingUrls);
+    if (!urls.isEmpty()) {
+        d->mBackEnd->retrieveSemanticInfoBatch(urls);
+    }
 }
 
 QVariant SemanticInfoDirModel::data(const QModelIndex& index, int role) const
@@ -214,19 +267,39 @@ bool SemanticInfoDirModel::setData(const QModelIndex& index, const QVariant& dat
 
 void SemanticInfoDirModel::slotSemanticInfoRetrieved(const QUrl &url, const SemanticInfo& semanticInfo)
 {
-    SemanticInfoCache::iterator it = d->mSemanticInfoCache.find(url);
-    if (it == d->mSemanticInfoCache.end()) {
-        qWarning() << "No index for" << url;
-        return;
+    const QModelIndex index = d->updateCacheItem(url, semanticInfo);
+    if (index.isValid()) {
+        emit dataChanged(index, index);
     }
-    SemanticInfoCacheItem& cacheItem = it.value();
-    if (!cacheItem.mIndex.isValid()) {
-        qWarning() << "Index for" << url << "is invalid";
-        return;
+}
+
+void SemanticInfoDirModel::slotSemanticInfoBatchRetrieved(const SemanticInfoHash& semanticInfoHash)
+{
+    // Emit one dataChanged() per parent, covering all the updated rows, so
+    // that proxy models filter and sort them in one go
+    typedef QPair<int, int> RowRange;
+    QHash<QModelIndex, RowRange> rangeForParent;
+    SemanticInfoHash::ConstIterator it = semanticInfoHash.constBegin(), end = semanticInfoHash.constEnd();
+    for (; it != end; ++it) {
+        const QModelIndex index = d->updateCacheItem(it.key(), it.value());
+        if (!index.isValid()) {
+            continue;
+        }
+        const QModelIndex parent = index.parent();
+        QHash<QModelIndex, RowRange>::Iterator rangeIt = rangeForParent.find(parent);
+        if (rangeIt == rangeForParent.end()) {
+            rangeForParent.insert(parent, RowRange(index.row(), index.row()));
+        } else {
+            rangeIt.value().first = qMin(rangeIt.value().first, index.row());
+            rangeIt.value().second = qMax(rangeIt.value().second, index.row());
+        }
+    }
+
+    QHash<QModelIndex, RowRange>::ConstIterator rangeIt = rangeForParent.constBegin();
+    for (; rangeIt != rangeForParent.constEnd(); ++rangeIt) {
+        const QModelIndex& parent = rangeIt.key();
+        emit dataChanged(index(rangeIt.value().first, 0, parent), index(rangeIt.value().second, 0, parent));
     }
-    cacheItem.mInfo = semanticInfo;
-    cacheItem.mValid = true;
-    emit dataChanged(cacheItem.mIndex, cacheItem.mIndex);
 }
 
 void SemanticInfoDirModel::slotRowsAboutToBeRemoved(const QModelIndex& parent, int start, int end)
@@ -244,6 +317,7 @@ void SemanticInfoDirModel::slotRowsAboutToBeRemoved(const QModelIndex& parent, i
 void SemanticInfoDirModel::slotModelAboutToBeReset()
 {
     d->mSemanticInfoCache.clear();
+    d->mPendingUrls.clear();
 }
 
 AbstractSemanticInfoBackEnd* SemanticInfoDirModel::semanticInfoBackEnd() const
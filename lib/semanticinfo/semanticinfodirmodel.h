@@ -27,14 +27,13 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 #include <KDirModel>
 
 // Local
+#include <lib/semanticinfo/abstractsemanticinfobackend.h>
 
 class QUrl;
 
 namespace Gwenview
 {
 
-class AbstractSemanticInfoBackEnd;
-struct SemanticInfo;
 struct SemanticInfoDirModelPrivate;
 /**
  * Extends KDirModel by providing read/write access to image metadata such as
@@ -56,6 +55,10 @@ public:
 
     bool semanticInfoAvailableForIndex(const QModelIndex&) const;
 
+    /**
+     * Schedules the retrieval of the semantic info of index. Requests are
+     * gathered and handed to the back end in batches.
+     */
     void retrieveSemanticInfoForIndex(const QModelIndex&);
 
     SemanticInfo semanticInfoForIndex(const QModelIndex&) const;
@@ -74,6 +77,8 @@ private:
 
 private Q_SLOTS:
     void slotSemanticInfoRetrieved(const QUrl &url, const SemanticInfo&);
+    void slotSemanticInfoBatchRetrieved(const SemanticInfoHash&);
+    void retrievePendingSemanticInfo();
 
     void slotRowsAboutToBeRemoved(const QModelIndex&, int, int);
     void slotModelAboutToBeReset();
@@ -21,6 +21,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <config-gwenview.h>
 
 // Qt
+#include <QHash>
+#include <QPair>
+#include <QPersistentModelIndex>
 #include <QTimer>
 #include <QDebug>
 #include <QUrl>
@@ -69,6 +72,9 @@ struct SortedDirModelPrivate
     QStringList mBlackListedExtensions;
     QList<AbstractSortedDirModelFilter*> mFilters;
     QTimer mDelayedApplyFiltersTimer;
+    // Items whose date has been loaded since the last resort
+    QList<QPersistentModelIndex> mDateTimeChangedIndexes;
+    QTimer mDelayedDateTimesChangedTimer;
     MimeTypeUtils::Kinds mKindFilter;
 };
 
@@ -85,6 +91,14 @@ SortedDirModel::SortedDirModel(QObject* parent)
     d->mDelayedApplyFiltersTimer.setInterval(0);
     d->mDelayedApplyFiltersTimer.setSingleShot(true);
     connect(&d->mDelayedApplyFiltersTimer, &QTimer::timeout, this, &SortedDirModel::doApplyFilters);
+
+    // Dates are loaded in batches: wait a bit so that several batches are
+    // handled with a single resort
+    d->mDelayedDateTimesChangedTimer.setInterval(200);
+    d->mDelayedDateTimesChangedTimer.setSingleShot(true);
+    connect(&d->mDelayedDateTimesChangedTimer, &QTimer::timeout, this, &SortedDirModel::resortDateTimeChangedItems);
+    connect(TimeUtils::DateTimeIndex::instance(), &TimeUtils::DateTimeIndex::dateTimesLoaded,
+            this, &SortedDirModel::slotDateTimesLoaded);
 }
 
 SortedDirModel::~SortedDirModel()
@@ -257,6 +271,56 @@ void SortedDirModel::doApplyFilters()
     QSortFilterProxyModel::invalidateFilter();
 }
 
+void SortedDirModel::slotDateTimesLoaded(const QList<QUrl>& urls)
+{
+    if (sortColumn() != KDirModel::ModifiedTime && d->mFilters.isEmpty()) {
+        return;
+    }
+    Q_FOREACH(const QUrl& url, urls) {
+        const QModelIndex index = d->mSourceModel->indexForUrl(url);
+        if (index.isValid()) {
+            d->mDateTimeChangedIndexes << index;
+        }
+    }
+    // Do not restart the timer: a steady flow of batches must not postpone
+    // the resort
+    if (!d->mDateTimeChangedIndexes.isEmpty() && !d->mDelayedDateTimesChangedTimer.isActive()) {
+        d->mDelayedDateTimesChangedTimer.start();
+    }
+}
+
+void SortedDirModel::resortDateTimeChangedItems()
+{
+    // Tell that the rows changed, as SemanticInfoDirModel does for semantic
+    // info: the dynamic sort filter moves and filters only these rows, and
+    // keeps the selection and the current index, unlike invalidate()
+    typedef QPair<int, int> RowRange;
+    QHash<QModelIndex, RowRange> rangeForParent;
+    Q_FOREACH(const QPersistentModelIndex& index, d->mDateTimeChangedIndexes) {
+        if (!index.isValid()) {
+            continue;
+        }
+        const QModelIndex parent = index.parent();
+        QHash<QModelIndex, RowRange>::Iterator rangeIt = rangeForParent.find(parent);
+        if (rangeIt == rangeForParent.end()) {
+            rangeForParent.insert(parent, RowRange(index.row(), index.row()));
+        } else {
+            rangeIt.value().first = qMin(rangeIt.value().first, index.row());
+            rangeIt.value().second = qMax(rangeIt.value().second, index.row());
+        }
+    }
+    d->mDateTimeChangedIndexes.clear();
+
+    const int lastColumn = d->mSourceModel->columnCount() - 1;
+    QHash<QModelIndex, RowRange>::ConstIterator rangeIt = rangeForParent.constBegin();
+    for (; rangeIt != rangeForParent.constEnd(); ++rangeIt) {
+        const QModelIndex& parent = rangeIt.key();
+        emit d->mSourceModel->dataChanged(
+            d->mSourceModel->index(rangeIt.value().first, 0, parent),
+            d->mSourceModel->index(rangeIt.value().second, lastColumn, parent));
+    }
+}
+
 bool SortedDirModel::lessThan(const QModelIndex& left, const QModelIndex& right) const
 {
     const KFileItem leftItem = itemForSourceIndex(left);
@@ -273,8 +337,10 @@ bool SortedDirModel::lessThan(const QModelIndex& left, const QModelIndex& right)
     // a secondary criterion is needed, delegate sorting to the parent class.
     if (!leftIsDirOrArchive) {
         if (sortColumn() == KDirModel::ModifiedTime) {
-            const QDateTime leftDate = TimeUtils::dateTimeForFileItem(leftItem);
-            const QDateTime rightDate = TimeUtils::dateTimeForFileItem(rightItem);
+            // Never read files while sorting: unknown dates are loaded in
+            // the background and the model is sorted again once they arrive
+            const QDateTime leftDate = TimeUtils::dateTimeForFileItem(leftItem, TimeUtils::CacheOnly);
+            const QDateTime rightDate = TimeUtils::dateTimeForFileItem(rightItem, TimeUtils::CacheOnly);
 
             if (leftDate != rightDate) {
                 return leftDate < rightDate;
@@ -122,6 +122,8 @@ protected:
 
 private Q_SLOTS:
     void doApplyFilters();
+    void slotDateTimesLoaded(const QList<QUrl>& urls);
+    void resortDateTimeChangedItems();
 
 private:
     friend struct SortedDirModelPrivate;
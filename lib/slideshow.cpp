@@ -264,6 +264,41 @@ int SlideShow::position() const
     return 0;
 }
 
+QList<QUrl> SlideShow::upcomingUrls(int count) const
+{
+    QList<QUrl> urls;
+    if (GwenviewConfig::random()) {
+        // Urls are taken from the back of the shuffled list. Once it is
+        // empty, the next order is not known yet.
+        QVector<QUrl>::ConstIterator it = d->mShuffledUrls.constEnd();
+        while (urls.count() < count && it != d->mShuffledUrls.constBegin()) {
+            --it;
+            urls << *it;
+        }
+        return urls;
+    }
+
+    QVector<QUrl>::ConstIterator current = qFind(d->mUrls.constBegin(), d->mUrls.constEnd(), d->mCurrentUrl);
+    if (current == d->mUrls.constEnd()) {
+        return urls;
+    }
+    QVector<QUrl>::ConstIterator it = current;
+    while (urls.count() < count) {
+        ++it;
+        if (it == d->mUrls.constEnd()) {
+            if (!GwenviewConfig::loop()) {
+                break;
+            }
+            it = d->mUrls.constBegin();
+        }
+        if (it == current || (!GwenviewConfig::loop() && it == d->mStartIt)) {
+            break;
+        }
+        urls << *it;
+    }
+    return urls;
+}
+
 void SlideShow::pause()
 {
     LOG("Stopping timer");
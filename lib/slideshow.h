@@ -60,6 +60,13 @@ public:
      */
     int position() const;
 
+    /**
+     * @return the next @p count urls the slideshow will show, in order. May
+     * return less urls if the slideshow stops before or if they are not known
+     * yet.
+     */
+    QList<QUrl> upcomingUrls(int count) const;
+
 public Q_SLOTS:
     void setInterval(int);
     void setCurrentUrl(const QUrl &url);
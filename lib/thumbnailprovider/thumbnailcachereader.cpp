@@ -0,0 +1,297 @@
+// vim: set tabstop=4 shiftwidth=4 expandtab:
+/*
+Gwenview: an image viewer
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA.
+
+*/
+// Self
+#include "thumbnailcachereader.h"
+
+// Local
+#include <lib/thumbnailgroup.h>
+
+// KDE
+
+// Qt
+#include <QDateTime>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QThreadPool>
+#include <QtConcurrentRun>
+#include <QtEndian>
+
+namespace Gwenview
+{
+
+#undef ENABLE_LOG
+#undef LOG
+//#define ENABLE_LOG
+#ifdef ENABLE_LOG
+#define LOG(x) qDebug() << x
+#else
+#define LOG(x) ;
+#endif
+
+static const int BATCH_SIZE = 64;
+
+/**
+ * Lookups get their own pool, like thumbnail generation: they must not wait
+ * for, nor delay, the jobs running in the global pool.
+ */
+Q_GLOBAL_STATIC(QThreadPool, sCacheLookupThreadPool)
+
+// Text chunks bigger than this are not written by thumbnailers, skip them
+static const quint32 MAX_TEXT_CHUNK_SIZE = 64 * 1024;
+
+static const char PNG_SIGNATURE[] = "\x89PNG\r\n\x1a\n";
+static const int PNG_SIGNATURE_SIZE = 8;
+
+static bool inflateText(const QByteArray& compressed, QByteArray* text)
+{
+    // qUncompress() wants the expected size first. It grows its buffer if
+    // the guess is too small.
+    QByteArray data(4, '\0');
+    qToBigEndian<quint32>(quint32(compressed.size()) * 4, reinterpret_cast<uchar*>(data.data()));
+    data += compressed;
+    *text = qUncompress(data);
+    return !text->isEmpty();
+}
+
+static void parseTextChunk(const QByteArray& type, const QByteArray& data, QHash<QString, QString>* texts)
+{
+    const int keyEnd = data.indexOf('\0');
+    if (keyEnd <= 0) {
+        return;
+    }
+    const QString key = QString::fromLatin1(data.constData(), keyEnd);
+
+    if (type == "tEXt") {
+        texts->insert(key, QString::fromLatin1(data.mid(keyEnd + 1)));
+    } else if (type == "zTXt") {
+        // Compression method, then the zlib stream
+        QByteArray text;
+        if (inflateText(data.mid(keyEnd + 2), &text)) {
+            texts->insert(key, QString::fromLatin1(text));
+        }
+    } else {
+        // iTXt: compression flag, compression method, language tag,
+        // translated keyword, then the UTF-8 text
+        const int flagPos = keyEnd + 1;
+        if (flagPos + 2 > data.size()) {
+            return;
+        }
+        const bool compressed = data.at(flagPos) != 0;
+        const int languageEnd = data.indexOf('\0', flagPos + 2);
+        if (languageEnd < 0) {
+            return;
+        }
+        const int translatedKeyEnd = data.indexOf('\0', languageEnd + 1);
+        if (translatedKeyEnd < 0) {
+            return;
+        }
+        QByteArray text = data.mid(translatedKeyEnd + 1);
+        if (compressed && !inflateText(text, &text)) {
+            return;
+        }
+        texts->insert(key, QString::fromUtf8(text));
+    }
+}
+
+bool ThumbnailCacheReader::readPngTexts(QIODevice* device, QHash<QString, QString>* texts)
+{
+    if (device->read(PNG_SIGNATURE_SIZE) != QByteArray(PNG_SIGNATURE, PNG_SIGNATURE_SIZE)) {
+        return false;
+    }
+    // Text chunks can come before and after the image data: go through all
+    // the chunks, skipping the others
+    while (true) {
+        const QByteArray header = device->read(8);
+        if (header.size() != 8) {
+            // Truncated file, keep what we found
+            return true;
+        }
+        const quint32 length = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(header.constData()));
+        const QByteArray type = header.mid(4);
+        if (type == "IEND") {
+            return true;
+        }
+
+        if ((type == "tEXt" || type == "zTXt" || type == "iTXt") && length <= MAX_TEXT_CHUNK_SIZE) {
+            const QByteArray data = device->read(length);
+            if (data.size() != int(length)) {
+                return true;
+            }
+            parseTextChunk(type, data, texts);
+            // Skip the CRC
+            if (!device->seek(device->pos() + 4)) {
+                return true;
+            }
+        } else {
+            if (!device->seek(device->pos() + qint64(length) + 4)) {
+                return true;
+            }
+        }
+    }
+}
+
+static bool isValidThumbnail(const QHash<QString, QString>& texts, const ThumbnailCacheLookup& lookup)
+{
+    const KIO::filesize_t fileSize = texts.value("Thumb::Size").toULongLong();
+    return texts.value("Thumb::URI") == lookup.mOriginalUri
+        && texts.value("Thumb::MTime").toInt() == lookup.mOriginalTime
+        && (fileSize == 0 || fileSize == lookup.mOriginalFileSize);
+}
+
+/**
+ * Returns the thumbnail stored at path if it is valid for lookup, a null
+ * image otherwise. exists is set to false if there is no file at path.
+ */
+static QImage loadValidThumbnail(const QString& path, const ThumbnailCacheLookup& lookup, QHash<QString, QString>* texts, bool* exists)
+{
+    QFile file(path);
+    *exists = file.open(QIODevice::ReadOnly);
+    if (!*exists) {
+        return QImage();
+    }
+    if (!ThumbnailCacheReader::readPngTexts(&file, texts) || !isValidThumbnail(*texts, lookup)) {
+        LOG("Invalid thumbnail" << path);
+        return QImage();
+    }
+    QImage image;
+    if (!file.seek(0) || !image.load(&file, "png")) {
+        qWarning() << "Could not decode thumbnail" << path;
+    }
+    return image;
+}
+
+static void lookupThumbnail(ThumbnailCacheLookup* lookup)
+{
+    lookup->mNeedCaching = false;
+    lookup->mFromPack = false;
+    const QFileInfo info(lookup->mItem.url().toLocalFile());
+    lookup->mOriginalTime = info.lastModified().toTime_t();
+
+    if (lookup->mPack) {
+        QSize originalSize;
+        const QImage image = lookup->mPack->find(info.fileName(), lookup->mOriginalTime, lookup->mOriginalFileSize, &originalSize);
+        if (!image.isNull()) {
+            lookup->mImage = image;
+            lookup->mOriginalSize = originalSize;
+            lookup->mFromPack = true;
+            return;
+        }
+    }
+
+    QHash<QString, QString> texts;
+    QImage image;
+    if (!lookup->mPendingImage.isNull()) {
+        Q_FOREACH(const QString& key, lookup->mPendingImage.textKeys()) {
+            texts.insert(key, lookup->mPendingImage.text(key));
+        }
+        if (isValidThumbnail(texts, *lookup)) {
+            image = lookup->mPendingImage;
+        }
+        lookup->mPendingImage = QImage();
+    } else {
+        bool exists;
+        image = loadValidThumbnail(lookup->mThumbnailPath, *lookup, &texts, &exists);
+        if (!exists && !lookup->mLargeThumbnailPath.isEmpty()) {
+            // If there is a large-sized thumbnail, generate the normal-sized
+            // version from it
+            texts.clear();
+            const QImage largeImage = loadValidThumbnail(lookup->mLargeThumbnailPath, *lookup, &texts, &exists);
+            if (!largeImage.isNull()) {
+                const int size = ThumbnailGroup::pixelSize(ThumbnailGroup::Normal);
+                image = largeImage.scaled(size, size, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+                Q_FOREACH(const QString& key, largeImage.textKeys()) {
+                    image.setText(key, largeImage.text(key));
+                }
+                lookup->mNeedCaching = true;
+            }
+        }
+    }
+    if (image.isNull()) {
+        return;
+    }
+
+    bool ok;
+    const int width = texts.value("Thumb::Image::Width").toInt(&ok);
+    const int height = ok ? texts.value("Thumb::Image::Height").toInt(&ok) : 0;
+    if (ok) {
+        lookup->mOriginalSize = QSize(width, height);
+    } else {
+        LOG("Thumbnail for" << lookup->mOriginalUri << "does not contain correct image size information");
+    }
+    lookup->mImage = image;
+    if (!lookup->mPackPath.isEmpty()) {
+        // Compress it here rather than in the GUI thread
+        lookup->mPackEntry = ThumbnailPack::createEntry(info.fileName(), lookup->mOriginalTime, lookup->mOriginalFileSize, lookup->mOriginalSize, image);
+    }
+}
+
+static ThumbnailCacheLookupList lookupThumbnails(ThumbnailCacheLookupList lookups)
+{
+    ThumbnailCacheLookupList::Iterator it = lookups.begin(), end = lookups.end();
+    for (; it != end; ++it) {
+        lookupThumbnail(&*it);
+    }
+    return lookups;
+}
+
+ThumbnailCacheReader::ThumbnailCacheReader(QObject* parent)
+: QObject(parent)
+, mRunningCount(0)
+{}
+
+ThumbnailCacheReader::~ThumbnailCacheReader()
+{
+    // Running batches cannot be interrupted. Their watchers are deleted with
+    // us, so their results are dropped.
+}
+
+int ThumbnailCacheReader::batchSize()
+{
+    return BATCH_SIZE;
+}
+
+void ThumbnailCacheReader::lookup(const ThumbnailCacheLookupList& lookups)
+{
+    Watcher* watcher = new Watcher(this);
+    connect(watcher, SIGNAL(finished()), SLOT(slotBatchFinished()));
+    ++mRunningCount;
+    watcher->setFuture(QtConcurrent::run(sCacheLookupThreadPool(), lookupThumbnails, lookups));
+}
+
+bool ThumbnailCacheReader::isFull() const
+{
+    return mRunningCount >= sCacheLookupThreadPool->maxThreadCount();
+}
+
+bool ThumbnailCacheReader::isIdle() const
+{
+    return mRunningCount == 0;
+}
+
+void ThumbnailCacheReader::slotBatchFinished()
+{
+    Watcher* watcher = static_cast<Watcher*>(sender());
+    watcher->deleteLater();
+    --mRunningCount;
+    emit done(watcher->result());
+}
+
+} // namespace
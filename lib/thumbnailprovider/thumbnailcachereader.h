@@ -0,0 +1,125 @@
+// vim: set tabstop=4 shiftwidth=4 expandtab:
+/*
+Gwenview: an image viewer
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA.
+
+*/
+#ifndef THUMBNAILCACHEREADER_H
+#define THUMBNAILCACHEREADER_H
+
+// Local
+#include <lib/thumbnailprovider/thumbnailpack.h>
+
+// KDE
+#include <KFileItem>
+
+// Qt
+#include <QFutureWatcher>
+#include <QHash>
+#include <QImage>
+#include <QList>
+#include <QObject>
+
+class QIODevice;
+
+namespace Gwenview
+{
+
+/**
+ * Describes a local item whose thumbnail must be looked up in the cache, and
+ * holds the result of the lookup
+ */
+struct ThumbnailCacheLookup {
+    KFileItem mItem;
+    QString mOriginalUri;
+    KIO::filesize_t mOriginalFileSize;
+    QString mThumbnailPath;
+    /// Large thumbnail to scale down if there is no thumbnail at
+    /// mThumbnailPath, empty if the wanted thumbnail is a large one
+    QString mLargeThumbnailPath;
+    /// Thumbnail for mThumbnailPath which has not been written to disk yet
+    QImage mPendingImage;
+    /// Path of the pack of the directory of the item, empty if packs are
+    /// not used
+    QString mPackPath;
+    /// The pack at mPackPath, looked up before mThumbnailPath. Can be null.
+    ThumbnailPack::Ptr mPack;
+
+    /// Set by the lookup
+    time_t mOriginalTime;
+    /// Null if there is no valid thumbnail in the cache
+    QImage mImage;
+    /// Invalid if the thumbnail does not say
+    QSize mOriginalSize;
+    /// True if mImage comes from the large thumbnail and should be written
+    /// to mThumbnailPath
+    bool mNeedCaching;
+    /// True if mImage comes from mPack
+    bool mFromPack;
+    /// mImage, ready to be added to the pack at mPackPath. Empty if the
+    /// thumbnail is already in the pack.
+    ThumbnailPackEntry mPackEntry;
+};
+
+typedef QList<ThumbnailCacheLookup> ThumbnailCacheLookupList;
+
+/**
+ * Looks up thumbnails in the cache, in batches, on worker threads.
+ *
+ * Thumbnails are validated by reading their PNG text chunks only: the image
+ * is decoded only if it is valid.
+ */
+class ThumbnailCacheReader : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ThumbnailCacheReader(QObject* parent = nullptr);
+    ~ThumbnailCacheReader() Q_DECL_OVERRIDE;
+
+    /**
+     * Maximum number of items in a batch passed to lookup()
+     */
+    static int batchSize();
+
+    void lookup(const ThumbnailCacheLookupList& lookups);
+
+    /**
+     * Returns true if enough batches are running to keep all threads busy
+     */
+    bool isFull() const;
+
+    bool isIdle() const;
+
+    /**
+     * Reads the text chunks of the PNG image in @p device, without decoding
+     * the image. Returns false if the device does not contain a PNG image.
+     */
+    static bool readPngTexts(QIODevice* device, QHash<QString, QString>* texts);
+
+Q_SIGNALS:
+    void done(const ThumbnailCacheLookupList&);
+
+private Q_SLOTS:
+    void slotBatchFinished();
+
+private:
+    typedef QFutureWatcher<ThumbnailCacheLookupList> Watcher;
+    int mRunningCount;
+};
+
+} // namespace
+
+#endif /* THUMBNAILCACHEREADER_H */
@@ -37,6 +37,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 #include <QImageReader>
 #include <QMatrix>
 #include <QBuffer>
+#include <QFile>
+#include <QThreadPool>
+#include <QtConcurrent>
 
 namespace Gwenview
 {
@@ -192,131 +195,118 @@ bool ThumbnailContext::load(const QString &pixPath, int pixelSize)
 // ThumbnailGenerator
 //
 //------------------------------------------------------------------------
-ThumbnailGenerator::ThumbnailGenerator()
-: mCancel(false)
-{}
+/**
+ * Thumbnails get their own pool: generating them must not wait for, nor
+ * delay, the jobs running in the global pool.
+ */
+Q_GLOBAL_STATIC(QThreadPool, sThumbnailThreadPool)
 
-void ThumbnailGenerator::load(
-    const QString& originalUri, time_t originalTime, KIO::filesize_t originalFileSize, const QString& originalMimeType,
-    const QString& pixPath,
-    const QString& thumbnailPath,
-    ThumbnailGroup::Enum group)
+static ThumbnailResult generateThumbnail(const ThumbnailTask& task)
 {
-    QMutexLocker lock(&mMutex);
-    Q_ASSERT(mPixPath.isNull());
-
-    mOriginalUri = originalUri;
-    mOriginalTime = originalTime;
-    mOriginalFileSize = originalFileSize;
-    mOriginalMimeType = originalMimeType;
-    mPixPath = pixPath;
-    mThumbnailPath = thumbnailPath;
-    mThumbnailGroup = group;
-    if (!isRunning()) start();
-    mCond.wakeOne();
+    LOG("Loading" << task.mPixPath);
+    ThumbnailResult result;
+    result.mTask = task;
+    result.mNeedCaching = false;
+
+    ThumbnailContext context;
+    if (context.load(task.mPixPath, ThumbnailGroup::pixelSize(task.mThumbnailGroup))) {
+        result.mImage = context.mImage;
+        result.mOriginalSize = QSize(context.mOriginalWidth, context.mOriginalHeight);
+        result.mNeedCaching = context.mNeedCaching;
+        if (context.mNeedCaching) {
+            QImage& image = result.mImage;
+            image.setText("Thumb::URI"          , task.mOriginalUri);
+            image.setText("Thumb::MTime"        , QString::number(task.mOriginalTime));
+            image.setText("Thumb::Size"         , QString::number(task.mOriginalFileSize));
+            image.setText("Thumb::Mimetype"     , task.mOriginalMimeType);
+            image.setText("Thumb::Image::Width" , QString::number(context.mOriginalWidth));
+            image.setText("Thumb::Image::Height", QString::number(context.mOriginalHeight));
+            image.setText("Software"            , QStringLiteral("Gwenview"));
+        }
+        // Like the thumbnail cache, packs do not store thumbnails which are
+        // cheaper to create than to load
+        if (context.mNeedCaching && !task.mPackPath.isEmpty()) {
+            result.mPackEntry = ThumbnailPack::createEntry(task.mItem.url().fileName(), task.mOriginalTime, task.mOriginalFileSize, result.mOriginalSize, result.mImage);
+        }
+    } else {
+        qWarning() << "Could not generate thumbnail for file" << task.mOriginalUri;
+    }
+
+    if (task.mRemovePixPath) {
+        LOG("Delete temp file" << task.mPixPath);
+        QFile::remove(task.mPixPath);
+    }
+    return result;
 }
 
-QString ThumbnailGenerator::originalUri() const
+ThumbnailGenerator::ThumbnailGenerator(QObject* parent)
+: QObject(parent)
+, mRunningCount(0)
+{}
+
+ThumbnailGenerator::~ThumbnailGenerator()
 {
-    return mOriginalUri;
+    // Running tasks cannot be interrupted. Their watchers are deleted with us,
+    // so their results are dropped.
 }
 
-time_t ThumbnailGenerator::originalTime() const
+void ThumbnailGenerator::load(const ThumbnailTask& task)
 {
-    return mOriginalTime;
+    Watcher* watcher = new Watcher(this);
+    connect(watcher, SIGNAL(finished()), SLOT(slotTaskFinished()));
+    RunningTask runningTask;
+    runningTask.mWatcher = watcher;
+    runningTask.mOriginalTime = task.mOriginalTime;
+    mTaskForUrl.insert(task.mItem.url(), runningTask);
+    ++mRunningCount;
+    watcher->setFuture(QtConcurrent::run(sThumbnailThreadPool(), generateThumbnail, task));
 }
 
-KIO::filesize_t ThumbnailGenerator::originalFileSize() const
+void ThumbnailGenerator::cancel(const QUrl& url)
 {
-    return mOriginalFileSize;
+    mTaskForUrl.remove(url);
 }
 
-QString ThumbnailGenerator::originalMimeType() const
+bool ThumbnailGenerator::isLoading(const KFileItem& item, time_t originalTime) const
 {
-    return mOriginalMimeType;
+    QHash<QUrl, RunningTask>::ConstIterator it = mTaskForUrl.constFind(item.url());
+    return it != mTaskForUrl.constEnd() && it.value().mOriginalTime == originalTime;
 }
 
-bool ThumbnailGenerator::testCancel()
+bool ThumbnailGenerator::isFull() const
 {
-    QMutexLocker lock(&mMutex);
-    return mCancel;
+    return mRunningCount >= sThumbnailThreadPool->maxThreadCount();
 }
 
-void ThumbnailGenerator::cancel()
+bool ThumbnailGenerator::isIdle() const
 {
-    QMutexLocker lock(&mMutex);
-    mCancel = true;
-    mCond.wakeOne();
+    return mRunningCount == 0;
 }
 
-void ThumbnailGenerator::run()
+void ThumbnailGenerator::slotTaskFinished()
 {
-    LOG("");
-    while (!testCancel()) {
-        QString pixPath;
-        int pixelSize;
-        {
-            QMutexLocker lock(&mMutex);
-            // empty mPixPath means nothing to do
-            LOG("Waiting for mPixPath");
-            if (mPixPath.isNull()) {
-                LOG("mPixPath.isNull");
-                mCond.wait(&mMutex);
-            }
-        }
-        if (testCancel()) {
-            return;
-        }
-        {
-            QMutexLocker lock(&mMutex);
-            pixPath = mPixPath;
-            pixelSize = ThumbnailGroup::pixelSize(mThumbnailGroup);
-        }
-
-        Q_ASSERT(!pixPath.isNull());
-        LOG("Loading" << pixPath);
-        ThumbnailContext context;
-        bool ok = context.load(pixPath, pixelSize);
-
-        {
-            QMutexLocker lock(&mMutex);
-            if (ok) {
-                mImage = context.mImage;
-                mOriginalWidth = context.mOriginalWidth;
-                mOriginalHeight = context.mOriginalHeight;
-                if (context.mNeedCaching) {
-                    cacheThumbnail();
-                }
-            } else {
-                qWarning() << "Could not generate thumbnail for file" << mOriginalUri;
-            }
-            mPixPath.clear(); // done, ready for next
-        }
-        if (testCancel()) {
-            return;
-        }
-        {
-            QSize size(mOriginalWidth, mOriginalHeight);
-            LOG("emitting done signal, size=" << size);
-            QMutexLocker lock(&mMutex);
-            done(mImage, size);
-            LOG("Done");
-        }
+    Watcher* watcher = static_cast<Watcher*>(sender());
+    watcher->deleteLater();
+    --mRunningCount;
+
+    const ThumbnailResult result = watcher->result();
+    const QUrl url = result.mTask.mItem.url();
+    if (result.mNeedCaching) {
+        emit thumbnailReadyToBeCached(result.mTask.mThumbnailPath, result.mImage);
+    }
+    if (!result.mPackEntry.mData.isEmpty()) {
+        emit thumbnailReadyToBePacked(result.mTask.mItem, result.mTask.mPackPath, result.mPackEntry);
     }
-    LOG("Ending thread");
-}
 
-void ThumbnailGenerator::cacheThumbnail()
-{
-    mImage.setText("Thumb::URI"          , mOriginalUri);
-    mImage.setText("Thumb::MTime"        , QString::number(mOriginalTime));
-    mImage.setText("Thumb::Size"         , QString::number(mOriginalFileSize));
-    mImage.setText("Thumb::Mimetype"     , mOriginalMimeType);
-    mImage.setText("Thumb::Image::Width" , QString::number(mOriginalWidth));
-    mImage.setText("Thumb::Image::Height", QString::number(mOriginalHeight));
-    mImage.setText("Software"            , QStringLiteral("Gwenview"));
-
-    emit thumbnailReadyToBeCached(mThumbnailPath, mImage);
+    QHash<QUrl, RunningTask>::Iterator it = mTaskForUrl.find(url);
+    if (it == mTaskForUrl.end() || it.value().mWatcher != watcher) {
+        LOG("Task for" << url << "has been cancelled");
+        emit workerAvailable();
+        return;
+    }
+    mTaskForUrl.erase(it);
+    LOG("emitting done signal, size=" << result.mOriginalSize);
+    emit done(result.mTask.mItem, result.mImage, result.mOriginalSize);
 }
 
 } // namespace
@@ -23,15 +23,17 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 
 // Local
 #include <lib/thumbnailgroup.h>
+#include <lib/thumbnailprovider/thumbnailpack.h>
 
 // KDE
 #include <KFileItem>
 
 // Qt
+#include <QFutureWatcher>
+#include <QHash>
 #include <QImage>
-#include <QMutex>
-#include <QThread>
-#include <QWaitCondition>
+#include <QObject>
+#include <QUrl>
 
 namespace Gwenview
 {
@@ -45,50 +47,94 @@ struct ThumbnailContext {
     bool load(const QString &pixPath, int pixelSize);
 };
 
-class ThumbnailGenerator : public QThread
+/**
+ * Describes a thumbnail to generate
+ */
+struct ThumbnailTask {
+    KFileItem mItem;
+    QString mOriginalUri;
+    time_t mOriginalTime;
+    KIO::filesize_t mOriginalFileSize;
+    QString mOriginalMimeType;
+    /// The file to generate the thumbnail from
+    QString mPixPath;
+    /// Set to true if mPixPath is a temporary file to remove once done
+    bool mRemovePixPath;
+    QString mThumbnailPath;
+    ThumbnailGroup::Enum mThumbnailGroup;
+    /// Pack to add the thumbnail to, empty if none
+    QString mPackPath;
+};
+
+struct ThumbnailResult {
+    ThumbnailTask mTask;
+    /// Null if the thumbnail could not be generated
+    QImage mImage;
+    QSize mOriginalSize;
+    bool mNeedCaching;
+    /// Set if mImage must be added to the pack at mTask.mPackPath
+    ThumbnailPackEntry mPackEntry;
+};
+
+/**
+ * Generates thumbnails in a pool of worker threads, sized to the number of
+ * cores.
+ *
+ * Tasks are started as soon as they are passed to load(): callers keep their
+ * own queue, sorted by priority, and hand over the next task when isFull()
+ * returns false. This way the priority of waiting items can change until
+ * the very last moment.
+ */
+class ThumbnailGenerator : public QObject
 {
     Q_OBJECT
 public:
-    ThumbnailGenerator();
-
-    void load(
-        const QString& originalUri,
-        time_t originalTime,
-        KIO::filesize_t originalFileSize,
-        const QString& originalMimeType,
-        const QString& pixPath,
-        const QString& thumbnailPath,
-        ThumbnailGroup::Enum group);
-
-    void cancel();
-
-    QString originalUri() const;
-    time_t originalTime() const;
-    KIO::filesize_t originalFileSize() const;
-    QString originalMimeType() const;
-protected:
-    void run() Q_DECL_OVERRIDE;
+    explicit ThumbnailGenerator(QObject* parent = nullptr);
+    ~ThumbnailGenerator() Q_DECL_OVERRIDE;
+
+    void load(const ThumbnailTask& task);
+
+    /**
+     * Do not emit done() for the thumbnail of this url. It is still
+     * generated and cached.
+     */
+    void cancel(const QUrl& url);
+
+    /**
+     * Returns true if the thumbnail for this version of the item is being
+     * generated
+     */
+    bool isLoading(const KFileItem& item, time_t originalTime) const;
+
+    /**
+     * Returns true if all workers are busy
+     */
+    bool isFull() const;
+
+    bool isIdle() const;
 
 Q_SIGNALS:
-    void done(const QImage&, const QSize&);
+    void done(const KFileItem&, const QImage&, const QSize&);
     void thumbnailReadyToBeCached(const QString& thumbnailPath, const QImage&);
+    void thumbnailReadyToBePacked(const KFileItem&, const QString& packPath, const ThumbnailPackEntry&);
+    /**
+     * Emitted when a cancelled task is done: its worker is available again
+     * but there is no done() signal to tell
+     */
+    void workerAvailable();
+
+private Q_SLOTS:
+    void slotTaskFinished();
 
 private:
-    bool testCancel();
-    void cacheThumbnail();
-    QImage mImage;
-    QString mPixPath;
-    QString mThumbnailPath;
-    QString mOriginalUri;
-    time_t mOriginalTime;
-    KIO::filesize_t mOriginalFileSize;
-    QString mOriginalMimeType;
-    int mOriginalWidth;
-    int mOriginalHeight;
-    QMutex mMutex;
-    QWaitCondition mCond;
-    ThumbnailGroup::Enum mThumbnailGroup;
-    bool mCancel;
+    typedef QFutureWatcher<ThumbnailResult> Watcher;
+    struct RunningTask {
+        Watcher* mWatcher;
+        time_t mOriginalTime;
+    };
+    /// Running tasks which are still expected to emit done()
+    QHash<QUrl, RunningTask> mTaskForUrl;
+    int mRunningCount;
 };
 
 } // namespace
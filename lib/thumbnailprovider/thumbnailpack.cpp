@@ -0,0 +1,379 @@
+// vim: set tabstop=4 shiftwidth=4 expandtab:
+/*
+Gwenview: an image viewer
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA.
+
+*/
+// Self
+#include "thumbnailpack.h"
+
+// Local
+#include <lib/thumbnailprovider/thumbnailprovider.h>
+
+// KDE
+
+// Qt
+#include <QCryptographicHash>
+#include <QCache>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QSet>
+#include <QThreadPool>
+#include <QtConcurrentRun>
+#include <QtEndian>
+
+namespace Gwenview
+{
+
+#undef ENABLE_LOG
+#undef LOG
+//#define ENABLE_LOG
+#ifdef ENABLE_LOG
+#define LOG(x) qDebug() << x
+#else
+#define LOG(x) ;
+#endif
+
+/*
+ * Pack layout, all numbers are little endian:
+ *
+ * Header:
+ *   0 char[4] magic
+ *   4 u32     version
+ *   8 u32     entry count
+ *  12 u32     reserved
+ *
+ * Entry table, one record per entry:
+ *   0 u32     offset of the file name (UTF-8)
+ *   4 u32     size of the file name
+ *   8 i64     modification time of the original
+ *  16 u64     size of the original
+ *  24 i32     width of the original, -1 if unknown
+ *  28 i32     height of the original, -1 if unknown
+ *  32 u16     width of the thumbnail
+ *  34 u16     height of the thumbnail
+ *  36 u32     QImage::Format of the thumbnail
+ *  40 u64     offset of the pixels
+ *  48 u32     size of the pixels
+ *  52 u32     reserved
+ *
+ * Then the file names and the pixels, compressed with qCompress(). Pixels
+ * are stored as 32 bit RGB32 or ARGB32_Premultiplied lines, without padding,
+ * so that they can be used without conversion.
+ */
+static const char MAGIC[] = "GVTP";
+static const quint32 VERSION = 1;
+static const int HEADER_SIZE = 16;
+static const int RECORD_SIZE = 56;
+
+// Thumbnails are small, favor speed over size
+static const int COMPRESSION_LEVEL = 1;
+
+// Packs of the directories which have been listed recently. Each of them
+// keeps a mapping and its index in memory.
+static const int MAX_CACHED_PACKS = 16;
+
+typedef QCache<QString, ThumbnailPack::Ptr> PackCache;
+Q_GLOBAL_STATIC_WITH_ARGS(PackCache, sPacks, (MAX_CACHED_PACKS))
+
+/**
+ * Packs are written on a single thread of their own: writes to the same pack
+ * are serialized, and they do not occupy the global pool.
+ */
+class PackWriterPool : public QThreadPool
+{
+public:
+    PackWriterPool()
+    {
+        setMaxThreadCount(1);
+    }
+};
+Q_GLOBAL_STATIC(PackWriterPool, sPackWriterPool)
+
+template <typename T>
+static T readNumber(const uchar* ptr)
+{
+    return qFromLittleEndian<T>(ptr);
+}
+
+template <typename T>
+static void writeNumber(QByteArray* array, int pos, T value)
+{
+    qToLittleEndian<T>(value, reinterpret_cast<uchar*>(array->data()) + pos);
+}
+
+ThumbnailPack::ThumbnailPack()
+: mData(nullptr)
+, mSize(0)
+{}
+
+ThumbnailPack::~ThumbnailPack()
+{
+    if (mData) {
+        mFile.unmap(const_cast<uchar*>(mData));
+    }
+}
+
+QString ThumbnailPack::packPath(const QUrl& dirUrl, ThumbnailGroup::Enum group)
+{
+    const QUrl url = dirUrl.adjusted(QUrl::RemovePassword | QUrl::StripTrailingSlash | QUrl::NormalizePathSegments);
+    QCryptographicHash md5(QCryptographicHash::Md5);
+    md5.addData(QFile::encodeName(url.url()));
+    return ThumbnailProvider::thumbnailBaseDir() + QStringLiteral("gwenview-packs/")
+        + QString::fromLatin1(md5.result().toHex())
+        + (group == ThumbnailGroup::Large ? QStringLiteral("-large.pack") : QStringLiteral("-normal.pack"));
+}
+
+ThumbnailPack::Ptr ThumbnailPack::get(const QString& path)
+{
+    if (const Ptr* cached = sPacks->object(path)) {
+        return *cached;
+    }
+    Ptr ptr;
+    if (QFile::exists(path)) {
+        ThumbnailPack* pack = new ThumbnailPack;
+        if (pack->load(path)) {
+            LOG("Loaded" << path << "with" << pack->mIndex.size() << "entries");
+            ptr = Ptr(pack);
+        } else {
+            qWarning() << "Invalid thumbnail pack" << path;
+            delete pack;
+        }
+    }
+    // Remember missing packs too, so that we do not look for them for each
+    // batch of thumbnails
+    sPacks->insert(path, new Ptr(ptr));
+    return ptr;
+}
+
+void ThumbnailPack::forget(const QString& path)
+{
+    sPacks->remove(path);
+}
+
+bool ThumbnailPack::load(const QString& path)
+{
+    mFile.setFileName(path);
+    if (!mFile.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    mSize = mFile.size();
+    if (mSize < HEADER_SIZE) {
+        return false;
+    }
+    mData = mFile.map(0, mSize);
+    // The mapping stays valid after the file is closed
+    mFile.close();
+    if (!mData) {
+        return false;
+    }
+    if (memcmp(mData, MAGIC, 4) != 0 || readNumber<quint32>(mData + 4) != VERSION) {
+        return false;
+    }
+    const quint32 count = readNumber<quint32>(mData + 8);
+    if (HEADER_SIZE + qint64(count) * RECORD_SIZE > mSize) {
+        return false;
+    }
+    mIndex.reserve(count);
+    for (quint32 index = 0; index < count; ++index) {
+        const uchar* ptr = record(index);
+        const quint32 nameOffset = readNumber<quint32>(ptr);
+        const quint32 nameSize = readNumber<quint32>(ptr + 4);
+        const quint64 dataOffset = readNumber<quint64>(ptr + 40);
+        const quint32 dataSize = readNumber<quint32>(ptr + 48);
+        if (qint64(nameOffset) + nameSize > mSize || dataOffset + dataSize > quint64(mSize)) {
+            return false;
+        }
+        const QString name = QString::fromUtf8(reinterpret_cast<const char*>(mData + nameOffset), nameSize);
+        mIndex.insert(name, index);
+    }
+    return true;
+}
+
+const uchar* ThumbnailPack::record(int index) const
+{
+    return mData + HEADER_SIZE + index * RECORD_SIZE;
+}
+
+QImage ThumbnailPack::find(const QString& name, time_t originalTime, quint64 originalFileSize, QSize* originalSize) const
+{
+    const int index = mIndex.value(name, -1);
+    if (index == -1) {
+        return QImage();
+    }
+    const uchar* ptr = record(index);
+    if (readNumber<qint64>(ptr + 8) != qint64(originalTime)
+        || readNumber<quint64>(ptr + 16) != originalFileSize) {
+        LOG(name << "has changed since its thumbnail was packed");
+        return QImage();
+    }
+    const int width = readNumber<quint16>(ptr + 32);
+    const int height = readNumber<quint16>(ptr + 34);
+    const QImage::Format format = QImage::Format(readNumber<quint32>(ptr + 36));
+    const quint64 dataOffset = readNumber<quint64>(ptr + 40);
+    const quint32 dataSize = readNumber<quint32>(ptr + 48);
+
+    if (format != QImage::Format_RGB32 && format != QImage::Format_ARGB32_Premultiplied) {
+        qWarning() << "Unexpected thumbnail format for" << name << "in" << mFile.fileName();
+        return QImage();
+    }
+    const QByteArray pixels = qUncompress(mData + dataOffset, dataSize);
+    if (pixels.size() != width * height * 4) {
+        qWarning() << "Corrupted thumbnail for" << name << "in" << mFile.fileName();
+        return QImage();
+    }
+    QImage image(width, height, format);
+    for (int y = 0; y < height; ++y) {
+        memcpy(image.scanLine(y), pixels.constData() + y * width * 4, width * 4);
+    }
+    *originalSize = QSize(readNumber<qint32>(ptr + 24), readNumber<qint32>(ptr + 28));
+    return image;
+}
+
+ThumbnailPackEntry ThumbnailPack::createEntry(const QString& name, time_t originalTime, quint64 originalFileSize, const QSize& originalSize, const QImage& image_)
+{
+    ThumbnailPackEntry entry;
+    entry.mName = name;
+    entry.mOriginalTime = originalTime;
+    entry.mOriginalFileSize = originalFileSize;
+    entry.mOriginalSize = originalSize;
+    entry.mFormat = QImage::Format_Invalid;
+    if (image_.isNull()) {
+        return entry;
+    }
+    const QImage image = image_.convertToFormat(
+                             image_.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+    const int lineSize = image.width() * 4;
+    QByteArray pixels(lineSize * image.height(), Qt::Uninitialized);
+    for (int y = 0; y < image.height(); ++y) {
+        memcpy(pixels.data() + y * lineSize, image.constScanLine(y), lineSize);
+    }
+    entry.mSize = image.size();
+    entry.mFormat = image.format();
+    entry.mData = qCompress(pixels, COMPRESSION_LEVEL);
+    return entry;
+}
+
+QFuture<bool> ThumbnailPack::write(const QString& path, const QString& dirPath, const ThumbnailPackEntryList& entries)
+{
+    return QtConcurrent::run(sPackWriterPool(), ThumbnailPack::doWrite, path, dirPath, entries);
+}
+
+bool ThumbnailPack::doWrite(const QString& path, const QString& dirPath, const ThumbnailPackEntryList& newEntries)
+{
+    ThumbnailPackEntryList entries;
+    QSet<QString> newNames;
+    Q_FOREACH(const ThumbnailPackEntry& entry, newEntries) {
+        if (entry.mData.isEmpty() || newNames.contains(entry.mName)) {
+            continue;
+        }
+        newNames << entry.mName;
+        entries << entry;
+    }
+
+    // Keep the entries of the current pack whose file did not change. Their
+    // pixels are copied as is. The pack is read again rather than taken from
+    // the cache of get(): it may have been written since it was cached.
+    ThumbnailPack pack;
+    if (QFile::exists(path) && pack.load(path)) {
+        QHash<QString, int>::ConstIterator it = pack.mIndex.constBegin(), end = pack.mIndex.constEnd();
+        for (; it != end; ++it) {
+            if (newNames.contains(it.key())) {
+                continue;
+            }
+            const uchar* ptr = pack.record(it.value());
+            const QFileInfo info(dirPath + '/' + it.key());
+            if (!info.exists()
+                || qint64(info.lastModified().toTime_t()) != readNumber<qint64>(ptr + 8)
+                || quint64(info.size()) != readNumber<quint64>(ptr + 16)) {
+                LOG("Dropping" << it.key() << "from" << path);
+                continue;
+            }
+            ThumbnailPackEntry entry;
+            entry.mName = it.key();
+            entry.mOriginalTime = readNumber<qint64>(ptr + 8);
+            entry.mOriginalFileSize = readNumber<quint64>(ptr + 16);
+            entry.mOriginalSize = QSize(readNumber<qint32>(ptr + 24), readNumber<qint32>(ptr + 28));
+            entry.mSize = QSize(readNumber<quint16>(ptr + 32), readNumber<quint16>(ptr + 34));
+            entry.mFormat = readNumber<quint32>(ptr + 36);
+            entry.mData = QByteArray(reinterpret_cast<const char*>(pack.mData + readNumber<quint64>(ptr + 40)),
+                                     readNumber<quint32>(ptr + 48));
+            entries << entry;
+        }
+    }
+
+    QList<QByteArray> names;
+    Q_FOREACH(const ThumbnailPackEntry& entry, entries) {
+        names << entry.mName.toUtf8();
+    }
+
+    QByteArray table(HEADER_SIZE + entries.size() * RECORD_SIZE, '\0');
+    memcpy(table.data(), MAGIC, 4);
+    writeNumber<quint32>(&table, 4, VERSION);
+    writeNumber<quint32>(&table, 8, entries.size());
+
+    quint64 namesSize = 0;
+    Q_FOREACH(const QByteArray& name, names) {
+        namesSize += name.size();
+    }
+    quint32 nameOffset = table.size();
+    quint64 dataOffset = table.size() + namesSize;
+    for (int index = 0; index < entries.size(); ++index) {
+        const ThumbnailPackEntry& entry = entries.at(index);
+        const QSize& originalSize = entry.mOriginalSize;
+        const int pos = HEADER_SIZE + index * RECORD_SIZE;
+        writeNumber<quint32>(&table, pos, nameOffset);
+        writeNumber<quint32>(&table, pos + 4, names.at(index).size());
+        writeNumber<qint64>(&table, pos + 8, entry.mOriginalTime);
+        writeNumber<quint64>(&table, pos + 16, entry.mOriginalFileSize);
+        writeNumber<qint32>(&table, pos + 24, originalSize.isValid() ? originalSize.width() : -1);
+        writeNumber<qint32>(&table, pos + 28, originalSize.isValid() ? originalSize.height() : -1);
+        writeNumber<quint16>(&table, pos + 32, entry.mSize.width());
+        writeNumber<quint16>(&table, pos + 34, entry.mSize.height());
+        writeNumber<quint32>(&table, pos + 36, entry.mFormat);
+        writeNumber<quint64>(&table, pos + 40, dataOffset);
+        writeNumber<quint32>(&table, pos + 48, entry.mData.size());
+        nameOffset += names.at(index).size();
+        dataOffset += entry.mData.size();
+    }
+
+    QDir().mkpath(QFileInfo(path).absolutePath());
+    // QSaveFile replaces the pack atomically: readers which mapped the
+    // previous version keep a valid mapping
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Could not write thumbnail pack" << path << file.errorString();
+        return false;
+    }
+    file.write(table);
+    Q_FOREACH(const QByteArray& name, names) {
+        file.write(name);
+    }
+    Q_FOREACH(const ThumbnailPackEntry& entry, entries) {
+        file.write(entry.mData);
+    }
+    if (!file.commit()) {
+        qWarning() << "Could not write thumbnail pack" << path << file.errorString();
+        return false;
+    }
+    LOG("Wrote" << entries.size() << "entries to" << path);
+    return true;
+}
+
+} // namespace
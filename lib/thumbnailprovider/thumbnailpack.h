@@ -0,0 +1,131 @@
+// vim: set tabstop=4 shiftwidth=4 expandtab:
+/*
+Gwenview: an image viewer
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA.
+
+*/
+#ifndef THUMBNAILPACK_H
+#define THUMBNAILPACK_H
+
+// Local
+#include <lib/thumbnailgroup.h>
+
+// KDE
+
+// Qt
+#include <QFile>
+#include <QFuture>
+#include <QHash>
+#include <QImage>
+#include <QList>
+#include <QSharedPointer>
+#include <QUrl>
+
+namespace Gwenview
+{
+
+/**
+ * A thumbnail to store in a pack, created by ThumbnailPack::createEntry().
+ * Its pixels are already compressed, so that entries waiting to be written
+ * stay small.
+ */
+struct ThumbnailPackEntry {
+    /// File name of the original, in the directory of the pack
+    QString mName;
+    time_t mOriginalTime;
+    quint64 mOriginalFileSize;
+    /// Invalid if unknown
+    QSize mOriginalSize;
+    QSize mSize;
+    /// QImage::Format of the pixels
+    quint32 mFormat;
+    /// Pixels compressed with qCompress(), empty if there is no thumbnail
+    QByteArray mData;
+};
+
+typedef QList<ThumbnailPackEntry> ThumbnailPackEntryList;
+
+/**
+ * A secondary thumbnail cache: one file per directory and thumbnail group,
+ * holding the thumbnails of the directory already decoded, compressed with
+ * zlib, and an index keyed by file name, modification time and size.
+ *
+ * Packs are memory mapped, so looking up thumbnails does not open any file.
+ * They are only a shortcut: the thumbnails they contain come from the
+ * freedesktop.org thumbnail cache, which remains the reference.
+ */
+class ThumbnailPack
+{
+public:
+    typedef QSharedPointer<const ThumbnailPack> Ptr;
+
+    ~ThumbnailPack();
+
+    /**
+     * Path of the pack for the thumbnails of the files in @p dirUrl
+     */
+    static QString packPath(const QUrl& dirUrl, ThumbnailGroup::Enum group);
+
+    /**
+     * Returns the pack stored at @p path, or a null pointer if there is
+     * none. Packs are kept open, so this must only be called from the GUI
+     * thread.
+     */
+    static Ptr get(const QString& path);
+
+    /**
+     * Closes the pack stored at @p path, so that the next call to get()
+     * reads it again. To be called from the GUI thread.
+     */
+    static void forget(const QString& path);
+
+    /**
+     * Creates an entry for the thumbnail @p image of the file @p name. Can be
+     * called from any thread.
+     */
+    static ThumbnailPackEntry createEntry(const QString& name, time_t originalTime, quint64 originalFileSize, const QSize& originalSize, const QImage& image);
+
+    /**
+     * Returns the thumbnail of @p name if it is in the pack and was created
+     * for this version of the file, a null image otherwise. Can be called from
+     * any thread.
+     */
+    QImage find(const QString& name, time_t originalTime, quint64 originalFileSize, QSize* originalSize) const;
+
+    /**
+     * Adds @p entries to the pack stored at @p path, in the background.
+     * Entries of the pack whose file in @p dirPath changed are dropped.
+     * Packs are written one at a time, so that writes to the same pack do
+     * not lose each other's entries.
+     */
+    static QFuture<bool> write(const QString& path, const QString& dirPath, const ThumbnailPackEntryList& entries);
+
+private:
+    ThumbnailPack();
+    bool load(const QString& path);
+    static bool doWrite(const QString& path, const QString& dirPath, const ThumbnailPackEntryList& entries);
+    const uchar* record(int index) const;
+
+    QFile mFile;
+    const uchar* mData;
+    qint64 mSize;
+    /// Maps file names to entry indexes
+    QHash<QString, int> mIndex;
+};
+
+} // namespace
+
+#endif /* THUMBNAILPACK_H */
@@ -30,7 +30,9 @@
 // Qt
 #include <QDir>
 #include <QFile>
+#include <QFutureWatcher>
 #include <QImage>
+#include <QMetaMethod>
 #include <QPixmap>
 #include <QCryptographicHash>
 #include <QDebug>
@@ -44,7 +46,11 @@
 #include <KJobWidgets>
 
 // Local
+#include "gwenviewconfig.h"
 #include "mimetypeutils.h"
+#include "thumbnailcachereader.h"
+#include "thumbnailpack.h"
+#include "thumbnailsourcefetcher.h"
 #include "thumbnailwriter.h"
 #include "thumbnailgenerator.h"
 #include "urlutils.h"
@@ -63,6 +69,10 @@ namespace Gwenview
 
 Q_GLOBAL_STATIC(ThumbnailWriter, sThumbnailWriter)
 
+// Thumbnails waiting to be added to a pack are written as soon as they take
+// this much memory, rather than when we are finished
+static const int MAX_PACK_UPDATE_SIZE = 4 * 1024 * 1024;
+
 static QString generateOriginalUri(const QUrl &url_)
 {
     QUrl url = url_;
@@ -120,6 +130,15 @@ void ThumbnailProvider::deleteImageThumbnail(const QUrl &url)
     QString uri = generateOriginalUri(url);
     QFile::remove(generateThumbnailPath(uri, ThumbnailGroup::Normal));
     QFile::remove(generateThumbnailPath(uri, ThumbnailGroup::Large));
+
+    // Packs cannot be edited in place: drop the pack of the directory, it
+    // is created again from the cache the next time the directory is listed
+    const QUrl dirUrl = url.adjusted(QUrl::RemoveFilename);
+    Q_FOREACH(ThumbnailGroup::Enum group, QList<ThumbnailGroup::Enum>() << ThumbnailGroup::Normal << ThumbnailGroup::Large) {
+        const QString packPath = ThumbnailPack::packPath(dirUrl, group);
+        ThumbnailPack::forget(packPath);
+        QFile::remove(packPath);
+    }
 }
 
 static void moveThumbnailHelper(const QString& oldUri, const QString& newUri, ThumbnailGroup::Enum group)
@@ -166,38 +185,42 @@ ThumbnailProvider::ThumbnailProvider()
     // Look for images and store the items in our todo list
     mCurrentItem = KFileItem();
     mThumbnailGroup = ThumbnailGroup::Large;
-    createNewThumbnailGenerator();
+
+    mThumbnailGenerator = new ThumbnailGenerator(this);
+    connect(mThumbnailGenerator, SIGNAL(done(KFileItem,QImage,QSize)),
+            SLOT(thumbnailReady(KFileItem,QImage,QSize)));
+    connect(mThumbnailGenerator, SIGNAL(workerAvailable()),
+            SLOT(slotWorkerAvailable()));
+
+    connect(mThumbnailGenerator, SIGNAL(thumbnailReadyToBeCached(QString,QImage)),
+            sThumbnailWriter, SLOT(queueThumbnail(QString,QImage)));
+    connect(mThumbnailGenerator, &ThumbnailGenerator::thumbnailReadyToBePacked, this, &ThumbnailProvider::addToPack);
+
+    mCacheReader = new ThumbnailCacheReader(this);
+    connect(mCacheReader, &ThumbnailCacheReader::done, this, &ThumbnailProvider::slotCacheLookupDone);
 }
 
 ThumbnailProvider::~ThumbnailProvider()
 {
     LOG(this);
     abortSubjob();
-    mThumbnailGenerator->cancel();
+    // Results of the thumbnails being generated or looked up are dropped
+    // with mThumbnailGenerator and mCacheReader
     disconnect(mThumbnailGenerator, nullptr, this, nullptr);
-    disconnect(mThumbnailGenerator, nullptr, sThumbnailWriter, nullptr);
-    connect(mThumbnailGenerator, SIGNAL(finished()), mThumbnailGenerator, SLOT(deleteLater()));
-    if (mPreviousThumbnailGenerator) {
-        disconnect(mPreviousThumbnailGenerator, nullptr, sThumbnailWriter, nullptr);
-    }
+    disconnect(mCacheReader, nullptr, this, nullptr);
     sThumbnailWriter->wait();
 }
 
 void ThumbnailProvider::stop()
 {
-    // Clear mItems and create a new ThumbnailGenerator if mThumbnailGenerator is running,
-    // but also make sure that at most two ThumbnailGenerators are running.
-    // startCreatingThumbnail() will take care that these two threads won't work on the same item.
+    // Thumbnails which are being generated cannot be interrupted: let them
+    // finish and get reported. startCreatingThumbnail() does not start them
+    // again if their items are appended back in the meantime.
     mItems.clear();
+    mUncachedLookups.clear();
+    // Cache lookups are dropped
+    mLookupUrls.clear();
     abortSubjob();
-    if (mThumbnailGenerator->isRunning() && !mPreviousThumbnailGenerator) {
-        mPreviousThumbnailGenerator = mThumbnailGenerator;
-        mPreviousThumbnailGenerator->cancel();
-        disconnect(mPreviousThumbnailGenerator, nullptr, this, nullptr);
-        connect(mPreviousThumbnailGenerator, SIGNAL(finished()), mPreviousThumbnailGenerator, SLOT(deleteLater()));
-        createNewThumbnailGenerator();
-        mCurrentItem = KFileItem();
-    }
 }
 
 const KFileItemList& ThumbnailProvider::pendingItems() const
@@ -229,11 +252,28 @@ void ThumbnailProvider::appendItems(const KFileItemList& items)
 
     if (mCurrentItem.isNull()) {
         determineNextIcon();
+    } else {
+        startCacheLookups();
     }
 }
 
 void ThumbnailProvider::removeItems(const KFileItemList& itemList)
 {
+    Q_FOREACH(const KFileItem & item, itemList) {
+        mThumbnailGenerator->cancel(item.url());
+        mLookupUrls.remove(item.url());
+    }
+    if (!mUncachedLookups.isEmpty()) {
+        const QSet<KFileItem> itemSet = itemList.toSet();
+        ThumbnailCacheLookupList::Iterator it = mUncachedLookups.begin();
+        while (it != mUncachedLookups.end()) {
+            if (itemSet.contains(it->mItem)) {
+                it = mUncachedLookups.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
     if (mItems.isEmpty()) {
         return;
     }
@@ -256,25 +296,16 @@ void ThumbnailProvider::removeItems(const KFileItemList& itemList)
 void ThumbnailProvider::removePendingItems()
 {
     mItems.clear();
+    mUncachedLookups.clear();
 }
 
 bool ThumbnailProvider::isRunning() const
 {
-    return !mCurrentItem.isNull();
+    return !mCurrentItem.isNull() || !mThumbnailGenerator->isIdle() || !mCacheReader->isIdle()
+        || !mUncachedLookups.isEmpty();
 }
 
 //-Internal--------------------------------------------------------------
-void ThumbnailProvider::createNewThumbnailGenerator()
-{
-    mThumbnailGenerator = new ThumbnailGenerator;
-    connect(mThumbnailGenerator, SIGNAL(done(QImage,QSize)),
-            SLOT(thumbnailReady(QImage,QSize)),
-            Qt::QueuedConnection);
-
-    connect(mThumbnailGenerator, SIGNAL(thumbnailReadyToBeCached(QString,QImage)),
-            sThumbnailWriter, SLOT(queueThumbnail(QString,QImage)),
-            Qt::QueuedConnection);
-}
 
 void ThumbnailProvider::abortSubjob()
 {
@@ -287,16 +318,165 @@ void ThumbnailProvider::abortSubjob()
     }
 }
 
+bool ThumbnailProvider::canLookupInCache(const KFileItem& item) const
+{
+    const QUrl url = item.url();
+    if (!UrlUtils::urlIsFastLocalFile(url)) {
+        // Needs a KIO::stat
+        return false;
+    }
+    // Files in the thumbnail dir are loaded directly
+    return !url.adjusted(QUrl::RemoveFilename|QUrl::StripTrailingSlash).path().startsWith(thumbnailBaseDir());
+}
+
+/**
+ * Moves local items from mItems to batches of cache lookups, as long as
+ * mCacheReader has free threads. The order of mItems is kept.
+ */
+void ThumbnailProvider::startCacheLookups()
+{
+    if (mItems.isEmpty() || mCacheReader->isFull()) {
+        return;
+    }
+    const int batchSize = ThumbnailCacheReader::batchSize();
+    const bool usePacks = GwenviewConfig::useThumbnailPacks();
+    // Items come from a few directories at most, avoid hashing the
+    // directory of each of them
+    QUrl packDirUrl;
+    QString packPath;
+    ThumbnailPack::Ptr pack;
+    KFileItemList remainingItems;
+    ThumbnailCacheLookupList lookups;
+    Q_FOREACH(const KFileItem& item, mItems) {
+        if (mCacheReader->isFull() || !canLookupInCache(item)) {
+            remainingItems << item;
+            continue;
+        }
+        const QUrl url = item.url().adjusted(QUrl::NormalizePathSegments);
+        ThumbnailCacheLookup lookup;
+        lookup.mItem = item;
+        lookup.mOriginalUri = generateOriginalUri(url);
+        lookup.mOriginalFileSize = item.size();
+        lookup.mThumbnailPath = generateThumbnailPath(lookup.mOriginalUri, mThumbnailGroup);
+        if (mThumbnailGroup == ThumbnailGroup::Normal) {
+            lookup.mLargeThumbnailPath = generateThumbnailPath(lookup.mOriginalUri, ThumbnailGroup::Large);
+        }
+        lookup.mPendingImage = sThumbnailWriter->value(lookup.mThumbnailPath);
+        if (usePacks) {
+            const QUrl dirUrl = url.adjusted(QUrl::RemoveFilename);
+            if (dirUrl != packDirUrl) {
+                packDirUrl = dirUrl;
+                packPath = ThumbnailPack::packPath(dirUrl, mThumbnailGroup);
+                pack = ThumbnailPack::get(packPath);
+            }
+            lookup.mPackPath = packPath;
+            lookup.mPack = pack;
+        }
+        lookup.mOriginalTime = 0;
+        lookup.mNeedCaching = false;
+        lookups << lookup;
+        mLookupUrls << item.url();
+
+        if (lookups.size() == batchSize) {
+            mCacheReader->lookup(lookups);
+            lookups.clear();
+        }
+    }
+    if (!lookups.isEmpty()) {
+        mCacheReader->lookup(lookups);
+    }
+    mItems = remainingItems;
+}
+
+void ThumbnailProvider::slotCacheLookupDone(const ThumbnailCacheLookupList& lookups)
+{
+    LoadedThumbnailList thumbnails;
+    Q_FOREACH(const ThumbnailCacheLookup& lookup, lookups) {
+        if (!mLookupUrls.remove(lookup.mItem.url())) {
+            // Item has been removed or we have been stopped
+            continue;
+        }
+        if (lookup.mImage.isNull()) {
+            mUncachedLookups << lookup;
+            continue;
+        }
+        if (lookup.mNeedCaching) {
+            sThumbnailWriter->queueThumbnail(lookup.mThumbnailPath, lookup.mImage);
+        }
+        if (!lookup.mPackEntry.mData.isEmpty()) {
+            addToPack(lookup.mItem, lookup.mPackPath, lookup.mPackEntry);
+        }
+        LoadedThumbnail thumbnail;
+        thumbnail.mItem = lookup.mItem;
+        thumbnail.mPixmap = QPixmap::fromImage(lookup.mImage);
+        thumbnail.mFullSize = lookup.mOriginalSize;
+        thumbnail.mFileSize = lookup.mOriginalFileSize;
+        thumbnails << thumbnail;
+    }
+    LOG(thumbnails.size() << "thumbnails loaded from cache," << mUncachedLookups.size() << "to create");
+
+    if (!thumbnails.isEmpty()) {
+        if (isSignalConnected(QMetaMethod::fromSignal(&ThumbnailProvider::thumbnailsLoaded))) {
+            emit thumbnailsLoaded(thumbnails);
+        } else {
+            Q_FOREACH(const LoadedThumbnail& thumbnail, thumbnails) {
+                emit thumbnailLoaded(thumbnail.mItem, thumbnail.mPixmap, thumbnail.mFullSize, thumbnail.mFileSize);
+            }
+        }
+    }
+
+    if (mCurrentItem.isNull()) {
+        determineNextIcon();
+    } else {
+        startCacheLookups();
+    }
+}
+
 void ThumbnailProvider::determineNextIcon()
 {
     LOG(this);
     mState = STATE_NEXTTHUMB;
+    mCurrentItem = KFileItem();
+
+    startCacheLookups();
+
+    // Wait for a worker to be available. Items are only picked when they
+    // can be processed, so that the order of mItems, which follows what is
+    // visible in the view, is respected until then. thumbnailReady() calls
+    // us again.
+    if (mThumbnailGenerator->isFull()) {
+        LOG("All workers are busy");
+        return;
+    }
+
+    // Items which are not in the cache come first: they have been looked up
+    // because they were at the top of mItems
+    if (!mUncachedLookups.isEmpty()) {
+        const ThumbnailCacheLookup lookup = mUncachedLookups.takeFirst();
+        mCurrentItem = lookup.mItem;
+        mCurrentUrl = mCurrentItem.url().adjusted(QUrl::NormalizePathSegments);
+        mOriginalFileSize = lookup.mOriginalFileSize;
+        mOriginalTime = lookup.mOriginalTime;
+        mOriginalUri = lookup.mOriginalUri;
+        mThumbnailPath = lookup.mThumbnailPath;
+        LOG("Creating thumbnail for" << mCurrentUrl);
+        createThumbnail();
+        return;
+    }
 
     // No more items ?
     if (mItems.isEmpty()) {
         LOG("No more items. Nothing to do");
-        mCurrentItem = KFileItem();
-        finished();
+        if (mThumbnailGenerator->isIdle() && mCacheReader->isIdle()) {
+            writePacks();
+            finished();
+        }
+        return;
+    }
+
+    if (canLookupInCache(mItems.first())) {
+        // All cache lookup threads are busy, startCacheLookups() picks it up
+        // when a batch is done
         return;
     }
 
@@ -322,6 +502,48 @@ void ThumbnailProvider::determineNextIcon()
     LOG("/determineNextIcon" << this);
 }
 
+void ThumbnailProvider::addToPack(const KFileItem& item, const QString& packPath, const ThumbnailPackEntry& entry)
+{
+    QHash<QString, PackUpdate>::Iterator it = mPackUpdates.find(packPath);
+    if (it == mPackUpdates.end()) {
+        PackUpdate update;
+        update.mDirPath = QFileInfo(item.url().toLocalFile()).absolutePath();
+        update.mDataSize = 0;
+        it = mPackUpdates.insert(packPath, update);
+    }
+    it->mEntries << entry;
+    it->mDataSize += entry.mData.size();
+    if (it->mDataSize >= MAX_PACK_UPDATE_SIZE) {
+        writePack(it.key(), it.value());
+        mPackUpdates.erase(it);
+    }
+}
+
+/**
+ * Writes the packs which miss thumbnails, in the background
+ */
+void ThumbnailProvider::writePacks()
+{
+    QHash<QString, PackUpdate>::ConstIterator it = mPackUpdates.constBegin(), end = mPackUpdates.constEnd();
+    for (; it != end; ++it) {
+        writePack(it.key(), it.value());
+    }
+    mPackUpdates.clear();
+}
+
+void ThumbnailProvider::writePack(const QString& path, const PackUpdate& update)
+{
+    LOG("Updating" << path << "with" << update.mEntries.size() << "thumbnails");
+    // The watcher is not a child of ours: the new pack must be read again
+    // even if we are gone
+    QFutureWatcher<bool>* watcher = new QFutureWatcher<bool>;
+    connect(watcher, &QFutureWatcher<bool>::finished, watcher, [watcher, path]() {
+        ThumbnailPack::forget(path);
+        watcher->deleteLater();
+    });
+    watcher->setFuture(ThumbnailPack::write(path, update.mDirPath, update.mEntries));
+}
+
 void ThumbnailProvider::slotResult(KJob * job)
 {
     LOG(mState);
@@ -357,7 +579,9 @@ void ThumbnailProvider::slotResult(KJob * job)
             mTempPath.clear();
             determineNextIcon();
         } else {
-            startCreatingThumbnail(mTempPath);
+            const QString tempPath = mTempPath;
+            mTempPath.clear();
+            startCreatingThumbnail(tempPath, true /* isTemporary */);
         }
         return;
 
@@ -367,21 +591,30 @@ void ThumbnailProvider::slotResult(KJob * job)
     }
 }
 
-void ThumbnailProvider::thumbnailReady(const QImage& _img, const QSize& _size)
+void ThumbnailProvider::thumbnailReady(const KFileItem& item, const QImage& img, const QSize& size)
 {
-    QImage img = _img;
-    QSize size = _size;
+    LOG(item.url());
     if (!img.isNull()) {
-        emitThumbnailLoaded(img, size);
+        emit thumbnailLoaded(item, QPixmap::fromImage(img), size, item.size());
     } else {
-        emitThumbnailLoadingFailed();
+        emit thumbnailLoadingFailed(item);
     }
-    if (!mTempPath.isEmpty()) {
-        LOG("Delete temp file" << mTempPath);
-        QFile::remove(mTempPath);
-        mTempPath.clear();
+
+    // A worker is now available. If mCurrentItem is set, we are busy with
+    // another item and determineNextIcon() will be called when we are done
+    // with it.
+    if (mCurrentItem.isNull()) {
+        determineNextIcon();
+    }
+}
+
+void ThumbnailProvider::slotWorkerAvailable()
+{
+    // A cancelled thumbnail is done. determineNextIcon() may have been
+    // waiting for a worker, or for the generator to be idle to finish.
+    if (mCurrentItem.isNull()) {
+        determineNextIcon();
     }
-    determineNextIcon();
 }
 
 QImage ThumbnailProvider::loadThumbnailFromCache() const
@@ -464,12 +697,17 @@ void ThumbnailProvider::checkThumbnail()
     }
 
     // Thumbnail not found or not valid
+    createThumbnail();
+}
+
+void ThumbnailProvider::createThumbnail()
+{
     if (MimeTypeUtils::fileItemKind(mCurrentItem) == MimeTypeUtils::KIND_RASTER_IMAGE) {
         if (mCurrentUrl.isLocalFile()) {
             // Original is a local file, create the thumbnail
-            startCreatingThumbnail(mCurrentUrl.toLocalFile());
+            startCreatingThumbnail(mCurrentUrl.toLocalFile(), false /* isTemporary */);
         } else {
-            // Original is remote, download it
+            // Original is remote, download what we need of it
             mState = STATE_DOWNLOADORIG;
 
             QTemporaryFile tempFile;
@@ -482,11 +720,10 @@ void ThumbnailProvider::checkThumbnail()
             }
             mTempPath = tempFile.fileName();
 
-            QUrl url = QUrl::fromLocalFile(mTempPath);
-            KIO::Job* job = KIO::file_copy(mCurrentUrl, url, -1, KIO::Overwrite | KIO::HideProgressInfo);
-            KJobWidgets::setWindow(job, qApp->activeWindow());
-            LOG("Download remote file" << mCurrentUrl.toDisplayString() << "to" << url.toDisplayString());
-            addSubjob(job);
+            ThumbnailSourceFetcher* fetcher = new ThumbnailSourceFetcher(mCurrentUrl, mTempPath, ThumbnailGroup::pixelSize(mThumbnailGroup));
+            LOG("Download remote file" << mCurrentUrl.toDisplayString() << "to" << mTempPath);
+            addSubjob(fetcher);
+            fetcher->start();
         }
     } else {
         // Not a raster image, use a KPreviewJob
@@ -508,25 +745,37 @@ void ThumbnailProvider::checkThumbnail()
     }
 }
 
-void ThumbnailProvider::startCreatingThumbnail(const QString& pixPath)
+void ThumbnailProvider::startCreatingThumbnail(const QString& pixPath, bool isTemporary)
 {
     LOG("Creating thumbnail from" << pixPath);
-    // If mPreviousThumbnailGenerator is already working on our current item
-    // its thumbnail will be passed to sThumbnailWriter when ready. So we
-    // connect mPreviousThumbnailGenerator's signal "finished" to determineNextIcon
-    // which will load the thumbnail from sThumbnailWriter or from disk
-    // (because we re-add mCurrentItem to mItems).
-    if (mPreviousThumbnailGenerator && mPreviousThumbnailGenerator->isRunning() &&
-        mOriginalUri == mPreviousThumbnailGenerator->originalUri() &&
-        mOriginalTime == mPreviousThumbnailGenerator->originalTime() &&
-        mOriginalFileSize == mPreviousThumbnailGenerator->originalFileSize() &&
-        mCurrentItem.mimetype() == mPreviousThumbnailGenerator->originalMimeType()) {
-            connect(mPreviousThumbnailGenerator, SIGNAL(finished()), SLOT(determineNextIcon()));
-            mItems.prepend(mCurrentItem);
-            return;
+    if (mThumbnailGenerator->isLoading(mCurrentItem, mOriginalTime)) {
+        // This can happen if the item was appended again after stop(): its
+        // thumbnail is still being generated
+        LOG("Already generating thumbnail for" << mCurrentItem.url());
+        if (isTemporary) {
+            QFile::remove(pixPath);
+        }
+        determineNextIcon();
+        return;
+    }
+
+    ThumbnailTask task;
+    task.mItem = mCurrentItem;
+    task.mOriginalUri = mOriginalUri;
+    task.mOriginalTime = mOriginalTime;
+    task.mOriginalFileSize = mOriginalFileSize;
+    task.mOriginalMimeType = mCurrentItem.mimetype();
+    task.mPixPath = pixPath;
+    task.mRemovePixPath = isTemporary;
+    task.mThumbnailPath = mThumbnailPath;
+    task.mThumbnailGroup = mThumbnailGroup;
+    if (!isTemporary && GwenviewConfig::useThumbnailPacks() && canLookupInCache(mCurrentItem)) {
+        task.mPackPath = ThumbnailPack::packPath(mCurrentUrl.adjusted(QUrl::RemoveFilename), mThumbnailGroup);
     }
-    mThumbnailGenerator->load(mOriginalUri, mOriginalTime, mOriginalFileSize,
-                          mCurrentItem.mimetype(), pixPath, mThumbnailPath, mThumbnailGroup);
+    mThumbnailGenerator->load(task);
+
+    // Do not wait for the thumbnail, move on to the next item
+    determineNextIcon();
 }
 
 void ThumbnailProvider::slotGotPreview(const KFileItem& item, const QPixmap& pixmap)
@@ -27,9 +27,11 @@
 #include <lib/gwenviewlib_export.h>
 
 // Qt
+#include <QHash>
 #include <QImage>
+#include <QList>
 #include <QPixmap>
-#include <QPointer>
+#include <QSet>
 
 // KDE
 #include <KIO/Job>
@@ -37,6 +39,7 @@
 
 // Local
 #include <lib/thumbnailgroup.h>
+#include <lib/thumbnailprovider/thumbnailcachereader.h>
 
 namespace Gwenview
 {
@@ -44,6 +47,19 @@ namespace Gwenview
 class ThumbnailGenerator;
 class ThumbnailWriter;
 
+/**
+ * A thumbnail, as reported by ThumbnailProvider::thumbnailsLoaded()
+ */
+struct LoadedThumbnail {
+    KFileItem mItem;
+    QPixmap mPixmap;
+    /// Size of the original image, invalid if unknown
+    QSize mFullSize;
+    qulonglong mFileSize;
+};
+
+typedef QList<LoadedThumbnail> LoadedThumbnailList;
+
 /**
  * A job that determines the thumbnails for the images in the current directory
  */
@@ -120,6 +136,13 @@ Q_SIGNALS:
      */
     void thumbnailLoaded(const KFileItem& item, const QPixmap&, const QSize&, qulonglong);
 
+    /**
+     * Emitted with the thumbnails of local items which were found in the
+     * cache, in batches. If this signal is not connected, thumbnailLoaded()
+     * is emitted for each of them instead.
+     */
+    void thumbnailsLoaded(const LoadedThumbnailList&);
+
     void thumbnailLoadingFailed(const KFileItem& item);
 
     /**
@@ -134,12 +157,22 @@ private Q_SLOTS:
     void determineNextIcon();
     void slotGotPreview(const KFileItem&, const QPixmap&);
     void checkThumbnail();
-    void thumbnailReady(const QImage&, const QSize&);
+    void thumbnailReady(const KFileItem&, const QImage&, const QSize&);
+    void slotWorkerAvailable();
+    void slotCacheLookupDone(const ThumbnailCacheLookupList&);
+    void addToPack(const KFileItem&, const QString& packPath, const ThumbnailPackEntry&);
     void emitThumbnailLoadingFailed();
 
 private:
     enum { STATE_STATORIG, STATE_DOWNLOADORIG, STATE_PREVIEWJOB, STATE_NEXTTHUMB } mState;
 
+    struct PackUpdate {
+        QString mDirPath;
+        ThumbnailPackEntryList mEntries;
+        /// Size of the compressed pixels of mEntries
+        int mDataSize;
+    };
+
     KFileItemList mItems;
     KFileItem mCurrentItem;
 
@@ -165,13 +198,29 @@ private:
     ThumbnailGroup::Enum mThumbnailGroup;
 
     ThumbnailGenerator* mThumbnailGenerator;
-    QPointer<ThumbnailGenerator> mPreviousThumbnailGenerator;
+
+    ThumbnailCacheReader* mCacheReader;
+
+    // Items whose thumbnail is being looked up by mCacheReader
+    QSet<QUrl> mLookupUrls;
+
+    // Items which have no valid thumbnail in the cache, waiting for one to
+    // be created
+    ThumbnailCacheLookupList mUncachedLookups;
+
+    // Thumbnails found in the cache or created which are missing from the
+    // pack of their directory, by pack path
+    QHash<QString, PackUpdate> mPackUpdates;
 
     QStringList mPreviewPlugins;
 
-    void createNewThumbnailGenerator();
     void abortSubjob();
-    void startCreatingThumbnail(const QString& path);
+    void startCacheLookups();
+    bool canLookupInCache(const KFileItem& item) const;
+    void createThumbnail();
+    void writePacks();
+    void writePack(const QString& path, const PackUpdate& update);
+    void startCreatingThumbnail(const QString& path, bool isTemporary);
 
     void emitThumbnailLoaded(const QImage& img, const QSize& size);
 
@@ -0,0 +1,258 @@
+// vim: set tabstop=4 shiftwidth=4 expandtab:
+/*
+Gwenview: an image viewer
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA.
+
+*/
+// Self
+#include "thumbnailsourcefetcher.h"
+
+// Local
+#include "gwenviewconfig.h"
+#include "jpegcontent.h"
+
+// KDE
+#include <KIO/TransferJob>
+#include <KJobWidgets>
+#include <KLocalizedString>
+
+// Qt
+#include <QApplication>
+#include <QDebug>
+#include <QImage>
+
+namespace Gwenview
+{
+
+#undef ENABLE_LOG
+#undef LOG
+//#define ENABLE_LOG
+#ifdef ENABLE_LOG
+#define LOG(x) qDebug() << x
+#else
+#define LOG(x) ;
+#endif
+
+// EXIF data is limited to 64KB, but other segments can come before the
+// image data. Give up looking for the header after this.
+static const int MAX_HEADER_SIZE = 1024 * 1024;
+
+static const char JPEG_EOI[] = "\xFF\xD9";
+
+int ThumbnailSourceFetcher::jpegHeaderSize(const QByteArray& data)
+{
+    const uchar* ptr = reinterpret_cast<const uchar*>(data.constData());
+    const int size = data.size();
+    if (size < 2) {
+        return -1;
+    }
+    if (ptr[0] != 0xFF || ptr[1] != 0xD8) {
+        return 0;
+    }
+    int pos = 2;
+    while (true) {
+        // Markers can be preceded by fill bytes
+        while (pos + 1 < size && ptr[pos] == 0xFF && ptr[pos + 1] == 0xFF) {
+            ++pos;
+        }
+        if (pos + 2 > size) {
+            return -1;
+        }
+        if (ptr[pos] != 0xFF) {
+            return 0;
+        }
+        const uchar marker = ptr[pos + 1];
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            // Markers without a segment
+            pos += 2;
+            continue;
+        }
+        if (marker == 0xD9) {
+            // End of image without image data
+            return 0;
+        }
+        if (pos + 4 > size) {
+            return -1;
+        }
+        const int length = (ptr[pos + 2] << 8) | ptr[pos + 3];
+        if (length < 2) {
+            return 0;
+        }
+        pos += 2 + length;
+        if (marker == 0xDA) {
+            // Start of scan: the image data follows
+            return pos <= size ? pos : -1;
+        }
+        if (pos > size) {
+            return -1;
+        }
+    }
+}
+
+ThumbnailSourceFetcher::ThumbnailSourceFetcher(const QUrl& url, const QString& destPath, int pixelSize, QObject* parent)
+: KJob(parent)
+, mUrl(url)
+, mPixelSize(pixelSize)
+, mFile(destPath)
+, mTransferJob(nullptr)
+, mScanningHeader(true)
+, mPartial(false)
+, mDone(false)
+, mReceivedSize(0)
+{}
+
+ThumbnailSourceFetcher::~ThumbnailSourceFetcher()
+{
+    abortTransfer();
+}
+
+void ThumbnailSourceFetcher::start()
+{
+    if (!mFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        finish(UserDefinedError, i18nc("@info", "Could not open file %1 for writing.", mFile.fileName()));
+        return;
+    }
+    // Thumbnails of images which are not in the header must be generated
+    // from the whole image
+    mScanningHeader = GwenviewConfig::applyExifOrientation();
+    LOG("Fetching" << mUrl << "to" << mFile.fileName());
+    startTransfer(mUrl);
+}
+
+bool ThumbnailSourceFetcher::isPartial() const
+{
+    return mPartial;
+}
+
+qint64 ThumbnailSourceFetcher::receivedSize() const
+{
+    return mReceivedSize;
+}
+
+bool ThumbnailSourceFetcher::doKill()
+{
+    abortTransfer();
+    mFile.close();
+    mDone = true;
+    return true;
+}
+
+void ThumbnailSourceFetcher::startTransfer(const QUrl& url)
+{
+    KIO::TransferJob* job = KIO::get(url, KIO::NoReload, KIO::HideProgressInfo);
+    KJobWidgets::setWindow(job, qApp->activeWindow());
+    connect(job, SIGNAL(data(KIO::Job*,QByteArray)), SLOT(slotData(KIO::Job*,QByteArray)));
+    connect(job, SIGNAL(result(KJob*)), SLOT(slotTransferResult(KJob*)));
+    mTransferJob = job;
+}
+
+void ThumbnailSourceFetcher::abortTransfer()
+{
+    if (mTransferJob) {
+        mTransferJob->kill();
+        mTransferJob = nullptr;
+    }
+}
+
+void ThumbnailSourceFetcher::slotData(KIO::Job*, const QByteArray& data)
+{
+    addData(data);
+}
+
+void ThumbnailSourceFetcher::slotTransferResult(KJob* job)
+{
+    mTransferJob = nullptr;
+    transferFinished(job->error(), job->errorString());
+}
+
+void ThumbnailSourceFetcher::addData(const QByteArray& data)
+{
+    if (mDone || data.isEmpty()) {
+        return;
+    }
+    mReceivedSize += data.size();
+    if (mFile.write(data) != data.size()) {
+        abortTransfer();
+        finish(UserDefinedError, i18nc("@info", "Could not write to file %1.", mFile.fileName()));
+        return;
+    }
+    if (mScanningHeader) {
+        mHeader += data;
+        scanHeader();
+    }
+}
+
+void ThumbnailSourceFetcher::scanHeader()
+{
+    const int headerSize = jpegHeaderSize(mHeader);
+    if (headerSize == -1) {
+        if (mHeader.size() > MAX_HEADER_SIZE) {
+            LOG("No header in the first" << mHeader.size() << "bytes of" << mUrl);
+            mScanningHeader = false;
+            mHeader.clear();
+        }
+        return;
+    }
+    mScanningHeader = false;
+    if (headerSize == 0) {
+        LOG(mUrl << "is not a JPEG file");
+        mHeader.clear();
+        return;
+    }
+
+    // Make the header a valid image on its own
+    mHeader.truncate(headerSize);
+    mHeader.append(JPEG_EOI, 2);
+
+    // Same check as ThumbnailContext::load()
+    JpegContent content;
+    const QImage thumbnail = content.loadFromData(mHeader) ? content.thumbnail() : QImage();
+    mHeader.clear();
+    if (qMax(thumbnail.width(), thumbnail.height()) < mPixelSize) {
+        LOG("EXIF thumbnail of" << mUrl << "is too small, downloading the whole file");
+        return;
+    }
+
+    LOG("Found EXIF thumbnail of" << mUrl << "after" << mReceivedSize << "bytes");
+    abortTransfer();
+    mPartial = true;
+    if (!mFile.flush() || !mFile.resize(headerSize) || !mFile.seek(headerSize) || mFile.write(JPEG_EOI, 2) != 2) {
+        finish(UserDefinedError, i18nc("@info", "Could not write to file %1.", mFile.fileName()));
+        return;
+    }
+    finish(NoError, QString());
+}
+
+void ThumbnailSourceFetcher::transferFinished(int error, const QString& errorText)
+{
+    if (mDone) {
+        return;
+    }
+    finish(error, errorText);
+}
+
+void ThumbnailSourceFetcher::finish(int error, const QString& errorText)
+{
+    mDone = true;
+    mFile.close();
+    if (error) {
+        setError(error);
+        setErrorText(errorText);
+    }
+    emitResult();
+}
+
+} // namespace
@@ -0,0 +1,120 @@
+// vim: set tabstop=4 shiftwidth=4 expandtab:
+/*
+Gwenview: an image viewer
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA.
+
+*/
+#ifndef THUMBNAILSOURCEFETCHER_H
+#define THUMBNAILSOURCEFETCHER_H
+
+#include <lib/gwenviewlib_export.h>
+
+// Local
+
+// KDE
+#include <KJob>
+
+// Qt
+#include <QByteArray>
+#include <QFile>
+#include <QUrl>
+
+namespace KIO
+{
+class Job;
+}
+
+namespace Gwenview
+{
+
+/**
+ * Downloads a remote image to a local file, so that a thumbnail can be
+ * generated from it.
+ *
+ * The image is streamed. For JPEG files, the download stops as soon as the
+ * header has been received if it contains an EXIF thumbnail big enough for
+ * the requested thumbnail size: the local file then only contains the
+ * header, which is all ThumbnailContext needs. Other files are downloaded
+ * completely.
+ */
+class GWENVIEWLIB_EXPORT ThumbnailSourceFetcher : public KJob
+{
+    Q_OBJECT
+public:
+    ThumbnailSourceFetcher(const QUrl& url, const QString& destPath, int pixelSize, QObject* parent = nullptr);
+    ~ThumbnailSourceFetcher() Q_DECL_OVERRIDE;
+
+    void start() Q_DECL_OVERRIDE;
+
+    /**
+     * Returns true if the download stopped after the header
+     */
+    bool isPartial() const;
+
+    /**
+     * Number of bytes received so far
+     */
+    qint64 receivedSize() const;
+
+    /**
+     * Returns the size of the JPEG header at the beginning of data, up to
+     * the start of the image data, 0 if data is not a JPEG file and -1 if
+     * more data is needed to tell.
+     */
+    static int jpegHeaderSize(const QByteArray& data);
+
+protected:
+    bool doKill() Q_DECL_OVERRIDE;
+
+    /**
+     * Starts transferring @p url. Implementations must call addData() with
+     * the data as it arrives, then transferFinished(). Uses KIO::get() by
+     * default.
+     */
+    virtual void startTransfer(const QUrl& url);
+
+    /**
+     * Stops the transfer started by startTransfer(). transferFinished()
+     * must not be called after this.
+     */
+    virtual void abortTransfer();
+
+    void addData(const QByteArray& data);
+    void transferFinished(int error, const QString& errorText);
+
+private Q_SLOTS:
+    void slotData(KIO::Job*, const QByteArray&);
+    void slotTransferResult(KJob*);
+
+private:
+    QUrl mUrl;
+    int mPixelSize;
+    QFile mFile;
+    KJob* mTransferJob;
+    /// Beginning of the file, while we look for the JPEG header
+    QByteArray mHeader;
+    bool mScanningHeader;
+    bool mPartial;
+    bool mDone;
+    qint64 mReceivedSize;
+
+    void scanHeader();
+    void finish(int error, const QString& errorText);
+};
+
+} // namespace
+
+#endif /* THUMBNAILSOURCEFETCHER_H */
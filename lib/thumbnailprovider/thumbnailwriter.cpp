@@ -25,8 +25,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 
 // Qt
 #include <QImage>
+#include <QImageWriter>
 #include <QDebug>
 #include <QTemporaryFile>
+#include <QtConcurrentMap>
 
 namespace Gwenview
 {
@@ -40,28 +42,78 @@ namespace Gwenview
 #define LOG(x) ;
 #endif
 
-static void storeThumbnailToDiskCache(const QString& path, const QImage& image)
+/**
+ * Maximum number of thumbnails handled in one batch
+ */
+static const int BATCH_SIZE = 32;
+
+/**
+ * Qt maps the quality of PNG images to a zlib compression level using
+ * (100 - quality) * 9 / 91: 85 gives level 1. Deflate is what dominates the
+ * cost of writing thumbnails and the fastest level only makes them slightly
+ * bigger.
+ */
+static const int PNG_QUALITY = 85;
+
+struct PendingThumbnail
 {
-    LOG(path);
-    QTemporaryFile tmp(path + QStringLiteral(".gwenview.tmpXXXXXX.png"));
+    QString mPath;
+    QImage mImage;
+};
+
+/**
+ * Writes the thumbnail next to its final path, returns the path of the
+ * written file or an empty string on failure
+ */
+static QString writeTemporaryThumbnail(const PendingThumbnail& thumbnail)
+{
+    LOG(thumbnail.mPath);
+    QTemporaryFile tmp(thumbnail.mPath + QStringLiteral(".gwenview.tmpXXXXXX.png"));
+    tmp.setAutoRemove(false);
     if (!tmp.open()) {
         qWarning() << "Could not create a temporary file.";
-        return;
+        return QString();
     }
 
-    if (!image.save(tmp.fileName(), "png")) {
+    QImageWriter writer(&tmp, "png");
+    writer.setQuality(PNG_QUALITY);
+    if (!writer.write(thumbnail.mImage)) {
         qWarning() << "Could not save thumbnail";
-        return;
+        tmp.remove();
+        return QString();
     }
+    return tmp.fileName();
+}
 
-    QFile::rename(tmp.fileName(), path);
+static void renameThumbnail(const QString& tmpPath, const QString& path)
+{
+    if (QFile::rename(tmpPath, path)) {
+        return;
+    }
+    // QFile::rename() does not overwrite outdated thumbnails
+    QFile::remove(path);
+    if (!QFile::rename(tmpPath, path)) {
+        qWarning() << "Could not rename" << tmpPath << "to" << path;
+        QFile::remove(tmpPath);
+    }
 }
 
+ThumbnailWriter::ThumbnailWriter()
+: mRunning(false)
+{}
+
 void ThumbnailWriter::queueThumbnail(const QString& path, const QImage& image)
 {
     LOG(path);
     QMutexLocker locker(&mMutex);
     mCache.insert(path, image);
+    if (mRunning) {
+        return;
+    }
+    mRunning = true;
+    locker.unlock();
+    // run() may not have returned yet after handling its last batch
+    wait();
     start();
 }
 
@@ -69,19 +121,38 @@ void ThumbnailWriter::run()
 {
     QMutexLocker locker(&mMutex);
     while (!mCache.isEmpty()) {
-        Cache::ConstIterator it = mCache.constBegin();
-        const QString path = it.key();
-        const QImage image = it.value();
+        QList<PendingThumbnail> batch;
+        Cache::ConstIterator entryIt = mCache.constBegin(), end = mCache.constEnd();
+        for (; entryIt != end && batch.size() < BATCH_SIZE; ++entryIt) {
+            PendingThumbnail thumbnail;
+            thumbnail.mPath = entryIt.key();
+            thumbnail.mImage = entryIt.value();
+            batch << thumbnail;
+        }
 
         // This part of the thread is the most time consuming but it does not
         // depend on mCache so we can unlock here. This way other thumbnails
         // can be added or queried
         locker.unlock();
-        storeThumbnailToDiskCache(path, image);
+        const QStringList tmpPaths = QtConcurrent::blockingMapped<QStringList>(batch, writeTemporaryThumbnail);
+        for (int idx = 0; idx < batch.size(); ++idx) {
+            if (!tmpPaths.at(idx).isEmpty()) {
+                renameThumbnail(tmpPaths.at(idx), batch.at(idx).mPath);
+            }
+        }
         locker.relock();
 
-        mCache.remove(path);
+        // Thumbnails are only removed from mCache once they are on disk, so
+        // that value() keeps finding them until then
+        Q_FOREACH(const PendingThumbnail& thumbnail, batch) {
+            Cache::Iterator it = mCache.find(thumbnail.mPath);
+            // Keep the thumbnail if a newer version has been queued meanwhile
+            if (it != mCache.end() && it.value().cacheKey() == thumbnail.mImage.cacheKey()) {
+                mCache.erase(it);
+            }
+        }
     }
+    mRunning = false;
 }
 
 QImage ThumbnailWriter::value(const QString& path) const
@@ -36,12 +36,17 @@ namespace Gwenview
 {
 
 /**
- * Store thumbnails to disk when done generating them
+ * Store thumbnails to disk when done generating them.
+ *
+ * Queued thumbnails are written in batches: they are encoded in parallel,
+ * then all renamed to their final path.
  */
 class ThumbnailWriter : public QThread
 {
     Q_OBJECT
 public:
+    ThumbnailWriter();
+
     // Return thumbnail if it has still not been stored
     QImage value(const QString&) const;
 
@@ -57,6 +62,9 @@ private:
     typedef QHash<QString, QImage> Cache;
     Cache mCache;
     mutable QMutex mMutex;
+    /// Protected by mMutex, true from the moment the thread is started
+    /// until run() has decided to return
+    bool mRunning;
 };
 
 } // namespace
@@ -30,6 +30,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <QPointer>
 #include <QQueue>
 #include <QScrollBar>
+#include <QSet>
 #include <QTimeLine>
 #include <QTimer>
 #include <QDrag>
@@ -51,6 +52,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "mimetypeutils.h"
 #include "urlutils.h"
 #include <lib/gvdebug.h>
+#include <lib/memoryutils.h>
 #include <lib/thumbnailprovider/thumbnailprovider.h>
 
 namespace Gwenview
@@ -70,6 +72,24 @@ const int SMOOTH_DELAY = 500;
 
 const int WHEEL_ZOOM_MULTIPLIER = 4;
 
+/**
+ * Maximum amount of memory used by the pixmaps of a view, in bytes. Off-screen
+ * thumbnails are evicted when it is exceeded and loaded again from the
+ * thumbnail store when they come back on screen.
+ */
+static qint64 thumbnailCacheBudget()
+{
+    static const qint64 budget = qBound(qint64(64) << 20,
+                                        qint64(MemoryUtils::getTotalMemory() / 32),
+                                        qint64(256) << 20);
+    return budget;
+}
+
+static qint64 pixmapCost(const QPixmap& pix)
+{
+    return qint64(pix.width()) * pix.height() * pix.depth() / 8;
+}
+
 static KFileItem fileItemForIndex(const QModelIndex& index)
 {
     if (!index.isValid()) {
@@ -93,12 +113,16 @@ struct Thumbnail
         , mModificationTime(mtime)
         , mFileSize(0)
         , mRough(true)
-        , mWaitingForThumbnail(true) {}
+        , mWaitingForThumbnail(true)
+        , mCost(0)
+        , mLastUsed(0) {}
 
     Thumbnail()
         : mFileSize(0)
         , mRough(true)
-        , mWaitingForThumbnail(true) {}
+        , mWaitingForThumbnail(true)
+        , mCost(0)
+        , mLastUsed(0) {}
 
     /**
      * Init the thumbnail based on a icon
@@ -128,6 +152,15 @@ struct Thumbnail
         return groupSize == qMax(mFullSize.width(), mFullSize.height());
     }
 
+    qint64 computeCost() const
+    {
+        qint64 cost = pixmapCost(mGroupPix);
+        if (mAdjustedPix.cacheKey() != mGroupPix.cacheKey()) {
+            cost += pixmapCost(mAdjustedPix);
+        }
+        return cost;
+    }
+
     void prepareForRefresh(const QDateTime& mtime)
     {
         mModificationTime = mtime;
@@ -158,6 +191,12 @@ struct Thumbnail
     bool mRough;
     /// Set to true if mGroupPix should be replaced with a real thumbnail
     bool mWaitingForThumbnail;
+    /// Memory used by mGroupPix and mAdjustedPix, as last accounted in
+    /// ThumbnailViewPrivate::mThumbnailCost
+    qint64 mCost;
+    /// Value of ThumbnailViewPrivate::mUsageCounter the last time the
+    /// thumbnail was painted
+    quint64 mLastUsed;
 };
 
 typedef QHash<QUrl, Thumbnail> ThumbnailForUrl;
@@ -175,6 +214,16 @@ struct ThumbnailViewPrivate
     ThumbnailForUrl mThumbnailForUrl;
     QTimer mScheduledThumbnailGenerationTimer;
 
+    /// Memory used by the pixmaps of mThumbnailForUrl
+    qint64 mThumbnailCost;
+    /// mThumbnailCost after the last call to trimThumbnailCache()
+    qint64 mThumbnailCostAfterTrim;
+    quint64 mUsageCounter;
+    QTimer mTrimThumbnailCacheTimer;
+    /// Thumbnails evicted by trimThumbnailCache(), they are only generated
+    /// again once they get near the viewport
+    QSet<QUrl> mEvictedUrls;
+
     UrlQueue mSmoothThumbnailQueue;
     QTimer mSmoothThumbnailTimer;
 
@@ -215,10 +264,55 @@ struct ThumbnailViewPrivate
         QPixmap pix;
         QSize fullSize;
         mDocumentInfoProvider->thumbnailForDocument(url, group, &pix, &fullSize);
-        mThumbnailForUrl[url] = Thumbnail(QPersistentModelIndex(index), QDateTime::currentDateTime());
+        ThumbnailForUrl::Iterator it = mThumbnailForUrl.find(url);
+        if (it != mThumbnailForUrl.end()) {
+            removeThumbnail(it);
+        }
+        mThumbnailForUrl.insert(url, Thumbnail(QPersistentModelIndex(index), QDateTime::currentDateTime()));
         q->setThumbnail(item, pix, fullSize, 0);
     }
 
+    /**
+     * Must be called whenever the pixmaps of thumbnail change
+     */
+    void updateThumbnailCost(Thumbnail* thumbnail)
+    {
+        const qint64 cost = thumbnail->computeCost();
+        if (cost == thumbnail->mCost) {
+            return;
+        }
+        mThumbnailCost += cost - thumbnail->mCost;
+        thumbnail->mCost = cost;
+        MemoryUtils::setCacheMemoryUsage(q, mThumbnailCost);
+
+        // Do not try again and again to trim the cache if visible thumbnails
+        // alone exceed the budget
+        const qint64 budget = thumbnailCacheBudget();
+        if (mThumbnailCost > qMax(budget, mThumbnailCostAfterTrim + budget / 8)
+            && !mTrimThumbnailCacheTimer.isActive())
+        {
+            mTrimThumbnailCacheTimer.start();
+        }
+    }
+
+    /**
+     * Thumbnails inside this rect are kept when trimming the cache: the
+     * viewport and one page around it
+     */
+    QRect keepRect() const
+    {
+        const QRect viewportRect = q->viewport()->rect();
+        const int margin = qMax(viewportRect.width(), viewportRect.height());
+        return viewportRect.adjusted(-margin, -margin, margin, margin);
+    }
+
+    void removeThumbnail(ThumbnailForUrl::Iterator it)
+    {
+        mThumbnailCost -= it.value().mCost;
+        MemoryUtils::setCacheMemoryUsage(q, mThumbnailCost);
+        mThumbnailForUrl.erase(it);
+    }
+
     void appendItemsToThumbnailProvider(const KFileItemList& list)
     {
         if (mThumbnailProvider) {
@@ -240,6 +334,7 @@ struct ThumbnailViewPrivate
             thumbnail->mAdjustedPix = scale(mGroupPix, Qt::FastTransformation);
             thumbnail->mRough = true;
         }
+        updateThumbnailCost(thumbnail);
     }
 
     void initDragPixmap(QDrag* drag, const QModelIndexList& indexes)
@@ -294,6 +389,9 @@ ThumbnailView::ThumbnailView(QWidget* parent)
     d->mThumbnailSize = QSize(1, 1);
     d->mThumbnailAspectRatio = 1;
     d->mCreateThumbnailsForRemoteUrls = true;
+    d->mThumbnailCost = 0;
+    d->mThumbnailCostAfterTrim = 0;
+    d->mUsageCounter = 0;
 
     setFrameShape(QFrame::NoFrame);
     setViewMode(QListView::IconMode);
@@ -316,6 +414,10 @@ ThumbnailView::ThumbnailView(QWidget* parent)
     d->mSmoothThumbnailTimer.setSingleShot(true);
     connect(&d->mSmoothThumbnailTimer, &QTimer::timeout, this, &ThumbnailView::smoothNextThumbnail);
 
+    d->mTrimThumbnailCacheTimer.setSingleShot(true);
+    d->mTrimThumbnailCacheTimer.setInterval(0);
+    connect(&d->mTrimThumbnailCacheTimer, &QTimer::timeout, this, &ThumbnailView::trimThumbnailCache);
+
     setContextMenuPolicy(Qt::CustomContextMenu);
     connect(this, &ThumbnailView::customContextMenuRequested, this, &ThumbnailView::showContextMenu);
 
@@ -324,6 +426,7 @@ ThumbnailView::ThumbnailView(QWidget* parent)
 
 ThumbnailView::~ThumbnailView()
 {
+    MemoryUtils::setCacheMemoryUsage(this, 0);
     delete d;
 }
 
@@ -344,6 +447,7 @@ void ThumbnailView::setModel(QAbstractItemModel* newModel)
         disconnect(model(), 0, this, 0);
     }
     QListView::setModel(newModel);
+    d->mEvictedUrls.clear();
     connect(model(), SIGNAL(rowsRemoved(QModelIndex,int,int)),
             SIGNAL(rowsRemovedSignal(QModelIndex,int,int)));
 }
@@ -354,6 +458,7 @@ void ThumbnailView::setThumbnailProvider(ThumbnailProvider* thumbnailProvider)
     if (thumbnailProvider) {
         connect(thumbnailProvider, SIGNAL(thumbnailLoaded(KFileItem,QPixmap,QSize,qulonglong)),
                          SLOT(setThumbnail(KFileItem,QPixmap,QSize,qulonglong)));
+        connect(thumbnailProvider, &ThumbnailProvider::thumbnailsLoaded, this, &ThumbnailView::setThumbnails);
         connect(thumbnailProvider, SIGNAL(thumbnailLoadingFailed(KFileItem)),
                          SLOT(setBrokenThumbnail(KFileItem)));
     } else {
@@ -391,6 +496,7 @@ void ThumbnailView::updateThumbnailSize()
     end = d->mThumbnailForUrl.end();
     for (; it != end; ++it) {
         it.value().mAdjustedPix = QPixmap();
+        d->updateThumbnailCost(&it.value());
     }
 
     thumbnailSizeChanged(value);
@@ -474,8 +580,12 @@ void ThumbnailView::rowsAboutToBeRemoved(const QModelIndex& parent, int start, i
         }
 
         QUrl url = item.url();
-        d->mThumbnailForUrl.remove(url);
+        ThumbnailForUrl::Iterator it = d->mThumbnailForUrl.find(url);
+        if (it != d->mThumbnailForUrl.end()) {
+            d->removeThumbnail(it);
+        }
         d->mSmoothThumbnailQueue.removeAll(url);
+        d->mEvictedUrls.remove(url);
 
         itemList.append(item);
     }
@@ -524,6 +634,7 @@ void ThumbnailView::dataChanged(const QModelIndex& topLeft, const QModelIndex& b
                 // modification time changes.
                 thumbnailsNeedRefresh = true;
                 it->prepareForRefresh(mtime);
+                d->updateThumbnailCost(&it.value());
             }
         }
     }
@@ -558,6 +669,7 @@ void ThumbnailView::setThumbnail(const KFileItem& item, const QPixmap& pixmap, c
     thumbnail.mRealFullSize = size;
     thumbnail.mWaitingForThumbnail = false;
     thumbnail.mFileSize = fileSize;
+    d->updateThumbnailCost(&thumbnail);
 
     update(thumbnail.mIndex);
     if (d->mScaleMode != ScaleToFit) {
@@ -565,6 +677,13 @@ void ThumbnailView::setThumbnail(const KFileItem& item, const QPixmap& pixmap, c
     }
 }
 
+void ThumbnailView::setThumbnails(const LoadedThumbnailList& thumbnails)
+{
+    Q_FOREACH(const LoadedThumbnail& thumbnail, thumbnails) {
+        setThumbnail(thumbnail.mItem, thumbnail.mPixmap, thumbnail.mFullSize, thumbnail.mFileSize);
+    }
+}
+
 void ThumbnailView::setBrokenThumbnail(const KFileItem& item)
 {
     ThumbnailForUrl::iterator it = d->mThumbnailForUrl.find(item.url());
@@ -588,6 +707,7 @@ void ThumbnailView::setBrokenThumbnail(const KFileItem& item)
         thumbnail.initAsIcon(DesktopIcon("image-missing", 48));
         thumbnail.mFullSize = thumbnail.mGroupPix.size();
     }
+    d->updateThumbnailCost(&thumbnail);
     update(thumbnail.mIndex);
 }
 
@@ -610,6 +730,7 @@ QPixmap ThumbnailView::thumbnailForIndex(const QModelIndex& index, QSize* fullSi
         it = d->mThumbnailForUrl.insert(url, thumbnail);
     }
     Thumbnail& thumbnail = it.value();
+    thumbnail.mLastUsed = ++d->mUsageCounter;
 
     // If dir or archive, generate a thumbnail from fileitem pixmap
     MimeTypeUtils::Kind kind = MimeTypeUtils::fileItemKind(item);
@@ -634,6 +755,7 @@ QPixmap ThumbnailView::thumbnailForIndex(const QModelIndex& index, QSize* fullSi
                 // mGroupPix)
                 thumbnail.mWaitingForThumbnail = true;
             }
+            d->updateThumbnailCost(&thumbnail);
         }
     }
 
@@ -802,6 +924,7 @@ void ThumbnailView::generateThumbnailsForItems()
     const QRect visibleRect = viewport()->rect();
     const int visibleSurface = visibleRect.width() * visibleRect.height();
     const QPoint origin = visibleRect.center();
+    const QRect keepRect = d->keepRect();
 
     // distance => item
     QMultiMap<int, KFileItem> itemMap;
@@ -834,9 +957,19 @@ void ThumbnailView::generateThumbnailsForItems()
             continue;
         }
 
+        const QRect itemRect = visualRect(index);
+
+        // Do not generate evicted thumbnails again before they get near the
+        // viewport, they would be evicted again by the next trim
+        if (d->mEvictedUrls.contains(url)) {
+            if (!itemRect.intersects(keepRect)) {
+                continue;
+            }
+            d->mEvictedUrls.remove(url);
+        }
+
         // Compute distance
         int distance;
-        const QRect itemRect = visualRect(index);
         const qreal itemSurface = itemRect.width() * itemRect.height();
         const QRect visibleItemRect = visibleRect.intersected(itemRect);
         qreal visibleItemFract = 0;
@@ -943,6 +1076,7 @@ void ThumbnailView::smoothNextThumbnail()
     Thumbnail& thumbnail = it.value();
     thumbnail.mAdjustedPix = d->scale(thumbnail.mGroupPix, Qt::SmoothTransformation);
     thumbnail.mRough = false;
+    d->updateThumbnailCost(&thumbnail);
 
     GV_RETURN_IF_FAIL2(thumbnail.mIndex.isValid(), "index for" << url << "is invalid.");
     update(thumbnail.mIndex);
@@ -964,10 +1098,60 @@ void ThumbnailView::reloadThumbnail(const QModelIndex& index)
     if (it == d->mThumbnailForUrl.end()) {
         return;
     }
-    d->mThumbnailForUrl.erase(it);
+    d->removeThumbnail(it);
+    d->mSmoothThumbnailQueue.removeAll(url);
     generateThumbnailsForItems();
 }
 
+void ThumbnailView::trimThumbnailCache()
+{
+    const qint64 budget = thumbnailCacheBudget();
+    if (d->mThumbnailCost <= budget) {
+        d->mThumbnailCostAfterTrim = d->mThumbnailCost;
+        return;
+    }
+    LOG("Thumbnail pixmaps use" << d->mThumbnailCost << "bytes, trimming");
+
+    // Keep thumbnails which are on screen or one page away from it
+    const QRect keepRect = d->keepRect();
+
+    // last use => url
+    QMultiMap<quint64, QUrl> candidates;
+    ThumbnailForUrl::ConstIterator
+        it = d->mThumbnailForUrl.constBegin(),
+        end = d->mThumbnailForUrl.constEnd();
+    for (; it != end; ++it) {
+        const Thumbnail& thumbnail = it.value();
+        // Thumbnails which are waiting for their pixmap are known to
+        // ThumbnailProvider, keep them so that setThumbnail() finds them
+        if (thumbnail.mCost == 0 || thumbnail.mWaitingForThumbnail) {
+            continue;
+        }
+        if (thumbnail.mIndex.isValid()) {
+            if (d->mBusyIndexSet.contains(thumbnail.mIndex)) {
+                continue;
+            }
+            if (visualRect(thumbnail.mIndex).intersects(keepRect)) {
+                continue;
+            }
+        }
+        candidates.insert(thumbnail.mLastUsed, it.key());
+    }
+
+    // Evicted thumbnails are reloaded from the thumbnail store by
+    // generateThumbnailsForItems() when they get near the viewport again
+    const qint64 target = budget * 3 / 4;
+    Q_FOREACH(const QUrl& url, candidates) {
+        if (d->mThumbnailCost <= target) {
+            break;
+        }
+        d->removeThumbnail(d->mThumbnailForUrl.find(url));
+        d->mSmoothThumbnailQueue.removeAll(url);
+        d->mEvictedUrls << url;
+    }
+    d->mThumbnailCostAfterTrim = d->mThumbnailCost;
+}
+
 void ThumbnailView::setCreateThumbnailsForRemoteUrls(bool createRemoteThumbs)
 {
     d->mCreateThumbnailsForRemoteUrls = createRemoteThumbs;
@@ -28,6 +28,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 // KDE
 #include <QUrl>
 
+// Local
+#include <lib/thumbnailprovider/thumbnailprovider.h>
+
 class KFileItem;
 class QDragEnterEvent;
 class QDragMoveEvent;
@@ -39,7 +42,6 @@ namespace Gwenview
 
 class AbstractDocumentInfoProvider;
 class AbstractThumbnailViewHelper;
-class ThumbnailProvider;
 
 struct ThumbnailViewPrivate;
 class GWENVIEWLIB_EXPORT ThumbnailView : public QListView
@@ -187,6 +189,7 @@ private Q_SLOTS:
     void showContextMenu();
     void emitIndexActivatedIfNoModifiers(const QModelIndex&);
     void setThumbnail(const KFileItem&, const QPixmap&, const QSize&, qulonglong fileSize);
+    void setThumbnails(const LoadedThumbnailList&);
     void setBrokenThumbnail(const KFileItem&);
 
     /**
@@ -206,6 +209,12 @@ private Q_SLOTS:
 
     void smoothNextThumbnail();
 
+    /**
+     * Evicts the least recently used off-screen thumbnails if their pixmaps
+     * use more memory than allowed
+     */
+    void trimThumbnailCache();
+
 private:
     friend struct ThumbnailViewPrivate;
     ThumbnailViewPrivate * const d;
@@ -22,9 +22,21 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 #include "timeutils.h"
 
 // Qt
-#include <QFile>
+#include <QDataStream>
 #include <QDateTime>
 #include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QQueue>
+#include <QSaveFile>
+#include <QSet>
+#include <QStandardPaths>
+#include <QThread>
+#include <QTimer>
+#include <QUrl>
 
 // KDE
 #include <KFileItem>
@@ -43,6 +55,22 @@ namespace Gwenview
 namespace TimeUtils
 {
 
+/**
+ * Number of dates the loader thread reads before handing them to the GUI
+ * thread
+ */
+static const int BATCH_SIZE = 64;
+
+/**
+ * Delay before modifications of the index are written to disk, in
+ * milliseconds
+ */
+static const int SAVE_DELAY = 5000;
+
+static const int MAX_INDEX_SIZE = 100000;
+
+static const quint32 INDEX_VERSION = 1;
+
 static Exiv2::ExifData::const_iterator findDateTimeKey(const Exiv2::ExifData& exifData)
 {
     // Ordered list of keys to try
@@ -62,6 +90,56 @@ static Exiv2::ExifData::const_iterator findDateTimeKey(const Exiv2::ExifData& ex
     return end;
 }
 
+/**
+ * Reads the date from the image loaded by loader. name is only used in
+ * warnings.
+ */
+static bool readDateTimeFromExif(Exiv2ImageLoader* loader, const QString& name, QDateTime* dateTime)
+{
+    Exiv2::Image::AutoPtr img = loader->popImage();
+    try {
+        Exiv2::ExifData exifData = img->exifData();
+        if (exifData.empty()) {
+            return false;
+        }
+        Exiv2::ExifData::const_iterator it = findDateTimeKey(exifData);
+        if (it == exifData.end()) {
+            qWarning() << "No date in exif header of" << name;
+            return false;
+        }
+
+        std::ostringstream stream;
+        stream << *it;
+        QString value = QString::fromLocal8Bit(stream.str().c_str());
+
+        QDateTime dt = QDateTime::fromString(value, "yyyy:MM:dd hh:mm:ss");
+        if (!dt.isValid()) {
+            qWarning() << "Invalid date in exif header of" << name;
+            return false;
+        }
+
+        *dateTime = dt;
+        return true;
+    } catch (const Exiv2::Error& error) {
+        qWarning() << "Failed to read date from exif header of" << name << ". Error:" << error.what();
+        return false;
+    }
+}
+
+static bool readDateTimeFromExif(const QUrl& url, QDateTime* dateTime)
+{
+    if (!UrlUtils::urlIsFastLocalFile(url)) {
+        return false;
+    }
+    QString path = url.path();
+    Exiv2ImageLoader loader;
+
+    if (!loader.load(path)) {
+        return false;
+    }
+    return readDateTimeFromExif(&loader, path, dateTime);
+}
+
 struct CacheItem
 {
     QDateTime fileMTime;
@@ -76,75 +154,298 @@ struct CacheItem
 
         fileMTime = time;
 
-        if (!updateFromExif(fileItem.url())) {
+        if (!readDateTimeFromExif(fileItem.url(), &realTime)) {
             realTime = time;
         }
     }
+};
+
+static QDataStream& operator<<(QDataStream& stream, const CacheItem& item)
+{
+    return stream << item.fileMTime << item.realTime;
+}
+
+static QDataStream& operator>>(QDataStream& stream, CacheItem& item)
+{
+    return stream >> item.fileMTime >> item.realTime;
+}
 
-    bool updateFromExif(const QUrl &url)
+typedef QHash<QUrl, CacheItem> Cache;
+
+struct DateTimeTask
+{
+    QUrl key;
+    QUrl url;
+    QDateTime fileMTime;
+};
+
+struct DateTimeResult
+{
+    QUrl key;
+    CacheItem item;
+};
+
+/**
+ * Reads dates from the EXIF header of the queued files. Results are collected
+ * in batches, the receiver is notified through its processResults() slot.
+ */
+class DateTimeLoaderThread : public QThread
+{
+public:
+    DateTimeLoaderThread(QObject* receiver)
+    : mReceiver(receiver)
+    , mRunning(false)
+    , mNotified(false)
+    , mStopped(false)
+    {}
+
+    void queue(const DateTimeTask& task)
     {
-        if (!UrlUtils::urlIsFastLocalFile(url)) {
-            return false;
+        QMutexLocker locker(&mMutex);
+        if (mStopped) {
+            return;
+        }
+        mTasks.enqueue(task);
+        if (mRunning) {
+            return;
         }
-        QString path = url.path();
-        Exiv2ImageLoader loader;
+        mRunning = true;
+        locker.unlock();
+        // run() may not have returned yet after processing its last task
+        wait();
+        start(QThread::LowPriority);
+    }
 
-        if (!loader.load(path)) {
-            return false;
+    QList<DateTimeResult> takeResults()
+    {
+        QMutexLocker locker(&mMutex);
+        QList<DateTimeResult> results;
+        results.swap(mResults);
+        mNotified = false;
+        return results;
+    }
+
+    void stop()
+    {
+        {
+            QMutexLocker locker(&mMutex);
+            mStopped = true;
+            mTasks.clear();
         }
-        Exiv2::Image::AutoPtr img = loader.popImage();
-        try {
-            Exiv2::ExifData exifData = img->exifData();
-            if (exifData.empty()) {
-                return false;
+        wait();
+    }
+
+protected:
+    void run() Q_DECL_OVERRIDE
+    {
+        QMutexLocker locker(&mMutex);
+        while (!mTasks.isEmpty()) {
+            const DateTimeTask task = mTasks.dequeue();
+            locker.unlock();
+
+            DateTimeResult result;
+            result.key = task.key;
+            result.item.fileMTime = task.fileMTime;
+            if (!readDateTimeFromExif(task.url, &result.item.realTime)) {
+                result.item.realTime = task.fileMTime;
             }
-            Exiv2::ExifData::const_iterator it = findDateTimeKey(exifData);
-            if (it == exifData.end()) {
-                qWarning() << "No date in exif header of" << path;
-                return false;
+
+            locker.relock();
+            mResults << result;
+            if (!mNotified && !mStopped && (mResults.size() >= BATCH_SIZE || mTasks.isEmpty())) {
+                mNotified = true;
+                QMetaObject::invokeMethod(mReceiver, "processResults", Qt::QueuedConnection);
             }
+        }
+        mRunning = false;
+    }
 
-            std::ostringstream stream;
-            stream << *it;
-            QString value = QString::fromLocal8Bit(stream.str().c_str());
+private:
+    QObject* mReceiver;
+    QMutex mMutex;
+    QQueue<DateTimeTask> mTasks;
+    QList<DateTimeResult> mResults;
+    bool mRunning;
+    bool mNotified;
+    bool mStopped;
+};
 
-            QDateTime dt = QDateTime::fromString(value, "yyyy:MM:dd hh:mm:ss");
-            if (!dt.isValid()) {
-                qWarning() << "Invalid date in exif header of" << path;
-                return false;
-            }
+struct DateTimeIndexPrivate
+{
+    Cache mCache;
+    QSet<QUrl> mPendingUrls;
+    DateTimeLoaderThread* mThread;
+    QTimer* mSaveTimer;
+    QString mIndexPath;
+    bool mDirty;
 
-            realTime = dt;
-            return true;
-        } catch (const Exiv2::Error& error) {
-            qWarning() << "Failed to read date from exif header of" << path << ". Error:" << error.what();
-            return false;
+    void load()
+    {
+        const QString dir = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation);
+        if (dir.isEmpty()) {
+            return;
+        }
+        mIndexPath = dir + "/gwenview/datetimeindex";
+
+        QFile file(mIndexPath);
+        if (!file.open(QIODevice::ReadOnly)) {
+            return;
+        }
+        QDataStream stream(&file);
+        stream.setVersion(QDataStream::Qt_5_0);
+        quint32 version;
+        stream >> version;
+        if (version != INDEX_VERSION) {
+            return;
+        }
+        stream >> mCache;
+        if (stream.status() != QDataStream::Ok) {
+            qWarning() << "Invalid date time index" << mIndexPath;
+            mCache.clear();
+        }
+    }
+
+    void scheduleSave()
+    {
+        mDirty = true;
+        if (!mSaveTimer->isActive()) {
+            mSaveTimer->start();
         }
     }
 };
 
-typedef QHash<QUrl, CacheItem> Cache;
+DateTimeIndex* DateTimeIndex::instance()
+{
+    static DateTimeIndex index;
+    return &index;
+}
 
-QDateTime dateTimeForFileItem(const KFileItem& fileItem, CachePolicy cachePolicy)
+DateTimeIndex::DateTimeIndex()
+: d(new DateTimeIndexPrivate)
 {
-    if (cachePolicy == SkipCache) {
-        CacheItem item;
-        item.update(fileItem);
-        return item.realTime;
-    }
+    d->mThread = new DateTimeLoaderThread(this);
+    d->mDirty = false;
+    d->mSaveTimer = new QTimer(this);
+    d->mSaveTimer->setInterval(SAVE_DELAY);
+    d->mSaveTimer->setSingleShot(true);
+    connect(d->mSaveTimer, SIGNAL(timeout()), SLOT(save()));
+    d->load();
+}
 
-    static Cache cache;
+DateTimeIndex::~DateTimeIndex()
+{
+    d->mThread->stop();
+    delete d->mThread;
+    save();
+    delete d;
+}
+
+QDateTime DateTimeIndex::dateTimeForFileItem(const KFileItem& fileItem, CachePolicy cachePolicy)
+{
     const QUrl url = fileItem.targetUrl();
+    Cache::iterator it = d->mCache.find(url);
+
+    if (cachePolicy == CacheOnly) {
+        const QDateTime mtime = fileItem.time(KFileItem::ModificationTime);
+        if (it != d->mCache.end() && it.value().fileMTime == mtime) {
+            return it.value().realTime;
+        }
+        if (UrlUtils::urlIsFastLocalFile(fileItem.url())) {
+            if (!d->mPendingUrls.contains(url)) {
+                d->mPendingUrls << url;
+                DateTimeTask task;
+                task.key = url;
+                task.url = fileItem.url();
+                task.fileMTime = mtime;
+                d->mThread->queue(task);
+            }
+        } else {
+            // There is no EXIF date to read, the modification time is the
+            // final answer
+            CacheItem& item = d->mCache[url];
+            item.fileMTime = mtime;
+            item.realTime = mtime;
+        }
+        return mtime;
+    }
 
-    Cache::iterator it = cache.find(url);
-    if (it == cache.end()) {
-        it = cache.insert(url, CacheItem());
+    if (it == d->mCache.end()) {
+        it = d->mCache.insert(url, CacheItem());
     }
 
+    const QDateTime oldMTime = it.value().fileMTime;
     it.value().update(fileItem);
+    if (it.value().fileMTime != oldMTime) {
+        d->scheduleSave();
+    }
     return it.value().realTime;
 }
 
+void DateTimeIndex::processResults()
+{
+    const QList<DateTimeResult> results = d->mThread->takeResults();
+    if (results.isEmpty()) {
+        return;
+    }
+    QList<QUrl> urls;
+    Q_FOREACH(const DateTimeResult& result, results) {
+        d->mCache[result.key] = result.item;
+        d->mPendingUrls.remove(result.key);
+        urls << result.key;
+    }
+    d->scheduleSave();
+    emit dateTimesLoaded(urls);
+}
+
+void DateTimeIndex::save()
+{
+    if (!d->mDirty || d->mIndexPath.isEmpty()) {
+        return;
+    }
+    d->mDirty = false;
+
+    if (d->mCache.size() > MAX_INDEX_SIZE) {
+        // Entries have no usage information, drop arbitrary ones
+        Cache::iterator it = d->mCache.begin();
+        while (d->mCache.size() > MAX_INDEX_SIZE) {
+            it = d->mCache.erase(it);
+        }
+    }
+
+    QDir().mkpath(QFileInfo(d->mIndexPath).absolutePath());
+    QSaveFile file(d->mIndexPath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Could not save date time index to" << d->mIndexPath;
+        return;
+    }
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+    stream << INDEX_VERSION << d->mCache;
+    if (!file.commit()) {
+        qWarning() << "Could not save date time index to" << d->mIndexPath;
+    }
+}
+
+bool dateTimeForData(const QByteArray& data, QDateTime* dateTime)
+{
+    Exiv2ImageLoader loader;
+    if (!loader.load(data)) {
+        return false;
+    }
+    return readDateTimeFromExif(&loader, QStringLiteral("buffer"), dateTime);
+}
+
+QDateTime dateTimeForFileItem(const KFileItem& fileItem, CachePolicy cachePolicy)
+{
+    if (cachePolicy == SkipCache) {
+        CacheItem item;
+        item.update(fileItem);
+        return item.realTime;
+    }
+
+    return DateTimeIndex::instance()->dateTimeForFileItem(fileItem, cachePolicy);
+}
+
 } // namespace
 
 } // namespace
@@ -21,11 +21,17 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Cambridge, MA 02110-1301, USA
 #ifndef TIMEUTILS_H
 #define TIMEUTILS_H
 
+// Qt
+#include <QList>
+#include <QObject>
+
 // Local
 #include <lib/gwenviewlib_export.h>
 
 class KFileItem;
+class QByteArray;
 class QDateTime;
+class QUrl;
 
 namespace Gwenview
 {
@@ -36,11 +42,53 @@ namespace TimeUtils
 enum CachePolicy
 {
     SkipCache,
-    UseCache
+    UseCache,
+    /**
+     * Never read the file: if its date is not known yet, return its
+     * modification time and load the date in the background.
+     * DateTimeIndex::dateTimesLoaded() is emitted once it is known.
+     */
+    CacheOnly
 };
 
 QDateTime GWENVIEWLIB_EXPORT dateTimeForFileItem(const KFileItem& fileItem, Gwenview::TimeUtils::CachePolicy cachePolicy = UseCache);
 
+/**
+ * Reads the date from the EXIF header of an image held in memory. data only
+ * needs to contain the beginning of the image, as long as the header fits.
+ * Returns false if there is no date to read.
+ */
+bool GWENVIEWLIB_EXPORT dateTimeForData(const QByteArray& data, QDateTime* dateTime);
+
+struct DateTimeIndexPrivate;
+/**
+ * Keeps the dates of file items. The index is saved on disk and its entries
+ * are validated against the modification time of the files.
+ *
+ * Dates requested with the CacheOnly policy are read by a background thread,
+ * which reports them in batches.
+ */
+class GWENVIEWLIB_EXPORT DateTimeIndex : public QObject
+{
+    Q_OBJECT
+public:
+    static DateTimeIndex* instance();
+    ~DateTimeIndex();
+
+    QDateTime dateTimeForFileItem(const KFileItem& fileItem, CachePolicy cachePolicy);
+
+Q_SIGNALS:
+    void dateTimesLoaded(const QList<QUrl>& urls);
+
+private Q_SLOTS:
+    void processResults();
+    void save();
+
+private:
+    DateTimeIndex();
+    DateTimeIndexPrivate* const d;
+};
+
 } // namespace
 
 } // namespace
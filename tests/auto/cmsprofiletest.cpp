@@ -64,6 +64,40 @@ void CmsProfileTest::testLoadFromImageData_data()
 }
 #undef NEW_ROW
 
+static QByteArray readTestFile(const QString& fileName)
+{
+    QFile file(pathForTestFile(fileName));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QByteArray();
+    }
+    return file.readAll();
+}
+
+void CmsProfileTest::testLoadFromJpegHeader()
+{
+    // The profile must be found without decoding the image: drop the scan
+    // data. The image is baseline, so the last SOS marker is the one of the
+    // image, not the one of the EXIF thumbnail.
+    QByteArray data = readTestFile("cms/Upper_Left.jpg");
+    int pos = data.lastIndexOf("\xFF\xDA");
+    QVERIFY(pos > 0);
+    data.truncate(pos + 2);
+
+    Cms::Profile::Ptr ptr = Cms::Profile::loadFromImageData(data, "jpeg");
+    QVERIFY(ptr);
+}
+
+void CmsProfileTest::testProfileCache()
+{
+    const QByteArray data = readTestFile("cms/Upper_Left.jpg");
+    QVERIFY(!data.isEmpty());
+    Cms::Profile::Ptr ptr1 = Cms::Profile::loadFromImageData(data, "jpeg");
+    Cms::Profile::Ptr ptr2 = Cms::Profile::loadFromImageData(data, "jpeg");
+    QVERIFY(ptr1);
+    QCOMPARE(ptr1.data(), ptr2.data());
+    QCOMPARE(ptr1->id().size(), 16);
+}
+
 #if 0
 
 void CmsProfileTest::testLoadFromExiv2Image()
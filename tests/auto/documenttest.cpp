@@ -20,7 +20,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 // Qt
 #include <QConicalGradient>
 #include <QImage>
+#include <QFileInfo>
 #include <QPainter>
+#include <QTemporaryDir>
 
 // KDE
 #include <QDebug>
@@ -259,6 +261,113 @@ void DocumentTest::testLoadDownSampledPng()
     QCOMPARE(stateSpy.mState, Document::Loaded);
 }
 
+void DocumentTest::testLoadMappedFile_data()
+{
+    QTest::addColumn<bool>("keepRawData");
+
+    QTest::newRow("drop raw data") << false;
+    QTest::newRow("keep raw data") << true;
+}
+
+void DocumentTest::testLoadMappedFile()
+{
+    QFETCH(bool, keepRawData);
+
+    // BMP files are not compressed: this one is big enough to be mapped
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path = dir.path() + "/mapped.bmp";
+    QImage image(1024, 512, QImage::Format_RGB32);
+    {
+        QPainter painter(&image);
+        QConicalGradient gradient(QPointF(512, 256), 100);
+        gradient.setColorAt(0, Qt::white);
+        gradient.setColorAt(1, Qt::blue);
+        painter.fillRect(image.rect(), gradient);
+    }
+    QVERIFY(image.save(path, "bmp"));
+    QVERIFY(QFileInfo(path).size() > 1024 * 1024);
+    const QImage expectedImage(path);
+
+    Document::Ptr doc = DocumentFactory::instance()->load(QUrl::fromLocalFile(path));
+    doc->setKeepRawData(keepRawData);
+    doc->waitUntilLoaded();
+    QCOMPARE(doc->loadingState(), Document::Loaded);
+
+    // The mapping has been released: the image and the raw data must not
+    // depend on it anymore
+    QVERIFY(QFile::remove(path));
+    QCOMPARE(doc->image().convertToFormat(QImage::Format_RGB32), expectedImage.convertToFormat(QImage::Format_RGB32));
+    if (keepRawData) {
+        QImage rawDataImage;
+        QVERIFY(rawDataImage.loadFromData(doc->rawData(), "bmp"));
+        QCOMPARE(rawDataImage.convertToFormat(QImage::Format_RGB32), expectedImage.convertToFormat(QImage::Format_RGB32));
+    } else {
+        QVERIFY(doc->rawData().isEmpty());
+    }
+}
+
+void DocumentTest::testReleaseFullImage()
+{
+    QUrl url = urlForTestFile("orient6.jpg");
+    Document::Ptr doc = DocumentFactory::instance()->load(url);
+    doc->waitUntilLoaded();
+    QCOMPARE(doc->loadingState(), Document::Loaded);
+
+    // Nothing to keep yet
+    QVERIFY(!doc->releaseFullImage());
+
+    QSignalSpy downSampledImageReadySpy(doc.data(), SIGNAL(downSampledImageReady()));
+    if (!doc->prepareDownSampledImageForZoom(0.2)) {
+        QVERIFY(downSampledImageReadySpy.wait());
+    }
+    while (doc->isBusy()) {
+        QTest::qWait(100);
+    }
+    const QSize downSampledSize = doc->downSampledImageForZoom(0.2).size();
+    const qint64 usage = doc->memoryUsage();
+    QCOMPARE(doc->memoryUsageWithoutFullImage(), usage - doc->image().byteCount());
+
+    const QSize size = doc->size();
+    const QByteArray format = doc->format();
+    QVERIFY(doc->releaseFullImage());
+    QVERIFY(doc->image().isNull());
+    QVERIFY(doc->memoryUsage() < usage);
+    QVERIFY(doc->prepareDownSampledImageForZoom(0.2));
+    QCOMPARE(doc->downSampledImageForZoom(0.2).size(), downSampledSize);
+
+    // Meta information is kept
+    QCOMPARE(doc->loadingState(), Document::MetaInfoLoaded);
+    QCOMPARE(doc->size(), size);
+    QCOMPARE(doc->format(), format);
+
+    // The full image comes back when asked for
+    QSignalSpy loadedSpy(doc.data(), SIGNAL(loaded(QUrl)));
+    doc->startLoadingFullImage();
+    doc->waitUntilLoaded();
+    QCOMPARE(doc->loadingState(), Document::Loaded);
+    QCOMPARE(doc->image().size(), size);
+    QCOMPARE(loadedSpy.count(), 1);
+    QVERIFY(doc->editor());
+}
+
+void DocumentTest::testCacheCounters()
+{
+    DocumentFactory* factory = DocumentFactory::instance();
+    const int hitCount = factory->cacheHitCount();
+    const int missCount = factory->cacheMissCount();
+
+    QUrl url = urlForTestFile("test.png");
+    Document::Ptr doc1 = factory->load(url);
+    QCOMPARE(factory->cacheMissCount(), missCount + 1);
+    QCOMPARE(factory->cacheHitCount(), hitCount);
+
+    Document::Ptr doc2 = factory->load(url);
+    QCOMPARE(doc1.data(), doc2.data());
+    QCOMPARE(factory->cacheMissCount(), missCount + 1);
+    QCOMPARE(factory->cacheHitCount(), hitCount + 1);
+}
+
 void DocumentTest::testLoadRemote()
 {
     QUrl url = setUpRemoteTestDir("test.png");
@@ -307,6 +416,30 @@ void DocumentTest::testLoadAnimated()
     QVERIFY2(spy.count() > count, "No imageRectUpdated() signal received after restarting");
 }
 
+void DocumentTest::testAnimationDirtyRects()
+{
+    QUrl srcUrl = urlForTestFile("40frames.gif");
+    Document::Ptr doc = DocumentFactory::instance()->load(srcUrl);
+    doc->waitUntilLoaded();
+    QVERIFY(doc->isAnimated());
+    const QRect imageRect = doc->image().rect();
+
+    QSignalSpy spy(doc.data(), SIGNAL(imageRectUpdated(QRect)));
+    doc->startAnimation();
+    QTest::qWait(1000);
+    doc->stopAnimation();
+    QVERIFY2(spy.count() > 0, "No imageRectUpdated() signal received");
+
+    // Frames identical to the previous one are not signaled, the others
+    // only signal the area which changed
+    Q_FOREACH(const QList<QVariant>& arguments, spy) {
+        const QRect rect = arguments.first().toRect();
+        QVERIFY(!rect.isEmpty());
+        QVERIFY(imageRect.contains(rect));
+    }
+    QCOMPARE(doc->image().size(), imageRect.size());
+}
+
 void DocumentTest::testPrepareDownSampledAfterFailure()
 {
     QUrl url = urlForTestFile("empty.png");
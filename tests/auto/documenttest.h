@@ -111,8 +111,13 @@ private Q_SLOTS:
     void testLoadDownSampled();
     void testLoadDownSampled_data();
     void testLoadDownSampledPng();
+    void testLoadMappedFile();
+    void testLoadMappedFile_data();
+    void testReleaseFullImage();
+    void testCacheCounters();
     void testLoadRemote();
     void testLoadAnimated();
+    void testAnimationDirtyRects();
     void testPrepareDownSampledAfterFailure();
     void testDeleteWhileLoading();
     void testLoadRotated();
@@ -51,10 +51,9 @@ void ImageScalerTest::testScaleFullImage()
 
     scaler.setDestinationRegion(QRect(QPoint(0, 0), doc->size() * zoom));
 
-    QSignalSpy spy(&scaler, SIGNAL(scaledRect(int,int,QImage)));
-
-    bool ok = spy.wait(30);
-    QVERIFY2(ok, "ImageScaler did not emit scaledRect() signal in time");
+    // Tiles are scaled in worker threads, wait for all of them
+    const QRegion fullRegion(QRect(QPoint(0, 0), doc->size() * zoom));
+    QTRY_VERIFY((fullRegion - client.coveredRegion()).isEmpty());
 
     // Document should be fully loaded by the time image scaler is done
     QCOMPARE(doc->loadingState(), Document::Loaded);
@@ -65,6 +64,34 @@ void ImageScalerTest::testScaleFullImage()
     QVERIFY(TestUtils::imageCompare(scaledImage, expectedImage));
 }
 
+/**
+ * Scaling an area which has already been scaled at the same zoom should be
+ * served synchronously from the tile cache
+ */
+void ImageScalerTest::testScaleFromCache()
+{
+    const qreal zoom = 3;
+    QUrl url = urlForTestFile("test.png");
+    Document::Ptr doc = DocumentFactory::instance()->load(url);
+    doc->waitUntilLoaded();
+
+    ImageScaler scaler;
+    ImageScalerClient client(&scaler);
+    scaler.setDocument(doc);
+    scaler.setZoom(zoom);
+
+    const QRect fullRect(QPoint(0, 0), doc->size() * zoom);
+    scaler.setDestinationRegion(fullRect);
+    QTRY_VERIFY((QRegion(fullRect) - client.coveredRegion()).isEmpty());
+    const QImage firstImage = client.createFullImage();
+
+    // No event loop here: everything must come from the cache
+    client.mImageInfoList.clear();
+    scaler.setDestinationRegion(fullRect);
+    QVERIFY((QRegion(fullRect) - client.coveredRegion()).isEmpty());
+    QVERIFY(TestUtils::imageCompare(client.createFullImage(), firstImage));
+}
+
 #if 0
 /**
  * Scale parts of an image
@@ -25,6 +25,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 // Qt
 #include <QImage>
 #include <QPainter>
+#include <QRegion>
 
 // KDE
 #include <QDebug>
@@ -47,6 +48,15 @@ public:
     };
     QVector<ImageInfo> mImageInfoList;
 
+    QRegion coveredRegion() const
+    {
+        QRegion region;
+        Q_FOREACH(const ImageInfo & info, mImageInfoList) {
+            region |= QRect(info.left, info.top, info.image.width(), info.image.height());
+        }
+        return region;
+    }
+
     QImage createFullImage()
     {
         Q_ASSERT(mImageInfoList.size() > 0);
@@ -88,6 +98,7 @@ class ImageScalerTest : public QObject
 
 private Q_SLOTS:
     void testScaleFullImage();
+    void testScaleFromCache();
 
     // FIXME Disabled for now, does not compile since ImageScaler::setImage() has
     // been replaced with ImageScaler::setDocument()
@@ -138,6 +138,36 @@ void ImporterTest::testSkippedUrlList()
     QCOMPARE(importer.renamedCount(), 0);
 }
 
+void ImporterTest::testDuplicateContent()
+{
+    QUrl destUrl = QUrl::fromLocalFile(mTempDir->path() + "/foo");
+
+    // Same content as the first document, under another name
+    QUrl duplicateUrl = QUrl::fromLocalFile(mTempDir->path() + "/duplicate.jpg");
+    QVERIFY(QFile::copy(mDocumentList[0].toLocalFile(), duplicateUrl.toLocalFile()));
+
+    Importer importer(nullptr);
+
+    QList<QUrl> list = QList<QUrl>() << mDocumentList[0] << duplicateUrl << mDocumentList[1];
+
+    QEventLoop loop;
+    connect(&importer, SIGNAL(importFinished()), &loop, SLOT(quit()));
+    importer.start(list, destUrl);
+    loop.exec();
+
+    QCOMPARE(importer.importedUrlList(), mDocumentList.mid(0, 2));
+    QCOMPARE(importer.skippedUrlList(), QList<QUrl>() << duplicateUrl);
+    QCOMPARE(importer.renamedCount(), 0);
+
+    // Documents already in the destination folder are skipped as well,
+    // whatever their name
+    importer.start(QList<QUrl>() << duplicateUrl << mDocumentList[2], destUrl);
+    loop.exec();
+
+    QCOMPARE(importer.importedUrlList(), mDocumentList.mid(2));
+    QCOMPARE(importer.skippedUrlList(), QList<QUrl>() << duplicateUrl);
+}
+
 void ImporterTest::testRenamedCount()
 {
     QUrl destUrl = QUrl::fromLocalFile(mTempDir->path() + "/foo");
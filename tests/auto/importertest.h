@@ -43,6 +43,7 @@ private Q_SLOTS:
     void testFileNameFormater();
     void testFileNameFormater_data();
     void testSkippedUrlList();
+    void testDuplicateContent();
     void testRenamedCount();
 
 private:
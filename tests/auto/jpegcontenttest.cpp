@@ -24,6 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <QDir>
 #include <QFile>
 #include <QImage>
+#include <QPainter>
 #include <QString>
 
 // KDE
@@ -302,3 +303,112 @@ void JpegContentTest::testSetImage()
 //    ignoredKeys << "Orientation";
 //    compareMetaInfo(pathForTestFile(ORIENT6_FILE), pathForTestFile(TMP_FILE), ignoredKeys);
 }
+
+void JpegContentTest::testTransformAfterSetImage()
+{
+    Gwenview::JpegContent content;
+    bool result = content.load(pathForTestFile(ORIENT6_FILE));
+    QVERIFY(result);
+
+    QImage image = QImage(400, 300, QImage::Format_RGB32);
+    image.fill(Qt::red);
+
+    // The new pixels are transformed directly, before being encoded
+    content.setImage(image);
+    content.transform(Gwenview::ROT_90);
+    QCOMPARE(content.size(), QSize(300, 400));
+
+    result = content.save(TMP_FILE);
+    QVERIFY(result);
+
+    result = content.load(TMP_FILE);
+    QVERIFY(result);
+    QCOMPARE(content.size(), QSize(300, 400));
+}
+
+void JpegContentTest::testCrop()
+{
+    // Generate test image. Qt encodes it with 2x2 chroma subsampling, so its
+    // iMCUs are 16x16 pixels.
+    QImage image(200, 96, QImage::Format_RGB32);
+    {
+        QPainter painter(&image);
+        QConicalGradient gradient(QPointF(100, 48), 100);
+        gradient.setColorAt(0, Qt::white);
+        gradient.setColorAt(1, Qt::blue);
+        painter.fillRect(image.rect(), gradient);
+    }
+    QVERIFY(image.save(TMP_FILE, "jpeg"));
+    const QImage original(TMP_FILE);
+
+    Gwenview::JpegContent content;
+    bool result = content.load(TMP_FILE);
+    QVERIFY(result);
+    const QByteArray rawData = content.rawData();
+
+    // Not aligned on iMCUs: the content is left untouched
+    QVERIFY(!content.crop(QRect(4, 16, 100, 50)));
+    QCOMPARE(content.rawData(), rawData);
+
+    const QRect rect(32, 16, 100, 50);
+    if (!content.crop(rect)) {
+        QSKIP("libjpeg is too old to crop without decoding");
+    }
+    QCOMPARE(content.size(), rect.size());
+    result = content.save(TMP_FILE);
+    QVERIFY(result);
+
+    QImage cropped(TMP_FILE);
+    QCOMPARE(cropped.size(), rect.size());
+    // Chroma upsampling differs on the new edges, compare what is inside
+    const QRect inside = QRect(QPoint(0, 0), rect.size()).adjusted(2, 2, -2, -2);
+    QVERIFY(TestUtils::fuzzyImageCompare(cropped.copy(inside), original.copy(inside.translated(rect.topLeft()))));
+}
+
+void JpegContentTest::testCropAfterTransform()
+{
+    // Same kind of image as in testCrop(), with 16x16 iMCUs
+    QImage image(200, 96, QImage::Format_RGB32);
+    {
+        QPainter painter(&image);
+        QConicalGradient gradient(QPointF(100, 48), 100);
+        gradient.setColorAt(0, Qt::white);
+        gradient.setColorAt(1, Qt::blue);
+        painter.fillRect(image.rect(), gradient);
+    }
+    QVERIFY(image.save(TMP_FILE, "jpeg"));
+    const QImage original(TMP_FILE);
+
+    Gwenview::JpegContent content;
+    bool result = content.load(TMP_FILE);
+    QVERIFY(result);
+    const QByteArray rawData = content.rawData();
+
+    // Crop rects are expressed in the coordinates of the rotated image
+    content.transform(Gwenview::ROT_90);
+
+    // Not aligned on iMCUs: the content is left untouched, rotation included
+    QVERIFY(!content.crop(QRect(4, 32, 50, 100)));
+    QCOMPARE(content.rawData(), rawData);
+    QCOMPARE(content.size(), image.size());
+    result = content.save(TMP_FILE);
+    QVERIFY(result);
+    QCOMPARE(QImage(TMP_FILE).size(), QSize(96, 200));
+
+    result = content.load(TMP_FILE);
+    QVERIFY(result);
+    content.transform(Gwenview::ROT_270);
+    const QRect rect(32, 16, 100, 50);
+    if (!content.crop(rect)) {
+        QSKIP("libjpeg is too old to crop without decoding");
+    }
+    QCOMPARE(content.size(), rect.size());
+    result = content.save(TMP_FILE);
+    QVERIFY(result);
+
+    QImage cropped(TMP_FILE);
+    QCOMPARE(cropped.size(), rect.size());
+    // Rotating back and forth is lossless, so cropped matches the original
+    const QRect inside = QRect(QPoint(0, 0), rect.size()).adjusted(2, 2, -2, -2);
+    QVERIFY(TestUtils::fuzzyImageCompare(cropped.copy(inside), original.copy(inside.translated(rect.topLeft()))));
+}
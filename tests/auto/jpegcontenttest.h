@@ -39,6 +39,9 @@ private Q_SLOTS:
     void testLoadTruncated();
     void testRawData();
     void testSetImage();
+    void testTransformAfterSetImage();
+    void testCrop();
+    void testCropAfterTransform();
 };
 
 #endif // JPEGCONTENTTEST_H
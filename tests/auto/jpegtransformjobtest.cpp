@@ -0,0 +1,142 @@
+/*
+Gwenview: an image viewer
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+#include "jpegtransformjobtest.h"
+
+// Qt
+#include <QFile>
+#include <QImage>
+#include <QSignalSpy>
+#include <QTest>
+
+// Local
+#include "../lib/gwenviewconfig.h"
+#include "../lib/imageutils.h"
+#include "../lib/jpegcontent.h"
+#include "../lib/jpegtransformjob.h"
+#include "../lib/orientation.h"
+#include "testutils.h"
+
+using namespace Gwenview;
+
+QTEST_MAIN(JpegTransformJobTest)
+
+Q_DECLARE_METATYPE(Gwenview::Orientation)
+
+// orient6.jpg is stored as a 256x128 image, with an EXIF orientation of ROT_90
+static const char* ORIENT6_FILE = "orient6.jpg";
+
+void JpegTransformJobTest::initTestCase()
+{
+    qRegisterMetaType<QUrl>("QUrl");
+    GwenviewConfig::setApplyExifOrientation(true);
+}
+
+void JpegTransformJobTest::testCombinedOrientation_data()
+{
+    QTest::addColumn<Orientation>("first");
+    QTest::addColumn<Orientation>("second");
+    QTest::addColumn<Orientation>("expected");
+
+    QTest::newRow("normal") << NORMAL << ROT_90 << ROT_90;
+    QTest::newRow("rot90-rot90") << ROT_90 << ROT_90 << ROT_180;
+    QTest::newRow("rot90-rot270") << ROT_90 << ROT_270 << NORMAL;
+    QTest::newRow("rot180-rot270") << ROT_180 << ROT_270 << ROT_90;
+    QTest::newRow("hflip-hflip") << HFLIP << HFLIP << NORMAL;
+    QTest::newRow("hflip-rot180") << HFLIP << ROT_180 << VFLIP;
+}
+
+void JpegTransformJobTest::testCombinedOrientation()
+{
+    QFETCH(Orientation, first);
+    QFETCH(Orientation, second);
+    QFETCH(Orientation, expected);
+    QCOMPARE(JpegTransformJob::combinedOrientation(first, second), expected);
+}
+
+void JpegTransformJobTest::testTransform_data()
+{
+    QTest::addColumn<Orientation>("orientation");
+    QTest::addColumn<QSize>("expectedSize");
+    QTest::addColumn<Orientation>("pixelOrientation");
+
+    // Rotating the portrait image to the left cancels its EXIF orientation:
+    // pixels are left untouched
+    QTest::newRow("rot270") << ROT_270 << QSize(256, 128) << NORMAL;
+    QTest::newRow("rot90") << ROT_90 << QSize(256, 128) << ROT_180;
+}
+
+void JpegTransformJobTest::testTransform()
+{
+    QFETCH(Orientation, orientation);
+    QFETCH(QSize, expectedSize);
+    QFETCH(Orientation, pixelOrientation);
+
+    const QImage original(pathForTestFile(ORIENT6_FILE));
+    QVERIFY(!original.isNull());
+
+    TestUtils::SandBoxDir sandBox;
+    QList<QUrl> urls;
+    for (int idx = 0; idx < 2; ++idx) {
+        const QString path = sandBox.absoluteFilePath(QStringLiteral("image%1.jpg").arg(idx));
+        QVERIFY(QFile::copy(pathForTestFile(ORIENT6_FILE), path));
+        urls << QUrl::fromLocalFile(path);
+    }
+
+    JpegTransformJob* job = new JpegTransformJob(urls, orientation);
+    job->setAutoDelete(false);
+    QSignalSpy spy(job, SIGNAL(urlTransformed(QUrl)));
+    QVERIFY2(job->exec(), qPrintable(job->errorString()));
+    QCOMPARE(spy.count(), urls.count());
+    QVERIFY(job->failedUrls().isEmpty());
+    delete job;
+
+    const QImage expected = original.transformed(ImageUtils::transformMatrix(pixelOrientation));
+    Q_FOREACH(const QUrl& url, urls) {
+        JpegContent content;
+        QVERIFY(content.load(url.toLocalFile()));
+        QCOMPARE(content.orientation(), NORMAL);
+        QCOMPARE(content.size(), expectedSize);
+
+        const QImage thumbnail = content.thumbnail();
+        QVERIFY(!thumbnail.isNull());
+        QCOMPARE(thumbnail.width() > thumbnail.height(), expectedSize.width() > expectedSize.height());
+
+        const QImage image(url.toLocalFile());
+        QVERIFY(TestUtils::fuzzyImageCompare(image, expected));
+    }
+}
+
+void JpegTransformJobTest::testFailedUrl()
+{
+    TestUtils::SandBoxDir sandBox;
+    const QString path = sandBox.absoluteFilePath(QStringLiteral("image.jpg"));
+    QVERIFY(QFile::copy(pathForTestFile(ORIENT6_FILE), path));
+    const QUrl goodUrl = QUrl::fromLocalFile(path);
+    const QUrl badUrl = QUrl::fromLocalFile(sandBox.absoluteFilePath(QStringLiteral("missing.jpg")));
+
+    JpegTransformJob* job = new JpegTransformJob(QList<QUrl>() << badUrl << goodUrl, ROT_90);
+    job->setAutoDelete(false);
+    QVERIFY(!job->exec());
+    QCOMPARE(job->failedUrls(), QList<QUrl>() << badUrl);
+    delete job;
+
+    JpegContent content;
+    QVERIFY(content.load(path));
+    QCOMPARE(content.orientation(), NORMAL);
+}
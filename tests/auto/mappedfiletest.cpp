@@ -0,0 +1,78 @@
+/*
+Gwenview: an image viewer
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+#include "mappedfiletest.h"
+
+// Qt
+#include <QFile>
+#include <QTemporaryDir>
+
+// KDE
+#include <qtest.h>
+
+// Local
+#include "../lib/mappedfile.h"
+
+QTEST_MAIN(MappedFileTest)
+
+using namespace Gwenview;
+
+static const int FILE_SIZE = 1024 * 1024;
+
+static bool createFile(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    return file.write(QByteArray(FILE_SIZE, 'x')) == FILE_SIZE;
+}
+
+void MappedFileTest::testMap()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path = dir.path() + "/file";
+    QVERIFY(createFile(path));
+
+    MappedFile file(path);
+    QVERIFY(file.map());
+    QCOMPARE(file.data(), QByteArray(FILE_SIZE, 'x'));
+    QVERIFY(!file.isTruncated());
+}
+
+void MappedFileTest::testTruncated()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("Mapped files cannot be truncated on this platform");
+#endif
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+    const QString path = dir.path() + "/file";
+    QVERIFY(createFile(path));
+
+    MappedFile file(path);
+    QVERIFY(file.map());
+    QVERIFY(QFile::resize(path, 0));
+    QVERIFY(file.isTruncated());
+
+    // Reading the missing pages must not crash, they read as zeros
+    const QByteArray& data = file.data();
+    QCOMPARE(data.at(FILE_SIZE / 2), '\0');
+    QCOMPARE(data.at(FILE_SIZE - 1), '\0');
+}
@@ -26,6 +26,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 // KDE
 #include <QDebug>
 #include <KRandom>
+#include <QTemporaryDir>
 #include <QTemporaryFile>
 #include <qtest.h>
 
@@ -55,6 +56,8 @@ SemanticInfoBackEndClient::SemanticInfoBackEndClient(AbstractSemanticInfoBackEnd
 {
     connect(backEnd, SIGNAL(semanticInfoRetrieved(QUrl,SemanticInfo)),
             SLOT(slotSemanticInfoRetrieved(QUrl,SemanticInfo)));
+    connect(backEnd, SIGNAL(semanticInfoBatchRetrieved(SemanticInfoHash)),
+            SLOT(slotSemanticInfoBatchRetrieved(SemanticInfoHash)));
 }
 
 void SemanticInfoBackEndClient::slotSemanticInfoRetrieved(const QUrl &url, const SemanticInfo& semanticInfo)
@@ -62,6 +65,11 @@ void SemanticInfoBackEndClient::slotSemanticInfoRetrieved(const QUrl &url, const
     mSemanticInfoForUrl[url] = semanticInfo;
 }
 
+void SemanticInfoBackEndClient::slotSemanticInfoBatchRetrieved(const SemanticInfoHash& semanticInfoHash)
+{
+    mSemanticInfoForUrl.unite(semanticInfoHash);
+}
+
 void SemanticInfoBackEndTest::initTestCase()
 {
     qRegisterMetaType<QUrl>("QUrl");
@@ -106,6 +114,32 @@ void SemanticInfoBackEndTest::testRating()
     mBackEnd->storeSemanticInfo(url, semanticInfo);
 }
 
+/**
+ * Retrieve the semantic info of more files than fit in one batch
+ */
+void SemanticInfoBackEndTest::testRetrieveBatch()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    QList<QUrl> urls;
+    for (int idx = 0; idx < 200; ++idx) {
+        QString path = dir.path() + QString("/%1.metadatabackendtest").arg(idx);
+        createEmptyFile(path);
+        urls << QUrl::fromLocalFile(path);
+    }
+
+    SemanticInfoBackEndClient client(mBackEnd);
+    mBackEnd->retrieveSemanticInfoBatch(urls);
+    for (int x = 0; x < 50 && client.count() < urls.count(); ++x) {
+        QTest::qWait(100);
+    }
+    QCOMPARE(client.count(), urls.count());
+    Q_FOREACH(const QUrl& url, urls) {
+        QCOMPARE(client.semanticInfoForUrl(url).mRating, 0);
+    }
+}
+
 #if 0
 // Disabled because Baloo does not work like Nepomuk: it does not create tags
 // independently of files.
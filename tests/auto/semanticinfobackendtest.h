@@ -35,7 +35,8 @@ namespace Gwenview
 
 /**
  * Helper class which gathers the metadata retrieved when
- * AbstractSemanticInfoBackEnd::retrieveSemanticInfo() is called.
+ * AbstractSemanticInfoBackEnd::retrieveSemanticInfo() or
+ * AbstractSemanticInfoBackEnd::retrieveSemanticInfoBatch() is called.
  */
 class SemanticInfoBackEndClient : public QObject
 {
@@ -48,8 +49,14 @@ public:
         return mSemanticInfoForUrl.value(url);
     }
 
+    int count() const
+    {
+        return mSemanticInfoForUrl.count();
+    }
+
 private Q_SLOTS:
     void slotSemanticInfoRetrieved(const QUrl&, const SemanticInfo&);
+    void slotSemanticInfoBatchRetrieved(const SemanticInfoHash&);
 
 private:
     QHash<QUrl, SemanticInfo> mSemanticInfoForUrl;
@@ -65,6 +72,7 @@ private Q_SLOTS:
     void init();
     void cleanup();
     void testRating();
+    void testRetrieveBatch();
     #if 0
     void testTagForLabel();
     #endif
@@ -24,6 +24,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <QFile>
 #include <QImage>
 #include <QPainter>
+#include <QThread>
+#include <QTimer>
 
 // KDE
 #include <qtest.h>
@@ -33,12 +35,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 // Local
 #include "../lib/imageformats/imageformats.h"
+#include "../lib/jpegcontent.h"
+#include "../lib/thumbnailprovider/thumbnailpack.h"
 #include "../lib/thumbnailprovider/thumbnailprovider.h"
+#include "../lib/thumbnailprovider/thumbnailsourcefetcher.h"
 #include "testutils.h"
 
 // libc
 #include <errno.h>
 #include <string.h>
+#include <utime.h>
 
 using namespace Gwenview;
 
@@ -107,6 +113,66 @@ void ThumbnailProviderTest::init()
     mSandBox.fill();
 }
 
+/**
+ * Stands in for a slow remote transfer: sends a local file in small chunks,
+ * one chunk every few milliseconds
+ */
+class SlowFileFetcher : public ThumbnailSourceFetcher
+{
+public:
+    enum { ChunkSize = 4096 };
+
+    SlowFileFetcher(const QUrl& url, const QString& destPath, int pixelSize)
+    : ThumbnailSourceFetcher(url, destPath, pixelSize)
+    , mSentSize(0)
+    {
+        mTimer.setInterval(2);
+        QObject::connect(&mTimer, &QTimer::timeout, [this]() {
+            sendChunk();
+        });
+    }
+
+    int sentSize() const
+    {
+        return mSentSize;
+    }
+
+protected:
+    void startTransfer(const QUrl& url) Q_DECL_OVERRIDE
+    {
+        QFile file(url.toLocalFile());
+        if (!file.open(QIODevice::ReadOnly)) {
+            // Fails the job, exec() returns false in the test
+            transferFinished(KJob::UserDefinedError, file.errorString());
+            return;
+        }
+        mData = file.readAll();
+        mTimer.start();
+    }
+
+    void abortTransfer() Q_DECL_OVERRIDE
+    {
+        mTimer.stop();
+    }
+
+private:
+    QTimer mTimer;
+    QByteArray mData;
+    int mSentSize;
+
+    void sendChunk()
+    {
+        if (mSentSize == mData.size()) {
+            mTimer.stop();
+            transferFinished(0, QString());
+            return;
+        }
+        const QByteArray chunk = mData.mid(mSentSize, ChunkSize);
+        mSentSize += chunk.size();
+        addData(chunk);
+    }
+};
+
 static void syncRun(ThumbnailProvider *provider)
 {
     QEventLoop loop;
@@ -187,6 +253,185 @@ void ThumbnailProviderTest::testLoadLocal()
     }
 }
 
+void ThumbnailProviderTest::testLoadFromCache()
+{
+    QDir dir(mSandBox.mPath);
+    KFileItemList list;
+    Q_FOREACH(const QFileInfo & info, dir.entryInfoList(QDir::Files)) {
+        QUrl url("file://" + info.absoluteFilePath());
+        list << KFileItem(url);
+    }
+
+    // Generate the thumbnails
+    {
+        ThumbnailProvider provider;
+        provider.setThumbnailGroup(ThumbnailGroup::Normal);
+        provider.appendItems(list);
+        syncRun(&provider);
+        while (!ThumbnailProvider::isThumbnailWriterEmpty()) {
+            QTest::qWait(100);
+        }
+    }
+
+    // Load them again: they should come from the cache, in batches
+    ThumbnailProvider provider;
+    provider.setThumbnailGroup(ThumbnailGroup::Normal);
+    LoadedThumbnailList thumbnails;
+    connect(&provider, &ThumbnailProvider::thumbnailsLoaded, [&thumbnails](const LoadedThumbnailList& batch) {
+        thumbnails << batch;
+    });
+    QSignalSpy spy(&provider, SIGNAL(thumbnailLoaded(KFileItem,QPixmap,QSize,qulonglong)));
+    provider.appendItems(list);
+    syncRun(&provider);
+
+    // small.png is too small to have a thumbnail, so it is generated again
+    QCOMPARE(spy.count(), 1);
+    QCOMPARE(qvariant_cast<KFileItem>(spy.at(0).at(0)).url().fileName(), QString("small.png"));
+
+    QCOMPARE(thumbnails.count(), mSandBox.mSizeHash.size() - 1);
+    Q_FOREACH(const LoadedThumbnail& thumbnail, thumbnails) {
+        QVERIFY(!thumbnail.mPixmap.isNull());
+        const QSize expectedSize = mSandBox.mSizeHash.value(thumbnail.mItem.url().fileName());
+        QCOMPARE(thumbnail.mFullSize, expectedSize);
+        QCOMPARE(thumbnail.mFileSize, qulonglong(thumbnail.mItem.size()));
+    }
+}
+
+void ThumbnailProviderTest::testLoadFromPack()
+{
+    QDir dir(mSandBox.mPath);
+    KFileItemList list;
+    Q_FOREACH(const QFileInfo & info, dir.entryInfoList(QDir::Files)) {
+        QUrl url("file://" + info.absoluteFilePath());
+        list << KFileItem(url);
+    }
+    const QString packPath = ThumbnailPack::packPath(QUrl::fromLocalFile(mSandBox.mPath), ThumbnailGroup::Normal);
+    ThumbnailPack::forget(packPath);
+
+    // Generate the thumbnails: this creates the pack
+    {
+        ThumbnailProvider provider;
+        provider.setThumbnailGroup(ThumbnailGroup::Normal);
+        provider.appendItems(list);
+        syncRun(&provider);
+    }
+    QTRY_VERIFY_WITH_TIMEOUT(ThumbnailProvider::isThumbnailWriterEmpty(), 10000);
+    QTRY_VERIFY_WITH_TIMEOUT(QFile::exists(packPath), 10000);
+    ThumbnailPack::forget(packPath);
+
+    // Without the thumbnail cache, thumbnails can only come from the pack
+    QVERIFY(QDir(ThumbnailProvider::thumbnailBaseDir(ThumbnailGroup::Normal)).removeRecursively());
+    QVERIFY(QDir(ThumbnailProvider::thumbnailBaseDir(ThumbnailGroup::Large)).removeRecursively());
+
+    // Packed thumbnails must not be used for modified files. Make sure the
+    // modification time changes, even if we are fast.
+    const QString redPath = mSandBox.mPath + "/red.png";
+    const time_t redTime = QFileInfo(redPath).lastModified().toTime_t();
+    mSandBox.createTestImage("red.png", 400, 100, Qt::red);
+    struct utimbuf times;
+    times.actime = redTime + 10;
+    times.modtime = redTime + 10;
+    QVERIFY2(utime(QFile::encodeName(redPath).constData(), &times) == 0, strerror(errno));
+
+    // Create new items, the old ones know the previous size of red.png
+    list.clear();
+    Q_FOREACH(const QFileInfo & info, dir.entryInfoList(QDir::Files)) {
+        QUrl url("file://" + info.absoluteFilePath());
+        list << KFileItem(url);
+    }
+
+    ThumbnailProvider provider;
+    provider.setThumbnailGroup(ThumbnailGroup::Normal);
+    LoadedThumbnailList thumbnails;
+    connect(&provider, &ThumbnailProvider::thumbnailsLoaded, [&thumbnails](const LoadedThumbnailList& batch) {
+        thumbnails << batch;
+    });
+    QSignalSpy spy(&provider, SIGNAL(thumbnailLoaded(KFileItem,QPixmap,QSize,qulonglong)));
+    provider.appendItems(list);
+    syncRun(&provider);
+
+    // small.png has no thumbnail, red.png changed
+    QCOMPARE(spy.count(), 2);
+    QStringList generatedNames;
+    for (int i = 0; i < spy.count(); ++i) {
+        const QString name = qvariant_cast<KFileItem>(spy.at(i).at(0)).url().fileName();
+        generatedNames << name;
+        QCOMPARE(spy.at(i).at(2).toSize(), mSandBox.mSizeHash.value(name));
+    }
+    generatedNames.sort();
+    QCOMPARE(generatedNames, QStringList() << "red.png" << "small.png");
+
+    QCOMPARE(thumbnails.count(), mSandBox.mSizeHash.size() - 2);
+    Q_FOREACH(const LoadedThumbnail& thumbnail, thumbnails) {
+        QVERIFY(!thumbnail.mPixmap.isNull());
+        const QSize expectedSize = mSandBox.mSizeHash.value(thumbnail.mItem.url().fileName());
+        QCOMPARE(thumbnail.mFullSize, expectedSize);
+    }
+}
+
+void ThumbnailProviderTest::testFetchRemoteHeader()
+{
+    // Create a big JPEG with a big enough EXIF thumbnail
+    const QSize size(1600, 1200);
+    QImage image(size, QImage::Format_RGB32);
+    qsrand(1);
+    for (int y = 0; y < size.height(); ++y) {
+        QRgb* line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < size.width(); ++x) {
+            line[x] = qRgb(qrand() % 256, qrand() % 256, qrand() % 256);
+        }
+    }
+    JpegContent content;
+    QVERIFY(content.load(pathForTestFile("orient6.jpg")));
+    content.setImage(image);
+    content.setThumbnail(image.scaled(160, 120));
+    const QString path = mSandBox.mPath + "/big.jpg";
+    QVERIFY(content.save(path));
+    const qint64 fileSize = QFileInfo(path).size();
+
+    const QString destPath = mSandBox.mPath + "/big-header.jpg";
+    SlowFileFetcher fetcher(QUrl::fromLocalFile(path), destPath, ThumbnailGroup::pixelSize(ThumbnailGroup::Normal));
+    fetcher.setAutoDelete(false);
+    QVERIFY2(fetcher.exec(), qPrintable(fetcher.errorString()));
+
+    // Only the beginning of the file should have been transferred
+    QVERIFY(fetcher.isPartial());
+    QCOMPARE(fetcher.receivedSize(), qint64(fetcher.sentSize()));
+    QVERIFY(fetcher.receivedSize() < fileSize / 10);
+
+    // The header must be usable on its own
+    JpegContent header;
+    QVERIFY(header.load(destPath));
+    QCOMPARE(header.size(), size);
+    QCOMPARE(header.thumbnail().size(), QSize(160, 120));
+}
+
+void ThumbnailProviderTest::testFetchRemoteWholeFile_data()
+{
+    QTest::addColumn<QString>("fileName");
+
+    QTest::newRow("png") << "red.png";
+    // Its EXIF thumbnail is too small
+    QTest::newRow("jpeg") << "orient6.jpg";
+}
+
+void ThumbnailProviderTest::testFetchRemoteWholeFile()
+{
+    QFETCH(QString, fileName);
+    const QString path = mSandBox.mPath + '/' + fileName;
+    const QString destPath = mSandBox.mPath + "/fetched";
+    SlowFileFetcher fetcher(QUrl::fromLocalFile(path), destPath, ThumbnailGroup::pixelSize(ThumbnailGroup::Normal));
+    fetcher.setAutoDelete(false);
+    QVERIFY2(fetcher.exec(), qPrintable(fetcher.errorString()));
+
+    QVERIFY(!fetcher.isPartial());
+    QFile original(path);
+    QVERIFY(original.open(QIODevice::ReadOnly));
+    QFile fetched(destPath);
+    QVERIFY(fetched.open(QIODevice::ReadOnly));
+    QCOMPARE(fetched.readAll(), original.readAll());
+}
+
 void ThumbnailProviderTest::testUseEmbeddedOrNot()
 {
     QImage expectedThumbnail;
@@ -278,3 +523,30 @@ void ThumbnailProviderTest::testRemoveItemsWhileGenerating()
     provider.removeItems(list);
     loop.exec();
 }
+
+void ThumbnailProviderTest::testRemoveItemsWithFullPool()
+{
+    // Create more big images than there are workers, so that the provider
+    // waits for a worker to be available
+    const int count = QThread::idealThreadCount() * 2 + 2;
+    KFileItemList list;
+    for (int i = 0; i < count; ++i) {
+        const QString name = QStringLiteral("big%1.png").arg(i);
+        mSandBox.createTestImage(name, 2000, 1500, Qt::blue);
+        list << KFileItem(QUrl::fromLocalFile(mSandBox.mPath + '/' + name));
+    }
+
+    ThumbnailProvider provider;
+    provider.setThumbnailGroup(ThumbnailGroup::Normal);
+    QSignalSpy loadedSpy(&provider, SIGNAL(thumbnailLoaded(KFileItem,QPixmap,QSize,qulonglong)));
+    QSignalSpy finishedSpy(&provider, SIGNAL(finished()));
+    provider.appendItems(list);
+
+    // Once the first thumbnail is there, the other workers are busy. Remove
+    // all items: the running tasks get cancelled and we must still be told
+    // when they are done.
+    QVERIFY(loadedSpy.wait(10000));
+    provider.removeItems(list);
+    QTRY_VERIFY_WITH_TIMEOUT(!finishedSpy.isEmpty(), 10000);
+    QVERIFY(!provider.isRunning());
+}
@@ -47,9 +47,15 @@ private Q_SLOTS:
     void init();
     void initTestCase();
     void testLoadLocal();
+    void testLoadFromCache();
+    void testLoadFromPack();
+    void testFetchRemoteHeader();
+    void testFetchRemoteWholeFile_data();
+    void testFetchRemoteWholeFile();
     void testLoadRemote();
     void testUseEmbeddedOrNot();
     void testRemoveItemsWhileGenerating();
+    void testRemoveItemsWithFullPool();
 
 private:
     SandBox mSandBox;
@@ -25,6 +25,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 // KDE
 #include <KFileItem>
+#include <QSignalSpy>
+#include <QStandardPaths>
+#include <QTemporaryDir>
 #include <QTemporaryFile>
 #include <qtest.h>
 
@@ -42,6 +45,12 @@ static void touchFile(const QString& path)
     utime(QFile::encodeName(path).data(), 0);
 }
 
+void TimeUtilsTest::initTestCase()
+{
+    // Keep the date time index out of the user cache
+    QStandardPaths::setTestModeEnabled(true);
+}
+
 #define NEW_ROW(fileName, dateTime) QTest::newRow(fileName) << fileName << dateTime
 void TimeUtilsTest::testBasic_data()
 {
@@ -90,3 +99,26 @@ void TimeUtilsTest::testCache()
 
     QCOMPARE(dateTime2, item2.time(KFileItem::ModificationTime));
 }
+
+void TimeUtilsTest::testCacheOnly()
+{
+    QTemporaryDir dir;
+    const QString path = dir.path() + "/exif-datetimeoriginal.jpg";
+    QVERIFY(QFile::copy(pathForTestFile("date/exif-datetimeoriginal.jpg"), path));
+    KFileItem item(QUrl::fromLocalFile(path));
+
+    qRegisterMetaType<QList<QUrl> >("QList<QUrl>");
+    QSignalSpy spy(TimeUtils::DateTimeIndex::instance(), SIGNAL(dateTimesLoaded(QList<QUrl>)));
+
+    // The date is not known yet: the modification time must be returned
+    // without reading the file
+    QDateTime dateTime = TimeUtils::dateTimeForFileItem(item, TimeUtils::CacheOnly);
+    QCOMPARE(dateTime, item.time(KFileItem::ModificationTime));
+
+    QVERIFY(spy.wait());
+    QList<QUrl> urls = spy.takeFirst().at(0).value<QList<QUrl> >();
+    QVERIFY(urls.contains(item.targetUrl()));
+
+    dateTime = TimeUtils::dateTimeForFileItem(item, TimeUtils::CacheOnly);
+    QCOMPARE(dateTime, QDateTime::fromString("2003-03-10T17:45:21", Qt::ISODate));
+}
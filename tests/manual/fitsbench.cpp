@@ -0,0 +1,149 @@
+// Qt
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QThreadPool>
+#include <QtEndian>
+
+// STL
+#include <string.h>
+
+// Local
+#include <lib/imageformats/fitsformat/fitsdata.h>
+
+/**
+ * Measures the FITS statistics and stretch kernels on synthetic frames, with
+ * one thread and with all threads.
+ */
+
+const int ITERATIONS = 5;
+const int FITS_BLOCK_SIZE = 2880;
+const int FITS_CARD_SIZE = 80;
+
+static void appendCard(QByteArray* header, const QString& key, const QString& value)
+{
+    QByteArray card = QString("%1= %2").arg(key, -8).arg(value, 20).toLatin1();
+    card.append(QByteArray(FITS_CARD_SIZE - card.size(), ' '));
+    header->append(card);
+}
+
+static void padToBlock(QByteArray* data, char padding)
+{
+    const int remainder = data->size() % FITS_BLOCK_SIZE;
+    if (remainder) {
+        data->append(QByteArray(FITS_BLOCK_SIZE - remainder, padding));
+    }
+}
+
+/**
+ * Creates a frame looking vaguely like a sky: a noisy background with a few
+ * bright spots
+ */
+static QByteArray createFrame(int bitpix, int width, int height)
+{
+    QByteArray data;
+    appendCard(&data, "SIMPLE", "T");
+    appendCard(&data, "BITPIX", QString::number(bitpix));
+    appendCard(&data, "NAXIS", "2");
+    appendCard(&data, "NAXIS1", QString::number(width));
+    appendCard(&data, "NAXIS2", QString::number(height));
+    if (bitpix == 16) {
+        appendCard(&data, "BZERO", "32768");
+        appendCard(&data, "BSCALE", "1");
+    }
+    QByteArray end("END");
+    end.append(QByteArray(FITS_CARD_SIZE - end.size(), ' '));
+    data.append(end);
+    padToBlock(&data, ' ');
+
+    const int headerSize = data.size();
+    const int bytesPerSample = qAbs(bitpix) / 8;
+    data.resize(headerSize + width * height * bytesPerSample);
+    uchar* out = reinterpret_cast<uchar*>(data.data()) + headerSize;
+
+    quint32 seed = 1;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            seed = seed * 1103515245 + 12345;
+            float value = 1000 + (seed >> 16) % 200;
+            if ((x / 64 + y / 64) % 17 == 0) {
+                value += 20000;
+            }
+            if (bitpix == 16) {
+                qToBigEndian<qint16>(qint16(int(value) - 32768), out);
+            } else {
+                quint32 bits;
+                memcpy(&bits, &value, sizeof(bits));
+                qToBigEndian<quint32>(bits, out);
+            }
+            out += bytesPerSample;
+        }
+    }
+    padToBlock(&data, '\0');
+    return data;
+}
+
+static void bench(const char* name, FITSData* fits, int threadCount)
+{
+    QThreadPool::globalInstance()->setMaxThreadCount(threadCount);
+
+    QElapsedTimer chrono;
+    chrono.start();
+    for (int iteration = 0; iteration < ITERATIONS; ++iteration) {
+        fits->calculateStats(true);
+    }
+    const qint64 statsTime = chrono.restart();
+
+    QImage image;
+    for (int iteration = 0; iteration < ITERATIONS; ++iteration) {
+        image = fits->toImage();
+    }
+    const qint64 stretchTime = chrono.elapsed();
+
+    qDebug() << name << "threads:" << threadCount
+             << "stats:" << statsTime / ITERATIONS << "ms"
+             << "stretch:" << stretchTime / ITERATIONS << "ms";
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    int width = 6000;
+    int height = 4000;
+    if (argc == 3) {
+        width = QString::fromUtf8(argv[1]).toInt();
+        height = QString::fromUtf8(argv[2]).toInt();
+    }
+    if (argc == 2 || argc > 3 || width <= 0 || height <= 0) {
+        qDebug() << "Usage: fitsbench [<width> <height>]";
+        return 1;
+    }
+
+    const int idealThreadCount = QThreadPool::globalInstance()->maxThreadCount();
+
+    struct {
+        const char* name;
+        int bitpix;
+    } frames[] = {
+        { "16-bit", 16 },
+        { "float", -32 }
+    };
+
+    for (const auto& frame : frames) {
+        QByteArray data = createFrame(frame.bitpix, width, height);
+        QBuffer buffer(&data);
+        buffer.open(QIODevice::ReadOnly);
+
+        FITSData fits;
+        if (!fits.loadFITS(buffer)) {
+            qDebug() << "Could not load" << frame.name << "frame:" << fits.getLastError();
+            return 2;
+        }
+        bench(frame.name, &fits, 1);
+        bench(frame.name, &fits, idealThreadCount);
+    }
+
+    return 0;
+}
@@ -1,61 +1,673 @@
-#include <QBuffer>
-#include <QCoreApplication>
+// Qt
+#include <QApplication>
+#include <QCommandLineParser>
 #include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QFileInfo>
 #include <QImage>
 #include <QImageReader>
-#include <QTime>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QPainter>
+#include <QRadialGradient>
+#include <QTemporaryDir>
+#include <QTest>
+#include <QtEndian>
 
+// KDE
+#include <KFileItem>
+
+// STL
+#include <algorithm>
+
+// Local
+#include <lib/document/documentfactory.h>
 #include <lib/imageformats/imageformats.h>
+#include <lib/thumbnailprovider/thumbnailprovider.h>
+
+using namespace Gwenview;
 
-const int ITERATIONS = 2;
+/**
+ * Measures how fast Gwenview decodes images, on a generated corpus or on the
+ * files given on the command line, and writes the results as JSON.
+ *
+ * For each file it measures:
+ * - qtScaledRead: QImageReader reading the image scaled to SCALED_SIZE
+ * - metaInfo: Document loading until the size is known
+ * - firstPixel: Document loading until an image fitting SCALED_SIZE is ready
+ * - fullDecode: Document loading until the full image is ready
+ * - downSampled: Document loading until the image down sampled by each
+ *   invertedZoom is ready
+ * - thumbnail: ThumbnailProvider generating a normal thumbnail
+ * - peakRss: the peak resident memory while measuring the file, on Linux
+ *
+ * Times are in milliseconds, memory in bytes.
+ */
+
+const int DEFAULT_ITERATIONS = 3;
 const QSize SCALED_SIZE(1280, 800);
+const int INVERTED_ZOOMS[] = { 2, 4, 8 };
+const int TIMEOUT = 60000;
+
+const int FITS_BLOCK_SIZE = 2880;
+const int FITS_CARD_SIZE = 80;
+
+const int GIF_FRAME_COUNT = 10;
+
+//// Corpus generation ////
+
+/**
+ * Creates an image looking vaguely like a photo: smooth gradients, some hard
+ * edges and noise, so that encoders have something to chew on
+ */
+static QImage createImage(const QSize& size, int seed)
+{
+    QImage image(size, QImage::Format_RGB32);
+    {
+        QPainter painter(&image);
+        QLinearGradient sky(0, 0, 0, size.height());
+        sky.setColorAt(0, QColor(40, 90, 200));
+        sky.setColorAt(1, QColor(250, 220, 180));
+        painter.fillRect(image.rect(), sky);
+
+        painter.setPen(Qt::NoPen);
+        for (int idx = 0; idx < 12; ++idx) {
+            const int radius = size.width() / (4 + (idx + seed) % 8);
+            const QPointF center(size.width() * ((idx * 37 + seed * 11) % 100) / 100.,
+                                 size.height() * ((idx * 53 + seed * 7) % 100) / 100.);
+            QRadialGradient gradient(center, radius);
+            gradient.setColorAt(0, QColor::fromHsv((idx * 30 + seed * 50) % 360, 200, 240));
+            gradient.setColorAt(1, Qt::transparent);
+            painter.setBrush(gradient);
+            painter.drawEllipse(center, radius, radius);
+        }
+    }
+
+    quint32 random = seed + 1;
+    for (int y = 0; y < size.height(); ++y) {
+        QRgb* line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < size.width(); ++x) {
+            random = random * 1103515245 + 12345;
+            const int noise = int((random >> 16) % 17) - 8;
+            const QRgb rgb = line[x];
+            line[x] = qRgb(qBound(0, qRed(rgb) + noise, 255),
+                           qBound(0, qGreen(rgb) + noise, 255),
+                           qBound(0, qBlue(rgb) + noise, 255));
+        }
+    }
+    return image;
+}
+
+static void appendFITSCard(QByteArray* header, const QString& key, const QString& value)
+{
+    QByteArray card = QString("%1= %2").arg(key, -8).arg(value, 20).toLatin1();
+    card.append(QByteArray(FITS_CARD_SIZE - card.size(), ' '));
+    header->append(card);
+}
+
+static void padFITSToBlock(QByteArray* data, char padding)
+{
+    const int remainder = data->size() % FITS_BLOCK_SIZE;
+    if (remainder) {
+        data->append(QByteArray(FITS_BLOCK_SIZE - remainder, padding));
+    }
+}
+
+/**
+ * Writes the luminance of image as a 16-bit FITS frame
+ */
+static bool saveFITS(const QImage& image, const QString& path)
+{
+    QByteArray data;
+    appendFITSCard(&data, "SIMPLE", "T");
+    appendFITSCard(&data, "BITPIX", "16");
+    appendFITSCard(&data, "NAXIS", "2");
+    appendFITSCard(&data, "NAXIS1", QString::number(image.width()));
+    appendFITSCard(&data, "NAXIS2", QString::number(image.height()));
+    appendFITSCard(&data, "BZERO", "32768");
+    appendFITSCard(&data, "BSCALE", "1");
+    QByteArray end("END");
+    end.append(QByteArray(FITS_CARD_SIZE - end.size(), ' '));
+    data.append(end);
+    padFITSToBlock(&data, ' ');
+
+    const int headerSize = data.size();
+    data.resize(headerSize + image.width() * image.height() * 2);
+    uchar* out = reinterpret_cast<uchar*>(data.data()) + headerSize;
+    // FITS rows go from bottom to top
+    for (int y = image.height() - 1; y >= 0; --y) {
+        const QRgb* line = reinterpret_cast<const QRgb*>(image.constScanLine(y));
+        for (int x = 0; x < image.width(); ++x) {
+            const int value = qGray(line[x]) * 257;
+            qToBigEndian<qint16>(qint16(value - 32768), out);
+            out += 2;
+        }
+    }
+    padFITSToBlock(&data, '\0');
+
+    QFile file(path);
+    return file.open(QIODevice::WriteOnly) && file.write(data) == data.size();
+}
 
-static void bench(QIODevice* device, const QString& outputName)
+/**
+ * Packs variable width LZW codes the way GIF wants them: least significant
+ * bits first, in sub-blocks of at most 255 bytes
+ */
+class GifCodeWriter
 {
-    QTime chrono;
+public:
+    GifCodeWriter(QByteArray* output)
+    : mOutput(output)
+    , mBits(0)
+    , mBitCount(0)
+    {}
+
+    void write(int code, int width)
+    {
+        mBits |= quint32(code) << mBitCount;
+        mBitCount += width;
+        while (mBitCount >= 8) {
+            appendByte(mBits & 0xff);
+            mBits >>= 8;
+            mBitCount -= 8;
+        }
+    }
+
+    void finish()
+    {
+        if (mBitCount > 0) {
+            appendByte(mBits & 0xff);
+        }
+        flushBlock();
+        mOutput->append(char(0));
+    }
+
+private:
+    QByteArray* mOutput;
+    QByteArray mBlock;
+    quint32 mBits;
+    int mBitCount;
+
+    void appendByte(int byte)
+    {
+        mBlock.append(char(byte));
+        if (mBlock.size() == 255) {
+            flushBlock();
+        }
+    }
+
+    void flushBlock()
+    {
+        if (mBlock.isEmpty()) {
+            return;
+        }
+        mOutput->append(char(mBlock.size()));
+        mOutput->append(mBlock);
+        mBlock.clear();
+    }
+};
+
+static void appendLE16(QByteArray* data, int value)
+{
+    data->append(char(value & 0xff));
+    data->append(char((value >> 8) & 0xff));
+}
+
+/**
+ * Writes frames as an animated GIF, using a fixed 3-3-2 palette. Qt cannot
+ * write GIF files, so this does it without compression: a clear code is sent
+ * before the LZW table would need codes wider than 9 bits.
+ */
+static bool saveAnimatedGIF(const QList<QImage>& frames, const QString& path)
+{
+    const QSize size = frames.first().size();
+    QByteArray data("GIF89a");
+    appendLE16(&data, size.width());
+    appendLE16(&data, size.height());
+    data.append(char(0xf7)); // Global color table of 256 entries
+    data.append(char(0));
+    data.append(char(0));
+    for (int idx = 0; idx < 256; ++idx) {
+        data.append(char((idx >> 5) * 255 / 7));
+        data.append(char(((idx >> 2) & 7) * 255 / 7));
+        data.append(char((idx & 3) * 255 / 3));
+    }
+    // Loop forever
+    data.append("\x21\xff\x0bNETSCAPE2.0\x03\x01", 16);
+    appendLE16(&data, 0);
+    data.append(char(0));
+
+    const int clearCode = 256;
+    const int endCode = 257;
+    const int codesPerClear = 250;
+    Q_FOREACH(const QImage& frame, frames) {
+        // Graphic control extension: 100ms per frame
+        data.append("\x21\xf9\x04\x00", 4);
+        appendLE16(&data, 10);
+        data.append(char(0));
+        data.append(char(0));
+
+        data.append(char(0x2c));
+        appendLE16(&data, 0);
+        appendLE16(&data, 0);
+        appendLE16(&data, size.width());
+        appendLE16(&data, size.height());
+        data.append(char(0));
+
+        data.append(char(8)); // Minimum code size
+        GifCodeWriter writer(&data);
+        int count = 0;
+        for (int y = 0; y < size.height(); ++y) {
+            const QRgb* line = reinterpret_cast<const QRgb*>(frame.constScanLine(y));
+            for (int x = 0; x < size.width(); ++x) {
+                if (count % codesPerClear == 0) {
+                    writer.write(clearCode, 9);
+                }
+                const QRgb rgb = line[x];
+                writer.write((qRed(rgb) & 0xe0) | ((qGreen(rgb) >> 3) & 0x1c) | (qBlue(rgb) >> 6), 9);
+                ++count;
+            }
+        }
+        writer.write(endCode, 9);
+        writer.finish();
+    }
+    data.append(char(0x3b));
+
+    QFile file(path);
+    return file.open(QIODevice::WriteOnly) && file.write(data) == data.size();
+}
+
+static QStringList createCorpus(const QString& dirName)
+{
+    QStringList paths;
+    QDir dir(dirName);
+    const QList<QSize> sizes = QList<QSize>()
+                               << QSize(640, 480)
+                               << QSize(2048, 1536)
+                               << QSize(6000, 4000);
+    const QList<int> qualities = QList<int>() << 50 << 85 << 95;
+
+    int seed = 0;
+    Q_FOREACH(const QSize& size, sizes) {
+        const QImage image = createImage(size, seed++);
+        Q_FOREACH(int quality, qualities) {
+            const QString path = dir.filePath(QString("jpeg-%1x%2-q%3.jpg")
+                                              .arg(size.width()).arg(size.height()).arg(quality));
+            if (image.save(path, "jpeg", quality)) {
+                paths << path;
+            } else {
+                qWarning() << "Could not create" << path;
+            }
+        }
+    }
+
+    const QImage image = createImage(sizes.at(1), seed++);
+    QString path = dir.filePath("png-2048x1536.png");
+    if (image.save(path, "png")) {
+        paths << path;
+    } else {
+        qWarning() << "Could not create" << path;
+    }
+
+    path = dir.filePath("fits-2048x1536.fits");
+    if (saveFITS(image, path)) {
+        paths << path;
+    } else {
+        qWarning() << "Could not create" << path;
+    }
+
+    QList<QImage> frames;
+    for (int idx = 0; idx < GIF_FRAME_COUNT; ++idx) {
+        frames << createImage(sizes.first(), seed + idx);
+    }
+    path = dir.filePath("gif-640x480-animated.gif");
+    if (saveAnimatedGIF(frames, path)) {
+        paths << path;
+    } else {
+        qWarning() << "Could not create" << path;
+    }
+    return paths;
+}
+
+//// Measurements ////
+
+/**
+ * Resets the peak resident memory of the process. Only works on Linux.
+ */
+static void resetPeakRss()
+{
+    QFile file("/proc/self/clear_refs");
+    if (file.open(QIODevice::WriteOnly)) {
+        file.write("5");
+    }
+}
+
+/**
+ * Returns the peak resident memory of the process in bytes, -1 if unknown
+ */
+static qint64 peakRss()
+{
+    QFile file("/proc/self/status");
+    if (!file.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+    Q_FOREACH(const QByteArray& line, file.readAll().split('\n')) {
+        if (line.startsWith("VmHWM:")) {
+            return line.mid(6).trimmed().split(' ').first().toLongLong() * 1024;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Processes events until done() returns true. Returns false on timeout.
+ */
+template <class Predicate>
+static bool waitUntil(Predicate done)
+{
+    QElapsedTimer chrono;
     chrono.start();
-    for (int iteration = 0; iteration < ITERATIONS; ++iteration) {
-        qDebug() << "Iteration:" << iteration;
+    while (!done()) {
+        if (chrono.elapsed() > TIMEOUT) {
+            return false;
+        }
+        QTest::qWait(10);
+    }
+    return true;
+}
+
+static Document::Ptr loadDocument(const QUrl& url)
+{
+    // Never get a document from a previous measurement
+    DocumentFactory::instance()->clearCache();
+    return DocumentFactory::instance()->load(url);
+}
 
-        device->open(QIODevice::ReadOnly);
-        QImageReader reader(device);
-        QSize size = reader.size();
+static bool waitForMetaInfo(const Document::Ptr& doc)
+{
+    return waitUntil([&doc]() {
+        return doc->loadingState() >= Document::MetaInfoLoaded;
+    }) && doc->loadingState() != Document::LoadingFailed;
+}
+
+static bool waitForDownSampledImage(const Document::Ptr& doc, qreal zoom)
+{
+    return waitUntil([&doc, zoom]() {
+        return doc->loadingState() == Document::LoadingFailed
+            || doc->prepareDownSampledImageForZoom(zoom);
+    }) && doc->loadingState() != Document::LoadingFailed;
+}
+
+static bool waitForFullImage(const Document::Ptr& doc)
+{
+    doc->startLoadingFullImage();
+    return waitUntil([&doc]() {
+        return doc->loadingState() >= Document::Loaded;
+    }) && doc->loadingState() != Document::LoadingFailed;
+}
+
+/**
+ * Collects the timings of one measurement over all iterations
+ */
+class Timings
+{
+public:
+    Timings()
+    : mFailed(false)
+    {}
+
+    void add(qint64 time)
+    {
+        mTimes << time;
+    }
+
+    void fail()
+    {
+        mFailed = true;
+    }
+
+    QJsonValue toJson() const
+    {
+        if (mFailed || mTimes.isEmpty()) {
+            return QJsonValue();
+        }
+        QList<qint64> times = mTimes;
+        std::sort(times.begin(), times.end());
+        QJsonObject object;
+        object["min"] = double(times.first());
+        object["median"] = double(times.at(times.count() / 2));
+        object["max"] = double(times.last());
+        return object;
+    }
+
+private:
+    QList<qint64> mTimes;
+    bool mFailed;
+};
+
+static void measureQtScaledRead(const QString& path, Timings* timings)
+{
+    QElapsedTimer chrono;
+    chrono.start();
+    QImageReader reader(path);
+    QSize size = reader.size();
+    if (size.isValid()) {
         size.scale(SCALED_SIZE, Qt::KeepAspectRatio);
         reader.setScaledSize(size);
-        QImage img = reader.read();
-        device->close();
+    }
+    const QImage image = reader.read();
+    if (image.isNull()) {
+        timings->fail();
+        return;
+    }
+    timings->add(chrono.elapsed());
+}
 
-        if (iteration == ITERATIONS - 1) {
-            qDebug() << "time:" << chrono.elapsed();
-            img.save(outputName, "png");
-        }
+static void measureFirstPixel(const QUrl& url, Timings* metaInfoTimings, Timings* firstPixelTimings)
+{
+    QElapsedTimer chrono;
+    chrono.start();
+    Document::Ptr doc = loadDocument(url);
+    if (!waitForMetaInfo(doc)) {
+        metaInfoTimings->fail();
+        firstPixelTimings->fail();
+        return;
+    }
+    metaInfoTimings->add(chrono.elapsed());
+
+    const QSize size = doc->size();
+    const qreal zoom = qMin(SCALED_SIZE.width() / qreal(size.width()),
+                            SCALED_SIZE.height() / qreal(size.height()));
+    bool ok;
+    if (zoom < Document::maxDownSampledZoom()) {
+        ok = waitForDownSampledImage(doc, zoom);
+    } else {
+        ok = waitForFullImage(doc);
     }
+    if (!ok) {
+        firstPixelTimings->fail();
+        return;
+    }
+    firstPixelTimings->add(chrono.elapsed());
+}
+
+static void measureFullDecode(const QUrl& url, Timings* timings)
+{
+    QElapsedTimer chrono;
+    chrono.start();
+    Document::Ptr doc = loadDocument(url);
+    if (!waitForFullImage(doc)) {
+        timings->fail();
+        return;
+    }
+    timings->add(chrono.elapsed());
+}
+
+static void measureDownSampled(const QUrl& url, int invertedZoom, Timings* timings)
+{
+    // Document picks invertedZoom for zooms in [1 / (4 * invertedZoom), 1 / (2 * invertedZoom)[
+    const qreal zoom = 1. / (3 * invertedZoom);
+    QElapsedTimer chrono;
+    chrono.start();
+    Document::Ptr doc = loadDocument(url);
+    if (!waitForMetaInfo(doc) || !waitForDownSampledImage(doc, zoom)) {
+        timings->fail();
+        return;
+    }
+    timings->add(chrono.elapsed());
+}
+
+static void measureThumbnail(const QUrl& url, const QString& thumbnailBaseDir, Timings* timings)
+{
+    // A new dir each time, so that the thumbnail is generated again
+    ThumbnailProvider::setThumbnailBaseDir(thumbnailBaseDir);
+
+    ThumbnailProvider provider;
+    provider.setThumbnailGroup(ThumbnailGroup::Normal);
+    bool done = false;
+    bool ok = false;
+    QObject::connect(&provider, &ThumbnailProvider::thumbnailLoaded, [&done, &ok]() {
+        done = true;
+        ok = true;
+    });
+    QObject::connect(&provider, &ThumbnailProvider::thumbnailLoadingFailed, [&done]() {
+        done = true;
+    });
+
+    QElapsedTimer chrono;
+    chrono.start();
+    provider.appendItems(KFileItemList() << KFileItem(url));
+    if (!waitUntil([&done]() { return done; }) || !ok) {
+        timings->fail();
+    } else {
+        timings->add(chrono.elapsed());
+    }
+
+    // Do not let the thumbnail writer slow down the next measurement
+    waitUntil([]() { return ThumbnailProvider::isThumbnailWriterEmpty(); });
 }
 
 int main(int argc, char** argv)
 {
-    QCoreApplication app(argc, argv);
-    if (argc != 2) {
-        qDebug() << "Usage: imageloadbench <file.jpg>";
+    QApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Measures how fast Gwenview decodes images. Without files, measures a generated corpus.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("files", "Images to measure", "[files...]");
+    QCommandLineOption iterationsOption(QStringList() << "i" << "iterations",
+                                        "Measure each file <count> times", "count",
+                                        QString::number(DEFAULT_ITERATIONS));
+    QCommandLineOption corpusDirOption(QStringList() << "c" << "corpus-dir",
+                                       "Generate the corpus in <dir> and keep it", "dir");
+    QCommandLineOption outputOption(QStringList() << "o" << "output",
+                                    "Write the JSON results to <file> instead of stdout", "file");
+    parser.addOption(iterationsOption);
+    parser.addOption(corpusDirOption);
+    parser.addOption(outputOption);
+    parser.process(app);
+
+    const int iterations = parser.value(iterationsOption).toInt();
+    if (iterations <= 0) {
+        qWarning() << "Invalid iteration count";
         return 1;
     }
 
-    QString fileName = QString::fromUtf8(argv[1]);
-
-    QFile file(fileName);
-    if (!file.open(QIODevice::ReadOnly)) {
-        qDebug() << QString("Could not open '%1'").arg(fileName);
+    QTemporaryDir tempDir;
+    if (!tempDir.isValid()) {
+        qWarning() << "Could not create a temporary dir";
         return 2;
     }
-    QByteArray data = file.readAll();
-    QBuffer buffer(&data);
 
-    qDebug() << "Using Qt loader";
-    bench(&buffer, "qt.png");
-    Gwenview::ImageFormats::registerPlugins();
-    qDebug() << "Using Gwenview loader";
-    bench(&buffer, "gv.png");
+    QStringList paths = parser.positionalArguments();
+    if (paths.isEmpty()) {
+        QString corpusDir = parser.value(corpusDirOption);
+        if (corpusDir.isEmpty()) {
+            corpusDir = tempDir.path() + "/corpus";
+        }
+        QDir().mkpath(corpusDir);
+        qWarning() << "Generating corpus in" << corpusDir;
+        paths = createCorpus(corpusDir);
+    }
+
+    // Qt loaders first, as registering our plugins may replace them
+    QList<Timings> qtScaledReadTimings;
+    Q_FOREACH(const QString& path, paths) {
+        Timings timings;
+        for (int iteration = 0; iteration < iterations; ++iteration) {
+            measureQtScaledRead(path, &timings);
+        }
+        qtScaledReadTimings << timings;
+    }
+
+    ImageFormats::registerPlugins();
+
+    QJsonArray results;
+    int thumbnailDirIndex = 0;
+    for (int idx = 0; idx < paths.count(); ++idx) {
+        const QString path = paths.at(idx);
+        const QUrl url = QUrl::fromLocalFile(QFileInfo(path).absoluteFilePath());
+        qWarning() << "Measuring" << path;
+
+        resetPeakRss();
+        Timings metaInfoTimings;
+        Timings firstPixelTimings;
+        Timings fullDecodeTimings;
+        QMap<int, Timings> downSampledTimings;
+        Timings thumbnailTimings;
+        for (int iteration = 0; iteration < iterations; ++iteration) {
+            measureFirstPixel(url, &metaInfoTimings, &firstPixelTimings);
+            measureFullDecode(url, &fullDecodeTimings);
+            for (int invertedZoom : INVERTED_ZOOMS) {
+                measureDownSampled(url, invertedZoom, &downSampledTimings[invertedZoom]);
+            }
+            const QString thumbnailDir = QString("%1/thumbnails-%2/").arg(tempDir.path()).arg(thumbnailDirIndex++);
+            measureThumbnail(url, thumbnailDir, &thumbnailTimings);
+        }
+        DocumentFactory::instance()->clearCache();
+
+        QJsonObject result;
+        const QImageReader reader(path);
+        result["file"] = QFileInfo(path).fileName();
+        result["format"] = QString::fromLatin1(QImageReader::imageFormat(path));
+        result["width"] = reader.size().width();
+        result["height"] = reader.size().height();
+        result["fileSize"] = double(QFileInfo(path).size());
+        result["qtScaledRead"] = qtScaledReadTimings.at(idx).toJson();
+        result["metaInfo"] = metaInfoTimings.toJson();
+        result["firstPixel"] = firstPixelTimings.toJson();
+        result["fullDecode"] = fullDecodeTimings.toJson();
+        QJsonObject downSampled;
+        for (int invertedZoom : INVERTED_ZOOMS) {
+            downSampled[QString::number(invertedZoom)] = downSampledTimings[invertedZoom].toJson();
+        }
+        result["downSampled"] = downSampled;
+        result["thumbnail"] = thumbnailTimings.toJson();
+        result["peakRss"] = double(peakRss());
+        results.append(result);
+    }
+
+    QJsonObject root;
+    root["iterations"] = iterations;
+    root["scaledSize"] = QString("%1x%2").arg(SCALED_SIZE.width()).arg(SCALED_SIZE.height());
+    root["results"] = results;
+    const QByteArray json = QJsonDocument(root).toJson();
+
+    const QString outputPath = parser.value(outputOption);
+    if (outputPath.isEmpty()) {
+        QFile output;
+        output.open(stdout, QIODevice::WriteOnly);
+        output.write(json);
+    } else {
+        QFile output(outputPath);
+        if (!output.open(QIODevice::WriteOnly) || output.write(json) != json.size()) {
+            qWarning() << "Could not write" << outputPath;
+            return 3;
+        }
+    }
 
     return 0;
 }